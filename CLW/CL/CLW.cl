@@ -298,6 +298,8 @@ DEFINE_GROUP_SCAN_EXCLUSIVE_SUM(uint)
 DEFINE_GROUP_SCAN_EXCLUSIVE_PART(int)
 DEFINE_GROUP_SCAN_EXCLUSIVE_PART(float)
 
+DEFINE_GROUP_REDUCE(int)
+
 DEFINE_SCAN_EXCLUSIVE(int)
 DEFINE_SCAN_EXCLUSIVE(float)
 
@@ -1079,6 +1081,78 @@ __kernel void copy(__global int4* in_input,
     safe_store_int4(value, out_output, global_id, in_size);
 }
 
+// Set bit i of the output mask if in_array[i] is positive,
+// group size has to be a multiple of 32 to own whole words
+__kernel void pack_bits(__global int const* in_array,
+                        uint numElems,
+                        __global uint* out_mask,
+                        __local uint* shmem)
+{
+    int global_id  = get_global_id(0);
+    int local_id   = get_local_id(0);
+    int group_id   = get_group_id(0);
+    int num_words  = get_local_size(0) >> 5;
+
+    if (local_id < num_words)
+    {
+        shmem[local_id] = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (global_id < numElems && in_array[global_id] > 0)
+    {
+        atomic_or(&shmem[local_id >> 5], 1u << (local_id & 31));
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint word = group_id * num_words + local_id;
+
+    if (local_id < num_words && word * 32 < numElems)
+    {
+        out_mask[word] = shmem[local_id];
+    }
+}
+
+// Count set bits of the mask, out_count has to be cleared
+__kernel void count_bits(__global uint const* in_mask,
+                         uint numBits,
+                         __global int* out_count,
+                         __local int* shmem)
+{
+    int global_id  = get_global_id(0);
+    int local_id   = get_local_id(0);
+    int group_size = get_local_size(0);
+    uint num_words = (numBits + 31) / 32;
+
+    int count = 0;
+
+    if (global_id < num_words)
+    {
+        uint word = in_mask[global_id];
+
+        // Bits past the end of the mask are not guaranteed to be zero
+        if (global_id == num_words - 1 && (numBits & 31))
+        {
+            word &= (1u << (numBits & 31)) - 1;
+        }
+
+        count = popcount(word);
+    }
+
+    shmem[local_id] = count;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    group_reduce_int(local_id, group_size, shmem);
+
+    if (local_id == 0)
+    {
+        atomic_add(out_count, shmem[group_size - 1]);
+    }
+}
+
 
 #define FLAG(x) (flags[(x)] & 0x1)
 #define FLAG_COMBINED(x) (flags[(x)])
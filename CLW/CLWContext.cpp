@@ -286,3 +286,27 @@ void CLWContext::Flush(unsigned int idx) const
 	cl_int status = clFlush(commandQueues_[idx]);
 	ThrowIf(status != CL_SUCCESS, status, "clFlush failed");
 }
+
+void CLWContext::Barrier(unsigned int idx, CLWEvent depEvent) const
+{
+    cl_event eventToWait = depEvent;
+#if defined(CL_VERSION_1_2) && !defined(OPENCL_10)
+    cl_int status = clEnqueueBarrierWithWaitList(commandQueues_[idx], 1, &eventToWait, nullptr);
+    ThrowIf(status != CL_SUCCESS, status, "clEnqueueBarrierWithWaitList failed");
+#else
+    // OpenCL 1.0 runtimes lack the barrier with a wait list, this one does the same for a single queue
+    cl_int status = clEnqueueWaitForEvents(commandQueues_[idx], 1, &eventToWait);
+    ThrowIf(status != CL_SUCCESS, status, "clEnqueueWaitForEvents failed");
+#endif
+}
+
+unsigned int CLWContext::CreateCommandQueue(CLWDevice device)
+{
+    commandQueues_.push_back(CLWCommandQueue::Create(device, *this));
+    return (unsigned int)commandQueues_.size() - 1;
+}
+
+unsigned int CLWContext::GetCommandQueueCount() const
+{
+    return (unsigned int)commandQueues_.size();
+}
@@ -91,6 +91,12 @@ public:
 
     void Finish(unsigned int idx) const;
 	void Flush(unsigned int idx) const;
+    // Make subsequent commands of the queue wait for the event
+    void Barrier(unsigned int idx, CLWEvent depEvent) const;
+
+    // Additional queues get indices after the ones created per device
+    unsigned int CreateCommandQueue(CLWDevice device);
+    unsigned int GetCommandQueueCount() const;
 
     // GL interop 
     void AcquireGLObjects(unsigned int idx, std::vector<cl_mem> const& objects) const;
@@ -37,6 +37,7 @@ CLWDevice::CLWDevice(cl_device_id id) : ReferenceCounter<cl_device_id, clRetainD
     GetDeviceInfoParameter(*this, CL_DEVICE_TYPE, type_);
     
     GetDeviceInfoParameter(*this, CL_DEVICE_MAX_WORK_GROUP_SIZE, maxWorkGroupSize_);
+    GetDeviceInfoParameter(*this, CL_DEVICE_MAX_COMPUTE_UNITS, maxComputeUnits_);
     GetDeviceInfoParameter(*this, CL_DEVICE_GLOBAL_MEM_SIZE, globalMemSize_);
     GetDeviceInfoParameter(*this, CL_DEVICE_LOCAL_MEM_SIZE, localMemSize_);
     GetDeviceInfoParameter(*this, CL_DEVICE_LOCAL_MEM_TYPE, localMemType_);
@@ -108,6 +109,11 @@ size_t   CLWDevice::GetMaxWorkGroupSize() const
     return maxWorkGroupSize_;
 }
 
+cl_uint  CLWDevice::GetMaxComputeUnits() const
+{
+    return maxComputeUnits_;
+}
+
 cl_device_id CLWDevice::GetID() const
 {
     return *this;
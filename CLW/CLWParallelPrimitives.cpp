@@ -977,4 +977,35 @@ CLWEvent CLWParallelPrimitives::Copy(unsigned int deviceIdx, CLWBuffer<cl_int> i
     copyKernel.SetArg(2, output);
 
     return context_.Launch1D(0, NUM_BLOCKS * WG_SIZE, WG_SIZE, copyKernel);
-}
\ No newline at end of file
+}
+
+CLWEvent CLWParallelPrimitives::PackBits(unsigned int deviceIdx, CLWBuffer<char> input, CLWBuffer<char> output, int numElems)
+{
+    int NUM_BLOCKS = (numElems + WG_SIZE - 1) / WG_SIZE;
+
+    CLWKernel packKernel = program_.GetKernel("pack_bits");
+
+    packKernel.SetArg(0, input);
+    packKernel.SetArg(1, (cl_uint)numElems);
+    packKernel.SetArg(2, output);
+    packKernel.SetArg(3, SharedMemory((WG_SIZE / 32) * sizeof(cl_uint)));
+
+    return context_.Launch1D(deviceIdx, std::max(NUM_BLOCKS, 1) * WG_SIZE, WG_SIZE, packKernel);
+}
+
+CLWEvent CLWParallelPrimitives::CountBits(unsigned int deviceIdx, CLWBuffer<char> input, CLWBuffer<char> output, int numBits)
+{
+    int numWords = (numBits + 31) / 32;
+    int NUM_BLOCKS = (numWords + WG_SIZE - 1) / WG_SIZE;
+
+    context_.FillBuffer(deviceIdx, output, (char)0, sizeof(cl_int));
+
+    CLWKernel countKernel = program_.GetKernel("count_bits");
+
+    countKernel.SetArg(0, input);
+    countKernel.SetArg(1, (cl_uint)numBits);
+    countKernel.SetArg(2, output);
+    countKernel.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
+
+    return context_.Launch1D(deviceIdx, std::max(NUM_BLOCKS, 1) * WG_SIZE, WG_SIZE, countKernel);
+}
@@ -55,6 +55,10 @@ public:
     CLWEvent Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, cl_int& newSize);
 	CLWEvent Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, CLWBuffer<cl_int> newSize);
     CLWEvent Copy(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output);
+    // Pack positive elements of int array into 1 bit per element mask
+    CLWEvent PackBits(unsigned int deviceIdx, CLWBuffer<char> input, CLWBuffer<char> output, int numElems);
+    // Count set bits of the mask into single int
+    CLWEvent CountBits(unsigned int deviceIdx, CLWBuffer<char> input, CLWBuffer<char> output, int numBits);
 
     void ReclaimDeviceMemory();
 
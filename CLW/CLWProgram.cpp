@@ -229,6 +229,84 @@ CLWProgram CLWProgram::CreateFromFile(char const* filename,
 	}
 }
 
+CLWProgram CLWProgram::CreateFromBinary(unsigned char const* binary,
+                                        size_t binarysize,
+                                        CLWContext context)
+{
+    cl_int status = CL_SUCCESS;
+
+    std::vector<cl_device_id> deviceIds(context.GetDeviceCount());
+    std::vector<unsigned char const*> binaries(context.GetDeviceCount(), binary);
+    std::vector<size_t> binarysizes(context.GetDeviceCount(), binarysize);
+    std::vector<cl_int> binarystatus(context.GetDeviceCount(), CL_SUCCESS);
+
+    for(unsigned int i = 0; i < context.GetDeviceCount(); ++i)
+    {
+        deviceIds[i] = context.GetDevice(i);
+    }
+
+    cl_program program = clCreateProgramWithBinary(context, context.GetDeviceCount(), &deviceIds[0], &binarysizes[0], &binaries[0], &binarystatus[0], &status);
+
+    ThrowIf(status != CL_SUCCESS, status, "clCreateProgramWithBinary failed");
+
+    char const* buildopts =
+#if defined(__APPLE__)
+        "-D APPLE -cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I."
+#elif defined(_WIN32) || defined (WIN32)
+        "-D WIN32 -cl-mad-enable -cl-std=CL1.2 -I."
+#elif defined(__linux__)
+        "-D __linux__ -I."
+#else
+        nullptr
+#endif
+        ;
+
+    status = clBuildProgram(program, context.GetDeviceCount(), &deviceIds[0], buildopts, nullptr, nullptr);
+
+    if(status != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        throw CLWException(status, "clBuildProgram failed for program binary");
+    }
+
+    CLWProgram prg(program);
+
+    clReleaseProgram(program);
+
+    return prg;
+}
+
+size_t CLWProgram::GetBinarySize() const
+{
+    cl_uint numDevices = 0;
+    cl_int status = clGetProgramInfo(*this, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &numDevices, nullptr);
+
+    ThrowIf(status != CL_SUCCESS, status, "clGetProgramInfo failed");
+
+    std::vector<size_t> sizes(numDevices);
+    status = clGetProgramInfo(*this, CL_PROGRAM_BINARY_SIZES, numDevices * sizeof(size_t), &sizes[0], nullptr);
+
+    ThrowIf(status != CL_SUCCESS, status, "clGetProgramInfo failed");
+
+    return sizes[0];
+}
+
+void CLWProgram::GetBinary(unsigned char* binary) const
+{
+    cl_uint numDevices = 0;
+    cl_int status = clGetProgramInfo(*this, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &numDevices, nullptr);
+
+    ThrowIf(status != CL_SUCCESS, status, "clGetProgramInfo failed");
+
+    // Only the first device binary is requested, the rest are skipped with nullptr
+    std::vector<unsigned char*> binaries(numDevices, nullptr);
+    binaries[0] = binary;
+
+    status = clGetProgramInfo(*this, CL_PROGRAM_BINARIES, numDevices * sizeof(unsigned char*), &binaries[0], nullptr);
+
+    ThrowIf(status != CL_SUCCESS, status, "clGetProgramInfo failed");
+}
+
 CLWProgram::CLWProgram(cl_program program)
 : ReferenceCounter<cl_program, clRetainProgram, clReleaseProgram>(program)
 {
@@ -59,11 +59,21 @@ public:
                                      int numheaders,
                                      CLWContext context);
 
+    // Create program from binary previously obtained with GetBinary
+    // (binary is loaded for all the devices of the context)
+    static CLWProgram CreateFromBinary(unsigned char const* binary,
+                                       size_t binarysize,
+                                       CLWContext context);
+
     CLWProgram() {}
     virtual      ~CLWProgram();
 
     unsigned int GetKernelCount() const;
     CLWKernel    GetKernel(std::string const& funcName) const;
+
+    // Program binary for the first device of the context
+    size_t       GetBinarySize() const;
+    void         GetBinary(unsigned char* binary) const;
     
 private:
     CLWProgram(cl_program program);
@@ -27,13 +27,18 @@ namespace Calc
 	{
 		kRead = 0x1,
 		kWrite = 0x2,
-		kPinned = 0x4
+		kPinned = 0x4,
+		// Buffer is backed by initdata memory instead of a copy of it,
+		// the memory has to stay valid until the buffer is deleted
+		kUseHostPtr = 0x8
 	};
 
 	enum MapType
 	{
 		kMapRead = 0x1,
-		kMapWrite = 0x2
+		kMapWrite = 0x2,
+		// Whole mapped region is overwritten, previous contents are not copied in
+		kMapWriteInvalidate = 0x4
 	};
 
 	enum class DeviceType
@@ -48,6 +48,11 @@ namespace Calc
 		std::uint32_t min_alignment;
 		std::uint32_t max_num_queues;
 		std::size_t max_local_size;
+		// Number of parallel compute units (CPU cores for native device)
+		std::uint32_t num_compute_units;
+		// Commands without an event complete before the call returns (native device),
+		// otherwise they are only enqueued
+		bool blocking_commands;
 	};
 
 	// Main interface to control compute device
@@ -102,6 +107,8 @@ namespace Calc
 		virtual void WaitForEvent(Event* e) = 0;
 		virtual void WaitForMultipleEvents(Event** e, std::size_t num_events) = 0;
 		virtual void DeleteEvent(Event* e) = 0;
+		// Subsequent commands of the queue wait for the event, the call is non-blocking
+		virtual void EnqueueWaitForEvent(std::uint32_t queue, Event* e) = 0;
 
 		// Queue management functions
 		virtual void Flush(std::uint32_t queue) = 0;
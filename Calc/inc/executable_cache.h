@@ -0,0 +1,78 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace Calc
+{
+	class Device;
+	class Executable;
+
+	// Persistent on-disk cache of executable binaries
+	//  * Executables are keyed by the hash of source text, compile options and device name
+	//  * Cache misses compile from source and store device binary for the next run
+	//  * Unreadable or rejected binaries silently fall back to source compilation
+	//
+	class ExecutableCache
+	{
+	public:
+		// Cache directory is created if it does not exist (single level only)
+		ExecutableCache(Device* device, std::string const& path);
+
+		// Compile executable from source or load it from the cache
+		Executable* CompileExecutable(char const* source_code, std::size_t size, char const* options);
+
+		// Compile executable from file or load it from the cache
+		Executable* CompileExecutable(char const* filename,
+			char const** headernames,
+			int numheaders);
+
+		// Cache directory
+		std::string const& GetPath() const { return m_path; }
+
+		// Cache file of the executable compiled from source with the options
+		std::string GetEntryFileName(char const* source_code, std::size_t size, char const* options) const;
+
+		// Number of executables loaded from the cache and compiled from source since construction
+		std::uint32_t GetNumHits() const { return m_num_hits; }
+		std::uint32_t GetNumMisses() const { return m_num_misses; }
+
+		// Forbidden stuff
+		ExecutableCache(ExecutableCache const&) = delete;
+		ExecutableCache& operator = (ExecutableCache const&) = delete;
+
+	private:
+		std::uint64_t GetKey(std::string const& source, char const* options) const;
+		std::string GetFileName(std::uint64_t key) const;
+		Executable* Load(std::uint64_t key, char const* options) const;
+		void Store(std::uint64_t key, Executable const* executable) const;
+
+		Device* m_device;
+		std::string m_path;
+		std::atomic<std::uint32_t> m_num_hits;
+		std::atomic<std::uint32_t> m_num_misses;
+	};
+}
@@ -0,0 +1,88 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+namespace Calc
+{
+	// Single argument of a native function as it was set via Function::SetArg:
+	// either a pointer to the buffer contents or a copy of a by-value argument
+	struct NativeArg
+	{
+		void* ptr;
+		std::size_t size;
+		std::vector<std::uint8_t> value;
+	};
+
+	// Snapshot of native function arguments taken at launch time
+	class NativeArgs
+	{
+	public:
+		NativeArgs(std::vector<NativeArg> const& args) : m_args(args) {}
+
+		// Number of arguments
+		std::size_t GetCount() const { return m_args.size(); }
+
+		// Access buffer argument contents
+		template <typename T> T* GetBuffer(std::uint32_t idx) const
+		{
+			return static_cast<T*>(m_args[idx].ptr);
+		}
+
+		// Access buffer argument size in bytes
+		std::size_t GetBufferSize(std::uint32_t idx) const
+		{
+			return m_args[idx].size;
+		}
+
+		// Access by-value argument
+		template <typename T> T GetValue(std::uint32_t idx) const
+		{
+			T res;
+			std::memcpy(&res, &m_args[idx].value[0], sizeof(T));
+			return res;
+		}
+
+	private:
+		std::vector<NativeArg> m_args;
+	};
+
+	// Native kernel processes global work items in [begin, end) range.
+	// Ranges are always aligned to the local size passed to Device::Execute,
+	// so a kernel is free to treat each local_size chunk as a work group.
+	typedef std::function<void(NativeArgs const& args, std::size_t begin, std::size_t end)> NativeKernel;
+
+	// Register native implementation of a kernel function.
+	// program is the file name of the program (without directory, e.g. "bvh.cl"),
+	// name is the name of the kernel function within the program.
+	void RegisterNativeKernel(char const* program, char const* name, NativeKernel kernel);
+
+	// Associate a program with its source code (used in embedded kernels mode
+	// where programs are compiled from the source rather than from file).
+	// Source is copied, so the string does not need to outlive the call.
+	void RegisterNativeProgramSource(char const* program, char const* source);
+}
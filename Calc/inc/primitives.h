@@ -26,13 +26,29 @@ THE SOFTWARE.
 namespace Calc
 {
 	class Buffer;
+	class Event;
+
 	class Primitives
 	{
 	public:
 		Primitives() = default;
         virtual ~Primitives() = default;
 
-		virtual void SortRadixInt32(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) = 0;
+		// Sort int32 keys along with the values.
+		// The call is non-blocking, pass an event to sync.
+		virtual void SortRadixInt32(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size, Event** e) = 0;
+
+		// Set bit i of the mask if i-th int32 of the input is positive, bits past size in the last word are undefined.
+		// The call is non-blocking, pass an event to sync.
+		virtual void PackBitsInt32(std::uint32_t queueidx, Buffer const* from, Buffer* to_mask, std::size_t size, Event** e) = 0;
+
+		// Set the first size int32 elements of the buffer to value.
+		// The call is non-blocking, pass an event to sync.
+		virtual void FillInt32(std::uint32_t queueidx, Buffer* buffer, std::int32_t value, std::size_t size, Event** e) = 0;
+
+		// Write the number of set bits among the first numbits bits of the mask as a single int32.
+		// The call is non-blocking, pass an event to sync.
+		virtual void CountBits(std::uint32_t queueidx, Buffer const* mask, Buffer* count, std::size_t numbits, Event** e) = 0;
 
 
 	private:
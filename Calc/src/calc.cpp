@@ -21,6 +21,8 @@ THE SOFTWARE.
 ********************************************************************/
 #include "calc.h"
 #include "calc_clw.h"
+#include "calc_native.h"
+#include "except.h"
 
 #define USE_OPENCL
 
@@ -30,9 +32,17 @@ namespace Calc
 	Calc* CreateCalc(int reserved)
 	{
 #ifdef USE_OPENCL
-		return new CalcClw();
+		try
+		{
+			return new CalcClw();
+		}
+		catch (Exception&)
+		{
+			// No OpenCL runtime available: native CPU device is still there
+			return new CalcNative();
+		}
 #else
-		return nullptr;
+		return new CalcNative();
 #endif
 	}
 
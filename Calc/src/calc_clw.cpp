@@ -58,17 +58,23 @@ namespace Calc
 	// Enumerate devices 
 	std::uint32_t CalcClw::GetDeviceCount() const
 	{
-		return static_cast<std::uint32_t>(m_devices.size());
+		return static_cast<std::uint32_t>(m_devices.size()) + m_native.GetDeviceCount();
 	}
 
 	// Get i-th device spec
 	void CalcClw::GetDeviceSpec(std::uint32_t idx, DeviceSpec& spec) const
 	{
-		if (idx >= m_devices.size())
+		if (idx >= GetDeviceCount())
 		{
 			throw ExceptionClw("Index is out of bounds");
 		}
 
+		if (idx >= m_devices.size())
+		{
+			m_native.GetDeviceSpec(idx - static_cast<std::uint32_t>(m_devices.size()), spec);
+			return;
+		}
+
 		// Strings leave until the destructor of this object is called
 		// which is pretty much ok
 		spec.name = m_devices[idx].GetName().c_str();
@@ -79,16 +85,23 @@ namespace Calc
 		spec.min_alignment = m_devices[idx].GetMinAlignSize();
 		spec.max_alloc_size = m_devices[idx].GetMaxAllocSize();
 		spec.max_local_size = m_devices[idx].GetMaxWorkGroupSize();
+		spec.num_compute_units = m_devices[idx].GetMaxComputeUnits();
+		spec.blocking_commands = false;
 	}
 
 	// Create the device with specified index
 	Device* CalcClw::CreateDevice(std::uint32_t idx) const
 	{
-		if (idx >= m_devices.size())
+		if (idx >= GetDeviceCount())
 		{
 			throw ExceptionClw("Index is out of bounds");
 		}
 
+		if (idx >= m_devices.size())
+		{
+			return m_native.CreateDevice(idx - static_cast<std::uint32_t>(m_devices.size()));
+		}
+
 		try
 		{
 			return new DeviceClw(m_devices[idx]);
@@ -22,6 +22,7 @@ THE SOFTWARE.
 #pragma once
 
 #include "calc_cl.h"
+#include "calc_native.h"
 
 #include "CLW.h"
 #include <vector>
@@ -53,6 +54,8 @@ namespace Calc
 	private:
 		std::vector<CLWPlatform> m_platforms;
 		std::vector<CLWDevice> m_devices;
+		// Native CPU device goes after OpenCL ones
+		CalcNative m_native;
 	};
 }
 
@@ -28,8 +28,15 @@ namespace Calc
 {
 	inline cl_mem_flags Convert2ClCreationFlags(std::uint32_t flags)
 	{
-		// TODO: implement correctly
-		return CL_MEM_READ_WRITE;
+		// TODO: implement access flags correctly
+		cl_mem_flags res = CL_MEM_READ_WRITE;
+
+		if (flags & kUseHostPtr)
+			res |= CL_MEM_USE_HOST_PTR;
+		else if (flags & kPinned)
+			res |= CL_MEM_ALLOC_HOST_PTR;
+
+		return res;
 	}
 
 	inline cl_mem_flags Convert2ClMapFlags(std::uint32_t flags)
@@ -42,6 +49,13 @@ namespace Calc
 		if (flags & kMapWrite)
 			res |= CL_MAP_WRITE;
 
+		if (flags & kMapWriteInvalidate)
+#if defined(CL_VERSION_1_2) && !defined(OPENCL_10)
+			res |= CL_MAP_WRITE_INVALIDATE_REGION;
+#else
+			res |= CL_MAP_WRITE;
+#endif
+
 		return res;
 	}
 
@@ -76,6 +76,7 @@ namespace Calc
 		bool IsComplete() const override;
 
 		void SetEvent(CLWEvent event);
+		CLWEvent GetEvent() const;
 
 	private:
 		CLWEvent m_event;
@@ -119,6 +120,11 @@ namespace Calc
 		m_event = event;
 	}
 
+	CLWEvent EventClw::GetEvent() const
+	{
+		return m_event;
+	}
+
 	class FunctionClw : public Function
 	{
 	public:
@@ -201,6 +207,9 @@ namespace Calc
 		Function* CreateFunction(char const* name) override;
 		void DeleteFunction(Function* func) override;
 
+		// Underlying CLW program
+		CLWProgram GetProgram() const { return m_program; }
+
 	private:
 		CLWProgram m_program;
 	};
@@ -238,6 +247,8 @@ namespace Calc
 		: m_device(device)
 		, m_context(CLWContext::Create(device))
 	{
+		CreateQueues();
+
 		// Initialize event pool
 		for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
 		{
@@ -249,6 +260,8 @@ namespace Calc
     : m_device(device)
     , m_context(context)
     {
+        CreateQueues();
+
         // Initialize event pool
         for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
         {
@@ -256,6 +269,31 @@ namespace Calc
         }
     }
 
+	void DeviceClw::CreateQueues()
+	{
+		// CLW addresses queues by device index, so additional queues
+		// only go after the single device queue
+		if (m_context.GetDeviceCount() != 1)
+		{
+			m_num_queues = 1;
+			return;
+		}
+
+		try
+		{
+			while (m_context.GetCommandQueueCount() < NUM_QUEUES)
+			{
+				m_context.CreateCommandQueue(m_device);
+			}
+		}
+		catch (CLWException& e)
+		{
+			throw ExceptionClw(e.what());
+		}
+
+		m_num_queues = m_context.GetCommandQueueCount();
+	}
+
 	DeviceClw::~DeviceClw()
 	{
 		while (!m_event_pool.empty())
@@ -277,6 +315,9 @@ namespace Calc
 		spec.min_alignment = m_device.GetMinAlignSize();
 		spec.max_alloc_size = m_device.GetMaxAllocSize();
 		spec.max_local_size = m_device.GetMaxWorkGroupSize();
+		spec.num_compute_units = m_device.GetMaxComputeUnits();
+		spec.max_num_queues = m_num_queues;
+		spec.blocking_commands = false;
 	}
 
 	Buffer* DeviceClw::CreateBuffer(std::size_t size, std::uint32_t flags)
@@ -295,7 +336,14 @@ namespace Calc
 	{
 		try
 		{
-			return new BufferClw(m_context.CreateBuffer<char>(size, Convert2ClCreationFlags(flags) | CL_MEM_COPY_HOST_PTR, initdata));
+			auto clflags = Convert2ClCreationFlags(flags);
+
+			if (!(flags & kUseHostPtr))
+			{
+				clflags |= CL_MEM_COPY_HOST_PTR;
+			}
+
+			return new BufferClw(m_context.CreateBuffer<char>(size, clflags, initdata));
 		}
 		catch (CLWException& e)
 		{
@@ -423,7 +471,14 @@ namespace Calc
 
 	Executable* DeviceClw::CompileExecutable(std::uint8_t const* binary_code, std::size_t size, char const* options)
 	{
-		return nullptr;
+		try
+		{
+			return new ExecutableClw(CLWProgram::CreateFromBinary(binary_code, size, m_context));
+		}
+		catch (CLWException& e)
+		{
+			throw ExceptionClw(e.what());
+		}
 	}
 
 	void DeviceClw::DeleteExecutable(Executable* executable)
@@ -433,12 +488,26 @@ namespace Calc
 
 	size_t DeviceClw::GetExecutableBinarySize(Executable const* executable) const
 	{
-		return 0;
+		try
+		{
+			return static_cast<ExecutableClw const*>(executable)->GetProgram().GetBinarySize();
+		}
+		catch (CLWException& e)
+		{
+			throw ExceptionClw(e.what());
+		}
 	}
 
 	void DeviceClw::GetExecutableBinary(Executable const* executable, std::uint8_t* binary) const
 	{
-
+		try
+		{
+			static_cast<ExecutableClw const*>(executable)->GetProgram().GetBinary(binary);
+		}
+		catch (CLWException& e)
+		{
+			throw ExceptionClw(e.what());
+		}
 	}
 
 	void DeviceClw::Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e)
@@ -492,6 +561,18 @@ namespace Calc
 		}
 	}
 
+	void DeviceClw::EnqueueWaitForEvent(std::uint32_t queue, Event* e)
+	{
+		try
+		{
+			m_context.Barrier(queue, static_cast<EventClw*>(e)->GetEvent());
+		}
+		catch (CLWException& e)
+		{
+			throw ExceptionClw(e.what());
+		}
+	}
+
 	void DeviceClw::Finish(std::uint32_t queue)
 	{
 		try
@@ -506,6 +587,8 @@ namespace Calc
 
 	EventClw* DeviceClw::CreateEventClw() const
 	{
+		std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+
 		if (m_event_pool.empty())
 		{
 			auto event = new EventClw();
@@ -521,6 +604,7 @@ namespace Calc
 
 	void DeviceClw::ReleaseEventClw(EventClw* e) const
 	{
+		std::lock_guard<std::mutex> lock(m_event_pool_mutex);
 		m_event_pool.push(e);
 	}
     
@@ -540,22 +624,86 @@ namespace Calc
 	class PrimitivesClw : public Primitives
 	{
 	public:
-		PrimitivesClw(CLWContext context)
-			: m_pp(context)
+		PrimitivesClw(DeviceClw const* device)
+			: m_device(device)
+			, m_pp(device->m_context)
 		{
 		}
 
-		void SortRadixInt32(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) override
+		void SortRadixInt32(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size, Event** e) override
 		{
 			auto from_key_clw = static_cast<BufferClw const*>(from_key);
 			auto to_key_clw = static_cast<BufferClw*>(to_key);
 			auto from_value_clw = static_cast<BufferClw const*>(from_value);
 			auto to_value_clw = static_cast<BufferClw*>(to_value);
 
-			m_pp.SortRadix((int)queueidx, from_key_clw->GetData(), to_key_clw->GetData(), from_value_clw->GetData(), to_value_clw->GetData(), (int)size);
+			try
+			{
+				SetEvent(m_pp.SortRadix((int)queueidx, from_key_clw->GetData(), to_key_clw->GetData(), from_value_clw->GetData(), to_value_clw->GetData(), (int)size), e);
+			}
+			catch (CLWException& ex)
+			{
+				throw ExceptionClw(ex.what());
+			}
+		}
+
+		void PackBitsInt32(std::uint32_t queueidx, Buffer const* from, Buffer* to_mask, std::size_t size, Event** e) override
+		{
+			auto from_clw = static_cast<BufferClw const*>(from);
+			auto to_mask_clw = static_cast<BufferClw*>(to_mask);
+
+			try
+			{
+				SetEvent(m_pp.PackBits(queueidx, from_clw->GetData(), to_mask_clw->GetData(), (int)size), e);
+			}
+			catch (CLWException& ex)
+			{
+				throw ExceptionClw(ex.what());
+			}
+		}
+
+		void FillInt32(std::uint32_t queueidx, Buffer* buffer, std::int32_t value, std::size_t size, Event** e) override
+		{
+			auto buffer_clw = static_cast<BufferClw*>(buffer);
+
+			try
+			{
+				auto buffer_int = CLWBuffer<cl_int>::CreateFromClBuffer(buffer_clw->GetData());
+				SetEvent(m_device->m_context.FillBuffer(queueidx, buffer_int, (cl_int)value, size), e);
+			}
+			catch (CLWException& ex)
+			{
+				throw ExceptionClw(ex.what());
+			}
+		}
+
+		void CountBits(std::uint32_t queueidx, Buffer const* mask, Buffer* count, std::size_t numbits, Event** e) override
+		{
+			auto mask_clw = static_cast<BufferClw const*>(mask);
+			auto count_clw = static_cast<BufferClw*>(count);
+
+			try
+			{
+				SetEvent(m_pp.CountBits(queueidx, mask_clw->GetData(), count_clw->GetData(), (int)numbits), e);
+			}
+			catch (CLWException& ex)
+			{
+				throw ExceptionClw(ex.what());
+			}
 		}
 
 	private:
+		void SetEvent(CLWEvent event, Event** e) const
+		{
+			if (e)
+			{
+				auto event_clw = m_device->CreateEventClw();
+				event_clw->SetEvent(event);
+				*e = event_clw;
+			}
+		}
+
+		DeviceClw const* m_device;
 		CLWParallelPrimitives m_pp;
 	};
 
@@ -567,7 +715,7 @@ namespace Calc
 
 	Primitives* DeviceClw::CreatePrimitives() const
 	{
-		return new PrimitivesClw(m_context);
+		return new PrimitivesClw(this);
 	}
 
 	void DeviceClw::DeletePrimitives(Primitives* prims)
@@ -26,6 +26,7 @@ THE SOFTWARE.
 #include "CLW.h"
 
 #include <queue>
+#include <mutex>
 
 namespace Calc
 {
@@ -75,6 +76,7 @@ namespace Calc
 		void WaitForEvent(Event* e) override;
 		void WaitForMultipleEvents(Event** e, std::size_t num_events) override;
 		void DeleteEvent(Event* e) override;
+		void EnqueueWaitForEvent(std::uint32_t queue, Event* e) override;
 
 		// Queue management functions
 		void Flush(std::uint32_t queue) override;
@@ -89,6 +91,9 @@ namespace Calc
 		Buffer* CreateBuffer(cl_mem buffer) override;
 
 	protected:
+		// Create additional command queues for transfers and kernels to overlap
+		void CreateQueues();
+
 		EventClw* CreateEventClw() const;
 		void	  ReleaseEventClw(EventClw* e) const;
 
@@ -96,9 +101,17 @@ namespace Calc
 		CLWDevice m_device;
 		CLWContext m_context;
 
+		// Number of command queues to create
+		static const std::uint32_t NUM_QUEUES = 3;
+		// Number of command queues exposed by the device
+		std::uint32_t m_num_queues;
+
 		// Initial number of events in the pool
 		static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
 		// Event pool
 		mutable std::queue<EventClw*> m_event_pool;
+		mutable std::mutex m_event_pool_mutex;
+
+		friend class PrimitivesClw;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,907 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "calc.h"
+#include "primitives.h"
+#include "device_native.h"
+#include "buffer.h"
+#include "event.h"
+#include "executable.h"
+#include "native_kernel.h"
+#include "except_native.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace Calc
+{
+	// Native kernel registry
+	struct NativeProgram
+	{
+		std::map<std::string, NativeKernel> kernels;
+		std::string source;
+	};
+
+	static std::mutex& GetRegistryMutex()
+	{
+		static std::mutex s_mutex;
+		return s_mutex;
+	}
+
+	static std::map<std::string, NativeProgram>& GetRegistry()
+	{
+		static std::map<std::string, NativeProgram> s_registry;
+		return s_registry;
+	}
+
+	// Strip directories from program file name
+	static std::string GetProgramName(char const* filename)
+	{
+		std::string name(filename);
+		auto pos = name.find_last_of("/\\");
+		return pos == std::string::npos ? name : name.substr(pos + 1);
+	}
+
+	void RegisterNativeKernel(char const* program, char const* name, NativeKernel kernel)
+	{
+		std::lock_guard<std::mutex> lock(GetRegistryMutex());
+		GetRegistry()[GetProgramName(program)].kernels[name] = kernel;
+	}
+
+	void RegisterNativeProgramSource(char const* program, char const* source)
+	{
+		std::lock_guard<std::mutex> lock(GetRegistryMutex());
+		GetRegistry()[GetProgramName(program)].source = source;
+	}
+
+	// Buffer implementation in system memory
+	class BufferNative : public Buffer
+	{
+	public:
+		BufferNative(std::size_t size);
+		// Wraps memory owned by the caller
+		BufferNative(std::size_t size, void* hostptr);
+		~BufferNative();
+
+		std::size_t GetSize() const override;
+
+		std::uint8_t* GetData() const;
+
+	private:
+		mutable std::vector<std::uint8_t> m_data;
+		std::uint8_t* m_hostptr;
+		std::size_t m_size;
+	};
+
+	BufferNative::BufferNative(std::size_t size)
+		: m_data(size)
+		, m_hostptr(nullptr)
+		, m_size(size)
+	{
+	}
+
+	BufferNative::BufferNative(std::size_t size, void* hostptr)
+		: m_hostptr(static_cast<std::uint8_t*>(hostptr))
+		, m_size(size)
+	{
+	}
+
+	BufferNative::~BufferNative()
+	{
+	}
+
+	std::size_t BufferNative::GetSize() const
+	{
+		return m_size;
+	}
+
+	std::uint8_t* BufferNative::GetData() const
+	{
+		if (m_hostptr)
+		{
+			return m_hostptr;
+		}
+
+		return m_data.empty() ? nullptr : &m_data[0];
+	}
+
+	// Completion state shared between an event and the command it tracks,
+	// so the event can be recycled while the command is still in flight
+	struct EventStateNative
+	{
+		std::mutex mutex;
+		std::condition_variable cv;
+		bool complete;
+		std::string error;
+
+		EventStateNative() : complete(false) {}
+
+		void Signal(std::string const& err)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			complete = true;
+			error = err;
+			cv.notify_all();
+		}
+
+		void Wait()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]() { return complete; });
+
+			if (!error.empty())
+			{
+				throw ExceptionNative(error);
+			}
+		}
+	};
+
+	// Event implementation for native device
+	class EventNative : public Event
+	{
+	public:
+		EventNative() {}
+		~EventNative();
+
+		void Wait() override;
+		bool IsComplete() const override;
+
+		void SetState(std::shared_ptr<EventStateNative> state);
+		std::shared_ptr<EventStateNative> GetState() const;
+
+	private:
+		std::shared_ptr<EventStateNative> m_state;
+	};
+
+	EventNative::~EventNative()
+	{
+	}
+
+	void EventNative::Wait()
+	{
+		m_state->Wait();
+	}
+
+	bool EventNative::IsComplete() const
+	{
+		std::lock_guard<std::mutex> lock(m_state->mutex);
+		return m_state->complete;
+	}
+
+	void EventNative::SetState(std::shared_ptr<EventStateNative> state)
+	{
+		m_state = state;
+	}
+
+	std::shared_ptr<EventStateNative> EventNative::GetState() const
+	{
+		return m_state;
+	}
+
+	// In-order command queue served by a dedicated thread
+	class QueueNative
+	{
+	public:
+		QueueNative();
+		~QueueNative();
+
+		void Push(std::function<void()> command, std::shared_ptr<EventStateNative> state);
+
+	private:
+		struct Command
+		{
+			std::function<void()> work;
+			std::shared_ptr<EventStateNative> state;
+		};
+
+		void RunLoop();
+
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+		std::deque<Command> m_commands;
+		bool m_done;
+		std::thread m_thread;
+	};
+
+	QueueNative::QueueNative()
+		: m_done(false)
+	{
+		m_thread = std::thread(&QueueNative::RunLoop, this);
+	}
+
+	QueueNative::~QueueNative()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_done = true;
+		}
+
+		m_cv.notify_all();
+		m_thread.join();
+	}
+
+	void QueueNative::Push(std::function<void()> command, std::shared_ptr<EventStateNative> state)
+	{
+		Command cmd = { command, state };
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_commands.push_back(cmd);
+		}
+
+		m_cv.notify_one();
+	}
+
+	void QueueNative::RunLoop()
+	{
+		for (;;)
+		{
+			Command cmd;
+
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cv.wait(lock, [this]() { return m_done || !m_commands.empty(); });
+
+				// Drain remaining commands before exit
+				if (m_commands.empty())
+					return;
+
+				cmd = m_commands.front();
+				m_commands.pop_front();
+			}
+
+			std::string error;
+
+			try
+			{
+				if (cmd.work)
+				{
+					cmd.work();
+				}
+			}
+			catch (Exception& e)
+			{
+				error = e.what();
+			}
+			catch (std::exception& e)
+			{
+				error = e.what();
+			}
+			catch (...)
+			{
+				error = "Unknown error in native command";
+			}
+
+			cmd.state->Signal(error);
+		}
+	}
+
+	// Function implementation: native kernel plus argument values
+	class FunctionNative : public Function
+	{
+	public:
+		FunctionNative(NativeKernel kernel);
+		~FunctionNative();
+
+		// Argument setters
+		void SetArg(std::uint32_t idx, std::size_t arg_size, void* arg) override;
+		void SetArg(std::uint32_t idx, Buffer const* arg) override;
+		void SetArg(std::uint32_t idx, std::size_t size, SharedMemory shmem) override;
+
+		NativeKernel const& GetKernel() const;
+		std::vector<NativeArg> const& GetArgs() const;
+
+	private:
+		NativeArg& GetArg(std::uint32_t idx);
+
+		NativeKernel m_kernel;
+		std::vector<NativeArg> m_args;
+	};
+
+	FunctionNative::FunctionNative(NativeKernel kernel)
+		: m_kernel(kernel)
+	{
+	}
+
+	FunctionNative::~FunctionNative()
+	{
+	}
+
+	NativeArg& FunctionNative::GetArg(std::uint32_t idx)
+	{
+		if (idx >= m_args.size())
+		{
+			NativeArg empty = { nullptr, 0, std::vector<std::uint8_t>() };
+			m_args.resize(idx + 1, empty);
+		}
+
+		return m_args[idx];
+	}
+
+	void FunctionNative::SetArg(std::uint32_t idx, std::size_t arg_size, void* arg)
+	{
+		auto& a = GetArg(idx);
+		auto bytes = static_cast<std::uint8_t const*>(arg);
+		a.ptr = nullptr;
+		a.size = arg_size;
+		a.value.assign(bytes, bytes + arg_size);
+	}
+
+	void FunctionNative::SetArg(std::uint32_t idx, Buffer const* arg)
+	{
+		auto& a = GetArg(idx);
+		auto buffer_native = static_cast<BufferNative const*>(arg);
+		a.ptr = buffer_native ? buffer_native->GetData() : nullptr;
+		a.size = buffer_native ? buffer_native->GetSize() : 0;
+		a.value.clear();
+	}
+
+	void FunctionNative::SetArg(std::uint32_t idx, std::size_t size, SharedMemory)
+	{
+		// Kernels allocate their scratch memory themselves
+		auto& a = GetArg(idx);
+		a.ptr = nullptr;
+		a.size = size;
+		a.value.clear();
+	}
+
+	NativeKernel const& FunctionNative::GetKernel() const
+	{
+		return m_kernel;
+	}
+
+	std::vector<NativeArg> const& FunctionNative::GetArgs() const
+	{
+		return m_args;
+	}
+
+	// Executable implementation: reference to registered native program
+	class ExecutableNative : public Executable
+	{
+	public:
+		ExecutableNative(std::string const& program);
+		~ExecutableNative();
+
+		// Function management
+		Function* CreateFunction(char const* name) override;
+		void DeleteFunction(Function* func) override;
+
+		std::string const& GetProgram() const;
+
+	private:
+		std::string m_program;
+	};
+
+	ExecutableNative::ExecutableNative(std::string const& program)
+		: m_program(program)
+	{
+	}
+
+	ExecutableNative::~ExecutableNative()
+	{
+	}
+
+	Function* ExecutableNative::CreateFunction(char const* name)
+	{
+		std::lock_guard<std::mutex> lock(GetRegistryMutex());
+
+		auto& registry = GetRegistry();
+		auto program = registry.find(m_program);
+		auto kernel = program->second.kernels.find(name);
+
+		if (kernel == program->second.kernels.end())
+		{
+			throw ExceptionNative(std::string("No native implementation for kernel ") + name + " in " + m_program);
+		}
+
+		return new FunctionNative(kernel->second);
+	}
+
+	void ExecutableNative::DeleteFunction(Function* func)
+	{
+		delete func;
+	}
+
+	std::string const& ExecutableNative::GetProgram() const
+	{
+		return m_program;
+	}
+
+	// Device
+	DeviceNative::DeviceNative()
+		: m_pool(new WorkStealingPool())
+	{
+		for (auto i = 0U; i < NUM_QUEUES; ++i)
+		{
+			m_queues.emplace_back(new QueueNative());
+		}
+
+		// Initialize event pool
+		for (std::size_t i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
+		{
+			m_event_pool.push(new EventNative());
+		}
+	}
+
+	DeviceNative::~DeviceNative()
+	{
+		// Stop queues first as they might still use the pool
+		m_queues.clear();
+		m_pool.reset();
+
+		while (!m_event_pool.empty())
+		{
+			auto event = m_event_pool.front();
+			m_event_pool.pop();
+			delete event;
+		}
+	}
+
+	static std::size_t GetSystemMemorySize()
+	{
+#ifdef _WIN32
+		MEMORYSTATUSEX status;
+		status.dwLength = sizeof(status);
+		GlobalMemoryStatusEx(&status);
+		return static_cast<std::size_t>(status.ullTotalPhys);
+#else
+		auto pages = sysconf(_SC_PHYS_PAGES);
+		auto page_size = sysconf(_SC_PAGE_SIZE);
+		return pages > 0 && page_size > 0 ? static_cast<std::size_t>(pages) * static_cast<std::size_t>(page_size) : 0;
+#endif
+	}
+
+	void DeviceNative::GetSpec(DeviceSpec& spec)
+	{
+		GetNativeSpec(spec);
+	}
+
+	void DeviceNative::GetNativeSpec(DeviceSpec& spec)
+	{
+		spec.name = "Native CPU";
+		spec.vendor = "FireRays";
+		spec.type = DeviceType::kCpu;
+
+		spec.global_mem_size = GetSystemMemorySize();
+		spec.local_mem_size = 32 * 1024;
+		spec.min_alignment = 16;
+		spec.max_alloc_size = spec.global_mem_size;
+		spec.max_num_queues = NUM_QUEUES;
+		spec.max_local_size = 1024;
+		spec.num_compute_units = std::max(std::thread::hardware_concurrency(), 1u);
+		spec.blocking_commands = true;
+	}
+
+	Buffer* DeviceNative::CreateBuffer(std::size_t size, std::uint32_t)
+	{
+		return new BufferNative(size);
+	}
+
+	Buffer* DeviceNative::CreateBuffer(std::size_t size, std::uint32_t flags, void* initdata)
+	{
+		if (flags & kUseHostPtr)
+		{
+			return new BufferNative(size, initdata);
+		}
+
+		auto buffer = new BufferNative(size);
+
+		if (initdata && size)
+		{
+			std::memcpy(buffer->GetData(), initdata, size);
+		}
+
+		return buffer;
+	}
+
+	void DeviceNative::DeleteBuffer(Buffer* buffer)
+	{
+		delete buffer;
+	}
+
+	void DeviceNative::ReadBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* dst, Event** e) const
+	{
+		auto buffer_native = static_cast<BufferNative const*>(buffer);
+
+		if (offset + size > buffer_native->GetSize())
+		{
+			throw ExceptionNative("Read is out of buffer bounds");
+		}
+
+		auto src = buffer_native->GetData() + offset;
+
+		Enqueue(queue, [src, size, dst]() { std::memcpy(dst, src, size); }, e);
+	}
+
+	void DeviceNative::WriteBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* src, Event** e)
+	{
+		auto buffer_native = static_cast<BufferNative const*>(buffer);
+
+		if (offset + size > buffer_native->GetSize())
+		{
+			throw ExceptionNative("Write is out of buffer bounds");
+		}
+
+		auto dst = buffer_native->GetData() + offset;
+
+		Enqueue(queue, [src, size, dst]() { std::memcpy(dst, src, size); }, e);
+	}
+
+	void DeviceNative::MapBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, std::uint32_t, void** mapdata, Event** e)
+	{
+		auto buffer_native = static_cast<BufferNative const*>(buffer);
+
+		if (offset + size > buffer_native->GetSize())
+		{
+			throw ExceptionNative("Map is out of buffer bounds");
+		}
+
+		// Memory is directly accessible, the event only tracks
+		// completion of the commands enqueued before the map
+		*mapdata = buffer_native->GetData() + offset;
+
+		Enqueue(queue, std::function<void()>(), e);
+	}
+
+	void DeviceNative::UnmapBuffer(Buffer const*, std::uint32_t queue, void*, Event** e)
+	{
+		Enqueue(queue, std::function<void()>(), e);
+	}
+
+	Executable* DeviceNative::CompileExecutable(char const* source_code, std::size_t size, char const*)
+	{
+		std::lock_guard<std::mutex> lock(GetRegistryMutex());
+
+		// Programs are identified by the source they were registered with.
+		// Compare contents since every translation unit including embedded
+		// kernels gets its own copy of the string.
+		std::string source(source_code, size);
+
+		for (auto const& program : GetRegistry())
+		{
+			if (!program.second.source.empty() && program.second.source == source)
+			{
+				return new ExecutableNative(program.first);
+			}
+		}
+
+		throw ExceptionNative("No native implementation for the program source");
+	}
+
+	Executable* DeviceNative::CompileExecutable(char const* filename,
+		char const**,
+		int)
+	{
+		auto name = GetProgramName(filename);
+
+		std::lock_guard<std::mutex> lock(GetRegistryMutex());
+
+		if (GetRegistry().find(name) == GetRegistry().cend())
+		{
+			throw ExceptionNative("No native implementation for the program " + name);
+		}
+
+		return new ExecutableNative(name);
+	}
+
+	Executable* DeviceNative::CompileExecutable(std::uint8_t const* binary_code, std::size_t size, char const*)
+	{
+		// Native "binary" is just a program name
+		std::string name(reinterpret_cast<char const*>(binary_code), size);
+
+		std::lock_guard<std::mutex> lock(GetRegistryMutex());
+
+		if (GetRegistry().find(name) == GetRegistry().cend())
+		{
+			throw ExceptionNative("No native implementation for the program " + name);
+		}
+
+		return new ExecutableNative(name);
+	}
+
+	void DeviceNative::DeleteExecutable(Executable* executable)
+	{
+		delete executable;
+	}
+
+	size_t DeviceNative::GetExecutableBinarySize(Executable const* executable) const
+	{
+		return static_cast<ExecutableNative const*>(executable)->GetProgram().size();
+	}
+
+	void DeviceNative::GetExecutableBinary(Executable const* executable, std::uint8_t* binary) const
+	{
+		auto const& name = static_cast<ExecutableNative const*>(executable)->GetProgram();
+		std::copy(name.cbegin(), name.cend(), binary);
+	}
+
+	void DeviceNative::Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e)
+	{
+		auto func_native = static_cast<FunctionNative const*>(func);
+
+		// Arguments are captured at launch time as with OpenCL
+		NativeArgs args(func_native->GetArgs());
+		NativeKernel kernel = func_native->GetKernel();
+		WorkStealingPool* pool = m_pool.get();
+
+		local_size = std::max<std::size_t>(local_size, 1);
+
+		// Use several work groups per task to amortize scheduling costs,
+		// but still leave enough tasks for the stealing to balance the load
+		auto num_groups = (global_size + local_size - 1) / local_size;
+		auto groups_per_task = std::max<std::size_t>(1, num_groups / (pool->GetNumThreads() * 16));
+		auto grain = groups_per_task * local_size;
+
+		Enqueue(queue, [pool, kernel, args, global_size, grain]()
+		{
+			pool->ParallelFor(global_size, grain, [&kernel, &args](std::size_t begin, std::size_t end)
+			{
+				kernel(args, begin, end);
+			});
+		}, e);
+	}
+
+	void DeviceNative::WaitForEvent(Event* e)
+	{
+		e->Wait();
+	}
+
+	void DeviceNative::WaitForMultipleEvents(Event** e, std::size_t num_events)
+	{
+		for (std::size_t i = 0; i < num_events; ++i)
+		{
+			e[i]->Wait();
+		}
+	}
+
+	void DeviceNative::DeleteEvent(Event* e)
+	{
+		ReleaseEventNative(static_cast<EventNative*>(e));
+	}
+
+	void DeviceNative::EnqueueWaitForEvent(std::uint32_t queue, Event* e)
+	{
+		if (queue >= m_queues.size())
+		{
+			throw ExceptionNative("Queue index is out of bounds");
+		}
+
+		// Event state is shared, so the event itself might be released right away
+		auto state = static_cast<EventNative*>(e)->GetState();
+
+		m_queues[queue]->Push([state]() { state->Wait(); }, std::make_shared<EventStateNative>());
+	}
+
+	void DeviceNative::Flush(std::uint32_t)
+	{
+		// Commands are picked up as soon as they are enqueued
+	}
+
+	void DeviceNative::Finish(std::uint32_t queue)
+	{
+		Enqueue(queue, std::function<void()>(), nullptr);
+	}
+
+	void DeviceNative::Enqueue(std::uint32_t queue, std::function<void()> command, Event** e) const
+	{
+		if (queue >= m_queues.size())
+		{
+			throw ExceptionNative("Queue index is out of bounds");
+		}
+
+		auto state = std::make_shared<EventStateNative>();
+
+		m_queues[queue]->Push(command, state);
+
+		if (e)
+		{
+			auto event_native = CreateEventNative();
+			event_native->SetState(state);
+			*e = event_native;
+		}
+		else
+		{
+			state->Wait();
+		}
+	}
+
+	EventNative* DeviceNative::CreateEventNative() const
+	{
+		std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+
+		if (m_event_pool.empty())
+		{
+			auto event = new EventNative();
+			return event;
+		}
+		else
+		{
+			auto event = m_event_pool.front();
+			m_event_pool.pop();
+			return event;
+		}
+	}
+
+	void DeviceNative::ReleaseEventNative(EventNative* e) const
+	{
+		std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+		m_event_pool.push(e);
+	}
+
+	// Host implementation of parallel primitives
+	class PrimitivesNative : public Primitives
+	{
+	public:
+		PrimitivesNative(DeviceNative* device)
+			: m_device(device)
+		{
+		}
+
+		void SortRadixInt32(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size, Event** e) override
+		{
+			auto src_keys = reinterpret_cast<std::uint32_t const*>(static_cast<BufferNative const*>(from_key)->GetData());
+			auto dst_keys = reinterpret_cast<std::uint32_t*>(static_cast<BufferNative*>(to_key)->GetData());
+			auto src_values = reinterpret_cast<std::uint32_t const*>(static_cast<BufferNative const*>(from_value)->GetData());
+			auto dst_values = reinterpret_cast<std::uint32_t*>(static_cast<BufferNative*>(to_value)->GetData());
+
+			// Run on the queue to keep the ordering with other commands, keys are 
+			// sorted as unsigned integers in 4 passes of 8 bit LSD radix sort.
+			m_device->Enqueue(queueidx, [=]()
+			{
+				std::vector<std::uint32_t> tmp_keys(size);
+				std::vector<std::uint32_t> tmp_values(size);
+
+				std::copy(src_keys, src_keys + size, dst_keys);
+				std::copy(src_values, src_values + size, dst_values);
+
+				std::uint32_t* keys[2] = { dst_keys, size ? &tmp_keys[0] : nullptr };
+				std::uint32_t* values[2] = { dst_values, size ? &tmp_values[0] : nullptr };
+
+				for (auto pass = 0; pass < 4; ++pass)
+				{
+					auto shift = pass * 8;
+					auto in = pass & 1;
+					auto out = 1 - in;
+
+					std::size_t histogram[257] = { 0 };
+
+					for (std::size_t i = 0; i < size; ++i)
+					{
+						++histogram[((keys[in][i] >> shift) & 0xFF) + 1];
+					}
+
+					for (auto i = 1; i < 257; ++i)
+					{
+						histogram[i] += histogram[i - 1];
+					}
+
+					for (std::size_t i = 0; i < size; ++i)
+					{
+						auto bucket = (keys[in][i] >> shift) & 0xFF;
+						auto dst = histogram[bucket]++;
+						keys[out][dst] = keys[in][i];
+						values[out][dst] = values[in][i];
+					}
+				}
+				// Even number of passes: the result ends up in destination buffers
+			}, e);
+		}
+
+		void PackBitsInt32(std::uint32_t queueidx, Buffer const* from, Buffer* to_mask, std::size_t size, Event** e) override
+		{
+			auto src = reinterpret_cast<std::int32_t const*>(static_cast<BufferNative const*>(from)->GetData());
+			auto dst = reinterpret_cast<std::uint32_t*>(static_cast<BufferNative*>(to_mask)->GetData());
+
+			m_device->Enqueue(queueidx, [=]()
+			{
+				for (std::size_t word = 0; word * 32 < size; ++word)
+				{
+					auto first = word * 32;
+					auto count = std::min<std::size_t>(32, size - first);
+
+					std::uint32_t bits = 0;
+					for (std::size_t i = 0; i < count; ++i)
+					{
+						bits |= (src[first + i] > 0 ? 1u : 0u) << i;
+					}
+
+					dst[word] = bits;
+				}
+			}, e);
+		}
+
+		void FillInt32(std::uint32_t queueidx, Buffer* buffer, std::int32_t value, std::size_t size, Event** e) override
+		{
+			auto native = static_cast<BufferNative*>(buffer);
+
+			if (size * sizeof(std::int32_t) > native->GetSize())
+			{
+				throw ExceptionNative("Fill is out of buffer bounds");
+			}
+
+			auto dst = reinterpret_cast<std::int32_t*>(native->GetData());
+
+			m_device->Enqueue(queueidx, [=]()
+			{
+				std::fill(dst, dst + size, value);
+			}, e);
+		}
+
+		void CountBits(std::uint32_t queueidx, Buffer const* mask, Buffer* count, std::size_t numbits, Event** e) override
+		{
+			auto src = reinterpret_cast<std::uint32_t const*>(static_cast<BufferNative const*>(mask)->GetData());
+			auto dst = reinterpret_cast<std::int32_t*>(static_cast<BufferNative*>(count)->GetData());
+
+			m_device->Enqueue(queueidx, [=]()
+			{
+				std::int32_t total = 0;
+
+				for (std::size_t word = 0; word * 32 < numbits; ++word)
+				{
+					auto bits = src[word];
+
+					// Bits past the end of the mask are undefined
+					if (numbits - word * 32 < 32)
+					{
+						bits &= (1u << (numbits - word * 32)) - 1;
+					}
+
+					for (; bits; bits &= bits - 1)
+					{
+						++total;
+					}
+				}
+
+				*dst = total;
+			}, e);
+		}
+
+	private:
+		DeviceNative* m_device;
+	};
+
+	bool DeviceNative::HasBuiltinPrimitives() const
+	{
+		return true;
+	}
+
+	Primitives* DeviceNative::CreatePrimitives() const
+	{
+		return new PrimitivesNative(const_cast<DeviceNative*>(this));
+	}
+
+	void DeviceNative::DeletePrimitives(Primitives* prims)
+	{
+		delete prims;
+	}
+}
@@ -0,0 +1,300 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "executable_cache.h"
+#include "device.h"
+#include "except.h"
+
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+namespace Calc
+{
+	// Bump whenever the file layout or key composition changes
+	static const std::uint32_t kCacheMagic = 0x4b434c43; // "CLCK"
+	static const std::uint32_t kCacheVersion = 1;
+
+	struct CacheHeader
+	{
+		std::uint32_t magic;
+		std::uint32_t version;
+		std::uint64_t key;
+		std::uint64_t size;
+	};
+
+	// 64-bit FNV-1a
+	static std::uint64_t Hash(std::uint64_t hash, void const* data, std::size_t size)
+	{
+		auto bytes = static_cast<unsigned char const*>(data);
+		for (std::size_t i = 0; i < size; ++i)
+		{
+			hash ^= bytes[i];
+			hash *= 0x100000001b3ull;
+		}
+		return hash;
+	}
+
+	static std::uint64_t Hash(std::uint64_t hash, char const* str)
+	{
+		// Hash terminating zero as well so adjacent strings can't alias
+		return str ? Hash(hash, str, std::strlen(str) + 1) : Hash(hash, "", 1);
+	}
+
+	static bool LoadFileContents(std::string const& name, std::string& contents)
+	{
+		std::ifstream in(name, std::ios::in | std::ios::binary);
+
+		if (!in)
+		{
+			return false;
+		}
+
+		std::ostringstream ss;
+		ss << in.rdbuf();
+		contents = ss.str();
+		return true;
+	}
+
+	ExecutableCache::ExecutableCache(Device* device, std::string const& path)
+		: m_device(device)
+		, m_path(path)
+		, m_num_hits(0)
+		, m_num_misses(0)
+	{
+		if (!m_path.empty())
+		{
+			// Failure is fine here: the directory either exists
+			// already or cache writes will fail and be ignored
+#ifdef _WIN32
+			_mkdir(m_path.c_str());
+#else
+			mkdir(m_path.c_str(), 0755);
+#endif
+		}
+	}
+
+	Executable* ExecutableCache::CompileExecutable(char const* source_code, std::size_t size, char const* options)
+	{
+		if (m_path.empty())
+		{
+			return m_device->CompileExecutable(source_code, size, options);
+		}
+
+		auto key = GetKey(std::string(source_code, size), options);
+
+		if (auto executable = Load(key, options))
+		{
+			++m_num_hits;
+			return executable;
+		}
+
+		++m_num_misses;
+		auto executable = m_device->CompileExecutable(source_code, size, options);
+		Store(key, executable);
+		return executable;
+	}
+
+	Executable* ExecutableCache::CompileExecutable(char const* filename,
+		char const** headernames,
+		int numheaders)
+	{
+		if (m_path.empty())
+		{
+			return m_device->CompileExecutable(filename, headernames, numheaders);
+		}
+
+		// Key covers every file participating in compilation, so
+		// editing any of the headers invalidates the entry
+		std::string source;
+		std::string contents;
+		if (!LoadFileContents(filename, contents))
+		{
+			// Let the device report missing file
+			return m_device->CompileExecutable(filename, headernames, numheaders);
+		}
+
+		source.append(contents);
+
+		for (int i = 0; i < numheaders; ++i)
+		{
+			source.append(headernames[i]);
+			source.push_back('\0');
+
+			if (LoadFileContents(headernames[i], contents))
+			{
+				source.append(contents);
+			}
+		}
+
+		auto key = GetKey(source, nullptr);
+
+		if (auto executable = Load(key, nullptr))
+		{
+			++m_num_hits;
+			return executable;
+		}
+
+		++m_num_misses;
+		auto executable = m_device->CompileExecutable(filename, headernames, numheaders);
+		Store(key, executable);
+		return executable;
+	}
+
+	std::uint64_t ExecutableCache::GetKey(std::string const& source, char const* options) const
+	{
+		DeviceSpec spec;
+		m_device->GetSpec(spec);
+
+		std::uint64_t hash = 0xcbf29ce484222325ull;
+		hash = Hash(hash, &kCacheVersion, sizeof(kCacheVersion));
+		hash = Hash(hash, spec.name);
+		hash = Hash(hash, spec.vendor);
+		hash = Hash(hash, options);
+		hash = Hash(hash, source.data(), source.size());
+		return hash;
+	}
+
+	std::string ExecutableCache::GetEntryFileName(char const* source_code, std::size_t size, char const* options) const
+	{
+		return GetFileName(GetKey(std::string(source_code, size), options));
+	}
+
+	std::string ExecutableCache::GetFileName(std::uint64_t key) const
+	{
+		char name[17];
+		std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+		return m_path + "/" + name + ".bin";
+	}
+
+	Executable* ExecutableCache::Load(std::uint64_t key, char const* options) const
+	{
+		std::ifstream in(GetFileName(key), std::ios::in | std::ios::binary);
+
+		if (!in)
+		{
+			return nullptr;
+		}
+
+		CacheHeader header;
+		if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+			header.magic != kCacheMagic ||
+			header.version != kCacheVersion ||
+			header.key != key ||
+			header.size == 0)
+		{
+			return nullptr;
+		}
+
+		std::vector<std::uint8_t> binary(static_cast<std::size_t>(header.size));
+		if (!in.read(reinterpret_cast<char*>(&binary[0]), binary.size()))
+		{
+			return nullptr;
+		}
+
+		try
+		{
+			return m_device->CompileExecutable(&binary[0], binary.size(), options);
+		}
+		catch (Exception&)
+		{
+			// Driver may reject binaries produced by another version:
+			// recompile and overwrite the entry
+			return nullptr;
+		}
+	}
+
+	void ExecutableCache::Store(std::uint64_t key, Executable const* executable) const
+	{
+		try
+		{
+			auto size = m_device->GetExecutableBinarySize(executable);
+
+			if (size == 0)
+			{
+				return;
+			}
+
+			std::vector<std::uint8_t> binary(size);
+			m_device->GetExecutableBinary(executable, &binary[0]);
+
+			CacheHeader header = { kCacheMagic, kCacheVersion, key, size };
+
+			// Several processes might be warming the same cache:
+			// write into unique temporary file and move it in place,
+			// so readers never see partially written entries.
+			// Thread ids and clocks are only unique within the process
+			auto name = GetFileName(key);
+			std::ostringstream tmpname;
+#ifdef _WIN32
+			tmpname << name << "." << _getpid();
+#else
+			tmpname << name << "." << getpid();
+#endif
+			tmpname << "." << std::hash<std::thread::id>()(std::this_thread::get_id())
+				<< "." << std::chrono::steady_clock::now().time_since_epoch().count() << ".tmp";
+
+			{
+				std::ofstream out(tmpname.str(), std::ios::out | std::ios::binary);
+
+				if (!out)
+				{
+					return;
+				}
+
+				out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+				out.write(reinterpret_cast<char const*>(&binary[0]), binary.size());
+
+				if (!out)
+				{
+					out.close();
+					std::remove(tmpname.str().c_str());
+					return;
+				}
+			}
+
+			if (std::rename(tmpname.str().c_str(), name.c_str()) != 0)
+			{
+				// Windows refuses to rename over existing file,
+				// somebody else has stored this entry already
+				std::remove(tmpname.str().c_str());
+			}
+		}
+		catch (Exception&)
+		{
+			// Caching is best effort, compiled executable is still valid
+		}
+	}
+}
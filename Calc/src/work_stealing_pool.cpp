@@ -0,0 +1,220 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "work_stealing_pool.h"
+
+#include <algorithm>
+
+namespace Calc
+{
+	struct WorkStealingPool::Batch
+	{
+		RangeFunc const* func;
+		std::atomic<std::size_t> remaining;
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::exception_ptr error;
+	};
+
+	WorkStealingPool::WorkStealingPool(std::uint32_t num_threads)
+		: m_pending(0)
+		, m_done(false)
+		, m_next_worker(0)
+	{
+		if (num_threads == 0)
+		{
+			num_threads = std::thread::hardware_concurrency();
+			num_threads = num_threads == 0 ? 2 : num_threads;
+		}
+
+		for (auto i = 0U; i < num_threads; ++i)
+		{
+			m_workers.emplace_back(new Worker());
+		}
+
+		for (auto i = 0U; i < num_threads; ++i)
+		{
+			m_threads.push_back(std::thread(&WorkStealingPool::RunLoop, this, i));
+		}
+	}
+
+	WorkStealingPool::~WorkStealingPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_done = true;
+		}
+
+		m_cv.notify_all();
+
+		for (auto& thread : m_threads)
+		{
+			thread.join();
+		}
+	}
+
+	std::uint32_t WorkStealingPool::GetNumThreads() const
+	{
+		return static_cast<std::uint32_t>(m_threads.size());
+	}
+
+	void WorkStealingPool::ParallelFor(std::size_t size, std::size_t grain, RangeFunc const& func)
+	{
+		if (size == 0)
+			return;
+
+		grain = std::max<std::size_t>(grain, 1);
+
+		auto num_tasks = (size + grain - 1) / grain;
+
+		// Do not bother waking up workers for a single chunk
+		if (num_tasks == 1)
+		{
+			func(0, size);
+			return;
+		}
+
+		Batch batch;
+		batch.func = &func;
+		batch.remaining = num_tasks;
+
+		// Deal contiguous runs of chunks to the workers, so each of them
+		// starts with coherent work and only steals once it runs dry
+		auto num_workers = static_cast<std::uint32_t>(m_workers.size());
+		auto first = m_next_worker.fetch_add(1) % num_workers;
+		auto per_worker = (num_tasks + num_workers - 1) / num_workers;
+
+		// Count the tasks before publishing them, workers decrement the counter as soon
+		// as they take a task and it must never wrap below zero. Idle workers might spin
+		// briefly until the tasks are in place
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pending += num_tasks;
+		}
+
+		for (std::size_t t = 0; t < num_tasks; t += per_worker)
+		{
+			auto& worker = *m_workers[(first + t / per_worker) % num_workers];
+			std::lock_guard<std::mutex> lock(worker.mutex);
+
+			auto last = std::min(num_tasks, t + per_worker);
+			// Owner pops from the back, so push in reverse to process in order
+			for (auto i = last; i > t; --i)
+			{
+				Task task = { &batch, (i - 1) * grain, std::min(size, i * grain) };
+				worker.tasks.push_back(task);
+			}
+		}
+
+		m_cv.notify_all();
+
+		{
+			std::unique_lock<std::mutex> lock(batch.mutex);
+			batch.cv.wait(lock, [&batch]() { return batch.remaining == 0; });
+		}
+
+		if (batch.error)
+		{
+			std::rethrow_exception(batch.error);
+		}
+	}
+
+	bool WorkStealingPool::PopLocal(std::uint32_t idx, Task& task)
+	{
+		auto& worker = *m_workers[idx];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+
+		if (worker.tasks.empty())
+			return false;
+
+		task = worker.tasks.back();
+		worker.tasks.pop_back();
+		--m_pending;
+		return true;
+	}
+
+	bool WorkStealingPool::Steal(std::uint32_t idx, Task& task)
+	{
+		auto num_workers = static_cast<std::uint32_t>(m_workers.size());
+
+		for (auto i = 1U; i < num_workers; ++i)
+		{
+			auto& victim = *m_workers[(idx + i) % num_workers];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+
+			if (!victim.tasks.empty())
+			{
+				task = victim.tasks.front();
+				victim.tasks.pop_front();
+				--m_pending;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void WorkStealingPool::RunTask(Task const& task)
+	{
+		auto batch = task.batch;
+
+		try
+		{
+			(*batch->func)(task.begin, task.end);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(batch->mutex);
+			if (!batch->error)
+			{
+				batch->error = std::current_exception();
+			}
+		}
+
+		// Batch lives on the stack of ParallelFor caller, so the last
+		// decrement has to happen under the lock it is waiting on
+		std::lock_guard<std::mutex> lock(batch->mutex);
+		if (--batch->remaining == 0)
+		{
+			batch->cv.notify_all();
+		}
+	}
+
+	void WorkStealingPool::RunLoop(std::uint32_t idx)
+	{
+		for (;;)
+		{
+			Task task;
+
+			if (PopLocal(idx, task) || Steal(idx, task))
+			{
+				RunTask(task);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cv.wait(lock, [this]() { return m_done || m_pending > 0; });
+
+			if (m_done && m_pending == 0)
+				return;
+		}
+	}
+}
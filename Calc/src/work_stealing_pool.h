@@ -0,0 +1,95 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Calc
+{
+	// Thread pool with per-thread task deques. The owner pops tasks from
+	// the back of its deque, idle threads steal from the front of others.
+	// Used by native device to run kernels over global work ranges.
+	class WorkStealingPool
+	{
+	public:
+		// Range function: processes [begin, end)
+		typedef std::function<void(std::size_t begin, std::size_t end)> RangeFunc;
+
+		// Pass 0 to use all available hardware threads
+		explicit WorkStealingPool(std::uint32_t num_threads = 0);
+		~WorkStealingPool();
+
+		// Split [0, size) into chunks of grain elements (the last one might be smaller),
+		// distribute them across worker threads and block until all of them are processed.
+		// The first exception thrown by func is rethrown in the calling thread.
+		void ParallelFor(std::size_t size, std::size_t grain, RangeFunc const& func);
+
+		// Number of worker threads
+		std::uint32_t GetNumThreads() const;
+
+		WorkStealingPool(WorkStealingPool const&) = delete;
+		WorkStealingPool& operator = (WorkStealingPool const&) = delete;
+
+	private:
+		struct Batch;
+
+		struct Task
+		{
+			Batch* batch;
+			std::size_t begin;
+			std::size_t end;
+		};
+
+		struct Worker
+		{
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+
+		void RunLoop(std::uint32_t idx);
+		bool PopLocal(std::uint32_t idx, Task& task);
+		bool Steal(std::uint32_t idx, Task& task);
+		void RunTask(Task const& task);
+
+		std::vector<std::unique_ptr<Worker>> m_workers;
+		std::vector<std::thread> m_threads;
+
+		// Wake up handling for idle threads
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+		// Number of tasks sitting in the deques
+		std::atomic<std::size_t> m_pending;
+		bool m_done;
+		// Distribution start for the next batch
+		std::atomic<std::uint32_t> m_next_worker;
+	};
+}
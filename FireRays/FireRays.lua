@@ -29,12 +29,6 @@ project "FireRays"
     end
 
 
-    if _OPTIONS["use_tbb"] then
-        defines {"USE_TBB"}
-        links {"tbb"}
-        includedirs { "../3rdParty/tbb/include" }
-    end
-
     if _OPTIONS["use_embree"] then
         files {"../FireRays/src/device/embree*"}
         defines {"USE_EMBREE"}
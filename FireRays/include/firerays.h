@@ -86,7 +86,10 @@ namespace FireRays
         virtual void SetTransform(matrix const& m, matrix const& minv) = 0;
         virtual void GetTransform(matrix& m, matrix& minv) const = 0;
 
-        // Motion blur
+        // Motion blur, the shape moves within shutter interval [0, 1] of ray time:
+        // at time t it is rotated around its local origin by the fraction t of the
+        // angular velocity rotation (quaternion) and then moved by linear velocity * t
+        // in world space. Motion is supported by 2-level BVH only.
         virtual void SetLinearVelocity(float3 const& v) = 0;
         virtual float3 GetLinearVelocity() const = 0;
 
@@ -100,6 +103,11 @@ namespace FireRays
 		// Geometry mask to mask out intersections
 		virtual void SetMask(int mask) = 0;
 		virtual int  GetMask() const = 0;
+
+        // Update positions of vertices [startidx, startidx + vnum) in place keeping topology and ID intact,
+        // vstride = 0 means densely packed float3 data (only supported by meshes, not instances),
+        // shared meshes expect vertices = nullptr after the caller has updated its own memory
+        virtual void UpdateVertices(float const* vertices, int startidx, int vnum, int vstride) = 0;
     };
 
     // Buffer represents a chunk of memory hosted inside the API
@@ -131,7 +139,7 @@ namespace FireRays
 
     struct Intersection
     {
-        // UV parametrization
+        // UV parametrization, w is the distance and z is 1 if the second triangle (v3, v4, v1) of a quad was hit
         float4 uvwt;
         // Shape ID
         Id shapeid;
@@ -144,6 +152,29 @@ namespace FireRays
         Intersection();
     };
 
+    // 16-byte intersection written by compact queries
+    struct CompactIntersection
+    {
+        // Distance to the hit (ray maxt if there is no hit)
+        float t;
+        // Barycentric coordinates as 16-bit unorms, u in the low half
+        std::uint32_t uv;
+        // Shape ID
+        Id shapeid;
+        // Primitve ID, kQuadTriangleBit is set if the second triangle (v3, v4, v1) of a quad was hit
+        Id primid;
+
+        static const Id kQuadTriangleBit = 0x40000000;
+
+        CompactIntersection();
+
+        float2 GetUv() const;
+        // Primitive ID without the quad triangle bit
+        Id GetPrimId() const;
+        // Same as Intersection::uvwt.z: 1 if the second triangle of a quad was hit, 0 otherwise
+        int GetQuadTriangle() const;
+    };
+
     enum MapType
     {
         kMapRead = 0x1,
@@ -157,6 +188,8 @@ namespace FireRays
     //    - Fast path: the data is expected to be in host memory as well as the returned result is put there
     //    - Complete path: the data can be put into remote memory allocated with API and can be accessed.
     //      by the app directly in remote memory space.
+    // Buffer, event and query calls might be issued from several threads concurrently, the work of each
+    // thread is executed in order. Scene changes and commits have to be serialized by the app.
     //
     class FRAPI IntersectionApi
     {
@@ -200,6 +233,21 @@ namespace FireRays
             int  numfaces
             ) const = 0;
 
+        // Same as CreateMesh, but the data is not copied: the mesh keeps the pointers and strides
+        // and reads caller memory directly whenever geometry is (re)built during Commit.
+        // Vertex, index and numfacevertices arrays must stay valid and unchanged until the shape
+        // is deleted; positions might be modified in place followed by UpdateVertices(nullptr, ...).
+        virtual Shape* CreateMeshShared(
+            // Position data
+            float const* vertices, int vnum, int vstride,
+            // Index data for vertices
+            int const* indices, int istride,
+            // Numbers of vertices per face
+            int const* numfacevertices,
+            // Number of faces
+            int  numfaces
+            ) const = 0;
+
         // Create an instance of a shape with its own transform (set via Shape interface).
         // The call is blocking, so the returned value is ready upon return.
         virtual Shape* CreateInstance(Shape const* shape) const = 0;
@@ -211,6 +259,15 @@ namespace FireRays
         virtual void DetachShape(Shape const* shape) = 0;
         // Commit all geometry creations/changes
         virtual void Commit() = 0;
+        // Commit all geometry creations/changes building acceleration structure in the background.
+        // Queries keep using the previously committed scene until the event is completed,
+        // after that they switch to the new one. Pass the event as waitevent to a query
+        // to make sure it sees the new scene. Event pointer might be nullptr, then the call is blocking.
+        // Shapes might be attached and detached right after the call, but the committed ones
+        // must not be changed or deleted until the event is completed: the background build reads
+        // their transforms, ids, masks and vertices. Queries issued before the first commit
+        // is completed wait for it.
+        virtual void CommitAsync(Event** event) = 0;
 
         /******************************************
         Memory management
@@ -230,9 +287,22 @@ namespace FireRays
         *******************************************/
         virtual void DeleteEvent(Event* event) const = 0;
 
+        /******************************************
+          Queues
+        *******************************************/
+        // Number of device queues. Work of different queues might overlap, e.g. upload of
+        // one ray batch, traversal of another one and download of the third.
+        virtual int GetQueueCount() const = 0;
+        // Select the queue for buffer and query calls of the calling thread, idx < GetQueueCount().
+        // By default threads are spread over the queues round robin. Calls on the same queue are
+        // executed in order, pass waitevent to a query to make it wait for the work of another queue.
+        virtual void SetQueue(int idx) = 0;
+
         /******************************************
           Ray casting
         ******************************************/
+        // Queries need the acceleration structure built by Commit or CommitAsync,
+        // the ones issued before the first commit throw an Exception.
         // Complete path:
         // Find closest intersection
         // The call is asynchronous. Event pointers might be nullptrs.
@@ -248,22 +318,88 @@ namespace FireRays
         // The call is asynchronous. Event pointer mights be nullptrs.
         virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
 
+        // Find any intersection and write the results as a bit mask: bit (i % 32) of 32-bit word (i / 32) is set if ray i is occluded.
+        // hitmask should hold (numrays + 31) / 32 words, bits of inactive rays are cleared, bits past the last ray are undefined.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryOcclusionMask(Buffer const* rays, int numrays, Buffer* hitmask, Event const* waitevent, Event** event) const = 0;
+        // Find any intersection and write the results as a bit mask, number of rays is in remote memory.
+        // hitmask should hold (maxrays + 31) / 32 words, bits of inactive rays and of rays from numrays up to maxrays are cleared.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryOcclusionMask(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitmask, Event const* waitevent, Event** event) const = 0;
+
+        // Compact path:
+        // Rays are compact_ray, masks and activity flags come from rayflags buffer of int2 (ray::extra layout),
+        // rayflags might be nullptr making all the rays active with full mask. Hits are CompactIntersection,
+        // hits on quads keep the triangle index in the primitive id (see CompactIntersection::GetQuadTriangle).
+        // The calls are asynchronous. Event pointers might be nullptrs.
+        virtual void QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
+        // Find any intersection (-1 if no intersection, 1 otherwise).
+        virtual void QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+        // Find closest intersection, number of rays is in remote memory
+        virtual void QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
+        // Find any intersection, number of rays is in remote memory
+        virtual void QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+
+        // Fast path:
+        // Find closest intersection for the rays in host memory, the results are written to host memory.
+        // Large batches are split into chunks with transfers overlapping the traversal,
+        // CPU devices use the memory directly. The call is blocking.
+        virtual void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos) const = 0;
+        // Find any intersection for the rays in host memory (-1 if no intersection, 1 otherwise).
+        // The call is blocking.
+        virtual void QueryOcclusion(ray const* rays, int numrays, int* hitresults) const = 0;
+
         /******************************************
         Utility
         ******************************************/
         // Set API global option: string
         // Supported options:
-        // option "bvh.type" values {"bvh" (regular bvh, default), "qbvh" (4 branching factor), "hlbvh" (fast builds)}
+        // option "acc.type" values {"bvh" (regular bvh, default), "fatbvh", "qbvh" (4 branching factor), "hlbvh" (fast builds),
+        //         "grid" (uniform grid, fast builds for evenly tessellated geometry),
+        //         "auto" (picked by the cost model from scene statistics and the device, the choice is kept
+        //         until the set of shapes or their face counts change)}
+        // option "acc.auto.rays" values {float, default = 1048576.f} (number of rays expected per Commit, "auto" weighs
+        //         build time of the acceleration structures against trace time of this many rays)
+        // option "acc.auto.probe" values {int, default = 0 (disabled)} (number of the cheapest candidates "auto" builds and
+        //         times with a short query before choosing, the winner is kept; makes the first Commit slower)
         // option "bvh.force2level" values {0(default), 1}
         //         by default 2-level BVH is used only if there is instancing in the scene or
         //         motion blur is enabled. 1 forces 2-level BVH for all cases.
         // option "bvh.builder" values {"sah" (use surface area heuristic), "median" (use spatial median, faster to build, default)}
-        // option "bvh.sah.usesplits" values {0(default),1} (allow spatial splits for BVH)
+        // option "bvh.sah.usesplits" values {0(default),1} (allow spatial splits for BVH, "bvh" acceleration structure with "sah" builder only,
+        //         ignored if the scene contains quads)
         // option "bvh.sah.trisah" values {float, default = 0.01f for GPU } (cost of triangle intersection vs node traversal)
         // option "bvh.sah.overlaparea" values { float < 1.f, default = 0.0001f } 
         //         (overlap area which is considered for a spatial splits, fraction of parent bbox)
-        // option "bvh.sah.maxprimsperleaf" values {int, default = 4} (the limit on number of primitives per BVH leaf)
+        // option "bvh.sah.maxprimsperleaf" values {int in [1, 16], default = 4} (the limit on number of primitives per BVH leaf,
+        //         applies to "bvh" and "bvh2l" (bottom level) acceleration structures with either builder)
         // option "bvh.sah.maxdepth" values {int, default = 10} (max depth in the tree where spatial split can happen)
+        // option "bvh.sah.numbins" values {int in [4, 128], default = 64} (number of SAH bins per axis,
+        //         fewer bins make SAH builds faster at the cost of tree quality)
+        // option "bvh.refit.threshold" values {float, default = 0.f (disabled)} (when shapes have only been moved,
+        //         "bvh" acceleration structure is refitted instead of rebuilt until its SAH cost exceeds the cost
+        //         after the last rebuild by this factor, e.g. 1.5f; keeps face bounds in memory; also applies
+        //         to meshes deformed via Shape::UpdateVertices)
+        // option "bvh.builder.threads" values {int, default = 0 (all hardware threads)} (number of threads building
+        //         large BVHs, 1 disables threading)
+        // option "bvh.builder.deterministic" values {0 (default), 1} (build the same tree regardless of the number of threads)
+        // option "bvh.motion.segments" values {int, default = 1} (number of time segments of the shutter interval if there are
+        //         fast moving shapes, 2-level BVH builds a top level BVH per segment bounding these shapes within its time range;
+        //         rays traverse the one of their time, which pays off for large motion at the cost of more top level nodes)
+        // option "bvh.triangles.precomputed" values {0 (default), 1} ("bvh" acceleration structure only, store world space
+        //         triangles in BVH leaf order instead of shared vertices and indices and use watertight intersection test;
+        //         no index indirection during traversal for 48 bytes per triangle vs 24 bytes plus 16 bytes per vertex;
+        //         ignored if the scene contains quads)
+        // option "grid.density" values {float, default = 4.f} (target number of voxels per primitive for "grid" acceleration structure)
+        // option "grid.maxres" values {int, default = 256} (max number of "grid" voxels along any axis)
+        // option "kernel.cache.path" values {string, default = "" (disabled)} (directory to keep compiled kernel binaries in,
+        //         kernels are compiled on the first Commit, so set this option before it)
+        // option "query.sortrays" values {0 (default), 1} (sort rays by origin and direction before the traversal
+        //         of buffer queries with the number of rays known on the host, improves coherence of secondary rays;
+        //         hits are written in the original order; applied on Commit)
+        // option "query.sortrays.threshold" values {int, default = 32768} (min number of rays in a query to sort)
+        // option "query.persistent" values {0 (default), 1} (launch "bvh", "fatbvh" and "hlbvh" traversal with a fixed number
+        //         of work groups fetching ray batches from a counter, helps when ray costs vary a lot; applied on Commit)
         virtual void SetOption(char const* name, char const* value) = 0;
         // Set API global option: float
         virtual void SetOption(char const* name, float value) = 0;
@@ -285,6 +421,30 @@ namespace FireRays
     {
     }
 
+    inline CompactIntersection::CompactIntersection()
+        : t(0.f)
+        , uv(0)
+        , shapeid(kNullId)
+        , primid(kNullId)
+    {
+    }
+
+    inline float2 CompactIntersection::GetUv() const
+    {
+        return float2((uv & 0xFFFF) / 65535.f, (uv >> 16) / 65535.f);
+    }
+
+    inline Id CompactIntersection::GetPrimId() const
+    {
+        // Misses keep kNullId as is
+        return primid < 0 ? primid : (primid & ~kQuadTriangleBit);
+    }
+
+    inline int CompactIntersection::GetQuadTriangle() const
+    {
+        return (primid >= 0 && (primid & kQuadTriangleBit)) ? 1 : 0;
+    }
+
     inline Buffer::~Buffer(){}
     inline Shape::~Shape(){}
     inline Event::~Event(){}
@@ -154,6 +154,23 @@ namespace FireRays
         float norm = q.norm();
         return q / norm;
     }
+
+    /// spherical linear interpolation of unit quaternions, the shortest arc is not enforced
+    /// so that rotations over 180 degrees are interpolated as they are
+    inline quaternion slerp( quaternion const& q1, quaternion const& q2, float t )
+    {
+        float cosangle = q1.x*q2.x + q1.y*q2.y + q1.z*q2.z + q1.w*q2.w;
+        float angle = std::acos(std::fmin(std::fmax(cosangle, -1.f), 1.f));
+        float sinangle = std::sin(angle);
+
+        // Rotation axis is undefined for (anti)parallel quaternions
+        if (sinangle < 1e-6f)
+        {
+            return t < 0.5f ? q1 : q2;
+        }
+
+        return (q1 * std::sin((1.f - t) * angle) + q2 * std::sin(t * angle)) / sinangle;
+    }
     
     inline void quaternion::to_matrix( matrix& m ) const
     {
@@ -95,6 +95,45 @@ namespace FireRays
 		int2 extra;
 		int2 padding;
     };
+
+    // 32-byte ray used by compact queries, matches the leading part of ray.
+    // Mask and activity flag are passed separately if needed.
+    struct compact_ray
+    {
+        compact_ray(float3 const& oo = float3(0,0,0),
+			float3 const& dd = float3(0,0,0),
+			float maxt = std::numeric_limits<float>::max(),
+			float time = 0.f)
+            : o(oo)
+            , d(dd)
+        {
+            SetMaxT(maxt);
+            SetTime(time);
+        }
+
+        void SetTime(float time)
+        {
+            d.w = time;
+        }
+
+		float GetTime() const
+		{
+			return d.w;
+		}
+
+        void SetMaxT(float maxt)
+        {
+            o.w = maxt;
+        }
+
+		float GetMaxT() const
+		{
+			return o.w;
+		}
+
+        float4 o;
+        float4 d;
+    };
 }
 
 #endif // RAY_H
\ No newline at end of file
@@ -20,6 +20,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "bvh.h"
+#include "../async/task_scheduler.h"
 
 #include <algorithm>
 #include <thread>
@@ -29,13 +30,196 @@ THE SOFTWARE.
 #include <vector>
 #include <future>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_USE_SSE
+#include <emmintrin.h>
+#endif
+
 namespace FireRays
 {
+    // Builds with fewer primitives are always done in a single thread
+    static int const kParallelBuildThreshold = 64 * 1024;
+    // Subtrees with more primitives are built in separate tasks
+    static int const kParallelSubtreeThreshold = 4096 * 4;
+    // Nodes with more primitives are binned and partitioned in chunks
+    static int const kParallelPartitionThreshold = 64 * 1024;
+    // Chunk size for parallel binning and partitioning (fixed to make
+    // deterministic builds independent of the number of threads)
+    static int const kParallelChunkSize = 16 * 1024;
+
     bool is_nan(float v)
     {
         return v != v;
     }
 
+#ifdef BVH_USE_SSE
+    // Running bounding box kept in SSE registers
+    struct BinBox
+    {
+        BinBox()
+            : pmin(_mm_set1_ps(std::numeric_limits<float>::max()))
+            , pmax(_mm_set1_ps(-std::numeric_limits<float>::max()))
+        {
+        }
+
+        void Grow(float3 const& bmin, float3 const& bmax)
+        {
+            pmin = _mm_min_ps(pmin, _mm_loadu_ps(&bmin.x));
+            pmax = _mm_max_ps(pmax, _mm_loadu_ps(&bmax.x));
+        }
+
+        // Same order of operations as bbox::surface_area
+        float SurfaceArea() const
+        {
+            __m128 ext = _mm_sub_ps(pmax, pmin);
+            // (x * y, y * z, z * x)
+            __m128 prod = _mm_mul_ps(ext, _mm_shuffle_ps(ext, ext, _MM_SHUFFLE(3, 0, 2, 1)));
+            float xy = _mm_cvtss_f32(prod);
+            float yz = _mm_cvtss_f32(_mm_shuffle_ps(prod, prod, _MM_SHUFFLE(1, 1, 1, 1)));
+            float xz = _mm_cvtss_f32(_mm_movehl_ps(prod, prod));
+            return 2.f * (xy + xz + yz);
+        }
+
+        __m128 pmin;
+        __m128 pmax;
+    };
+#else
+    struct BinBox
+    {
+        void Grow(float3 const& bmin, float3 const& bmax)
+        {
+            vmin(box.pmin, bmin, box.pmin);
+            vmax(box.pmax, bmax, box.pmax);
+        }
+
+        float SurfaceArea() const
+        {
+            return box.surface_area();
+        }
+
+        bbox box;
+    };
+#endif
+
+    // Centroid histograms for all three dimensions. Bounds are kept
+    // in separate min/max arrays so that bins can be grown with SIMD.
+    struct Bvh::SahBins
+    {
+        float3 pmin[3][kMaxSahBins];
+        float3 pmax[3][kMaxSahBins];
+        int count[3][kMaxSahBins];
+
+        void Clear(int numbins)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                for (int i = 0; i < numbins; ++i)
+                {
+                    pmin[axis][i] = float3(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+                    pmax[axis][i] = float3(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+                    count[axis][i] = 0;
+                }
+            }
+        }
+
+        void Merge(SahBins const& other, int numbins)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                for (int i = 0; i < numbins; ++i)
+                {
+                    vmin(pmin[axis][i], other.pmin[axis][i], pmin[axis][i]);
+                    vmax(pmax[axis][i], other.pmax[axis][i], pmax[axis][i]);
+                    count[axis][i] += other.count[axis][i];
+                }
+            }
+        }
+    };
+
+    void Bvh::BinPrimitives(int begin, int end, int const* primindices, bbox const* bounds, float3 const* centroids,
+        float3 const& rootmin, float3 const& invcentroid_rng, int numbins, SahBins& bins)
+    {
+        bins.Clear(numbins);
+
+#ifdef BVH_USE_SSE
+        // Bin indices for all three dimensions are calculated at once
+        __m128 vrootmin = _mm_setr_ps(rootmin.x, rootmin.y, rootmin.z, 0.f);
+        __m128 vinvrng = _mm_setr_ps(invcentroid_rng.x, invcentroid_rng.y, invcentroid_rng.z, 0.f);
+        __m128 vnumbins = _mm_set1_ps((float)numbins);
+        __m128 vmaxbin = _mm_set1_ps((float)(numbins - 1));
+
+        for (int i = begin; i < end; ++i)
+        {
+            int idx = primindices[i];
+
+            __m128 c = _mm_loadu_ps(&centroids[idx].x);
+            __m128 binf = _mm_min_ps(_mm_mul_ps(vnumbins, _mm_mul_ps(_mm_sub_ps(c, vrootmin), vinvrng)), vmaxbin);
+            __m128i binidx = _mm_cvttps_epi32(binf);
+
+            int binx = _mm_cvtsi128_si32(binidx);
+            int biny = _mm_cvtsi128_si32(_mm_shuffle_epi32(binidx, _MM_SHUFFLE(1, 1, 1, 1)));
+            int binz = _mm_cvtsi128_si32(_mm_shuffle_epi32(binidx, _MM_SHUFFLE(2, 2, 2, 2)));
+
+            __m128 bmin = _mm_loadu_ps(&bounds[idx].pmin.x);
+            __m128 bmax = _mm_loadu_ps(&bounds[idx].pmax.x);
+
+            _mm_storeu_ps(&bins.pmin[0][binx].x, _mm_min_ps(_mm_loadu_ps(&bins.pmin[0][binx].x), bmin));
+            _mm_storeu_ps(&bins.pmax[0][binx].x, _mm_max_ps(_mm_loadu_ps(&bins.pmax[0][binx].x), bmax));
+            _mm_storeu_ps(&bins.pmin[1][biny].x, _mm_min_ps(_mm_loadu_ps(&bins.pmin[1][biny].x), bmin));
+            _mm_storeu_ps(&bins.pmax[1][biny].x, _mm_max_ps(_mm_loadu_ps(&bins.pmax[1][biny].x), bmax));
+            _mm_storeu_ps(&bins.pmin[2][binz].x, _mm_min_ps(_mm_loadu_ps(&bins.pmin[2][binz].x), bmin));
+            _mm_storeu_ps(&bins.pmax[2][binz].x, _mm_max_ps(_mm_loadu_ps(&bins.pmax[2][binz].x), bmax));
+
+            ++bins.count[0][binx];
+            ++bins.count[1][biny];
+            ++bins.count[2][binz];
+        }
+#else
+        for (int i = begin; i < end; ++i)
+        {
+            int idx = primindices[i];
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                int binidx = (int)std::min<float>(numbins * ((centroids[idx][axis] - rootmin[axis]) * invcentroid_rng[axis]), (float)(numbins - 1));
+
+                vmin(bins.pmin[axis][binidx], bounds[idx].pmin, bins.pmin[axis][binidx]);
+                vmax(bins.pmax[axis][binidx], bounds[idx].pmax, bins.pmax[axis][binidx]);
+                ++bins.count[axis][binidx];
+            }
+        }
+#endif
+    }
+
+    void Bvh::SetBuildThreads(int numthreads, bool deterministic)
+    {
+        numthreads_ = std::max(numthreads, 0);
+        deterministic_ = deterministic;
+    }
+
+    void Bvh::ParallelFor(int begin, int end, int grain, std::function<void(int, int)> const& f) const
+    {
+        if (scheduler_)
+        {
+            scheduler_->parallel_for(begin, end, grain, f);
+        }
+        else
+        {
+            for (int i = begin; i < end; i += grain)
+            {
+                f(i, std::min(i + grain, end));
+            }
+        }
+    }
+
+    void Bvh::UpdateHeight(int level)
+    {
+        int height = height_;
+        while (height < level && !height_.compare_exchange_weak(height, level))
+        {
+        }
+    }
+
     void Bvh::Build(bbox const* bounds, int numbounds)
     {
         for (int i = 0; i < numbounds; ++i)
@@ -45,6 +229,9 @@ namespace FireRays
         }
 
         BuildImpl(bounds, numbounds);
+
+        // Drop reserved nodes which have not been used
+        nodes_.resize(nodecnt_);
     }
 
     bbox const& Bvh::Bounds() const
@@ -52,6 +239,48 @@ namespace FireRays
         return bounds_;
     }
 
+    void Bvh::Refit(bbox const* bounds)
+    {
+        // Children always go after their parents, so
+        // the nodes are updated bottom up in reverse order
+        for (int i = nodecnt_ - 1; i >= 0; --i)
+        {
+            Node& node = nodes_[i];
+            bbox nodebounds;
+
+            if (node.is_leaf())
+            {
+                for (int j = node.index; j < node.index + node.numprims; ++j)
+                {
+                    nodebounds.grow(bounds[primids_[j]]);
+                }
+            }
+            else
+            {
+                nodebounds = bboxunion(nodes_[i + 1].bounds(), nodes_[node.index].bounds());
+            }
+
+            node.set_bounds(nodebounds);
+        }
+
+        bounds_ = nodes_[0].bounds();
+    }
+
+    float Bvh::GetSahCost() const
+    {
+        float rootarea = nodes_[0].bounds().surface_area();
+
+        // Same costs as FindSahSplit uses: 10 for a node and 1 for a primitive
+        float cost = 0.f;
+        for (int i = 0; i < nodecnt_; ++i)
+        {
+            float area = nodes_[i].bounds().surface_area();
+            cost += (nodes_[i].is_leaf() ? (float)nodes_[i].numprims : 10.f) * area;
+        }
+
+        return rootarea > 0.f ? cost / rootarea : 0.f;
+    }
+
 
     void  Bvh::InitNodeAllocator(size_t maxnum)
     {
@@ -59,48 +288,87 @@ namespace FireRays
         nodes_.resize(maxnum);
     }
 
-    Bvh::Node* Bvh::AllocateNode()
+    int Bvh::AllocateNode()
     {
-        return &nodes_[nodecnt_++];
+        return nodecnt_++;
     }
 
-    void Bvh::BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices)
+    void Bvh::CompactNodes(int numslots)
     {
-		height_ = std::max(height_, req.level);
+        // Unused nodes are marked with negative primitive count,
+        // nodes only move towards the start, so it can be done in place
+        std::vector<int> remap(numslots);
 
-        Node* node = AllocateNode();
-        node->bounds = req.bounds;
+        int numnodes = 0;
+        for (int i = 0; i < numslots; ++i)
+        {
+            remap[i] = numnodes;
+            numnodes += nodes_[i].numprims >= 0 ? 1 : 0;
+        }
 
-        // Create leaf node if we have enough prims
-        if (req.numprims < 2)
+        for (int i = 0; i < numslots; ++i)
         {
-#ifdef USE_TBB
-            primitive_mutex_.lock();
-#endif
-            node->type = kLeaf;
-            node->startidx = req.startidx;
-            node->numprims = req.numprims;
-#ifdef USE_TBB
-            primitive_mutex_.unlock();
-#endif
+            if (nodes_[i].numprims < 0) continue;
+
+            Node node = nodes_[i];
+
+            if (!node.is_leaf())
+            {
+                node.index = remap[node.index];
+            }
+
+            nodes_[remap[i]] = node;
+        }
+    }
+
+    int Bvh::BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices)
+    {
+        UpdateHeight(req.level);
+
+        ++nodecnt_;
+        Node& node = nodes_[req.nodeidx];
+        node.set_bounds(req.bounds);
+
+        // Try to find SAH split first: its cost is needed to decide
+        // if it is worth splitting the node at all
+        SahSplit ss;
+        ss.dim = 0;
+        ss.split = std::numeric_limits<float>::quiet_NaN();
+        ss.sah = std::numeric_limits<float>::max();
+
+        if (usesah_ && req.level < 10 && req.numprims >= 2)
+        {
+            ss = FindSahSplit(req, bounds, centroids, primindices);
+        }
+
+        // Create leaf node if we have enough prims. Small enough nodes
+        // become leaves if SAH can't beat the cost of intersecting
+        // all of their primitives (or always, for median builder).
+        bool makeleaf = req.numprims < 2;
+
+        if (!makeleaf && req.numprims <= maxprimsperleaf_)
+        {
+            makeleaf = is_nan(ss.split) || ss.sah >= (float)req.numprims;
+        }
+
+        if (makeleaf)
+        {
+            node.index = req.startidx;
+            node.numprims = req.numprims;
+            return req.nodeidx + 1;
         }
         else
         {
-            node->type = kInternal;
+            node.numprims = 0;
 
             // Choose the maximum extent
             int axis = req.centroid_bounds.maxdim();
             float border = req.centroid_bounds.center()[axis];
 
-            if (usesah_ && req.level < 10)
+            if (!is_nan(ss.split))
             {
-                SahSplit ss = FindSahSplit(req, bounds, centroids, primindices);
-
-                if (!is_nan(ss.split))
-                {
-                    axis = ss.dim;
-                    border = ss.split;
-                }
+                axis = ss.dim;
+                border = ss.split;
             }
 
             // Start partitioning and updating extents for children at the same time
@@ -109,7 +377,16 @@ namespace FireRays
 
             bool near2far = (req.numprims + req.startidx) & 0x1;
 
-            if (req.centroid_bounds.extents()[axis] > 0.f)
+            // Chunked partition changes the order of primitives, so deterministic
+            // builds use it for large nodes even if there are no build threads
+            bool partitionparallel = req.numprims > kParallelPartitionThreshold && (scheduler_ || deterministic_);
+
+            if (req.centroid_bounds.extents()[axis] > 0.f && partitionparallel)
+            {
+                splitidx = PartitionParallel(req, axis, border, near2far, bounds, centroids, primindices,
+                    leftbounds, rightbounds, leftcentroid_bounds, rightcentroid_bounds);
+            }
+            else if (req.centroid_bounds.extents()[axis] > 0.f)
             {
                 auto first = req.startidx;
                 auto last = req.startidx + req.numprims;
@@ -201,55 +478,197 @@ namespace FireRays
                 }
             }
 
-            // Left request
-            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1 };
+            // Left request, left child goes right after its parent
+            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, req.nodeidx + 1, leftbounds, leftcentroid_bounds, req.level + 1 };
             // Right request
-            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1 };
+            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), -1, rightbounds, rightcentroid_bounds, req.level + 1 };
 
-#ifdef USE_TBB
-            // Put those to stack
-            // std::vector<std::future<int> > futures;
-            if (leftrequest.numprims > 4096 * 4)
+            // Build large left subtrees in separate tasks
+            if (taskgroup_ && leftrequest.numprims > kParallelSubtreeThreshold)
             {
-                taskgroup_.run(
-                    [=](){
-                    //std::cout << "Handling left " << leftrequest.startidx << " " << leftrequest.numprims << std::endl;
-                    BuildNode(leftrequest, bounds, centroids, primindices);
-                    });
+                // Reserve max number of nodes left subtree might need,
+                // the ones it does not use are removed by CompactNodes
+                rightrequest.nodeidx = leftrequest.nodeidx + 2 * leftrequest.numprims - 1;
+
+                taskgroup_->run([=]()
+                {
+                    int end = BuildNode(leftrequest, bounds, centroids, primindices);
+
+                    for (int i = end; i < rightrequest.nodeidx; ++i)
+                    {
+                        nodes_[i].numprims = -1;
+                    }
+                });
             }
             else
-#endif
             {
-                // Put those to stack
-                BuildNode(leftrequest, bounds, centroids, primindices);
+                rightrequest.nodeidx = BuildNode(leftrequest, bounds, centroids, primindices);
             }
 
-#ifdef USE_TBB
-            if (rightrequest.numprims > 4096 * 4 )
+            node.index = rightrequest.nodeidx;
+
+            return BuildNode(rightrequest, bounds, centroids, primindices);
+        }
+    }
+
+    int Bvh::PartitionParallel(SplitRequest const& req, int axis, float border, bool near2far,
+        bbox const* bounds, float3 const* centroids, int* primindices,
+        bbox& leftbounds, bbox& rightbounds, bbox& leftcentroid_bounds, bbox& rightcentroid_bounds)
+    {
+        struct Chunk
+        {
+            // Number of primitives going to the left child
+            int leftcount;
+            // Where chunk primitives go in the temporary buffer
+            int leftoffset;
+            int rightoffset;
+            bbox leftbounds;
+            bbox rightbounds;
+            bbox leftcentroid_bounds;
+            bbox rightcentroid_bounds;
+        };
+
+        int numchunks = (req.numprims + kParallelChunkSize - 1) / kParallelChunkSize;
+        std::vector<Chunk> chunks(numchunks);
+        std::vector<int> temp(req.numprims);
+
+        auto goesleft = [=](int idx)
+        {
+            float c = centroids[idx][axis];
+            return near2far ? c < border : c >= border;
+        };
+
+        auto chunkrange = [&](int c, int& first, int& last)
+        {
+            first = req.startidx + c * kParallelChunkSize;
+            last = std::min(first + kParallelChunkSize, req.startidx + req.numprims);
+        };
+
+        // Count primitives and calc child extents
+        auto count = [&](int c)
+        {
+            int first, last;
+            chunkrange(c, first, last);
+
+            Chunk& chunk = chunks[c];
+            chunk.leftcount = 0;
+
+            for (int i = first; i < last; ++i)
             {
+                int idx = primindices[i];
 
-                taskgroup_.run(
-                    [=](){
-                    //std::cout << "Handling right " << rightrequest.startidx << " " << rightrequest.numprims << std::endl;
-                    BuildNode(rightrequest, bounds, centroids, primindices);
-                });
+                if (goesleft(idx))
+                {
+                    chunk.leftbounds.grow(bounds[idx]);
+                    chunk.leftcentroid_bounds.grow(centroids[idx]);
+                    ++chunk.leftcount;
+                }
+                else
+                {
+                    chunk.rightbounds.grow(bounds[idx]);
+                    chunk.rightcentroid_bounds.grow(centroids[idx]);
+                }
             }
-            else
-#endif
+        };
+
+        // Move primitives to their places in the temporary buffer
+        auto scatter = [&](int c)
+        {
+            int first, last;
+            chunkrange(c, first, last);
+
+            int left = chunks[c].leftoffset;
+            int right = chunks[c].rightoffset;
+
+            for (int i = first; i < last; ++i)
+            {
+                int idx = primindices[i];
+                temp[goesleft(idx) ? left++ : right++] = idx;
+            }
+        };
+
+        int numleft = 0;
+
+        if (deterministic_)
+        {
+            // Offsets are computed in chunk order, so primitive order doesn't depend on threads
+            ParallelFor(0, numchunks, 1, [&](int begin, int end)
+            {
+                for (int c = begin; c < end; ++c) count(c);
+            });
+
+            for (int c = 0; c < numchunks; ++c)
+            {
+                chunks[c].leftoffset = numleft;
+                numleft += chunks[c].leftcount;
+            }
+
+            int numright = numleft;
+            for (int c = 0; c < numchunks; ++c)
+            {
+                int first, last;
+                chunkrange(c, first, last);
+
+                chunks[c].rightoffset = numright;
+                numright += (last - first) - chunks[c].leftcount;
+            }
+
+            ParallelFor(0, numchunks, 1, [&](int begin, int end)
             {
-                BuildNode(rightrequest, bounds, centroids, primindices);
+                for (int c = begin; c < end; ++c) scatter(c);
+            });
+        }
+        else
+        {
+            // Chunks claim their ranges as soon as they are counted, left children
+            // are filled from the start of the buffer and right ones from the end
+            std::atomic<int> leftcursor(0);
+            std::atomic<int> rightcursor(req.numprims);
+
+            ParallelFor(0, numchunks, 1, [&](int begin, int end)
+            {
+                for (int c = begin; c < end; ++c)
+                {
+                    int first, last;
+                    chunkrange(c, first, last);
+                    count(c);
+
+                    int rightcount = (last - first) - chunks[c].leftcount;
+                    chunks[c].leftoffset = leftcursor.fetch_add(chunks[c].leftcount);
+                    chunks[c].rightoffset = rightcursor.fetch_sub(rightcount) - rightcount;
+                    scatter(c);
+                }
+            });
+
+            numleft = leftcursor;
+        }
+
+        ParallelFor(0, numchunks, 1, [&](int begin, int end)
+        {
+            for (int c = begin; c < end; ++c)
+            {
+                int first, last;
+                chunkrange(c, first, last);
+                std::copy(temp.begin() + (first - req.startidx), temp.begin() + (last - req.startidx), primindices + first);
             }
+        });
+
+        for (int c = 0; c < numchunks; ++c)
+        {
+            leftbounds.grow(chunks[c].leftbounds);
+            rightbounds.grow(chunks[c].rightbounds);
+            leftcentroid_bounds.grow(chunks[c].leftcentroid_bounds);
+            rightcentroid_bounds.grow(chunks[c].rightcentroid_bounds);
         }
 
-        // Set parent ptr if any
-        if (req.ptr) *req.ptr = node;
+        return req.startidx + numleft;
     }
 
     Bvh::SahSplit Bvh::FindSahSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const
     {
         // SAH implementation
         // calc centroids histogram
-        int const kNumBins = 64;
+        int const kNumBins = numbins_;
         // moving split bin index
         int splitidx = -1;
         // Set SAH to maximum float value as a start
@@ -257,6 +676,7 @@ namespace FireRays
         SahSplit split;
         split.dim = 0;
         split.split = std::numeric_limits<float>::quiet_NaN();
+        split.sah = sah;
 
         // if we cannot apply histogram algorithm
         // put NAN sentinel as split border
@@ -268,59 +688,65 @@ namespace FireRays
             return split;
         }
 
-        // Bin has bbox and occurence count
-        struct Bin
-        {
-            bbox bounds;
-            int count;
-        };
-
         // Keep bins for each dimension
-        Bin   bins[3][kNumBins];
+        SahBins bins;
         // Precompute inverse parent area
         float invarea = 1.f / req.bounds.surface_area();
         // Precompute min point
         float3 rootmin = req.centroid_bounds.pmin;
 
-        // Evaluate all dimensions
+        // Degenerate dimensions go to the first bin and are skipped later
+        float3 invcentroid_rng;
         for (int axis = 0; axis < 3; ++axis)
         {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            float centroid_rng = centroid_extents[axis];
-            float invcentroid_rng = 1.f / centroid_rng;
+            invcentroid_rng[axis] = centroid_extents[axis] == 0.f ? 0.f : 1.f / centroid_extents[axis];
+        }
 
-            // If the box is degenerate in that dimension skip it
-            if (centroid_rng == 0.f) continue;
+        if (req.numprims > kParallelPartitionThreshold && scheduler_)
+        {
+            // Bin chunks in parallel and merge them in chunk order
+            int numchunks = (req.numprims + kParallelChunkSize - 1) / kParallelChunkSize;
+            std::vector<SahBins> chunkbins(numchunks);
 
-            // Initialize bins
-            for (unsigned i = 0; i < kNumBins; ++i)
+            ParallelFor(0, numchunks, 1, [&](int begin, int end)
             {
-                bins[axis][i].count = 0;
-                bins[axis][i].bounds = bbox();
-            }
+                for (int c = begin; c < end; ++c)
+                {
+                    int first = req.startidx + c * kParallelChunkSize;
+                    int last = std::min(first + kParallelChunkSize, req.startidx + req.numprims);
+                    BinPrimitives(first, last, primindices, bounds, centroids, rootmin, invcentroid_rng, kNumBins, chunkbins[c]);
+                }
+            });
 
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
-            {
-                int idx = primindices[i];
-                int binidx = (int)std::min<float>(kNumBins * ((centroids[idx][axis] - rootminc) * invcentroid_rng), kNumBins - 1);
+            bins.Clear(kNumBins);
 
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.grow(bounds[idx]);
+            for (int c = 0; c < numchunks; ++c)
+            {
+                bins.Merge(chunkbins[c], kNumBins);
             }
+        }
+        else
+        {
+            BinPrimitives(req.startidx, req.startidx + req.numprims, primindices, bounds, centroids, rootmin, invcentroid_rng, kNumBins, bins);
+        }
 
-            bbox rightbounds[kNumBins - 1];
+        // Evaluate all dimensions
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // If the box is degenerate in that dimension skip it
+            if (centroid_extents[axis] == 0.f) continue;
+
+            float rightareas[kMaxSahBins - 1];
 
             // Start with 1-bin right box
-            bbox rightbox = bbox();
+            BinBox rightbox;
             for (int i = kNumBins - 1; i > 0; --i)
             {
-                rightbox.grow(bins[axis][i].bounds);
-                rightbounds[i - 1] = rightbox;
+                rightbox.Grow(bins.pmin[axis][i], bins.pmax[axis][i]);
+                rightareas[i - 1] = rightbox.SurfaceArea();
             }
 
-            bbox leftbox = bbox();
+            BinBox leftbox;
             int  leftcount = 0;
             int  rightcount = req.numprims;
 
@@ -329,12 +755,12 @@ namespace FireRays
             float sahtmp = 0.f;
             for (int i = 0; i < kNumBins - 1; ++i)
             {
-                leftbox.grow(bins[axis][i].bounds);
-                leftcount += bins[axis][i].count;
-                rightcount -= bins[axis][i].count;
+                leftbox.Grow(bins.pmin[axis][i], bins.pmax[axis][i]);
+                leftcount += bins.count[axis][i];
+                rightcount -= bins.count[axis][i];
 
                 // Compute SAH
-                sahtmp = 10.f + (leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area()) * invarea;
+                sahtmp = 10.f + (leftcount * leftbox.SurfaceArea() + rightcount * rightareas[i]) * invarea;
 
                 // Check if it is better than what we found so far
                 if (sahtmp < sah)
@@ -350,6 +776,7 @@ namespace FireRays
         if (splitidx != -1)
         {
             split.split = rootmin[split.dim] + (splitidx + 1) * (centroid_extents[split.dim] / kNumBins);
+            split.sah = sah;
         }
 
         return split;
@@ -357,6 +784,26 @@ namespace FireRays
 
     void Bvh::BuildImpl(bbox const* bounds, int numbounds)
     {
+        // Start build threads for large builds only, task group
+        // goes first to be destroyed before the scheduler
+        std::unique_ptr<task_scheduler> scheduler;
+        std::unique_ptr<task_group> taskgroup;
+
+        scheduler_ = nullptr;
+        taskgroup_ = nullptr;
+
+        if (numthreads_ != 1 && numbounds >= kParallelBuildThreshold)
+        {
+            scheduler.reset(new task_scheduler(numthreads_));
+
+            if (scheduler->num_threads() > 1)
+            {
+                taskgroup.reset(new task_group(*scheduler));
+                scheduler_ = scheduler.get();
+                taskgroup_ = taskgroup.get();
+            }
+        }
+
         // Structure describing split request
         InitNodeAllocator(2 * numbounds - 1);
 
@@ -365,133 +812,47 @@ namespace FireRays
         primids_.resize(numbounds);
         std::iota(primids_.begin(), primids_.end(), 0);
 
-        // Calc bbox
-        bbox centroid_bounds;
-        for (size_t i = 0; i < numbounds; ++i)
-        {
-            float3 c = bounds[i].center();
-            centroid_bounds.grow(c);
-            centroids[i] = c;
-        }
+        // Calc centroids and their bbox
+        int numchunks = (numbounds + kParallelChunkSize - 1) / kParallelChunkSize;
+        std::vector<bbox> chunk_centroid_bounds(numchunks);
 
-        SplitRequest init = { 0, numbounds, nullptr, bounds_, centroid_bounds, 0 };
-
-#ifdef USE_BUILD_STACK
-        std::stack<SplitRequest> stack;
-        // Put initial request into the stack
-        stack.push(init);
-
-        while (!stack.empty())
+        ParallelFor(0, numchunks, 1, [&](int begin, int end)
         {
-            // Fetch new request
-            SplitRequest req = stack.top();
-            stack.pop();
-
-            Node* node = AllocateNode();
-            node->bounds = req.bounds;
-
-            // Create leaf node if we have enough prims
-            if (req.numprims < 2)
-            {
-                node->type = kLeaf;
-                node->startidx = (int)primitives_.size();
-                node->numprims = req.numprims;
-                for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
-                {
-                    primitives_.push_back(prims[primindices[i]]);
-                }
-            }
-            else
+            for (int c = begin; c < end; ++c)
             {
-                node->type = kInternal;
+                int last = std::min((c + 1) * kParallelChunkSize, numbounds);
 
-                // Choose the maximum extent
-                int axis = req.centroid_bounds.maxdim();
-                float border = req.centroid_bounds.center()[axis];
-
-                // Start partitioning and updating extents for children at the same time
-                bbox leftbounds, rightbounds, leftcentroid_bounds, rightcentroid_bounds;
-                int splitidx = 0;
-
-                if (req.centroid_bounds.extents()[axis] > 0.f)
+                for (int i = c * kParallelChunkSize; i < last; ++i)
                 {
-
-                    auto first = req.startidx;
-                    auto last = req.startidx + req.numprims;
-
-                    while (1)
-                    {
-                        while ((first != last) &&
-                            centroids[primindices[first]][axis] < border)
-                        {
-                            leftbounds.grow(bounds[primindices[first]]);
-                            leftcentroid_bounds.grow(centroids[primindices[first]]);
-                            ++first;
-                        }
-
-                        if (first == last--) break;
-
-                        rightbounds.grow(bounds[primindices[first]]);
-                        rightcentroid_bounds.grow(centroids[primindices[first]]);
-
-                        while ((first != last) &&
-                            centroids[primindices[last]][axis] >= border)
-                        {
-                            rightbounds.grow(bounds[primindices[last]]);
-                            rightcentroid_bounds.grow(centroids[primindices[last]]);
-                            --last;
-                        }
-
-                        if (first == last) break;
-
-                        leftbounds.grow(bounds[primindices[last]]);
-                        leftcentroid_bounds.grow(centroids[primindices[last]]);
-
-                        std::swap(primindices[first++], primindices[last]);
-                    }
-
-                    splitidx = first;
+                    float3 ctr = bounds[i].center();
+                    chunk_centroid_bounds[c].grow(ctr);
+                    centroids[i] = ctr;
                 }
-                else
-                {
-                    splitidx = req.startidx + (req.numprims >> 1);
-
-                    for (int i = req.startidx; i < splitidx; ++i)
-                    {
-                        leftbounds.grow(bounds[primindices[i]]);
-                        leftcentroid_bounds.grow(centroids[primindices[i]]);
-                    }
+            }
+        });
 
-                    for (int i = splitidx; i < req.startidx + req.numprims; ++i)
-                    {
-                        rightbounds.grow(bounds[primindices[i]]);
-                        rightcentroid_bounds.grow(centroids[primindices[i]]);
-                    }
-                }
+        bbox centroid_bounds;
+        for (int c = 0; c < numchunks; ++c)
+        {
+            centroid_bounds.grow(chunk_centroid_bounds[c]);
+        }
 
-                // Left request
-                SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds };
-                // Right request
-                SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds };
+        SplitRequest init = { 0, numbounds, 0, bounds_, centroid_bounds, 0 };
 
-                // Put those to stack
-                stack.push(leftrequest);
-                stack.push(rightrequest);
-            }
+        int numslots = BuildNode(init, bounds, &centroids[0], &primids_[0]);
 
-            // Set parent ptr if any
-            if (req.ptr) *req.ptr = node;
+        if (taskgroup_)
+        {
+            taskgroup_->wait();
         }
-#else
-        BuildNode(init, bounds, &centroids[0], &primids_[0]);
-#endif
 
-#ifdef USE_TBB
-        taskgroup_.wait();
-#endif
+        scheduler_ = nullptr;
+        taskgroup_ = nullptr;
 
-        // Set root_ pointer
-        root_ = &nodes_[0];
+        if (numslots != nodecnt_)
+        {
+            CompactNodes(numslots);
+        }
     }
 
 }
@@ -22,32 +22,42 @@ THE SOFTWARE.
 #ifndef BVH_H
 #define BVH_H
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <atomic>
+#include <functional>
 
 
 #include "math/bbox.h"
 
-//#define USE_TBB
-#ifdef USE_TBB
-#define NOMINMAX
-#include <tbb/task_group.h>
-#include <tbb/mutex.h>
-#endif
-
 namespace FireRays
 {
+    class task_scheduler;
+    class task_group;
+
     ///< The class represents bounding volume hierarachy
     ///< intersection accelerator
     ///<
     class Bvh
     {
     public:
-        Bvh(bool usesah = false)
-            : root_(nullptr)
+        // Max number of primitives per leaf, leaf encoding in
+        // PlainBvhTranslator can't hold more than that
+        static const int kMaxPrimsPerLeaf = 16;
+        // Max number of SAH bins per dimension
+        static const int kMaxSahBins = 128;
+
+        Bvh(bool usesah = false, int maxprimsperleaf = 1, int numbins = 64)
+            : nodecnt_(0)
             , usesah_(usesah)
 			, height_(0)
+            , maxprimsperleaf_(std::min(std::max(maxprimsperleaf, 1), (int)kMaxPrimsPerLeaf))
+            , numbins_(std::min(std::max(numbins, 4), (int)kMaxSahBins))
+            , numthreads_(0)
+            , deterministic_(false)
+            , scheduler_(nullptr)
+            , taskgroup_(nullptr)
         {
         }
 
@@ -58,20 +68,36 @@ namespace FireRays
 
         // Build function
         void Build(bbox const* bounds, int numbounds);
+
+        // Recalculate node bounds for updated primitive bounds keeping the tree topology
+        void Refit(bbox const* bounds);
+
+        // SAH cost of the tree in primitive intersection units
+        float GetSahCost() const;
         
         // Get reordered prim indices
         int const* GetIndices() const { return &primids_[0]; }
+        // Number of prim indices (might exceed the number of prims if references are duplicated)
+        int GetNumIndices() const { return (int)primids_.size(); }
+
+        // BVH node
+        struct Node;
+        // Nodes in depth first order, root goes first
+        Node const* GetNodes() const { return &nodes_[0]; }
+        int GetNumNodes() const { return nodecnt_; }
 
 		// Tree height
 		int height() const { return height_; }
 
+        // Number of threads used for large builds (0 means all hardware threads, 1 disables threading).
+        // Deterministic builds produce the same tree regardless of the number of threads.
+        void SetBuildThreads(int numthreads, bool deterministic);
+
     protected:
         // Build function
         virtual void BuildImpl(bbox const* bounds, int numbounds);
-        // BVH node
-        struct Node;
-        // Node allocation
-        virtual Node* AllocateNode();
+        // Node allocation, returns node index
+        virtual int   AllocateNode();
         virtual void  InitNodeAllocator(size_t maxnum);
 
         struct SplitRequest
@@ -80,8 +106,8 @@ namespace FireRays
             int startidx;
             // Number of primitives
             int numprims;
-            // Root node
-            Node** ptr;
+            // Index of the node
+            int nodeidx;
             // Bounding box
             bbox bounds;
             // Centroid bounds
@@ -94,40 +120,58 @@ namespace FireRays
         {
             int dim;
             float split;
+            // Cost of the split in primitive intersection units
+            float sah;
         };
 
-        void BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices);
+        // Builds the subtree at req.nodeidx, returns the index past its last node
+        int BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices);
 
         SahSplit FindSahSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const;
 
-        // Enum for node type
-        enum NodeType
-        {
-            kInternal,
-            kLeaf
-        };
+        // Centroid histograms used by FindSahSplit
+        struct SahBins;
+        static void BinPrimitives(int begin, int end, int const* primindices, bbox const* bounds, float3 const* centroids,
+            float3 const& rootmin, float3 const& invcentroid_rng, int numbins, SahBins& bins);
+
+        // Chunked partition of large nodes, returns split index
+        int PartitionParallel(SplitRequest const& req, int axis, float border, bool near2far,
+            bbox const* bounds, float3 const* centroids, int* primindices,
+            bbox& leftbounds, bbox& rightbounds, bbox& leftcentroid_bounds, bbox& rightcentroid_bounds);
+
+        // Run f on chunks of [begin, end) using build threads if any
+        void ParallelFor(int begin, int end, int grain, std::function<void(int, int)> const& f) const;
+
+        // Atomically raise tree height to level
+        void UpdateHeight(int level);
+
+        // Remove nodes reserved but not used by parallel builds
+        void CompactNodes(int numslots);
 
         // Bvh nodes
         std::vector<Node> nodes_;
         // Identifiers of leaf primitives
         std::vector<int> primids_;
 
-#ifdef USE_TBB
-        tbb::atomic<int> nodecnt_;
-        tbb::mutex primitive_mutex_;
-        tbb::task_group taskgroup_;
-#else
         // Node allocator counter, atomic for thread safety
         std::atomic<int> nodecnt_;
-#endif
         // Bounding box containing all primitives
         bbox bounds_;
-        // Root node
-        Node* root_;
         // SAH flag
         bool usesah_;
 		// Tree height
-		int height_;
+		std::atomic<int> height_;
+        // Max number of primitives in a leaf
+        int maxprimsperleaf_;
+        // Number of SAH bins per dimension
+        int numbins_;
+        // Number of build threads
+        int numthreads_;
+        // Deterministic build flag
+        bool deterministic_;
+        // Build threads and subtree tasks, only valid during the build
+        task_scheduler* scheduler_;
+        task_group* taskgroup_;
 
 
     private:
@@ -138,29 +182,36 @@ namespace FireRays
         friend class FatNodeBvhTranslator;
     };
 
+    // 32 bytes node, the left child of an internal node always follows it
     struct Bvh::Node
     {
         // Node bounds in world space
-        bbox bounds;
-        // Type of the node
-        NodeType type;
+        float pmin[3];
+        // For internal nodes: index of the right child,
+        // for leaves: index of the first primitive
+        int index;
+        float pmax[3];
+        // Number of primitives for leaves, 0 for internal nodes
+        int numprims;
+
+        bool is_leaf() const { return numprims > 0; }
 
-        union
+        bbox bounds() const
         {
-            // For internal nodes: left and right children
-            struct
-            {
-                Node* lc;
-                Node* rc;
-            };
+            bbox b;
+            b.pmin = float3(pmin[0], pmin[1], pmin[2]);
+            b.pmax = float3(pmax[0], pmax[1], pmax[2]);
+            return b;
+        }
 
-            // For leaves: starting primitive index and number of primitives
-            struct
+        void set_bounds(bbox const& b)
+        {
+            for (int i = 0; i < 3; ++i)
             {
-                int startidx;
-                int numprims;
-            };
-        };
+                pmin[i] = b.pmin[i];
+                pmax[i] = b.pmax[i];
+            }
+        }
     };
 
     inline Bvh::~Bvh()
@@ -0,0 +1,219 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "grid.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+
+namespace FireRays
+{
+    // Primitive boxes are grown by this fraction of a voxel, so the references
+    // survive rounding errors of the traversal in voxel space
+    static float const kVoxelEpsilon = 1e-3f;
+
+    Grid::Grid(float density, int maxres)
+        : density_(std::max(density, 0.01f))
+        , maxres_(std::max(maxres, 1))
+    {
+        res_[0] = res_[1] = res_[2] = 1;
+    }
+
+    void Grid::CalcResolution(bbox const& bounds, int numbounds, float density, int maxres, int res[3])
+    {
+        float3 const extents = bounds.extents();
+
+        // Cleary et al.: voxel count proportional to the number of primitives,
+        // voxels as close to cubes as possible. Axes too thin to hold even a
+        // single voxel (e.g. height of a terrain) get resolution 1 and the
+        // density is redistributed among the rest.
+        bool flat[3] = { false, false, false };
+
+        for (int iter = 0; iter < 3; ++iter)
+        {
+            float volume = 1.f;
+            int numdims = 0;
+
+            for (int i = 0; i < 3; ++i)
+            {
+                if (!flat[i])
+                {
+                    volume *= extents[i];
+                    ++numdims;
+                }
+            }
+
+            float const k = numdims > 0 ? std::pow(density * numbounds / volume, 1.f / numdims) : 0.f;
+
+            bool changed = false;
+            for (int i = 0; i < 3; ++i)
+            {
+                if (!flat[i] && extents[i] * k < 1.f)
+                {
+                    flat[i] = true;
+                    changed = true;
+                }
+            }
+
+            if (!changed)
+            {
+                for (int i = 0; i < 3; ++i)
+                {
+                    res[i] = flat[i] ? 1 : std::min(std::max((int)(extents[i] * k), 1), maxres);
+                }
+
+                break;
+            }
+
+            res[0] = res[1] = res[2] = 1;
+        }
+    }
+
+    void Grid::CalcResolution(int numbounds)
+    {
+        CalcResolution(bounds_, numbounds, density_, maxres_, res_);
+
+        float3 const extents = bounds_.extents();
+
+        for (int i = 0; i < 3; ++i)
+        {
+            voxelsize_[i] = extents[i] / res_[i];
+            voxelsizeinv_[i] = 1.f / voxelsize_[i];
+        }
+    }
+
+    Grid::Desc Grid::GetDesc() const
+    {
+        Desc desc;
+        desc.bounds = bounds_;
+        desc.voxelsize = voxelsize_;
+        desc.voxelsizeinv = voxelsizeinv_;
+        desc.gridres[0] = res_[0];
+        desc.gridres[1] = res_[1];
+        desc.gridres[2] = res_[2];
+        desc.gridres[3] = 0;
+        return desc;
+    }
+
+    void Grid::GetVoxelRange(bbox const& box, int vmin[3], int vmax[3]) const
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            float const lo = (box.pmin[i] - bounds_.pmin[i]) * voxelsizeinv_[i] - kVoxelEpsilon;
+            float const hi = (box.pmax[i] - bounds_.pmin[i]) * voxelsizeinv_[i] + kVoxelEpsilon;
+
+            vmin[i] = std::min(std::max((int)std::floor(lo), 0), res_[i] - 1);
+            vmax[i] = std::min(std::max((int)std::floor(hi), 0), res_[i] - 1);
+        }
+    }
+
+    void Grid::Build(bbox const* bounds, int numbounds)
+    {
+        bounds_ = bbox();
+
+        for (int i = 0; i < numbounds; ++i)
+        {
+            bounds_.grow(bounds[i]);
+        }
+
+        if (numbounds == 0)
+        {
+            bounds_ = bbox(float3(0.f, 0.f, 0.f));
+        }
+
+        // Pad the grid so none of the axes is degenerate
+        float3 const extents = bounds_.extents();
+        float const maxextent = std::max(extents.x, std::max(extents.y, extents.z));
+        float const pad = std::max(maxextent * 1e-4f, 1e-6f);
+        bounds_.pmin -= float3(pad, pad, pad);
+        bounds_.pmax += float3(pad, pad, pad);
+
+        CalcResolution(numbounds);
+
+        int const numvoxels = res_[0] * res_[1] * res_[2];
+
+        // Count primitive references per voxel
+        std::unique_ptr<std::atomic<int>[]> counts(new std::atomic<int>[numvoxels]);
+
+#pragma omp parallel for
+        for (int i = 0; i < numvoxels; ++i)
+        {
+            counts[i].store(0, std::memory_order_relaxed);
+        }
+
+#pragma omp parallel for
+        for (int i = 0; i < numbounds; ++i)
+        {
+            int vmin[3], vmax[3];
+            GetVoxelRange(bounds[i], vmin, vmax);
+
+            for (int z = vmin[2]; z <= vmax[2]; ++z)
+                for (int y = vmin[1]; y <= vmax[1]; ++y)
+                    for (int x = vmin[0]; x <= vmax[0]; ++x)
+                    {
+                        counts[(z * res_[1] + y) * res_[0] + x].fetch_add(1, std::memory_order_relaxed);
+                    }
+        }
+
+        // Exclusive prefix sum gives voxel ranges
+        voxels_.resize(numvoxels);
+
+        int numindices = 0;
+        for (int i = 0; i < numvoxels; ++i)
+        {
+            int const count = counts[i].load(std::memory_order_relaxed);
+            voxels_[i].startidx = numindices;
+            voxels_[i].numprims = count;
+            numindices += count;
+            // Reuse counters as insertion cursors
+            counts[i].store(voxels_[i].startidx, std::memory_order_relaxed);
+        }
+
+        // Scatter primitive references
+        indices_.resize(numindices);
+
+#pragma omp parallel for
+        for (int i = 0; i < numbounds; ++i)
+        {
+            int vmin[3], vmax[3];
+            GetVoxelRange(bounds[i], vmin, vmax);
+
+            for (int z = vmin[2]; z <= vmax[2]; ++z)
+                for (int y = vmin[1]; y <= vmax[1]; ++y)
+                    for (int x = vmin[0]; x <= vmax[0]; ++x)
+                    {
+                        indices_[counts[(z * res_[1] + y) * res_[0] + x].fetch_add(1, std::memory_order_relaxed)] = i;
+                    }
+        }
+
+        // Keep reference order independent of the thread schedule
+#pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < numvoxels; ++i)
+        {
+            if (voxels_[i].numprims > 1)
+            {
+                std::sort(indices_.begin() + voxels_[i].startidx, indices_.begin() + voxels_[i].startidx + voxels_[i].numprims);
+            }
+        }
+    }
+}
@@ -0,0 +1,114 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef GRID_H
+#define GRID_H
+
+#include <vector>
+
+#include "math/bbox.h"
+
+namespace FireRays
+{
+    ///< The class represents uniform grid intersection accelerator,
+    ///< voxels keep the ranges of indices of overlapping primitives
+    ///<
+    class Grid
+    {
+    public:
+        // Voxel layout matches Voxel struct in grid.cl
+        struct Voxel
+        {
+            // Index of the first primitive reference
+            int startidx;
+            // Number of primitive references
+            int numprims;
+        };
+
+        // Grid description, layout matches GridDesc struct in grid.cl
+        struct Desc
+        {
+            // Grid bounds
+            bbox bounds;
+            // Voxel sizes
+            float3 voxelsize;
+            // Voxel size inverse
+            float3 voxelsizeinv;
+            // Grid resolution in each dimension
+            int gridres[4];
+        };
+
+        // Density is the target number of voxels per primitive (Cleary et al.),
+        // maxres limits the resolution along any axis
+        Grid(float density = 4.f, int maxres = 256);
+
+        // Build function
+        void Build(bbox const* bounds, int numbounds);
+
+        // World space bounding box
+        bbox const& Bounds() const { return bounds_; }
+        // Voxel extents and their inverse
+        float3 const& GetVoxelSize() const { return voxelsize_; }
+        float3 const& GetVoxelSizeInv() const { return voxelsizeinv_; }
+        // Number of voxels along the axis
+        int GetResolution(int axis) const { return res_[axis]; }
+
+        // Description for the traversal kernels
+        Desc GetDesc() const;
+
+        // Resolution Build chooses for the given bounds and number of primitives
+        static void CalcResolution(bbox const& bounds, int numbounds, float density, int maxres, int res[3]);
+
+        // Voxels in x, then y, then z order
+        Voxel const* GetVoxels() const { return &voxels_[0]; }
+        int GetNumVoxels() const { return (int)voxels_.size(); }
+
+        // Primitive references of all voxels
+        int const* GetIndices() const { return indices_.empty() ? nullptr : &indices_[0]; }
+        int GetNumIndices() const { return (int)indices_.size(); }
+
+    private:
+        // Choose the resolution for the given number of primitives
+        void CalcResolution(int numbounds);
+        // Voxel range covered by the box
+        void GetVoxelRange(bbox const& box, int vmin[3], int vmax[3]) const;
+
+        // Grid voxels
+        std::vector<Voxel> voxels_;
+        // Primitive references
+        std::vector<int> indices_;
+        // Bounding box containing all primitives
+        bbox bounds_;
+        float3 voxelsize_;
+        float3 voxelsizeinv_;
+        // Resolution along each axis
+        int res_[3];
+        // Target number of voxels per primitive
+        float density_;
+        // Max resolution along any axis
+        int maxres_;
+
+        Grid(Grid const&);
+        Grid& operator = (Grid const&);
+    };
+}
+
+#endif // GRID_H
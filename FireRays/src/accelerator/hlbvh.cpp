@@ -188,7 +188,7 @@ namespace FireRays
         m_device->Execute(m_gpudata->morton_code_func, 0, globalsize, kWorkGroupSize, nullptr);
         
         // Sort primitives according to their Morton codes
-        m_gpudata->pp->SortRadixInt32(0, m_gpudata->morton_codes, m_gpudata->sorted_morton_codes, m_gpudata->prim_indices, m_gpudata->sorted_prim_indices, size);
+        m_gpudata->pp->SortRadixInt32(0, m_gpudata->morton_codes, m_gpudata->sorted_morton_codes, m_gpudata->prim_indices, m_gpudata->sorted_prim_indices, size, nullptr);
        
         // Prepare tree construction kernel
         arg = 0;
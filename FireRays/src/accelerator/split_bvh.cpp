@@ -0,0 +1,492 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "split_bvh.h"
+#include "../except/except.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace FireRays
+{
+    // Number of bins for object and spatial splits
+    static int const kNumObjectBins = 64;
+    static int const kNumSpatialBins = 32;
+    // Node traversal cost in primitive intersection units (same as in Bvh)
+    static float const kTraversalCost = 10.f;
+
+    static bool IsEmpty(bbox const& box)
+    {
+        return box.pmin.x > box.pmax.x || box.pmin.y > box.pmax.y || box.pmin.z > box.pmax.z;
+    }
+
+    static float SurfaceArea(bbox const& box)
+    {
+        return IsEmpty(box) ? 0.f : box.surface_area();
+    }
+
+    void SplitBvh::Build(bbox const* bounds, float3 const* vertices, int numbounds)
+    {
+        vertices_ = vertices;
+        Bvh::Build(bounds, numbounds);
+        vertices_ = nullptr;
+    }
+
+    void SplitBvh::BuildImpl(bbox const* bounds, int numbounds)
+    {
+        // Bvh::Build called through the base class does not pass the triangles in
+        ThrowIf(!vertices_ && numbounds > 0, "SplitBvh needs world space triangles, use SplitBvh::Build(bounds, vertices, numbounds)");
+
+        // Each duplicated reference adds at most one leaf and one internal node
+        maxrefs_ = numbounds + (int)(extrarefs_ * numbounds);
+        numrefs_ = numbounds;
+        rootarea_ = bounds_.surface_area();
+
+        InitNodeAllocator(2 * maxrefs_ - 1);
+
+        primids_.clear();
+        primids_.reserve(maxrefs_);
+
+        std::vector<PrimRef> refs(numbounds);
+        for (int i = 0; i < numbounds; ++i)
+        {
+            refs[i].bounds = bounds[i];
+            refs[i].idx = i;
+        }
+
+        BuildNode(refs, bounds_, 0);
+    }
+
+    int SplitBvh::BuildNode(std::vector<PrimRef>& refs, bbox const& bounds, int level)
+    {
+        UpdateHeight(level);
+
+        // Nodes are allocated in depth first order
+        int nodeidx = AllocateNode();
+        nodes_[nodeidx].set_bounds(bounds);
+
+        int numprims = (int)refs.size();
+
+        Split split;
+        split.sah = std::numeric_limits<float>::max();
+        split.spatial = false;
+
+        if (numprims >= 2)
+        {
+            split = FindObjectSplit(refs, bounds);
+
+            // Try spatial split if object split children overlap considerably
+            if (level < maxsplitdepth_ && numrefs_ < maxrefs_ && split.sah < std::numeric_limits<float>::max())
+            {
+                bbox overlap;
+                intersection(split.leftbounds, split.rightbounds, overlap);
+
+                if (SurfaceArea(overlap) > minoverlap_ * rootarea_)
+                {
+                    Split spatial = FindSpatialSplit(refs, bounds);
+
+                    if (spatial.sah < split.sah)
+                    {
+                        split = spatial;
+                    }
+                }
+            }
+        }
+
+        // Small enough nodes become leaves if splitting does not pay off
+        bool makeleaf = numprims < 2 ||
+            (numprims <= maxprimsperleaf_ && split.sah >= (float)numprims);
+
+        if (makeleaf)
+        {
+            nodes_[nodeidx].index = (int)primids_.size();
+            nodes_[nodeidx].numprims = numprims;
+
+            for (auto& ref : refs)
+            {
+                primids_.push_back(ref.idx);
+            }
+        }
+        else
+        {
+            nodes_[nodeidx].numprims = 0;
+
+            std::vector<PrimRef> leftrefs;
+            std::vector<PrimRef> rightrefs;
+
+            if (split.sah < std::numeric_limits<float>::max())
+            {
+                if (split.spatial)
+                {
+                    PerformSpatialSplit(refs, split, leftrefs, rightrefs);
+                }
+                else
+                {
+                    PerformObjectSplit(refs, split, leftrefs, rightrefs);
+                }
+            }
+
+            // No valid split found: split in half
+            if (leftrefs.empty() || rightrefs.empty())
+            {
+                leftrefs.assign(refs.begin(), refs.begin() + numprims / 2);
+                rightrefs.assign(refs.begin() + numprims / 2, refs.end());
+            }
+
+            // Release memory before going down
+            std::vector<PrimRef>().swap(refs);
+
+            bbox leftbounds, rightbounds;
+            for (auto& ref : leftrefs)
+            {
+                leftbounds.grow(ref.bounds);
+            }
+
+            for (auto& ref : rightrefs)
+            {
+                rightbounds.grow(ref.bounds);
+            }
+
+            BuildNode(leftrefs, leftbounds, level + 1);
+            nodes_[nodeidx].index = BuildNode(rightrefs, rightbounds, level + 1);
+        }
+
+        return nodeidx;
+    }
+
+    SplitBvh::Split SplitBvh::FindObjectSplit(std::vector<PrimRef> const& refs, bbox const& bounds) const
+    {
+        Split split;
+        split.sah = std::numeric_limits<float>::max();
+        split.dim = 0;
+        split.split = 0.f;
+        split.spatial = false;
+
+        bbox centroid_bounds;
+        for (auto& ref : refs)
+        {
+            centroid_bounds.grow(ref.bounds.center());
+        }
+
+        float3 centroid_extents = centroid_bounds.extents();
+        float invarea = 1.f / bounds.surface_area();
+
+        struct Bin
+        {
+            bbox bounds;
+            int count;
+        };
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float centroid_rng = centroid_extents[axis];
+
+            // If the box is degenerate in that dimension skip it
+            if (centroid_rng <= 0.f) continue;
+
+            float rootminc = centroid_bounds.pmin[axis];
+            float invcentroid_rng = 1.f / centroid_rng;
+
+            Bin bins[kNumObjectBins];
+            for (int i = 0; i < kNumObjectBins; ++i)
+            {
+                bins[i].count = 0;
+            }
+
+            for (auto& ref : refs)
+            {
+                int binidx = (int)std::min<float>(kNumObjectBins * ((ref.bounds.center()[axis] - rootminc) * invcentroid_rng), kNumObjectBins - 1);
+                ++bins[binidx].count;
+                bins[binidx].bounds.grow(ref.bounds);
+            }
+
+            bbox rightbounds[kNumObjectBins - 1];
+            bbox rightbox;
+            for (int i = kNumObjectBins - 1; i > 0; --i)
+            {
+                rightbox.grow(bins[i].bounds);
+                rightbounds[i - 1] = rightbox;
+            }
+
+            bbox leftbox;
+            int leftcount = 0;
+            int rightcount = (int)refs.size();
+
+            for (int i = 0; i < kNumObjectBins - 1; ++i)
+            {
+                leftbox.grow(bins[i].bounds);
+                leftcount += bins[i].count;
+                rightcount -= bins[i].count;
+
+                if (leftcount == 0 || rightcount == 0) continue;
+
+                float sah = kTraversalCost + (leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area()) * invarea;
+
+                if (sah < split.sah)
+                {
+                    split.sah = sah;
+                    split.dim = axis;
+                    split.split = rootminc + (i + 1) * (centroid_rng / kNumObjectBins);
+                    split.leftbounds = leftbox;
+                    split.rightbounds = rightbounds[i];
+                }
+            }
+        }
+
+        return split;
+    }
+
+    SplitBvh::Split SplitBvh::FindSpatialSplit(std::vector<PrimRef> const& refs, bbox const& bounds) const
+    {
+        Split split;
+        split.sah = std::numeric_limits<float>::max();
+        split.dim = 0;
+        split.split = 0.f;
+        split.spatial = true;
+
+        float3 extents = bounds.extents();
+        float invarea = 1.f / bounds.surface_area();
+
+        struct Bin
+        {
+            bbox bounds;
+            int enter;
+            int exit;
+        };
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (extents[axis] <= 0.f) continue;
+
+            float origin = bounds.pmin[axis];
+            float binsize = extents[axis] / kNumSpatialBins;
+            float invbinsize = 1.f / binsize;
+
+            Bin bins[kNumSpatialBins];
+            for (int i = 0; i < kNumSpatialBins; ++i)
+            {
+                bins[i].enter = 0;
+                bins[i].exit = 0;
+            }
+
+            // Chop references into the bins they span
+            for (auto& ref : refs)
+            {
+                int firstbin = std::min(std::max((int)((ref.bounds.pmin[axis] - origin) * invbinsize), 0), kNumSpatialBins - 1);
+                int lastbin = std::min(std::max((int)((ref.bounds.pmax[axis] - origin) * invbinsize), firstbin), kNumSpatialBins - 1);
+
+                PrimRef current = ref;
+                for (int i = firstbin; i < lastbin; ++i)
+                {
+                    PrimRef leftref, rightref;
+                    SplitPrimRef(current, axis, origin + (i + 1) * binsize, leftref, rightref);
+                    bins[i].bounds.grow(leftref.bounds);
+                    current = rightref;
+                }
+
+                bins[lastbin].bounds.grow(current.bounds);
+                ++bins[firstbin].enter;
+                ++bins[lastbin].exit;
+            }
+
+            bbox rightbounds[kNumSpatialBins - 1];
+            int rightcounts[kNumSpatialBins - 1];
+            bbox rightbox;
+            int rightcount = 0;
+            for (int i = kNumSpatialBins - 1; i > 0; --i)
+            {
+                rightbox.grow(bins[i].bounds);
+                rightcount += bins[i].exit;
+                rightbounds[i - 1] = rightbox;
+                rightcounts[i - 1] = rightcount;
+            }
+
+            bbox leftbox;
+            int leftcount = 0;
+            for (int i = 0; i < kNumSpatialBins - 1; ++i)
+            {
+                leftbox.grow(bins[i].bounds);
+                leftcount += bins[i].enter;
+
+                if (leftcount == 0 || rightcounts[i] == 0) continue;
+
+                float sah = kTraversalCost + (leftcount * SurfaceArea(leftbox) + rightcounts[i] * SurfaceArea(rightbounds[i])) * invarea;
+
+                if (sah < split.sah)
+                {
+                    split.sah = sah;
+                    split.dim = axis;
+                    split.split = origin + (i + 1) * binsize;
+                }
+            }
+        }
+
+        return split;
+    }
+
+    void SplitBvh::PerformObjectSplit(std::vector<PrimRef>& refs, Split const& split,
+        std::vector<PrimRef>& leftrefs, std::vector<PrimRef>& rightrefs) const
+    {
+        for (auto& ref : refs)
+        {
+            if (ref.bounds.center()[split.dim] < split.split)
+            {
+                leftrefs.push_back(ref);
+            }
+            else
+            {
+                rightrefs.push_back(ref);
+            }
+        }
+    }
+
+    void SplitBvh::PerformSpatialSplit(std::vector<PrimRef>& refs, Split const& split,
+        std::vector<PrimRef>& leftrefs, std::vector<PrimRef>& rightrefs)
+    {
+        int dim = split.dim;
+        float pos = split.split;
+
+        bbox leftbounds, rightbounds;
+        std::vector<PrimRef> straddling;
+
+        // References fully on one side of the plane go there
+        for (auto& ref : refs)
+        {
+            if (ref.bounds.pmax[dim] <= pos)
+            {
+                leftrefs.push_back(ref);
+                leftbounds.grow(ref.bounds);
+            }
+            else if (ref.bounds.pmin[dim] >= pos)
+            {
+                rightrefs.push_back(ref);
+                rightbounds.grow(ref.bounds);
+            }
+            else
+            {
+                straddling.push_back(ref);
+            }
+        }
+
+        // Not enough reference budget left: fall back to object split
+        if (numrefs_ + (int)straddling.size() > maxrefs_)
+        {
+            leftrefs.clear();
+            rightrefs.clear();
+
+            bbox bounds;
+            for (auto& ref : refs)
+            {
+                bounds.grow(ref.bounds);
+            }
+
+            Split objsplit = FindObjectSplit(refs, bounds);
+            if (objsplit.sah < std::numeric_limits<float>::max())
+            {
+                PerformObjectSplit(refs, objsplit, leftrefs, rightrefs);
+            }
+            return;
+        }
+
+        // Straddling references are either split or moved entirely to
+        // one of the children whichever is cheaper (reference unsplitting)
+        for (auto& ref : straddling)
+        {
+            PrimRef leftref, rightref;
+            SplitPrimRef(ref, dim, pos, leftref, rightref);
+
+            int numleft = (int)leftrefs.size();
+            int numright = (int)rightrefs.size();
+
+            bool leftempty = IsEmpty(leftref.bounds);
+            bool rightempty = IsEmpty(rightref.bounds);
+
+            float splitcost = SurfaceArea(bboxunion(leftbounds, leftref.bounds)) * (numleft + 1) +
+                SurfaceArea(bboxunion(rightbounds, rightref.bounds)) * (numright + 1);
+            float leftcost = SurfaceArea(bboxunion(leftbounds, ref.bounds)) * (numleft + 1) +
+                SurfaceArea(rightbounds) * numright;
+            float rightcost = SurfaceArea(leftbounds) * numleft +
+                SurfaceArea(bboxunion(rightbounds, ref.bounds)) * (numright + 1);
+
+            if (rightempty || (!leftempty && leftcost < splitcost && leftcost <= rightcost))
+            {
+                leftrefs.push_back(ref);
+                leftbounds.grow(ref.bounds);
+            }
+            else if (leftempty || rightcost < splitcost)
+            {
+                rightrefs.push_back(ref);
+                rightbounds.grow(ref.bounds);
+            }
+            else
+            {
+                leftrefs.push_back(leftref);
+                leftbounds.grow(leftref.bounds);
+                rightrefs.push_back(rightref);
+                rightbounds.grow(rightref.bounds);
+                ++numrefs_;
+            }
+        }
+    }
+
+    void SplitBvh::SplitPrimRef(PrimRef const& ref, int dim, float split, PrimRef& leftref, PrimRef& rightref) const
+    {
+        leftref.idx = rightref.idx = ref.idx;
+        leftref.bounds = rightref.bounds = bbox();
+
+        float3 const* v = vertices_ + 3 * ref.idx;
+
+        // Walk triangle edges gathering vertices and plane intersection points on each side
+        for (int i = 0; i < 3; ++i)
+        {
+            float3 const& v0 = v[i];
+            float3 const& v1 = v[(i + 1) % 3];
+            float p0 = v0[dim];
+            float p1 = v1[dim];
+
+            if (p0 <= split) leftref.bounds.grow(v0);
+            if (p0 >= split) rightref.bounds.grow(v0);
+
+            if ((p0 < split && p1 > split) || (p0 > split && p1 < split))
+            {
+                float t = std::min(std::max((split - p0) / (p1 - p0), 0.f), 1.f);
+                float3 p = v0 + t * (v1 - v0);
+                p[dim] = split;
+                leftref.bounds.grow(p);
+                rightref.bounds.grow(p);
+            }
+        }
+
+        // Clip against the plane and reference bounds
+        leftref.bounds.pmax[dim] = std::min(leftref.bounds.pmax[dim], split);
+        rightref.bounds.pmin[dim] = std::max(rightref.bounds.pmin[dim], split);
+
+        if (!IsEmpty(leftref.bounds))
+        {
+            intersection(leftref.bounds, ref.bounds, leftref.bounds);
+        }
+
+        if (!IsEmpty(rightref.bounds))
+        {
+            intersection(rightref.bounds, ref.bounds, rightref.bounds);
+        }
+    }
+}
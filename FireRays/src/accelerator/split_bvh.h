@@ -0,0 +1,114 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef SPLIT_BVH_H
+#define SPLIT_BVH_H
+
+#include "bvh.h"
+
+#include <vector>
+
+namespace FireRays
+{
+    ///< The class represents bounding volume hierarchy with spatial splits (SBVH).
+    ///< References to triangles straddling a spatial split plane are clipped
+    ///< against it and go to both children, which reduces node overlap for
+    ///< long and thin triangles at the cost of extra references.
+    ///< Leaves index GetIndices() array, which is larger than the number of
+    ///< primitives if some references have been duplicated.
+    ///<
+    class SplitBvh : public Bvh
+    {
+    public:
+        // minoverlap: spatial splits are only tried if object split children overlap by more than
+        //             this fraction of the root surface area
+        // maxsplitdepth: spatial splits are only tried above this depth
+        // extrarefs: limit on the number of duplicated references as a fraction of primitive count
+        SplitBvh(int maxprimsperleaf, float minoverlap, int maxsplitdepth, float extrarefs = 1.f)
+            : Bvh(true, maxprimsperleaf)
+            , vertices_(nullptr)
+            , minoverlap_(minoverlap)
+            , maxsplitdepth_(maxsplitdepth)
+            , extrarefs_(extrarefs)
+            , numrefs_(0)
+            , maxrefs_(0)
+            , rootarea_(0.f)
+        {
+        }
+
+        // Build function: vertices contain 3 world space vertices for each primitive.
+        // Bvh::Build without vertices throws.
+        void Build(bbox const* bounds, float3 const* vertices, int numbounds);
+
+    protected:
+        void BuildImpl(bbox const* bounds, int numbounds) override;
+
+    private:
+        // Primitive reference, bounds might be clipped
+        struct PrimRef
+        {
+            bbox bounds;
+            int idx;
+        };
+
+        struct Split
+        {
+            // SAH cost
+            float sah;
+            // Split axis and position
+            int dim;
+            float split;
+            // Spatial or object split
+            bool spatial;
+            // Child bounds (valid for object splits)
+            bbox leftbounds;
+            bbox rightbounds;
+        };
+
+        // Returns index of the node
+        int BuildNode(std::vector<PrimRef>& refs, bbox const& bounds, int level);
+
+        Split FindObjectSplit(std::vector<PrimRef> const& refs, bbox const& bounds) const;
+        Split FindSpatialSplit(std::vector<PrimRef> const& refs, bbox const& bounds) const;
+
+        void PerformObjectSplit(std::vector<PrimRef>& refs, Split const& split,
+            std::vector<PrimRef>& leftrefs, std::vector<PrimRef>& rightrefs) const;
+        void PerformSpatialSplit(std::vector<PrimRef>& refs, Split const& split,
+            std::vector<PrimRef>& leftrefs, std::vector<PrimRef>& rightrefs);
+
+        // Clip primitive reference against axis aligned plane
+        void SplitPrimRef(PrimRef const& ref, int dim, float split, PrimRef& leftref, PrimRef& rightref) const;
+
+        // World space vertices
+        float3 const* vertices_;
+        // Spatial split limits
+        float minoverlap_;
+        int maxsplitdepth_;
+        float extrarefs_;
+        // Current and max number of references
+        int numrefs_;
+        int maxrefs_;
+        // Root node surface area
+        float rootarea_;
+    };
+}
+
+#endif // SPLIT_BVH_H
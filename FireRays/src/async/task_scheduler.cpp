@@ -0,0 +1,224 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "task_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace FireRays
+{
+    // Scheduler and deque index the current thread is working for
+    static thread_local task_scheduler* tls_scheduler = nullptr;
+    static thread_local int tls_index = 0;
+
+    task_scheduler::task_scheduler(int num_threads)
+        : num_queued_(0)
+        , done_(false)
+    {
+        if (num_threads <= 0)
+        {
+            num_threads = (int)std::thread::hardware_concurrency();
+            num_threads = num_threads == 0 ? 2 : num_threads;
+        }
+
+        for (int i = 0; i < num_threads; ++i)
+        {
+            workers_.emplace_back(new worker());
+        }
+
+        for (int i = 1; i < num_threads; ++i)
+        {
+            threads_.push_back(std::thread(&task_scheduler::run_loop, this, i));
+        }
+    }
+
+    task_scheduler::~task_scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+
+        cv_.notify_all();
+
+        for (auto& thread : threads_)
+        {
+            thread.join();
+        }
+    }
+
+    void task_scheduler::parallel_for(int begin, int end, int grain, std::function<void(int, int)> const& f)
+    {
+        grain = std::max(grain, 1);
+
+        if (end - begin <= grain || workers_.size() == 1)
+        {
+            if (end > begin)
+            {
+                f(begin, end);
+            }
+            return;
+        }
+
+        task_group group(*this);
+
+        for (int i = begin; i < end; i += grain)
+        {
+            int chunkend = std::min(i + grain, end);
+            group.run([&f, i, chunkend]() { f(i, chunkend); });
+        }
+
+        group.wait();
+    }
+
+    void task_scheduler::push(task&& t)
+    {
+        int idx = tls_scheduler == this ? tls_index : 0;
+
+        {
+            std::lock_guard<std::mutex> lock(workers_[idx]->mutex);
+            workers_[idx]->tasks.push_back(std::move(t));
+        }
+
+        ++num_queued_;
+
+        // Lock is needed to avoid missing sleeping worker
+        std::lock_guard<std::mutex> lock(mutex_);
+        cv_.notify_one();
+    }
+
+    bool task_scheduler::pop(int idx, task& t, bool back)
+    {
+        std::lock_guard<std::mutex> lock(workers_[idx]->mutex);
+
+        auto& tasks = workers_[idx]->tasks;
+
+        if (tasks.empty())
+        {
+            return false;
+        }
+
+        if (back)
+        {
+            t = std::move(tasks.back());
+            tasks.pop_back();
+        }
+        else
+        {
+            t = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        --num_queued_;
+        return true;
+    }
+
+    bool task_scheduler::try_execute_one()
+    {
+        int idx = tls_scheduler == this ? tls_index : 0;
+        int numworkers = (int)workers_.size();
+
+        task t;
+        bool found = pop(idx, t, true);
+
+        // Steal from others starting with the next one
+        for (int i = 1; i < numworkers && !found; ++i)
+        {
+            found = pop((idx + i) % numworkers, t, false);
+        }
+
+        if (!found)
+        {
+            return false;
+        }
+
+        try
+        {
+            t.f();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(t.group->mutex_);
+
+            if (!t.group->exception_)
+            {
+                t.group->exception_ = std::current_exception();
+            }
+        }
+
+        --t.group->pending_;
+        return true;
+    }
+
+    void task_scheduler::run_loop(int idx)
+    {
+        tls_scheduler = this;
+        tls_index = idx;
+
+        while (!done_)
+        {
+            if (!try_execute_one())
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait_for(lock, std::chrono::milliseconds(10), [this]() { return done_ || num_queued_ > 0; });
+            }
+        }
+    }
+
+    task_group::~task_group()
+    {
+        // Tasks reference the group, so it can't go away before them
+        while (pending_ > 0)
+        {
+            if (!scheduler_.try_execute_one())
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void task_group::run(std::function<void()> f)
+    {
+        ++pending_;
+
+        task_scheduler::task t = { std::move(f), this };
+        scheduler_.push(std::move(t));
+    }
+
+    void task_group::wait()
+    {
+        while (pending_ > 0)
+        {
+            if (!scheduler_.try_execute_one())
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        if (exception_)
+        {
+            auto e = exception_;
+            exception_ = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+}
@@ -0,0 +1,125 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace FireRays
+{
+    class task_group;
+
+    ///< Fork-join task scheduler with per-thread work stealing deques.
+    ///< Workers pop their own tasks LIFO and steal from others FIFO,
+    ///< threads waiting for a task group execute pending tasks meanwhile,
+    ///< so tasks can spawn and wait for other tasks without deadlocks.
+    ///<
+    class task_scheduler
+    {
+    public:
+        // Total number of threads including the calling one,
+        // 0 means use all hardware threads
+        explicit task_scheduler(int num_threads = 0);
+        ~task_scheduler();
+
+        // Number of threads including the calling one
+        int num_threads() const { return (int)workers_.size(); }
+
+        // Split [begin, end) into chunks of grain elements and process them in parallel.
+        // Blocks until all of them are processed, rethrows the first exception.
+        void parallel_for(int begin, int end, int grain, std::function<void(int, int)> const& f);
+
+        task_scheduler(task_scheduler const&) = delete;
+        task_scheduler& operator = (task_scheduler const&) = delete;
+
+    private:
+        struct task
+        {
+            std::function<void()> f;
+            task_group* group;
+        };
+
+        struct worker
+        {
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+
+        void push(task&& t);
+        bool try_execute_one();
+        bool pop(int idx, task& t, bool back);
+        void run_loop(int idx);
+
+        // Slot 0 is shared by external threads, the rest belong to worker threads
+        std::vector<std::unique_ptr<worker>> workers_;
+        std::vector<std::thread> threads_;
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::atomic<int> num_queued_;
+        std::atomic<bool> done_;
+
+        friend class task_group;
+    };
+
+    ///< Set of tasks which can be waited for together
+    ///<
+    class task_group
+    {
+    public:
+        explicit task_group(task_scheduler& scheduler)
+            : scheduler_(scheduler)
+            , pending_(0)
+        {
+        }
+
+        ~task_group();
+
+        // Schedule the task, it might start executing immediately
+        void run(std::function<void()> f);
+
+        // Execute pending tasks until all tasks of the group are done,
+        // then rethrow the first exception thrown by any of them
+        void wait();
+
+        task_group(task_group const&) = delete;
+        task_group& operator = (task_group const&) = delete;
+
+    private:
+        task_scheduler& scheduler_;
+        std::atomic<int> pending_;
+        std::mutex mutex_;
+        std::exception_ptr exception_;
+
+        friend class task_scheduler;
+    };
+}
+
+#endif // TASK_SCHEDULER_H
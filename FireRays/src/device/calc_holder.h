@@ -26,6 +26,9 @@ THE SOFTWARE.
 #include "device.h"
 #include "event.h"
 
+#include <chrono>
+#include <future>
+
 namespace FireRays
 {
 	struct CalcBufferHolder : public Buffer
@@ -63,16 +66,46 @@ namespace FireRays
 		void Set(Calc::Device* device, Calc::Event* event)
 		{
 			m_event = decltype(m_event)(event, [device](Calc::Event* event) { device->DeleteEvent(event); });
+			m_future = std::shared_future<void>();
+		}
+
+		// Track host side work (like asynchronous commit) instead of a device event
+		void Set(std::shared_future<void> future)
+		{
+			m_event.reset();
+			m_future = future;
 		}
 
 		bool Complete() const override
 		{
-			return m_event->IsComplete();
+			if (m_event)
+			{
+				return m_event->IsComplete();
+			}
+
+			return m_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
 		}
 
 		void Wait() override
 		{
-			return m_event->Wait();
+			if (m_event)
+			{
+				return m_event->Wait();
+			}
+
+			// Rethrows the exception host side work has failed with
+			m_future.get();
+		}
+
+		// Device event to pass as a dependency, host side work is waited for right away
+		Calc::Event* Resolve() const
+		{
+			if (!m_event && m_future.valid())
+			{
+				m_future.wait();
+			}
+
+			return m_event.get();
 		}
 
 		Calc::Event* GetData()
@@ -81,6 +114,7 @@ namespace FireRays
 		}
 
 		std::unique_ptr<Calc::Event, std::function<void(Calc::Event*)>> m_event;
+		std::shared_future<void> m_future;
 	};
 }
 
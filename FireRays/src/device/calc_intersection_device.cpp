@@ -25,25 +25,93 @@ THE SOFTWARE.
 #include "buffer.h"
 #include "device.h"
 #include "event.h"
+#include "except.h"
+#include "math/mathutils.h"
 #include "../primitive/shapeimpl.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
 
 #include "calc_holder.h"
+#include "ray_sorter.h"
 
 #include "../strategy/strategy.h"
 #include "../strategy/bvhstrategy.h"
 #include "../strategy/bvh2lstrategy.h"
 #include "../strategy/fatbvhstrategy.h"
+#include "../strategy/qbvhstrategy.h"
+#include "../strategy/gridstrategy.h"
 #include "../strategy/hlbvh_strategy.h"
 #include "../world/world.h"
+#include "../except/except.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+
+// Number of rays traced by acc.type "auto" probes
+static int const kNumProbeRays = 16384;
+// Number of acc.type "auto" choices kept for the scenes seen before
+static std::size_t const kMaxAutoChoices = 256;
 
 namespace FireRays
 {
-	// TODO: handle different BVH strategies, for now hardcoded
+	// Device queue assigned to the calling thread
+	struct ThreadQueue
+	{
+		std::uint64_t device;
+		std::uint32_t queue;
+	};
+
+	// Slots of the devices used by the calling thread, usually just one
+	static thread_local std::vector<ThreadQueue> tls_thread_queues;
+	// Ids are never reused, unlike device addresses, so stale slots never match
+	static std::atomic<std::uint64_t> g_next_device_id(0);
+
+	static ThreadQueue* FindThreadQueue(std::uint64_t device)
+	{
+		for (auto& slot : tls_thread_queues)
+		{
+			if (slot.device == device)
+			{
+				return &slot;
+			}
+		}
+
+		return nullptr;
+	}
+
+	static StrategySelector CreateSelector(Calc::Device* device)
+	{
+		Calc::DeviceSpec spec;
+		device->GetSpec(spec);
+		return StrategySelector(spec.type != Calc::DeviceType::kCpu, spec.num_compute_units);
+	}
+
+	// Strategy is created on the first Preprocess call, when options
+	// affecting kernel compilation (like the cache path) are known
 	CalcIntersectionDevice::CalcIntersectionDevice(Calc::Calc* calc, Calc::Device* device)
 		: m_device(device, [calc](Calc::Device* device) { calc->DeleteDevice(device); })
-		, m_intersector(new BvhStrategy(device))
-		, m_intersector_string("bvh")
+		, m_intersector(nullptr)
+		, m_intersector_string("")
+		, m_selector(CreateSelector(device))
+		, m_sort_rays(false)
+		, m_sort_threshold(0)
+		, m_id(g_next_device_id++)
+		, m_next_queue(0)
 	{
+		Calc::DeviceSpec spec;
+		m_device->GetSpec(spec);
+		m_num_queues = std::max<std::uint32_t>(spec.max_num_queues, 1);
+		m_host_zero_copy = spec.type == Calc::DeviceType::kCpu;
+		m_blocking_commands = spec.blocking_commands;
+
+		auto dev = m_device.get();
+		m_primitives = decltype(m_primitives)(dev->CreatePrimitives(), [dev](Calc::Primitives* prims) { dev->DeletePrimitives(prims); });
+		m_occlusion_scratch.resize(m_num_queues, nullptr);
+
 		// Initialize event pool
 		for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
 		{
@@ -53,6 +121,29 @@ namespace FireRays
 
 	CalcIntersectionDevice::~CalcIntersectionDevice()
 	{
+		// Background preprocessing is using the device and the cache
+		if (m_pending.valid())
+		{
+			m_pending.wait();
+		}
+
+		m_ray_sorter.reset();
+
+		ReleaseRetiredScratch(true);
+
+		// Slots of other threads are left behind, they never match a new device
+		auto iter = std::remove_if(tls_thread_queues.begin(), tls_thread_queues.end(),
+			[this](ThreadQueue const& slot) { return slot.device == m_id; });
+		tls_thread_queues.erase(iter, tls_thread_queues.end());
+
+		for (auto buffer : m_occlusion_scratch)
+		{
+			if (buffer)
+			{
+				m_device->DeleteBuffer(buffer);
+			}
+		}
+
 		while (!m_event_pool.empty())
 		{
 			auto event = m_event_pool.front();
@@ -61,7 +152,75 @@ namespace FireRays
 		}
 	}
 
-	void CalcIntersectionDevice::Preprocess(World const& world)
+	void CalcIntersectionDevice::UpdateCache(World const& world)
+	{
+		auto optcachepath = world.options_.GetOption("kernel.cache.path");
+		std::string cachepath = optcachepath ? optcachepath->AsString() : "";
+
+		if (!m_cache || m_cache->GetPath() != cachepath)
+		{
+			m_cache.reset(new Calc::ExecutableCache(m_device.get(), cachepath));
+		}
+	}
+
+	// World space bounds of all the shapes
+	static bbox GetSceneBounds(World const& world)
+	{
+		bbox bounds;
+
+		for (auto shape : world.shapes_)
+		{
+			auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+			auto mesh = shapeimpl->is_instance() ?
+				static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape()) :
+				static_cast<Mesh const*>(shape);
+
+			bbox meshbounds;
+			for (int i = 0; i < mesh->num_faces(); ++i)
+			{
+				bbox facebounds;
+				mesh->GetFaceBounds(i, true, facebounds);
+				meshbounds = bboxunion(meshbounds, facebounds);
+			}
+
+			if (mesh->num_faces() > 0)
+			{
+				matrix m, minv;
+				shape->GetTransform(m, minv);
+				bounds = bboxunion(bounds, transform_bbox(meshbounds, m));
+			}
+		}
+
+		return bounds;
+	}
+
+	void CalcIntersectionDevice::UpdateRaySorting(World const& world)
+	{
+		auto optsort = world.options_.GetOption("query.sortrays");
+		auto optthreshold = world.options_.GetOption("query.sortrays.threshold");
+		bool sort = optsort && optsort->AsFloat() > 0.f;
+		auto threshold = static_cast<std::uint32_t>(std::max(optthreshold ? optthreshold->AsFloat() : 32768.f, 1.f));
+
+		// Bounds are not needed while sorting is off
+		bbox bounds = sort ? GetSceneBounds(world) : bbox();
+
+		std::lock_guard<std::mutex> lock(m_submit_mutex);
+
+		if (sort && !m_ray_sorter)
+		{
+			m_ray_sorter.reset(new RaySorter(m_device.get(), m_cache.get(), m_primitives.get(), m_num_queues));
+		}
+
+		if (sort)
+		{
+			m_ray_sorter->SetBounds(bounds);
+		}
+
+		m_sort_rays = sort;
+		m_sort_threshold = threshold;
+	}
+
+	std::string CalcIntersectionDevice::ChooseStrategy(World const& world) const
 	{
 		bool use2level = false;
 
@@ -89,60 +248,367 @@ namespace FireRays
 					// Check if it is an instance and update flag
 					use2level = use2level | shapeimpl->is_instance();
 				}
+
+				// Motion blur is only supported by 2 level BVH
+				use2level = use2level || world.HasMotion();
 			}
 		}
 
 		if (use2level)
 		{
-			if (m_intersector_string != "bvh2l")
+			return "bvh2l";
+		}
+
+		auto optacctype = world.options_.GetOption("acc.type");
+		std::string acctype = optacctype ? optacctype->AsString() : "bvh";
+
+		// "auto" is resolved by SelectStrategy
+		if (acctype == "bvh" || acctype == "fatbvh" || acctype == "qbvh" ||
+			acctype == "grid" || acctype == "hlbvh" || acctype == "auto")
+		{
+			return acctype;
+		}
+
+		// Unknown acc.type keeps the current strategy, default one is used on the first call
+		return m_intersector_string.empty() ? "bvh" : m_intersector_string;
+	}
+
+	Strategy* CalcIntersectionDevice::CreateStrategy(std::string const& name) const
+	{
+		if (name == "bvh2l")
+		{
+			return new Bvh2lStrategy(m_device.get(), m_cache.get());
+		}
+		else if (name == "fatbvh")
+		{
+			return new FatBvhStrategy(m_device.get(), m_cache.get());
+		}
+		else if (name == "qbvh")
+		{
+			return new QbvhStrategy(m_device.get(), m_cache.get());
+		}
+		else if (name == "grid")
+		{
+			return new GridStrategy(m_device.get(), m_cache.get());
+		}
+		else if (name == "hlbvh")
+		{
+			// HLBVH is built by the kernels, there are no native implementations of them
+			try
 			{
-				m_intersector.reset(new Bvh2lStrategy(m_device.get()));
-				m_intersector_string = "bvh2l";
+				return new HlbvhStrategy(m_device.get(), m_cache.get());
+			}
+			catch (Calc::Exception& e)
+			{
+				throw ExceptionImpl(std::string("acc.type hlbvh is not supported by the device: ") + e.what());
 			}
 		}
 		else
 		{
+			return new BvhStrategy(m_device.get(), m_cache.get());
+		}
+	}
+
+	std::string CalcIntersectionDevice::SelectStrategy(World const& world, std::shared_ptr<Strategy>& probed)
+	{
+		auto hash = StrategySelector::GetSceneHash(world);
+
+		{
+			std::lock_guard<std::mutex> lock(m_auto_mutex);
+			auto iter = m_auto_choices.find(hash);
+			if (iter != m_auto_choices.cend())
 			{
-				auto optacctype = world.options_.GetOption("acc.type");
-				std::string acctype = optacctype ? optacctype->AsString() : "bvh";
+				return iter->second;
+			}
+		}
 
-				if (acctype == "bvh")
-				{
-					if (m_intersector_string != "bvh")
-					{
-						m_intersector.reset(new BvhStrategy(m_device.get()));
-						m_intersector_string = "bvh";
-					}
-				}
-				else if (acctype == "fatbvh")
-				{
-					if (m_intersector_string != "fatbvh")
-					{
-						m_intersector.reset(new FatBvhStrategy(m_device.get()));
-						m_intersector_string = "fatbvh";
-					}
-				}
-				else if (acctype == "hlbvh")
+		auto stats = StrategySelector::GetSceneStats(world);
+		auto estimates = m_selector.EstimateCosts(world, stats);
+		auto name = estimates.front().name;
+
+		// Build the cheapest candidates and time the probe query with them,
+		// the build time is measured as well since it is a part of the cost
+		auto optprobe = world.options_.GetOption("acc.auto.probe");
+		auto numprobes = std::min<std::size_t>(optprobe ? static_cast<std::size_t>(std::max(optprobe->AsFloat(), 0.f)) : 0, estimates.size());
+
+		if (numprobes > 1)
+		{
+			float numrays = StrategySelector::GetNumRays(world);
+			float mincost = std::numeric_limits<float>::max();
+
+			for (std::size_t i = 0; i < numprobes; ++i)
+			{
+				std::shared_ptr<Strategy> strategy(CreateStrategy(estimates[i].name));
+
+				auto start = std::chrono::high_resolution_clock::now();
+				strategy->Preprocess(world);
+				auto buildtime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+				auto tracetime = ProbeStrategy(*strategy, stats.bounds) * numrays / kNumProbeRays;
+
+				if (buildtime + tracetime < mincost)
 				{
-					if (m_intersector_string != "hlbvh")
-					{
-						m_intersector.reset(new HlbvhStrategy(m_device.get()));
-						m_intersector_string = "hlbvh";
-					}
+					mincost = buildtime + tracetime;
+					name = estimates[i].name;
+					probed = strategy;
 				}
 			}
 		}
 
+		std::lock_guard<std::mutex> lock(m_auto_mutex);
+
+		// Scenes keep changing, start over rather than grow forever
+		if (m_auto_choices.size() >= kMaxAutoChoices)
+		{
+			m_auto_choices.clear();
+		}
+
+		m_auto_choices[hash] = name;
+		return name;
+	}
+
+	// Probe rays start uniformly inside the scene bounds and go in uniformly distributed directions
+	float CalcIntersectionDevice::ProbeStrategy(Strategy const& strategy, bbox const& bounds) const
+	{
+		std::minstd_rand rng(1);
+		std::uniform_real_distribution<float> dist(0.f, 1.f);
+
+		float3 extents = bounds.extents();
+		float maxt = std::sqrt(dot(extents, extents));
+		std::vector<ray> rays(kNumProbeRays);
+
+		for (auto& r : rays)
+		{
+			float3 o = bounds.pmin + float3(dist(rng), dist(rng), dist(rng)) * extents;
+			float z = 1.f - 2.f * dist(rng);
+			float phi = 2.f * PI * dist(rng);
+			float sintheta = std::sqrt(std::max(1.f - z * z, 0.f));
+			r = ray(o, float3(sintheta * std::cos(phi), sintheta * std::sin(phi), z), maxt);
+		}
+
+		auto raybuffer = m_device->CreateBuffer(kNumProbeRays * sizeof(ray), Calc::BufferType::kRead, &rays[0]);
+		auto hitbuffer = m_device->CreateBuffer(kNumProbeRays * sizeof(Intersection), Calc::BufferType::kWrite);
+
+		// The first query pays for lazy initialization, so the second one is timed
+		float time = 0.f;
+		for (int i = 0; i < 2; ++i)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+
+			Calc::Event* event = nullptr;
+			strategy.QueryIntersection(0, raybuffer, kNumProbeRays, hitbuffer, QueryFormat(), nullptr, &event);
+			event->Wait();
+			m_device->DeleteEvent(event);
+
+			time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+
+		m_device->DeleteBuffer(raybuffer);
+		m_device->DeleteBuffer(hitbuffer);
+
+		return time;
+	}
+
+	std::shared_ptr<Strategy> CalcIntersectionDevice::GetIntersector() const
+	{
+		std::unique_lock<std::mutex> lock(m_intersector_mutex);
+
+		// The first strategy might still be built in background, its errors
+		// are reported through the event returned by PreprocessAsync
+		if (!m_intersector && m_pending.valid())
+		{
+			auto pending = m_pending;
+			lock.unlock();
+			pending.wait();
+			lock.lock();
+		}
+
+		// Strategy is created by the first Preprocess
+		ThrowIf(!m_intersector, "No acceleration structure to query, Commit has to be called first.");
+		return m_intersector;
+	}
+
+	void CalcIntersectionDevice::WaitPreprocess()
+	{
+		if (m_pending.valid())
+		{
+			// Errors are reported through the event returned by PreprocessAsync
+			m_pending.wait();
+
+			// Queries might be looking at it
+			std::lock_guard<std::mutex> lock(m_intersector_mutex);
+			m_pending = std::shared_future<void>();
+		}
+	}
+
+	void CalcIntersectionDevice::ReleaseRetired()
+	{
+		if (m_retired)
+		{
+			FinishQueues();
+			m_retired.reset();
+		}
+	}
+
+	void CalcIntersectionDevice::FinishQueues()
+	{
+		for (std::uint32_t i = 0; i < m_num_queues; ++i)
+		{
+			m_device->Finish(i);
+		}
+	}
+
+	int CalcIntersectionDevice::GetQueueCount() const
+	{
+		return static_cast<int>(m_num_queues);
+	}
+
+	void CalcIntersectionDevice::SetQueue(int idx)
+	{
+		auto slot = FindThreadQueue(m_id);
+
+		if (slot)
+		{
+			slot->queue = static_cast<std::uint32_t>(idx);
+		}
+		else
+		{
+			tls_thread_queues.push_back({ m_id, static_cast<std::uint32_t>(idx) });
+		}
+	}
+
+	std::uint32_t CalcIntersectionDevice::GetQueue() const
+	{
+		if (m_num_queues == 1)
+		{
+			return 0;
+		}
+
+		auto slot = FindThreadQueue(m_id);
+
+		if (!slot)
+		{
+			auto queue = m_next_queue++ % m_num_queues;
+			tls_thread_queues.push_back({ m_id, queue });
+			return queue;
+		}
+
+		return slot->queue;
+	}
+
+	void CalcIntersectionDevice::Preprocess(World const& world)
+	{
+		WaitPreprocess();
+		ReleaseRetired();
+		// Strategy is updated in place, while queries on other queues might still use it
+		FinishQueues();
+		UpdateCache(world);
+
+		auto name = ChooseStrategy(world);
+		std::shared_ptr<Strategy> probed;
+
+		if (name == "auto")
+		{
+			name = SelectStrategy(world, probed);
+		}
+
+		// Strategy built by the probe is up to date
+		bool uptodate = false;
+
+		if (m_intersector_string != name)
+		{
+			std::shared_ptr<Strategy> strategy(probed ? probed : std::shared_ptr<Strategy>(CreateStrategy(name)));
+			uptodate = probed != nullptr;
+
+			std::lock_guard<std::mutex> lock(m_intersector_mutex);
+			m_intersector = strategy;
+			m_intersector_string = name;
+		}
+
 		try
 		{
 			// Let intersector to do its preprocessing job
-			m_intersector->Preprocess(world);
+			if (!uptodate)
+			{
+				m_intersector->Preprocess(world);
+			}
 		}
 		catch (Exception& e)
 		{
 			std::cout << e.what();
 			throw;
 		}
+
+		UpdateRaySorting(world);
+	}
+
+	// Shadow strategy is built from scratch into its own set of device buffers,
+	// so it never looks at change tracking of the world and the shapes, which
+	// the caller is free to reset right after the call. Once the shadow strategy
+	// is swapped in, subsequent Preprocess calls update it incrementally.
+	// The snapshot copies the set of shapes and the options only, shape state
+	// and geometry are read in place, so the caller must not change them until
+	// the build is finished.
+	void CalcIntersectionDevice::PreprocessAsync(World const& world, Event** event)
+	{
+		// Single background build at a time
+		WaitPreprocess();
+		ReleaseRetired();
+		UpdateCache(world);
+
+		auto name = ChooseStrategy(world);
+		auto snapshot = std::make_shared<World>(world);
+
+		auto pending = std::async(std::launch::async, [this, name, snapshot]()
+		{
+			std::shared_ptr<Strategy> strategy;
+			auto strategyname = name;
+
+			try
+			{
+				if (strategyname == "auto")
+				{
+					strategyname = SelectStrategy(*snapshot, strategy);
+				}
+
+				if (!strategy)
+				{
+					strategy.reset(CreateStrategy(strategyname));
+					strategy->Preprocess(*snapshot);
+				}
+
+				UpdateRaySorting(*snapshot);
+			}
+			catch (...)
+			{
+				// Current strategy has not seen the changes of the world,
+				// so force the next Preprocess to start from scratch
+				std::lock_guard<std::mutex> lock(m_intersector_mutex);
+				m_intersector_string.clear();
+				throw;
+			}
+
+			std::lock_guard<std::mutex> lock(m_intersector_mutex);
+			m_retired = m_intersector;
+			m_intersector = strategy;
+			m_intersector_string = strategyname;
+		}).share();
+
+		{
+			// Queries wait for it if there is no strategy yet
+			std::lock_guard<std::mutex> lock(m_intersector_mutex);
+			m_pending = pending;
+		}
+
+		if (event)
+		{
+			auto holder = CreateEventHolder();
+			holder->Set(pending);
+			*event = holder;
+		}
+		else
+		{
+			pending.get();
+		}
 	}
 
 	Buffer* CalcIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
@@ -190,7 +656,7 @@ namespace FireRays
 		if (event)
 		{
 			Calc::Event* e = nullptr;
-			m_device->MapBuffer(calc_buffer->GetData(), 0, offset, size, CalcMapType(type), data, &e);
+			m_device->MapBuffer(calc_buffer->GetData(), GetQueue(), offset, size, CalcMapType(type), data, &e);
 
 			auto holder = CreateEventHolder();
 			holder->Set(m_device.get(), e);
@@ -198,7 +664,7 @@ namespace FireRays
 		}
 		else
 		{
-			m_device->MapBuffer(calc_buffer->GetData(), 0, offset, size, CalcMapType(type), data, nullptr);
+			m_device->MapBuffer(calc_buffer->GetData(), GetQueue(), offset, size, CalcMapType(type), data, nullptr);
 		}
 	}
 
@@ -209,7 +675,7 @@ namespace FireRays
 		if (event)
 		{
 			Calc::Event* e = nullptr;
-			m_device->UnmapBuffer(calc_buffer->GetData(), 0, ptr, &e);
+			m_device->UnmapBuffer(calc_buffer->GetData(), GetQueue(), ptr, &e);
 			
 			auto holder = CreateEventHolder();
 			holder->Set(m_device.get(), e);
@@ -217,112 +683,451 @@ namespace FireRays
 		}
 		else
 		{
-			m_device->UnmapBuffer(calc_buffer->GetData(), 0, ptr, nullptr);
+			m_device->UnmapBuffer(calc_buffer->GetData(), GetQueue(), ptr, nullptr);
 		}
 	}
 
 
 	void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+	{
+		Query(false, rays, nullptr, 0, nullptr, numrays, hits, waitevent, event);
+	}
+
+	void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+	{
+		Query(true, rays, nullptr, 0, nullptr, numrays, hits, waitevent, event);
+	}
+
+	void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+	{
+		Query(false, rays, nullptr, 0, numrays, maxrays, hits, waitevent, event);
+	}
+
+	void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+	{
+		Query(true, rays, nullptr, 0, numrays, maxrays, hits, waitevent, event);
+	}
+
+	void CalcIntersectionDevice::QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+	{
+		Query(false, rays, rayflags, kCompactRays | kCompactHits, nullptr, numrays, hits, waitevent, event);
+	}
+
+	void CalcIntersectionDevice::QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+	{
+		Query(true, rays, rayflags, kCompactRays, nullptr, numrays, hits, waitevent, event);
+	}
+
+	void CalcIntersectionDevice::QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+	{
+		Query(false, rays, rayflags, kCompactRays | kCompactHits, numrays, maxrays, hits, waitevent, event);
+	}
+
+	void CalcIntersectionDevice::QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+	{
+		Query(true, rays, rayflags, kCompactRays, numrays, maxrays, hits, waitevent, event);
+	}
+
+	void CalcIntersectionDevice::Query(bool occlusion, Buffer const* rays, Buffer const* rayflags, std::uint32_t format, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
 	{
 		// Extract Calc buffers from their holders
 		auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
 		auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+		auto numrays_buffer = numrays ? static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get() : nullptr;
+		auto rayflags_buffer = rayflags ? static_cast<CalcBufferHolder const*>(rayflags)->m_buffer.get() : nullptr;
 		// If waitevent is passed in we have to extract it as well
-		auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+		auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->Resolve() : nullptr;
+		// Keep the strategy alive if it is being swapped concurrently
+		auto intersector = GetIntersector();
+		auto queue = GetQueue();
+
+		QueryFormat query_format(rayflags_buffer ? (format | kRayFlags) : format, rayflags_buffer);
+
+		// Strategies do not pass dependencies to the device, which is only enough
+		// within the in-order queue, so the event might come from another queue
+		if (e && m_num_queues > 1)
+		{
+			m_device->EnqueueWaitForEvent(queue, e);
+		}
+
+		// Strategy is always asked for an event, so the traversal is not waited for under the lock
+		Calc::Event* calc_event = nullptr;
+		auto calc_event_ptr = &calc_event;
+
+		{
+			std::lock_guard<std::mutex> lock(m_submit_mutex);
+
+			if (numrays_buffer)
+			{
+				if (occlusion)
+				{
+					intersector->QueryOcclusion(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, query_format, e, calc_event_ptr);
+				}
+				else
+				{
+					intersector->QueryIntersection(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, query_format, e, calc_event_ptr);
+				}
+			}
+			else if (m_sort_rays && maxrays > 0 && static_cast<std::uint32_t>(maxrays) >= m_sort_threshold)
+			{
+				if (occlusion)
+				{
+					m_ray_sorter->QueryOcclusion(*intersector, queue, ray_buffer, maxrays, hit_buffer, query_format, e, calc_event_ptr);
+				}
+				else
+				{
+					m_ray_sorter->QueryIntersection(*intersector, queue, ray_buffer, maxrays, hit_buffer, query_format, e, calc_event_ptr);
+				}
+			}
+			else
+			{
+				if (occlusion)
+				{
+					intersector->QueryOcclusion(queue, ray_buffer, maxrays, hit_buffer, query_format, e, calc_event_ptr);
+				}
+				else
+				{
+					intersector->QueryIntersection(queue, ray_buffer, maxrays, hit_buffer, query_format, e, calc_event_ptr);
+				}
+			}
+		}
 
+		CompleteSubmit(calc_event, event);
+	}
+
+	void CalcIntersectionDevice::CompleteSubmit(Calc::Event* calc_event, Event** event) const
+	{
 		if (event)
 		{
 			// event pointer has been provided, so construct holder and return event to the user
-			Calc::Event* calc_event = nullptr;
-			m_intersector->QueryIntersection(0, ray_buffer, numrays, hit_buffer, e, &calc_event);
-			
 			auto holder = CreateEventHolder();
 			holder->Set(m_device.get(), calc_event);
 			*event = holder;
 		}
-		else
+		else if (calc_event)
 		{
-			m_intersector->QueryIntersection(0, ray_buffer, numrays, hit_buffer, e, nullptr);
+			// Native device blocks on calls without an event, keep it that way for the user
+			if (m_blocking_commands)
+			{
+				calc_event->Wait();
+			}
+
+			m_device->DeleteEvent(calc_event);
 		}
 	}
 
-	void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+	Calc::Buffer* CalcIntersectionDevice::GetOcclusionScratch(std::uint32_t queue, std::size_t numrays) const
 	{
-		// Extract Calc buffers from their holders
-		auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
-		auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
-		// If waitevent is passed in we have to extract it as well
-		auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+		ReleaseRetiredScratch(false);
 
-		if (event)
+		auto& buffer = m_occlusion_scratch[queue];
+		Calc::Buffer* retiring = nullptr;
+
+		if (!buffer || buffer->GetSize() < numrays * sizeof(int))
 		{
-			// event pointer has been provided, so construct holder and return event to the user
-			Calc::Event* calc_event = nullptr;
-			m_intersector->QueryOcclusion(0, ray_buffer, numrays, hit_buffer, e, &calc_event);
-			
-			auto holder = CreateEventHolder();
-			holder->Set(m_device.get(), calc_event);
-			*event = holder;
+			// Previous queries of the queue might still be using the buffer
+			retiring = buffer;
+			buffer = m_device->CreateBuffer(numrays * sizeof(int), Calc::BufferType::kWrite);
 		}
-		else
+
+		// Traversal skips inactive rays and the ones past the actual number, mark them as misses
+		Calc::Event* fill_event = nullptr;
+		m_primitives->FillInt32(queue, buffer, -1, numrays, &fill_event);
+
+		// Queue is in-order, so the old buffer is free once the fill is complete
+		if (retiring)
+		{
+			m_retired_scratch.emplace_back(fill_event, retiring);
+		}
+		else if (fill_event)
 		{
-			m_intersector->QueryOcclusion(0, ray_buffer, numrays, hit_buffer, e, nullptr);
+			m_device->DeleteEvent(fill_event);
 		}
+
+		return buffer;
 	}
 
-	void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+	void CalcIntersectionDevice::ReleaseRetiredScratch(bool wait) const
+	{
+		auto iter = m_retired_scratch.begin();
+
+		while (iter != m_retired_scratch.end())
+		{
+			auto event = iter->first;
+
+			if (event && !event->IsComplete())
+			{
+				if (!wait)
+				{
+					++iter;
+					continue;
+				}
+
+				event->Wait();
+			}
+
+			if (event)
+			{
+				m_device->DeleteEvent(event);
+			}
+
+			m_device->DeleteBuffer(iter->second);
+			iter = m_retired_scratch.erase(iter);
+		}
+	}
+
+	void CalcIntersectionDevice::QueryOcclusionMask(Buffer const* rays, int numrays, Buffer* hitmask, Event const* waitevent, Event** event) const
 	{
 		// Extract Calc buffers from their holders
 		auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
-		auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
-		auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
+		auto mask_buffer = static_cast<CalcBufferHolder const*>(hitmask)->m_buffer.get();
 		// If waitevent is passed in we have to extract it as well
-		auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+		auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->Resolve() : nullptr;
+		// Keep the strategy alive if it is being swapped concurrently
+		auto intersector = GetIntersector();
+		auto queue = GetQueue();
 
-		if (event)
+		if (e && m_num_queues > 1)
 		{
-			// event pointer has been provided, so construct holder and return event to the user
-			Calc::Event* calc_event = nullptr;
-			m_intersector->QueryIntersection(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
-			
-			auto holder = CreateEventHolder();
-			holder->Set(m_device.get(), calc_event);
-			*event = holder;
+			m_device->EnqueueWaitForEvent(queue, e);
 		}
-		else
+
+		Calc::Event* trace_event = nullptr;
+		Calc::Event* calc_event = nullptr;
+
 		{
-			m_intersector->QueryIntersection(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+			// Scratch buffer is shared by the callers on the same queue, so traversal
+			// and packing have to be submitted back to back
+			std::lock_guard<std::mutex> lock(m_submit_mutex);
+
+			auto hit_buffer = GetOcclusionScratch(queue, std::max(numrays, 1));
+			intersector->QueryOcclusion(queue, ray_buffer, numrays, hit_buffer, QueryFormat(), e, &trace_event);
+			// Packing follows the traversal on the in-order queue
+			if (trace_event)
+			{
+				m_device->DeleteEvent(trace_event);
+			}
+
+			m_primitives->PackBitsInt32(queue, hit_buffer, mask_buffer, numrays, &calc_event);
 		}
+
+		CompleteSubmit(calc_event, event);
 	}
 
-	void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+	void CalcIntersectionDevice::QueryOcclusionMask(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitmask, Event const* waitevent, Event** event) const
 	{
 		// Extract Calc buffers from their holders
 		auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
-		auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+		auto mask_buffer = static_cast<CalcBufferHolder const*>(hitmask)->m_buffer.get();
 		auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
 		// If waitevent is passed in we have to extract it as well
-		auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+		auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->Resolve() : nullptr;
+		// Keep the strategy alive if it is being swapped concurrently
+		auto intersector = GetIntersector();
+		auto queue = GetQueue();
 
-		if (event)
+		if (e && m_num_queues > 1)
+		{
+			m_device->EnqueueWaitForEvent(queue, e);
+		}
+
+		Calc::Event* trace_event = nullptr;
+		Calc::Event* calc_event = nullptr;
+
+		{
+			std::lock_guard<std::mutex> lock(m_submit_mutex);
+
+			auto hit_buffer = GetOcclusionScratch(queue, std::max(maxrays, 1));
+			intersector->QueryOcclusion(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, QueryFormat(), e, &trace_event);
+			// Packing follows the traversal on the in-order queue
+			if (trace_event)
+			{
+				m_device->DeleteEvent(trace_event);
+			}
+
+			m_primitives->PackBitsInt32(queue, hit_buffer, mask_buffer, maxrays, &calc_event);
+		}
+
+		CompleteSubmit(calc_event, event);
+	}
+
+	const std::size_t CalcIntersectionDevice::HOST_CHUNK_SIZE;
+
+	// Pinned buffers host memory queries are staged through, one pair per queue
+	struct CalcIntersectionDevice::HostStaging
+	{
+		HostStaging(Calc::Device* device, std::uint32_t numslots)
+			: device(device)
+		{
+			for (std::uint32_t i = 0; i < numslots; ++i)
+			{
+				rays.push_back(device->CreateBuffer(HOST_CHUNK_SIZE * sizeof(ray), Calc::BufferType::kRead | Calc::BufferType::kPinned));
+				hits.push_back(device->CreateBuffer(HOST_CHUNK_SIZE * sizeof(Intersection), Calc::BufferType::kWrite | Calc::BufferType::kPinned));
+			}
+		}
+
+		~HostStaging()
+		{
+			for (std::size_t i = 0; i < rays.size(); ++i)
+			{
+				device->DeleteBuffer(rays[i]);
+				device->DeleteBuffer(hits[i]);
+			}
+		}
+
+		Calc::Device* device;
+		std::vector<Calc::Buffer*> rays;
+		std::vector<Calc::Buffer*> hits;
+	};
+
+	void CalcIntersectionDevice::QueryIntersection(ray const* rays, int numrays, Intersection* hits) const
+	{
+		QueryHost(rays, numrays, hits, sizeof(Intersection), false);
+	}
+
+	void CalcIntersectionDevice::QueryOcclusion(ray const* rays, int numrays, int* hits) const
+	{
+		QueryHost(rays, numrays, hits, sizeof(int), true);
+	}
+
+	void CalcIntersectionDevice::QueryHost(ray const* rays, int numrays, void* hits, std::size_t hitsize, bool occlusion) const
+	{
+		if (numrays <= 0)
+		{
+			return;
+		}
+
+		auto intersector = GetIntersector();
+
+		auto submit = [this, &intersector, occlusion](std::uint32_t queue, Calc::Buffer const* ray_buffer, std::uint32_t n, Calc::Buffer* hit_buffer, Calc::Event** e)
 		{
-			// event pointer has been provided, so construct holder and return event to the user
 			Calc::Event* calc_event = nullptr;
-			m_intersector->QueryOcclusion(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
-			
-			auto holder = CreateEventHolder();
-			holder->Set(m_device.get(), calc_event);
-			*event = holder;
+
+			{
+				std::lock_guard<std::mutex> lock(m_submit_mutex);
+
+				if (occlusion)
+				{
+					intersector->QueryOcclusion(queue, ray_buffer, n, hit_buffer, QueryFormat(), nullptr, &calc_event);
+				}
+				else
+				{
+					intersector->QueryIntersection(queue, ray_buffer, n, hit_buffer, QueryFormat(), nullptr, &calc_event);
+				}
+			}
+
+			if (e)
+			{
+				*e = calc_event;
+			}
+			else
+			{
+				CompleteSubmit(calc_event, nullptr);
+			}
+		};
+
+		// CPU devices traverse caller memory directly
+		if (m_host_zero_copy)
+		{
+			auto queue = GetQueue();
+			auto ray_buffer = m_device->CreateBuffer(numrays * sizeof(ray), Calc::BufferType::kRead | Calc::BufferType::kUseHostPtr, const_cast<ray*>(rays));
+			auto hit_buffer = m_device->CreateBuffer(numrays * hitsize, Calc::BufferType::kWrite | Calc::BufferType::kUseHostPtr, hits);
+
+			submit(queue, ray_buffer, numrays, hit_buffer, nullptr);
+
+			// Mapping synchronizes host memory with the device view of it, OpenCL maps are non-blocking
+			void* data = nullptr;
+			Calc::Event* map_event = nullptr;
+			m_device->MapBuffer(hit_buffer, queue, 0, numrays * hitsize, Calc::MapType::kMapRead, &data, &map_event);
+			map_event->Wait();
+			m_device->DeleteEvent(map_event);
+			m_device->UnmapBuffer(hit_buffer, queue, data, nullptr);
+
+			m_device->DeleteBuffer(ray_buffer);
+			m_device->DeleteBuffer(hit_buffer);
+			return;
 		}
-		else
+
+		std::unique_ptr<HostStaging> staging;
+
 		{
-			m_intersector->QueryOcclusion(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+			std::lock_guard<std::mutex> lock(m_staging_mutex);
+
+			if (m_staging_pool.empty())
+			{
+				staging.reset(new HostStaging(m_device.get(), m_num_queues));
+			}
+			else
+			{
+				staging = std::move(m_staging_pool.back());
+				m_staging_pool.pop_back();
+			}
+		}
+
+		// Chunks go round robin over the queues, so the upload of one chunk,
+		// traversal of another one and the download of the third overlap.
+		// Strategies keep per queue stacks and ray counters, so the traversals might overlap too.
+		auto numchunks = (numrays + HOST_CHUNK_SIZE - 1) / HOST_CHUNK_SIZE;
+		std::vector<Calc::Event*> downloads(m_num_queues, nullptr);
+		std::vector<void*> mapped(m_num_queues, nullptr);
+		std::vector<std::size_t> chunks(m_num_queues, 0);
+
+		auto copyback = [&](std::uint32_t slot)
+		{
+			auto first = chunks[slot] * HOST_CHUNK_SIZE;
+			auto count = std::min<std::size_t>(HOST_CHUNK_SIZE, numrays - first);
+
+			downloads[slot]->Wait();
+			m_device->DeleteEvent(downloads[slot]);
+			downloads[slot] = nullptr;
+
+			std::memcpy(static_cast<char*>(hits) + first * hitsize, mapped[slot], count * hitsize);
+			m_device->UnmapBuffer(staging->hits[slot], slot, mapped[slot], nullptr);
+		};
+
+		for (std::size_t chunk = 0; chunk < numchunks; ++chunk)
+		{
+			auto slot = static_cast<std::uint32_t>(chunk % m_num_queues);
+			auto first = chunk * HOST_CHUNK_SIZE;
+			auto count = std::min<std::size_t>(HOST_CHUNK_SIZE, numrays - first);
+
+			// Slot is still busy with the chunk submitted a round ago
+			if (downloads[slot])
+			{
+				copyback(slot);
+			}
+
+			// Chunk overwrites the whole region, so there is no need to read the previous one back
+			void* data = nullptr;
+			Calc::Event* map_event = nullptr;
+			m_device->MapBuffer(staging->rays[slot], slot, 0, count * sizeof(ray), Calc::MapType::kMapWriteInvalidate, &data, &map_event);
+			map_event->Wait();
+			m_device->DeleteEvent(map_event);
+			std::memcpy(data, rays + first, count * sizeof(ray));
+			m_device->UnmapBuffer(staging->rays[slot], slot, data, nullptr);
+
+			submit(slot, staging->rays[slot], static_cast<std::uint32_t>(count), staging->hits[slot], nullptr);
+
+			m_device->MapBuffer(staging->hits[slot], slot, 0, count * hitsize, Calc::MapType::kMapRead, &mapped[slot], &downloads[slot]);
+			chunks[slot] = chunk;
 		}
 
+		for (std::uint32_t slot = 0; slot < m_num_queues; ++slot)
+		{
+			if (downloads[slot])
+			{
+				copyback(slot);
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(m_staging_mutex);
+		m_staging_pool.push_back(std::move(staging));
 	}
 
 	CalcEventHolder* CalcIntersectionDevice::CreateEventHolder() const
 	{
+		std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+
 		if (m_event_pool.empty())
 		{
 			auto event = new CalcEventHolder();
@@ -338,6 +1143,7 @@ namespace FireRays
 
 	void	CalcIntersectionDevice::ReleaseEventHolder(CalcEventHolder* e) const
 	{
+		std::lock_guard<std::mutex> lock(m_event_pool_mutex);
 		m_event_pool.push(e);
 	}
 }
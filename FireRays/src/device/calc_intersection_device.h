@@ -25,15 +25,25 @@ THE SOFTWARE.
 
 #include "CLW.h"
 #include "calc.h"
+#include "primitives.h"
+#include "executable_cache.h"
+#include "strategy_selector.h"
 
+#include <atomic>
 #include <memory>
 #include <functional>
+#include <future>
+#include <map>
+#include <mutex>
 #include <queue>
+#include <thread>
+#include <vector>
 
 
 namespace FireRays
 {
 	class Strategy;
+	class RaySorter;
 	struct CalcEventHolder;
 
 	///< The class represents Calc based intersection device.
@@ -48,12 +58,18 @@ namespace FireRays
 
 		void Preprocess(World const& world) override;
 
+		void PreprocessAsync(World const& world, Event** event) override;
+
 		Buffer* CreateBuffer(size_t size, void* initdata) const override;
 
 		void DeleteBuffer(Buffer* const) const override;
 
 		void DeleteEvent(Event* const) const override;
 
+		int GetQueueCount() const override;
+
+		void SetQueue(int idx) override;
+
 		void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
 
 		void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
@@ -66,18 +82,116 @@ namespace FireRays
 
 		void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
 
+		void QueryOcclusionMask(Buffer const* rays, int numrays, Buffer* hitmask, Event const* waitevent, Event** event) const override;
+
+		void QueryOcclusionMask(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitmask, Event const* waitevent, Event** event) const override;
+
+		void QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+
+		void QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+		void QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+
+		void QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+		void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos) const override;
+
+		void QueryOcclusion(ray const* rays, int numrays, int* hitresults) const override;
+
 	protected:
+		struct HostStaging;
+		// Submit buffer query in the given format, the number of rays is taken from numrays buffer if it is not nullptr
+		void Query(bool occlusion, Buffer const* rays, Buffer const* rayflags, std::uint32_t format, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const;
+
+		// Run intersection or occlusion query on host memory arrays
+		void QueryHost(ray const* rays, int numrays, void* hits, std::size_t hitsize, bool occlusion) const;
 		CalcEventHolder* CreateEventHolder() const;
 		void	  ReleaseEventHolder(CalcEventHolder* e) const;
 
+		// Recreate kernel cache if its location has changed
+		void UpdateCache(World const& world);
+		// Update ray sorting options and scene bounds
+		void UpdateRaySorting(World const& world);
+		// Name of the strategy requested by world contents and options
+		std::string ChooseStrategy(World const& world) const;
+		// Create strategy by its name
+		Strategy* CreateStrategy(std::string const& name) const;
+		// Strategy picked by the cost model for acc.type "auto", the choice is cached by the scene hash.
+		// If candidates have been probed the winner is returned in probed already preprocessed.
+		std::string SelectStrategy(World const& world, std::shared_ptr<Strategy>& probed);
+		// Time in ms to trace the probe rays using the strategy
+		float ProbeStrategy(Strategy const& strategy, bbox const& bounds) const;
+		// Strategy to submit queries to
+		std::shared_ptr<Strategy> GetIntersector() const;
+		// Block until background preprocessing (if any) is finished
+		void WaitPreprocess();
+		// Release the strategy replaced by asynchronous preprocessing
+		void ReleaseRetired();
+		// Wait for the work of all the queues to finish
+		void FinishQueues();
+		// Device queue of the calling thread
+		std::uint32_t GetQueue() const;
+
+		// Hand the event of a submitted query over to the user or release it, called after m_submit_mutex is unlocked
+		void CompleteSubmit(Calc::Event* calc_event, Event** event) const;
+		// Per ray occlusion results of the queue to be packed into a mask, cleared to misses.
+		// m_submit_mutex has to be locked
+		Calc::Buffer* GetOcclusionScratch(std::uint32_t queue, std::size_t numrays) const;
+		// Delete outgrown scratch buffers no longer used by the queues, wait for all of them if requested
+		void ReleaseRetiredScratch(bool wait) const;
+
 		std::unique_ptr<Calc::Device, std::function<void(Calc::Device*)>> m_device;
-		std::unique_ptr<Strategy> m_intersector;
+		// Kernel binary cache used by strategies at construction time
+		std::unique_ptr<Calc::ExecutableCache> m_cache;
+		std::shared_ptr<Strategy> m_intersector;
 		std::string m_intersector_string;
+		// Previous strategy, queries submitted before the swap might still use its buffers
+		std::shared_ptr<Strategy> m_retired;
+		// Background preprocessing into a shadow strategy
+		std::shared_future<void> m_pending;
+		// Cost model for acc.type "auto" and its choices by the scene hash
+		StrategySelector m_selector;
+		std::map<std::uint64_t, std::string> m_auto_choices;
+		std::mutex m_auto_mutex;
+		// Guards the swap of the strategies and m_pending read by the queries
+		mutable std::mutex m_intersector_mutex;
+		// Kernel arguments of the strategy are shared by all the callers, only the submission is
+		// guarded, so queries always take an event to not wait for the traversal under the lock
+		mutable std::mutex m_submit_mutex;
+
+		// Number of device queues
+		std::uint32_t m_num_queues;
+		// Host memory is directly accessible by the device
+		bool m_host_zero_copy;
+		// Calls without an event are blocking on the device, queries keep that for the user
+		bool m_blocking_commands;
+		// Staging buffers for host memory queries, one set per concurrent caller
+		mutable std::vector<std::unique_ptr<HostStaging>> m_staging_pool;
+		mutable std::mutex m_staging_mutex;
+		// Parallel primitives packing occlusion results into masks
+		std::unique_ptr<Calc::Primitives, std::function<void(Calc::Primitives*)>> m_primitives;
+		// Occlusion results packed into masks, one buffer per queue guarded by m_submit_mutex
+		mutable std::vector<Calc::Buffer*> m_occlusion_scratch;
+		// Outgrown scratch buffers along with the events of the first commands issued after them
+		mutable std::vector<std::pair<Calc::Event*, Calc::Buffer*>> m_retired_scratch;
+		// Reorders rays of large queries if enabled, guarded by m_submit_mutex
+		std::unique_ptr<RaySorter> m_ray_sorter;
+		bool m_sort_rays;
+		std::uint32_t m_sort_threshold;
+
+		// Number of rays host memory queries are split into
+		static const std::size_t HOST_CHUNK_SIZE = 65536;
+		// Caller threads are spread over device queues round robin,
+		// so the work of each thread is still executed in order.
+		// Assignments live in thread local slots keyed by the unique device id
+		std::uint64_t m_id;
+		mutable std::atomic<std::uint32_t> m_next_queue;
 
 		// Initial number of events in the pool
 		static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
 		// Event pool
 		mutable std::queue<CalcEventHolder*> m_event_pool;
+		mutable std::mutex m_event_pool_mutex;
 	};
 }
 
@@ -49,14 +49,22 @@ namespace FireRays
     public:
         EmbreeBuffer(size_t size, void* init)
             : m_data(nullptr)
+            , m_owned(true)
         {
             m_data = new char[size];
             if (init)
                 memcpy(m_data, init, size);
         }
+        //wraps memory owned by the caller
+        explicit EmbreeBuffer(void* data)
+            : m_data(data)
+            , m_owned(false)
+        {
+        }
         virtual ~EmbreeBuffer()
         {
-            delete[] m_data;
+            if (m_owned)
+                delete[] static_cast<char*>(m_data);
             m_data = nullptr;
         }
 
@@ -72,6 +80,7 @@ namespace FireRays
 
     private:
         void* m_data;
+        bool m_owned;
     };
 
     //simple FireRays::Event implementation
@@ -216,6 +225,17 @@ namespace FireRays
         CheckEmbreeError();
     }
 
+    void EmbreeIntersectionDevice::PreprocessAsync(World const& world, Event** event)
+    {
+        // Embree scene is not double buffered, so commit it right away
+        Preprocess(world);
+
+        if (event)
+        {
+            *event = new EmbreeEvent([]() {});
+        }
+    }
+
     Buffer* EmbreeIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
     {
         return new EmbreeBuffer(size, initdata);
@@ -231,6 +251,15 @@ namespace FireRays
         delete event;
     }
 
+    int EmbreeIntersectionDevice::GetQueueCount() const
+    {
+        return 1;
+    }
+
+    void EmbreeIntersectionDevice::SetQueue(int idx)
+    {
+    }
+
     void EmbreeIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
     {
         EmbreeEvent* ev = new EmbreeEvent([]() {});
@@ -470,6 +499,109 @@ namespace FireRays
         Throw("Not implemented for embree device.");
     }
 
+    void EmbreeIntersectionDevice::QueryOcclusionMask(Buffer const* rays, int numrays, Buffer* hitmask, Event const* waitevent, Event** event) const
+    {
+        EmbreeBuffer* fireMask = dynamic_cast<EmbreeBuffer*>(hitmask); ThrowIf(!fireMask, "Invalid embree buffer.");
+
+        // Occlusion query reports shape ids, pack them once it is done
+        std::vector<int> hits(numrays);
+        EmbreeBuffer hit_buffer(hits.data());
+        QueryOcclusion(rays, numrays, &hit_buffer, waitevent, nullptr);
+
+        std::uint32_t* mask = static_cast<std::uint32_t*>(fireMask->GetData());
+        for (int i = 0; i < numrays; i += 32)
+        {
+            std::uint32_t bits = 0;
+            for (int j = 0; j < 32 && i + j < numrays; ++j)
+            {
+                if (hits[i + j] != RTC_INVALID_GEOMETRY_ID)
+                    bits |= 1u << j;
+            }
+            mask[i / 32] = bits;
+        }
+
+        if (event)
+        {
+            *event = new EmbreeEvent([]() {});
+        }
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusionMask(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitmask, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::ExpandCompactRays(Buffer const* rays, Buffer const* rayflags, int numrays, std::vector<ray>& dst) const
+    {
+        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
+        const EmbreeBuffer* fireFlags = rayflags ? dynamic_cast<const EmbreeBuffer*>(rayflags) : nullptr; ThrowIf(rayflags && !fireFlags, "Invalid embree buffer.");
+
+        const compact_ray* src = static_cast<const compact_ray*>(fireRays->GetData());
+        const int2* flags = fireFlags ? static_cast<const int2*>(fireFlags->GetData()) : nullptr;
+
+        dst.resize(numrays);
+        for (int i = 0; i < numrays; ++i)
+        {
+            dst[i].o = src[i].o;
+            dst[i].d = src[i].d;
+            if (flags)
+                dst[i].extra = flags[i];
+        }
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hitinfos); ThrowIf(!fireHits, "Invalid embree buffer.");
+
+        // Embree traverses host copies anyway, so convert around the regular query
+        std::vector<ray> full_rays;
+        ExpandCompactRays(rays, rayflags, numrays, full_rays);
+        std::vector<Intersection> full_hits(numrays);
+
+        EmbreeBuffer ray_buffer(full_rays.data());
+        EmbreeBuffer hit_buffer(full_hits.data());
+        QueryIntersection(&ray_buffer, numrays, &hit_buffer, waitevent, nullptr);
+
+        CompactIntersection* hits = static_cast<CompactIntersection*>(fireHits->GetData());
+        for (int i = 0; i < numrays; ++i)
+        {
+            if (!full_rays[i].IsActive())
+                continue;
+
+            const Intersection& src = full_hits[i];
+            std::uint32_t u = static_cast<std::uint32_t>(clamp(src.uvwt.x, 0.f, 1.f) * 65535.f + 0.5f);
+            std::uint32_t v = static_cast<std::uint32_t>(clamp(src.uvwt.y, 0.f, 1.f) * 65535.f + 0.5f);
+            hits[i].t = src.uvwt.w;
+            hits[i].uv = u | (v << 16);
+            hits[i].shapeid = src.shapeid;
+            hits[i].primid = (src.primid >= 0 && src.uvwt.z > 0.f) ? (src.primid | CompactIntersection::kQuadTriangleBit) : src.primid;
+        }
+
+        if (event)
+        {
+            *event = new EmbreeEvent([]() {});
+        }
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        std::vector<ray> full_rays;
+        ExpandCompactRays(rays, rayflags, numrays, full_rays);
+
+        EmbreeBuffer ray_buffer(full_rays.data());
+        QueryOcclusion(&ray_buffer, numrays, hitresults, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
     RTCScene EmbreeIntersectionDevice::GetEmbreeMesh(const FireRays::Mesh* mesh)
     {
         if (m_meshes.count(mesh))
@@ -481,28 +613,28 @@ namespace FireRays
         unsigned id = rtcNewTriangleMesh(result, RTC_GEOMETRY_STATIC, mesh->num_faces(), mesh->num_vertices());
         CheckEmbreeError();
         
-        const float3* kMeshVerts = mesh->GetVertexData();
         float* verts = static_cast<float*>(rtcMapBuffer(result, id, RTC_VERTEX_BUFFER));
         CheckEmbreeError();
         ThrowIf(!verts, "Failed to map embree buffer.");
         for (int i = 0; i < mesh->num_vertices(); ++i)
         {
-            verts[4 * i] = kMeshVerts[i].x;
-            verts[4 * i + 1] = kMeshVerts[i].y;
-            verts[4 * i + 2] = kMeshVerts[i].z;
-            verts[4 * i + 3] = kMeshVerts[i].w;
+            float3 vertex = mesh->GetVertex(i);
+            verts[4 * i] = vertex.x;
+            verts[4 * i + 1] = vertex.y;
+            verts[4 * i + 2] = vertex.z;
+            verts[4 * i + 3] = vertex.w;
         }
         rtcUnmapBuffer(result, id, RTC_VERTEX_BUFFER);
 
         int* indices = static_cast<int*>(rtcMapBuffer(result, id, RTC_INDEX_BUFFER));
         CheckEmbreeError();
         ThrowIf(!indices, "Failed to map embree buffer.");
-        const Mesh::Face* kFaces = mesh->GetFaceData();
         for (int i = 0; i < mesh->num_faces(); ++i)
         {
-            indices[3 * i] = kFaces[i].i0;
-            indices[3 * i + 1] = kFaces[i].i1;
-            indices[3 * i + 2] = kFaces[i].i2;
+            Mesh::Face face = mesh->GetFace(i);
+            indices[3 * i] = face.i0;
+            indices[3 * i + 1] = face.i1;
+            indices[3 * i + 2] = face.i2;
         }
         rtcUnmapBuffer(result, id, RTC_INDEX_BUFFER);
         CheckEmbreeError();
@@ -539,6 +671,7 @@ namespace FireRays
         }
 
         ThrowIf(state & ShapeImpl::kStateChangeMotion, "Not implemented for embree device");
+        ThrowIf(state & ShapeImpl::kStateChangeVertices, "Not implemented for embree device");
     }
 
     void EmbreeIntersectionDevice::FillRTCRay(RTCRay& dst, const ray& src) const
@@ -621,4 +754,19 @@ namespace FireRays
             Throw("Embree error");
         }
     }
+
+    void EmbreeIntersectionDevice::QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos) const
+    {
+        // Embree traverses host memory anyway, so wrap the arrays without copies
+        EmbreeBuffer ray_buffer(const_cast<ray*>(rays));
+        EmbreeBuffer hit_buffer(hitinfos);
+        QueryIntersection(&ray_buffer, numrays, &hit_buffer, nullptr, nullptr);
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusion(ray const* rays, int numrays, int* hitresults) const
+    {
+        EmbreeBuffer ray_buffer(const_cast<ray*>(rays));
+        EmbreeBuffer hit_buffer(hitresults);
+        QueryOcclusion(&ray_buffer, numrays, &hit_buffer, nullptr, nullptr);
+    }
 } //FireRays
\ No newline at end of file
@@ -23,6 +23,7 @@ THE SOFTWARE.
 
 #include "intersection_device.h"
 #include <map>
+#include <vector>
 
 #include <embree2/rtcore.h>
 #include "../async/thread_pool.h"
@@ -46,15 +47,26 @@ namespace FireRays
 
         //IntersectionDevice
         void Preprocess(World const& world) override;
+        void PreprocessAsync(World const& world, Event** event) override;
         Buffer* CreateBuffer(size_t size, void* initdata) const override;
         void DeleteBuffer(Buffer* const) const override;
         void DeleteEvent(Event* const) const override;
+        int GetQueueCount() const override;
+        void SetQueue(int idx) override;
         void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
         void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
         void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
         void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
         void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionMask(Buffer const* rays, int numrays, Buffer* hitmask, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionMask(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitmask, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos) const override;
+        void QueryOcclusion(ray const* rays, int numrays, int* hitresults) const override;
     
     protected:
         RTCScene GetEmbreeMesh(const FireRays::Mesh*);
@@ -64,6 +76,8 @@ namespace FireRays
         void FillIntersection(Intersection& dst, const RTCRay& src) const;
         void FillIntersection(Intersection& dst, const RTCRay4& src, int i) const;
         void CheckEmbreeError() const;
+        // Expand compact rays into regular ones
+        void ExpandCompactRays(Buffer const* rays, Buffer const* rayflags, int numrays, std::vector<ray>& dst) const;
         
         // embree device
         RTCDevice m_device;
@@ -40,6 +40,14 @@ namespace FireRays
         // The call is blocking.
 		virtual void Preprocess(World const& world) = 0;
 
+        // Do scene preprocessing in the background.
+        // Queries keep using the previously preprocessed scene until the event is completed.
+        // Only the list of shapes and the options are copied, so shapes might be attached, detached
+        // or options changed right after the call. Transforms, ids, masks and vertices of the shapes
+        // are read in place and must not be changed until the event is completed.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+		virtual void PreprocessAsync(World const& world, Event** event) = 0;
+
         // Create a buffer of a specified size with specified initial data.
         // if initdata == nullptr the buffer is allocated, but not initialized.
 		virtual Buffer* CreateBuffer(size_t size, void* initdata) const = 0;
@@ -50,6 +58,12 @@ namespace FireRays
         // Release an event (this method is optimized for frequent calls)
 		virtual void DeleteEvent(Event* const) const = 0;
 
+        // Number of queues the work might be distributed over.
+		virtual int GetQueueCount() const = 0;
+
+        // Submit subsequent calls of the calling thread to the queue idx.
+		virtual void SetQueue(int idx) = 0;
+
         // Map buffer data.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
 		virtual void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const = 0;
@@ -87,6 +101,45 @@ namespace FireRays
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
 		virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find if the rays in rays buffer intersect any of the primitives in the scene and write the results as a bit mask.
+        // hitmask is assumed an array of (numrays + 31) / 32 32-bit words, bit (i % 32) of word (i / 32) is set if ray i is occluded.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+		virtual void QueryOcclusionMask(Buffer const* rays, int numrays, Buffer* hitmask, Event const* waitevent, Event** event) const = 0;
+
+        // Find if the rays in rays buffer intersect any of the primitives in the scene and write the results as a bit mask.
+        // Take the number of rays from the buffer in remote memory, hitmask is assumed to hold (maxrays + 31) / 32 words.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+		virtual void QueryOcclusionMask(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitmask, Event const* waitevent, Event** event) const = 0;
+
+        // Find intersection for the compact rays in rays buffer and write them into hits buffer.
+        // rays is assumed AOS with elements of type FireRays::compact_ray.
+        // rayflags is assumed an array of int2 masks and activity flags or nullptr (all rays are active with full mask).
+        // hits is assumed AOS with elements of type FireRays::CompactIntersection.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+		virtual void QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find if the compact rays in rays buffer intersect any of the primitives in the scene.
+        // hits is assumed AOS with elements of type int (-1 if no intersection, 1 otherwise).
+		virtual void QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Compact intersection query taking the number of rays from the buffer in remote memory.
+		virtual void QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Compact occlusion query taking the number of rays from the buffer in remote memory.
+		virtual void QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Find intersection for the rays in host memory and write them into hits in host memory.
+        // The call is blocking.
+		virtual void QueryIntersection(ray const* rays, int numrays, Intersection* hits) const = 0;
+
+        // Find if the rays in host memory intersect any of the primitives in the scene.
+        // hits is an array of int (-1 if no intersection, 1 otherwise).
+        // The call is blocking.
+		virtual void QueryOcclusion(ray const* rays, int numrays, int* hits) const = 0;
 	
 		IntersectionDevice(IntersectionDevice const&) = delete;
 		IntersectionDevice& operator = (IntersectionDevice const&) = delete;
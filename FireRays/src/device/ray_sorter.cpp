@@ -0,0 +1,320 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_sorter.h"
+
+#include "device.h"
+#include "primitives.h"
+
+#ifdef FR_EMBED_KERNELS
+#include "../kernel/CL/cache/kernels.h"
+#endif
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace FireRays
+{
+	struct RaySorter::Scratch
+	{
+		Scratch(Calc::Device* device)
+			: device(device)
+			, keys(nullptr)
+			, sorted_keys(nullptr)
+			, indices(nullptr)
+			, sorted_indices(nullptr)
+			, sorted_rays(nullptr)
+			, sorted_hits(nullptr)
+			, capacity(0)
+			, hits_capacity(0)
+		{
+		}
+
+		~Scratch()
+		{
+			Release();
+			ReleaseHits();
+
+			for (auto buffer : retiring)
+			{
+				device->DeleteBuffer(buffer);
+			}
+
+			ReleaseRetired(true);
+		}
+
+		// Buffers are retired rather than deleted, previous queries of the queue might still be using them
+		void Release()
+		{
+			for (auto buffer : { keys, sorted_keys, indices, sorted_indices, sorted_rays })
+			{
+				if (buffer)
+				{
+					retiring.push_back(buffer);
+				}
+			}
+
+			keys = sorted_keys = indices = sorted_indices = sorted_rays = nullptr;
+			capacity = 0;
+		}
+
+		void ReleaseHits()
+		{
+			if (sorted_hits)
+			{
+				retiring.push_back(sorted_hits);
+			}
+
+			sorted_hits = nullptr;
+			hits_capacity = 0;
+		}
+
+		// Buffers retired so far are deleted once the event is complete,
+		// it comes from the first command enqueued after them
+		void Retire(Calc::Event* event)
+		{
+			retired.push_back(std::make_pair(event, retiring));
+			retiring.clear();
+		}
+
+		// Delete retired buffers which are not used anymore
+		void ReleaseRetired(bool wait)
+		{
+			auto iter = retired.begin();
+			while (iter != retired.end())
+			{
+				if (!wait && !iter->first->IsComplete())
+				{
+					++iter;
+					continue;
+				}
+
+				iter->first->Wait();
+				device->DeleteEvent(iter->first);
+
+				for (auto buffer : iter->second)
+				{
+					device->DeleteBuffer(buffer);
+				}
+
+				iter = retired.erase(iter);
+			}
+		}
+
+		Calc::Device* device;
+		// Sort keys and ray indices before and after the sort
+		Calc::Buffer* keys;
+		Calc::Buffer* sorted_keys;
+		Calc::Buffer* indices;
+		Calc::Buffer* sorted_indices;
+		// Rays in the sorted order
+		Calc::Buffer* sorted_rays;
+		// Hits of the sorted rays
+		Calc::Buffer* sorted_hits;
+		// Number of rays the buffers can hold
+		std::size_t capacity;
+		// Size of hits buffer in bytes
+		std::size_t hits_capacity;
+		// Buffers replaced by the current call and the ones waiting for their event
+		std::vector<Calc::Buffer*> retiring;
+		std::vector<std::pair<Calc::Event*, std::vector<Calc::Buffer*>>> retired;
+	};
+
+	RaySorter::RaySorter(Calc::Device* device, Calc::ExecutableCache* cache, Calc::Primitives* primitives, std::uint32_t numqueues)
+		: m_device(device)
+		, m_primitives(primitives)
+		, m_scene_min(0.f, 0.f, 0.f)
+		, m_scene_invextent(1.f, 1.f, 1.f)
+	{
+#ifndef FR_EMBED_KERNELS
+		char const* headers[] = { "../FireRays/src/kernel/CL/common.cl" };
+
+		int numheaders = sizeof(headers) / sizeof(char const*);
+
+		m_executable = cache->CompileExecutable("../FireRays/src/kernel/CL/sort_rays.cl", headers, numheaders);
+#else
+		m_executable = cache->CompileExecutable(cl_sort_rays, std::strlen(cl_sort_rays), nullptr);
+#endif
+
+		m_keys_func = m_executable->CreateFunction("CalcRayKeys");
+		m_gather_func = m_executable->CreateFunction("GatherRays");
+		m_scatter_func = m_executable->CreateFunction("ScatterHits");
+
+		for (std::uint32_t i = 0; i < numqueues; ++i)
+		{
+			m_scratch.emplace_back(new Scratch(device));
+		}
+	}
+
+	RaySorter::~RaySorter()
+	{
+		m_scratch.clear();
+
+		m_executable->DeleteFunction(m_keys_func);
+		m_executable->DeleteFunction(m_gather_func);
+		m_executable->DeleteFunction(m_scatter_func);
+		m_device->DeleteExecutable(m_executable);
+	}
+
+	void RaySorter::SetBounds(bbox const& bounds)
+	{
+		float3 extent = bounds.extents();
+
+		m_scene_min = bounds.pmin;
+		// Degenerate axes map all the origins to the same cell
+		m_scene_invextent = float3(extent.x > 0.f ? 1.f / extent.x : 0.f,
+			extent.y > 0.f ? 1.f / extent.y : 0.f,
+			extent.z > 0.f ? 1.f / extent.z : 0.f);
+	}
+
+	RaySorter::Scratch& RaySorter::SortRays(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, std::size_t hitsize, QueryFormat const& format)
+	{
+		auto& scratch = *m_scratch[queueidx];
+
+		scratch.ReleaseRetired(false);
+
+		if (scratch.capacity < numrays)
+		{
+			scratch.Release();
+			scratch.keys = m_device->CreateBuffer(numrays * sizeof(int), Calc::BufferType::kWrite);
+			scratch.sorted_keys = m_device->CreateBuffer(numrays * sizeof(int), Calc::BufferType::kWrite);
+			scratch.indices = m_device->CreateBuffer(numrays * sizeof(int), Calc::BufferType::kWrite);
+			scratch.sorted_indices = m_device->CreateBuffer(numrays * sizeof(int), Calc::BufferType::kWrite);
+			scratch.sorted_rays = m_device->CreateBuffer(numrays * sizeof(ray), Calc::BufferType::kWrite);
+			scratch.capacity = numrays;
+		}
+
+		// Occlusion and intersection queries need different amount of memory for hits
+		if (scratch.hits_capacity < numrays * hitsize)
+		{
+			scratch.ReleaseHits();
+			scratch.sorted_hits = m_device->CreateBuffer(numrays * hitsize, Calc::BufferType::kWrite);
+			scratch.hits_capacity = numrays * hitsize;
+		}
+
+		size_t localsize = kWorkGroupSize;
+		size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+		int n = static_cast<int>(numrays);
+		int flags = static_cast<int>(format.flags);
+		float4 scenemin = m_scene_min;
+		float4 invextent = m_scene_invextent;
+		Calc::Buffer const* rayflags = format.rayflags ? format.rayflags : rays;
+
+		// Sort keys along with the original ray indices
+		int arg = 0;
+		m_keys_func->SetArg(arg++, rays);
+		m_keys_func->SetArg(arg++, sizeof(n), &n);
+		m_keys_func->SetArg(arg++, sizeof(scenemin), &scenemin);
+		m_keys_func->SetArg(arg++, sizeof(invextent), &invextent);
+		m_keys_func->SetArg(arg++, scratch.keys);
+		m_keys_func->SetArg(arg++, scratch.indices);
+		m_keys_func->SetArg(arg++, sizeof(flags), &flags);
+		m_keys_func->SetArg(arg++, rayflags);
+
+		// Stages follow each other on the in-order queue, events are only taken to not block native devices
+		Calc::Event* keys_event = nullptr;
+		m_device->Execute(m_keys_func, queueidx, globalsize, localsize, &keys_event);
+
+		// Keys are computed after all the previous commands of the queue,
+		// so the buffers replaced above are free once they are done
+		if (!scratch.retiring.empty())
+		{
+			scratch.Retire(keys_event);
+		}
+		else
+		{
+			m_device->DeleteEvent(keys_event);
+		}
+
+		Calc::Event* sort_event = nullptr;
+		m_primitives->SortRadixInt32(queueidx, scratch.keys, scratch.sorted_keys, scratch.indices, scratch.sorted_indices, numrays, &sort_event);
+		m_device->DeleteEvent(sort_event);
+
+		// Rays are stored in the full layout after the gather
+		arg = 0;
+		m_gather_func->SetArg(arg++, rays);
+		m_gather_func->SetArg(arg++, sizeof(n), &n);
+		m_gather_func->SetArg(arg++, scratch.sorted_indices);
+		m_gather_func->SetArg(arg++, scratch.sorted_rays);
+		m_gather_func->SetArg(arg++, sizeof(flags), &flags);
+		m_gather_func->SetArg(arg++, rayflags);
+
+		Calc::Event* gather_event = nullptr;
+		m_device->Execute(m_gather_func, queueidx, globalsize, localsize, &gather_event);
+		m_device->DeleteEvent(gather_event);
+
+		return scratch;
+	}
+
+	void RaySorter::ScatterHits(std::uint32_t queueidx, Scratch& scratch, std::uint32_t numrays, std::size_t hitsize, Calc::Buffer* hits, Calc::Event** event)
+	{
+		size_t localsize = kWorkGroupSize;
+		size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+		int n = static_cast<int>(numrays);
+		int hitints = static_cast<int>(hitsize / sizeof(int));
+
+		int arg = 0;
+		m_scatter_func->SetArg(arg++, scratch.sorted_rays);
+		m_scatter_func->SetArg(arg++, sizeof(n), &n);
+		m_scatter_func->SetArg(arg++, scratch.sorted_indices);
+		m_scatter_func->SetArg(arg++, sizeof(hitints), &hitints);
+		m_scatter_func->SetArg(arg++, scratch.sorted_hits);
+		m_scatter_func->SetArg(arg++, hits);
+		m_device->Execute(m_scatter_func, queueidx, globalsize, localsize, event);
+	}
+
+	void RaySorter::QueryIntersection(Strategy const& strategy, std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays,
+		Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event)
+	{
+		auto hitsize = (format.flags & kCompactHits) ? sizeof(CompactIntersection) : sizeof(Intersection);
+		auto& scratch = SortRays(queueidx, rays, numrays, hitsize, format);
+
+		Calc::Event* trace_event = nullptr;
+		strategy.QueryIntersection(queueidx, scratch.sorted_rays, numrays, scratch.sorted_hits, QueryFormat(format.flags & kCompactHits), waitevent, &trace_event);
+		if (trace_event)
+		{
+			m_device->DeleteEvent(trace_event);
+		}
+
+		ScatterHits(queueidx, scratch, numrays, hitsize, hits, event);
+	}
+
+	void RaySorter::QueryOcclusion(Strategy const& strategy, std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays,
+		Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event)
+	{
+		auto& scratch = SortRays(queueidx, rays, numrays, sizeof(int), format);
+
+		Calc::Event* trace_event = nullptr;
+		strategy.QueryOcclusion(queueidx, scratch.sorted_rays, numrays, scratch.sorted_hits, QueryFormat(), waitevent, &trace_event);
+		if (trace_event)
+		{
+			m_device->DeleteEvent(trace_event);
+		}
+
+		ScatterHits(queueidx, scratch, numrays, sizeof(int), hits, event);
+	}
+}
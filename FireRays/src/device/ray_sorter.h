@@ -0,0 +1,85 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "math/bbox.h"
+#include "../strategy/strategy.h"
+
+#include <memory>
+#include <vector>
+
+namespace Calc
+{
+	class Primitives;
+}
+
+namespace FireRays
+{
+	///< The class reorders incoherent rays before the traversal. Rays are
+	///< sorted by the key made of the direction octant and the Morton code
+	///< of the origin quantized within the scene bounds, traversed in the
+	///< sorted order and their hits are scattered back to the original order.
+	///< Scratch buffers are kept per queue, callers are expected to serialize
+	///< submission the same way as for strategies.
+	///<
+	class RaySorter
+	{
+	public:
+		RaySorter(Calc::Device* device, Calc::ExecutableCache* cache, Calc::Primitives* primitives, std::uint32_t numqueues);
+		~RaySorter();
+
+		// Set the bounds ray origins are quantized within
+		void SetBounds(bbox const& bounds);
+
+		// Same as the strategy queries, but rays are traversed in the sorted order.
+		// The call is non-blocking, an event is created only if requested.
+		void QueryIntersection(Strategy const& strategy, std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays,
+			Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event);
+
+		void QueryOcclusion(Strategy const& strategy, std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays,
+			Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event);
+
+		RaySorter(RaySorter const&) = delete;
+		RaySorter& operator = (RaySorter const&) = delete;
+
+	private:
+		struct Scratch;
+		// Compute keys, sort them and gather the rays into the scratch
+		Scratch& SortRays(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, std::size_t hitsize, QueryFormat const& format);
+		// Write sorted hits back in the original order
+		void ScatterHits(std::uint32_t queueidx, Scratch& scratch, std::uint32_t numrays, std::size_t hitsize, Calc::Buffer* hits, Calc::Event** event);
+
+		Calc::Device* m_device;
+		Calc::Primitives* m_primitives;
+
+		Calc::Executable* m_executable;
+		Calc::Function* m_keys_func;
+		Calc::Function* m_gather_func;
+		Calc::Function* m_scatter_func;
+
+		// Scene bounds minimum and reciprocal extent
+		float3 m_scene_min;
+		float3 m_scene_invextent;
+
+		std::vector<std::unique_ptr<Scratch>> m_scratch;
+	};
+}
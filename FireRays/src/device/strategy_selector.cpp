@@ -0,0 +1,433 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "strategy_selector.h"
+
+#include "math/mathutils.h"
+#include "../primitive/shapeimpl.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../accelerator/grid.h"
+#include "../world/world.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <thread>
+
+// Faces per leaf of the quick LBVH, default bvh.sah.maxprimsperleaf
+static int const kLeafSize = 4;
+// Any strategy traces scenes this small fast enough, so they get the default one
+static int const kMinFaces = 1024;
+// Default number of rays the builds are amortized over
+static float const kDefaultNumRays = 1048576.f;
+
+// Cost model constants in ns per CPU core, calibrated on the native device.
+// Trees: kTraceBase + kTraceNode * SAH cost of the quick LBVH per ray.
+static float const kTraceBase = 290.f;
+static float const kTraceNode = 23.f;
+// Grid: average resolution * (kTraceVoxel + kTraceOccupied * occupancy) per ray.
+static float const kTraceVoxel = 30.f;
+static float const kTraceOccupied = 30.f;
+// Builds: per face and tree level with median and SAH builders, per face for
+// fat node translation, per voxel and reference for the grid.
+static float const kBuildMedian = 28.f;
+static float const kBuildSah = 45.f;
+static float const kBuildFatNodes = 400.f;
+static float const kBuildGrid = 80.f;
+// HLBVH is built on the device, faces are gathered on the host
+static float const kBuildHlbvhHost = 10.f;
+static float const kBuildHlbvhDevice = 200.f;
+// Trace throughput of a GPU compute unit relative to a CPU core
+static float const kGpuComputeUnitSpeedup = 2.f;
+
+namespace FireRays
+{
+	static float GetFloatOption(World const& world, char const* name, float defaultvalue)
+	{
+		auto opt = world.options_.GetOption(name);
+		return opt ? opt->AsFloat() : defaultvalue;
+	}
+
+	static void HashCombine(std::uint64_t& hash, std::uint64_t value)
+	{
+		// FNV-1a over 64 bit words
+		hash ^= value;
+		hash *= 1099511628211ull;
+	}
+
+	static void HashCombine(std::uint64_t& hash, float value)
+	{
+		std::uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		HashCombine(hash, static_cast<std::uint64_t>(bits));
+	}
+
+	// Insert two zero bits after each of the lower 10 bits
+	static std::uint32_t SpreadBits(std::uint32_t x)
+	{
+		x = (x | (x << 16)) & 0x030000FF;
+		x = (x | (x << 8)) & 0x0300F00F;
+		x = (x | (x << 4)) & 0x030C30C3;
+		x = (x | (x << 2)) & 0x09249249;
+		return x;
+	}
+
+	// Build the tree over keys sorted by Morton code (upper 32 bits) splitting
+	// ranges at the highest differing bit, sum up areas of the nodes
+	static bbox BuildLbvh(std::vector<std::uint64_t> const& keys, std::vector<bbox> const& boxes,
+		std::size_t begin, std::size_t end, double& innerarea, double& leafarea)
+	{
+		if (end - begin <= kLeafSize)
+		{
+			bbox bounds;
+			for (auto i = begin; i < end; ++i)
+			{
+				bounds.grow(boxes[keys[i] & 0xFFFFFFFF]);
+			}
+
+			leafarea += bounds.surface_area() * (end - begin);
+			return bounds;
+		}
+
+		auto first = static_cast<std::uint32_t>(keys[begin] >> 32);
+		auto last = static_cast<std::uint32_t>(keys[end - 1] >> 32);
+		auto split = (begin + end) / 2;
+
+		if (first != last)
+		{
+			int bit = 31;
+			while (!(((first ^ last) >> bit) & 1))
+			{
+				--bit;
+			}
+
+			// The first key having the bit set
+			std::uint64_t splitkey = static_cast<std::uint64_t>(((first >> bit) | 1) << bit) << 32;
+			split = std::lower_bound(keys.cbegin() + begin, keys.cbegin() + end, splitkey) - keys.cbegin();
+		}
+
+		bbox bounds = bboxunion(BuildLbvh(keys, boxes, begin, split, innerarea, leafarea),
+			BuildLbvh(keys, boxes, split, end, innerarea, leafarea));
+		innerarea += bounds.surface_area();
+		return bounds;
+	}
+
+	// SAH cost of a quick LBVH over the boxes relative to the root area, i.e. the number of node visits
+	// and box tests for a ray crossing the root. Inner nodes only cost is returned in innercost if requested.
+	static float GetLbvhCost(std::vector<bbox> const& boxes, float* innercost = nullptr)
+	{
+		if (boxes.empty())
+		{
+			return 0.f;
+		}
+
+		bbox centroids;
+		for (auto const& box : boxes)
+		{
+			centroids.grow(box.center());
+		}
+
+		float3 extents = centroids.extents();
+		std::vector<std::uint64_t> keys(boxes.size());
+
+		for (std::size_t i = 0; i < boxes.size(); ++i)
+		{
+			float3 center = boxes[i].center();
+			std::uint32_t code = 0;
+
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				float t = extents[axis] > 0.f ? (center[axis] - centroids.pmin[axis]) / extents[axis] : 0.f;
+				auto cell = static_cast<std::uint32_t>(std::min(std::max(t * 1024.f, 0.f), 1023.f));
+				code |= SpreadBits(cell) << (2 - axis);
+			}
+
+			keys[i] = (static_cast<std::uint64_t>(code) << 32) | i;
+		}
+
+		std::sort(keys.begin(), keys.end());
+
+		double innerarea = 0.0;
+		double leafarea = 0.0;
+		bbox root = BuildLbvh(keys, boxes, 0, keys.size(), innerarea, leafarea);
+		double rootarea = root.surface_area();
+
+		if (rootarea <= 0.0)
+		{
+			return 1.f;
+		}
+
+		if (innercost)
+		{
+			*innercost = static_cast<float>(innerarea / rootarea);
+		}
+
+		return static_cast<float>((innerarea + leafarea) / rootarea);
+	}
+
+	StrategySelector::SceneStats::SceneStats()
+		: numfaces(0)
+		, numshapes(0)
+		, bottomlevelwork(0.f)
+		, flatcost(0.f)
+		, twolevelcost(0.f)
+		, gridres(0.f)
+		, gridvoxels(0.f)
+		, gridrefs(0.f)
+		, gridoccupancy(0.f)
+	{
+	}
+
+	StrategySelector::StrategySelector(bool gpu, std::uint32_t numcomputeunits)
+		: m_gpu(gpu)
+		, m_num_compute_units(std::max<std::uint32_t>(numcomputeunits, 1))
+	{
+	}
+
+	float StrategySelector::GetNumRays(World const& world)
+	{
+		return std::max(GetFloatOption(world, "acc.auto.rays", kDefaultNumRays), 1.f);
+	}
+
+	std::uint64_t StrategySelector::GetSceneHash(World const& world)
+	{
+		std::uint64_t hash = 14695981039346656037ull;
+
+		HashCombine(hash, static_cast<std::uint64_t>(world.shapes_.size()));
+
+		for (auto shape : world.shapes_)
+		{
+			auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+			auto mesh = shapeimpl->is_instance() ?
+				static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape()) :
+				static_cast<Mesh const*>(shape);
+
+			HashCombine(hash, static_cast<std::uint64_t>(shapeimpl->is_instance()));
+			HashCombine(hash, static_cast<std::uint64_t>(mesh->num_faces()));
+			HashCombine(hash, static_cast<std::uint64_t>(mesh->num_vertices()));
+		}
+
+		// Options changing the estimates
+		HashCombine(hash, GetNumRays(world));
+		HashCombine(hash, GetFloatOption(world, "acc.auto.probe", 0.f));
+		HashCombine(hash, GetFloatOption(world, "bvh.builder.threads", 0.f));
+		HashCombine(hash, GetFloatOption(world, "grid.density", 4.f));
+		HashCombine(hash, GetFloatOption(world, "grid.maxres", 256.f));
+
+		auto optbuilder = world.options_.GetOption("bvh.builder");
+		HashCombine(hash, static_cast<std::uint64_t>(std::hash<std::string>()(optbuilder ? optbuilder->AsString() : "")));
+
+		return hash;
+	}
+
+	StrategySelector::SceneStats StrategySelector::GetSceneStats(World const& world)
+	{
+		SceneStats stats;
+		stats.numshapes = static_cast<int>(world.shapes_.size());
+
+		std::vector<bbox> faces;
+		std::vector<bbox> shapes;
+		std::vector<bbox> meshfaces;
+		// Bottom level cost of the meshes, instances share it with their base mesh
+		std::map<Mesh const*, float> meshcosts;
+		double bottomlevelarea = 0.0;
+
+		for (auto shape : world.shapes_)
+		{
+			auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+			auto mesh = shapeimpl->is_instance() ?
+				static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape()) :
+				static_cast<Mesh const*>(shape);
+
+			int numfaces = mesh->num_faces();
+			if (numfaces == 0)
+			{
+				continue;
+			}
+
+			matrix m, minv;
+			shape->GetTransform(m, minv);
+
+			meshfaces.resize(numfaces);
+			bbox meshbounds;
+			for (int i = 0; i < numfaces; ++i)
+			{
+				mesh->GetFaceBounds(i, true, meshfaces[i]);
+				meshbounds.grow(meshfaces[i]);
+				faces.push_back(transform_bbox(meshfaces[i], m));
+			}
+
+			bbox shapebounds = transform_bbox(meshbounds, m);
+			shapes.push_back(shapebounds);
+			stats.bounds.grow(shapebounds);
+
+			auto iter = meshcosts.find(mesh);
+			if (iter == meshcosts.cend())
+			{
+				iter = meshcosts.emplace(mesh, GetLbvhCost(meshfaces)).first;
+				stats.bottomlevelwork += numfaces * std::log2(static_cast<float>(std::max(numfaces, 2)));
+			}
+
+			bottomlevelarea += shapebounds.surface_area() * iter->second;
+		}
+
+		stats.numfaces = static_cast<int>(faces.size());
+
+		if (stats.numfaces < kMinFaces)
+		{
+			return stats;
+		}
+
+		float scenearea = stats.bounds.surface_area();
+
+		if (shapes.size() == 1)
+		{
+			// Flat tree is the bottom level one up to the transform
+			stats.flatcost = stats.twolevelcost = meshcosts.cbegin()->second;
+		}
+		else
+		{
+			float toplevelcost = 0.f;
+			GetLbvhCost(shapes, &toplevelcost);
+			stats.flatcost = GetLbvhCost(faces);
+			stats.twolevelcost = toplevelcost + (scenearea > 0.f ? static_cast<float>(bottomlevelarea / scenearea) : 0.f);
+		}
+
+		// Resolution of the grid GridStrategy would build and the voxels the face centroids fall into
+		int res[3];
+		Grid::CalcResolution(stats.bounds, stats.numfaces, GetFloatOption(world, "grid.density", 4.f),
+			static_cast<int>(GetFloatOption(world, "grid.maxres", 256.f)), res);
+
+		std::size_t numvoxels = static_cast<std::size_t>(res[0]) * res[1] * res[2];
+		std::vector<bool> occupied(numvoxels, false);
+		std::size_t numoccupied = 0;
+		double numrefs = 0.0;
+
+		float3 extents = stats.bounds.extents();
+		float3 scale;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			scale[axis] = extents[axis] > 0.f ? res[axis] / extents[axis] : 0.f;
+		}
+
+		for (auto const& face : faces)
+		{
+			float3 center = face.center();
+			std::size_t voxel = 0;
+			double refs = 1.0;
+
+			for (int axis = 2; axis >= 0; --axis)
+			{
+				auto cell = [&](float p) { return std::min(std::max(static_cast<int>((p - stats.bounds.pmin[axis]) * scale[axis]), 0), res[axis] - 1); };
+				voxel = voxel * res[axis] + cell(center[axis]);
+				refs *= cell(face.pmax[axis]) - cell(face.pmin[axis]) + 1;
+			}
+
+			if (!occupied[voxel])
+			{
+				occupied[voxel] = true;
+				++numoccupied;
+			}
+
+			numrefs += refs;
+		}
+
+		// Uniformly distributed faces occupy 1 - e^(-faces/voxels) of the voxels
+		double expected = 1.0 - std::exp(-static_cast<double>(stats.numfaces) / numvoxels);
+		stats.gridres = (res[0] + res[1] + res[2]) / 3.f;
+		stats.gridvoxels = static_cast<float>(numvoxels);
+		stats.gridrefs = static_cast<float>(numrefs);
+		stats.gridoccupancy = static_cast<float>(std::min(numoccupied / (numvoxels * expected), 1.0));
+
+		return stats;
+	}
+
+	std::vector<StrategySelector::Estimate> StrategySelector::EstimateCosts(World const& world, SceneStats const& stats) const
+	{
+		std::vector<Estimate> estimates;
+
+		if (stats.numfaces < kMinFaces)
+		{
+			Estimate estimate = { "bvh", 0.f, 0.f };
+			estimates.push_back(estimate);
+			return estimates;
+		}
+
+		auto optbuilder = world.options_.GetOption("bvh.builder");
+		bool sah = optbuilder && optbuilder->AsString() == "sah";
+
+		// BVH and grid builders are running on the host
+		float numthreads = GetFloatOption(world, "bvh.builder.threads", 0.f);
+		if (numthreads <= 0.f)
+		{
+			numthreads = static_cast<float>(std::max(std::thread::hardware_concurrency(), 1u));
+		}
+
+		float throughput = m_gpu ? kGpuComputeUnitSpeedup * m_num_compute_units : static_cast<float>(m_num_compute_units);
+		float numrays = GetNumRays(world);
+		float numfaces = static_cast<float>(stats.numfaces);
+
+		// ns per ray to ms for all the rays
+		auto tracetime = [&](float cost) { return cost * numrays / throughput * 1e-6f; };
+
+		float bvhbuild = (sah ? kBuildSah : kBuildMedian) * numfaces * std::log2(numfaces) / numthreads * 1e-6f;
+		float bvhtrace = kTraceBase + kTraceNode * stats.flatcost;
+
+		// Native QBVH tests 4 boxes at once with SSE, fat nodes pay off on GPUs only
+		Estimate bvh = { "bvh", bvhbuild, tracetime(bvhtrace) };
+		Estimate qbvh = { "qbvh", bvhbuild, tracetime(bvhtrace * (m_gpu ? 1.f : 0.5f)) };
+		Estimate fatbvh = { "fatbvh", bvhbuild + kBuildFatNodes * numfaces * 1e-6f, tracetime(bvhtrace * (m_gpu ? 0.7f : 1.2f)) };
+		Estimate grid = { "grid", kBuildGrid * (stats.gridvoxels + stats.gridrefs) / numthreads * 1e-6f,
+			tracetime(stats.gridres * (kTraceVoxel + kTraceOccupied * stats.gridoccupancy)) };
+
+		estimates.push_back(bvh);
+		estimates.push_back(qbvh);
+		estimates.push_back(fatbvh);
+		estimates.push_back(grid);
+
+		// Bottom levels are overlapping if shapes do, top level traversal adds 30%
+		if (stats.numshapes > 1)
+		{
+			float numshapes = static_cast<float>(stats.numshapes);
+			Estimate bvh2l = { "bvh2l",
+				((sah ? kBuildSah : kBuildMedian) * stats.bottomlevelwork + kBuildMedian * numshapes * std::log2(numshapes)) / numthreads * 1e-6f,
+				tracetime(1.3f * (kTraceBase + kTraceNode * stats.twolevelcost)) };
+			estimates.push_back(bvh2l);
+		}
+
+		// HLBVH builds pay off on GPUs only (there are no native kernels), LBVH trees are about 30% worse
+		if (m_gpu)
+		{
+			Estimate hlbvh = { "hlbvh", (kBuildHlbvhHost + kBuildHlbvhDevice / m_num_compute_units) * numfaces * 1e-6f, tracetime(1.3f * bvhtrace) };
+			estimates.push_back(hlbvh);
+		}
+
+		std::stable_sort(estimates.begin(), estimates.end(), [](Estimate const& lhs, Estimate const& rhs)
+		{
+			return lhs.buildtime + lhs.tracetime < rhs.buildtime + rhs.tracetime;
+		});
+
+		return estimates;
+	}
+}
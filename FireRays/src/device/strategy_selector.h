@@ -0,0 +1,97 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "math/bbox.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace FireRays
+{
+	class World;
+
+	///< The class picks the acceleration structure for acc.type "auto".
+	///< Build and trace times of the strategies supported by the device are
+	///< estimated from the statistics of the scene: the SAH cost of a quick
+	///< LBVH over the faces (or over the shapes for 2-level BVH) and the
+	///< occupancy of the voxels of the uniform grid. Constants of the model
+	///< are calibrated on the native device, GPU ones are rough guesses,
+	///< so the estimates only order the strategies.
+	///<
+	class StrategySelector
+	{
+	public:
+		struct SceneStats
+		{
+			SceneStats();
+
+			// Number of faces including the faces of instances
+			int numfaces;
+			// Number of shapes
+			int numshapes;
+			// Sum of n * log2(n) over the meshes built by 2-level BVH
+			float bottomlevelwork;
+			// SAH cost of a quick LBVH over all the faces, in node visits and face tests per ray
+			float flatcost;
+			// Same for the top level LBVH over the shapes and the bottom level ones over the faces
+			float twolevelcost;
+			// Average resolution of the uniform grid, the number of its voxels and voxel references
+			float gridres;
+			float gridvoxels;
+			float gridrefs;
+			// Fraction of occupied voxels relative to uniformly distributed faces, in [0, 1]
+			float gridoccupancy;
+			// World space bounds
+			bbox bounds;
+		};
+
+		struct Estimate
+		{
+			std::string name;
+			// Estimated build time and time to trace the expected number of rays, in ms
+			float buildtime;
+			float tracetime;
+		};
+
+		// Device type and number of compute units define the trace throughput
+		StrategySelector(bool gpu, std::uint32_t numcomputeunits);
+
+		// Hash of everything the choice depends on except transforms,
+		// so the choice survives animation
+		static std::uint64_t GetSceneHash(World const& world);
+
+		// Statistics of the scene the cost model is using
+		static SceneStats GetSceneStats(World const& world);
+
+		// Estimates of the strategies supported by the device, cheapest first
+		std::vector<Estimate> EstimateCosts(World const& world, SceneStats const& stats) const;
+
+		// Number of rays the builds are amortized over
+		static float GetNumRays(World const& world);
+
+	private:
+		bool m_gpu;
+		std::uint32_t m_num_compute_units;
+	};
+}
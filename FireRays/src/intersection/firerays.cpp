@@ -37,6 +37,7 @@ THE SOFTWARE.
 #include "../device/intersection_device.h"
 #include "../device/calc_intersection_device.h"
 #include "../device/calc_intersection_device_cl.h"
+#include "../kernel/Native/native_kernels.h"
 
 #ifdef USE_EMBREE
     #include "../device/embree_intersection_device.h"
@@ -50,6 +51,8 @@ namespace FireRays
         static Calc::Calc* s_calc = nullptr;
         if (!s_calc)
         {
+            // Native device looks kernels up in the registry
+            RegisterNativeKernels();
             s_calc = Calc::CreateCalc(0);
         }
 
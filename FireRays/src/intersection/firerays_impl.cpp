@@ -86,6 +86,24 @@ namespace FireRays
         return mesh;
     }
 
+    Shape* IntersectionApiImpl::CreateMeshShared(
+        // Position data
+        float const* vertices, int vnum, int vstride,
+        // Index data for vertices
+        int const* indices, int istride,
+        // Numbers of vertices per face
+        int const* numfacevertices,
+        // Number of faces
+        int  numfaces
+        ) const
+    {
+        Mesh* mesh = new Mesh(vertices, vnum, vstride, indices, istride, numfacevertices, numfaces, true);
+
+        mesh->SetId(nextid_++);
+
+        return mesh;
+    }
+
 
     Shape* IntersectionApiImpl::CreateInstance(Shape const* shape) const
     {
@@ -100,6 +118,7 @@ namespace FireRays
 
     void IntersectionApiImpl::DeleteShape(Shape const* shape)
     {
+        world_.OnDeleteShape(shape);
         delete shape;
     }
 
@@ -122,6 +141,14 @@ namespace FireRays
         world_.OnCommit();
     }
 
+    void IntersectionApiImpl::CommitAsync(Event** event)
+    {
+        ThrowIf(world_.shapes_.empty(), "Scene is empty.");
+        m_device->PreprocessAsync(world_, event);
+
+        world_.OnCommit();
+    }
+
     void IntersectionApiImpl::DeleteBuffer(Buffer* buffer) const
     {
         m_device->DeleteBuffer(buffer);
@@ -147,10 +174,61 @@ namespace FireRays
         m_device->QueryOcclusion(rays, numrays, maxrays, hitresults, waitevent, event);
     }
 
+    void IntersectionApiImpl::QueryOcclusionMask(Buffer const* rays, int numrays, Buffer* hitmask, Event const* waitevent, Event** event) const
+    {
+        m_device->QueryOcclusionMask(rays, numrays, hitmask, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusionMask(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitmask, Event const* waitevent, Event** event) const
+    {
+        m_device->QueryOcclusionMask(rays, numrays, maxrays, hitmask, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        m_device->QueryIntersectionCompact(rays, rayflags, numrays, hitinfos, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        m_device->QueryOcclusionCompact(rays, rayflags, numrays, hitresults, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        m_device->QueryIntersectionCompact(rays, rayflags, numrays, maxrays, hitinfos, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        m_device->QueryOcclusionCompact(rays, rayflags, numrays, maxrays, hitresults, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos) const
+    {
+        m_device->QueryIntersection(rays, numrays, hitinfos);
+    }
+
+    void IntersectionApiImpl::QueryOcclusion(ray const* rays, int numrays, int* hitresults) const
+    {
+        m_device->QueryOcclusion(rays, numrays, hitresults);
+    }
+
     void IntersectionApiImpl::DeleteEvent(Event* event) const
     {
         m_device->DeleteEvent(event);
     }
+
+    int IntersectionApiImpl::GetQueueCount() const
+    {
+        return m_device->GetQueueCount();
+    }
+
+    void IntersectionApiImpl::SetQueue(int idx)
+    {
+        ThrowIf(idx < 0 || idx >= m_device->GetQueueCount(), "Queue index is out of bounds.");
+        m_device->SetQueue(idx);
+    }
     
     Buffer* IntersectionApiImpl::CreateBuffer(size_t size, void* initdata) const
     {
@@ -63,6 +63,19 @@ namespace FireRays
             int  numfaces
             ) const override;
 
+        // Same as CreateMesh, but references caller memory instead of copying it.
+        // The memory should outlive the shape.
+        Shape* CreateMeshShared(
+            // Position data
+            float const* vertices, int vnum, int vstride,
+            // Index data for vertices
+            int const* indices, int istride,
+            // Numbers of vertices per face
+            int const* numfacevertices,
+            // Number of faces
+            int  numfaces
+            ) const override;
+
         // Create an instance of a shape with its own transform (set via Shape interface).
         // The call is blocking, so the returned value is ready upon return.
         Shape* CreateInstance(Shape const* shape) const override;
@@ -74,6 +87,8 @@ namespace FireRays
         void DetachShape(Shape const* shape) override;
         // Commit all geometry creations/changes
         void Commit() override;
+        // Commit all geometry creations/changes in the background
+        void CommitAsync(Event** event) override;
 
         /******************************************
         Memory management
@@ -94,6 +109,12 @@ namespace FireRays
         *******************************************/
         void DeleteEvent(Event* event) const override;
 
+        /******************************************
+          Queues
+        *******************************************/
+        int GetQueueCount() const override;
+        void SetQueue(int idx) override;
+
         /******************************************
         Ray casting
         ******************************************/
@@ -116,6 +137,27 @@ namespace FireRays
         // The call is asynchronous. Event pointer mights be nullptrs.
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
 
+        // Find any intersection and write the results as a bit mask.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void QueryOcclusionMask(Buffer const* rays, int numrays, Buffer* hitmask, Event const* waitevent, Event** event) const override;
+        // Find any intersection and write the results as a bit mask, number of rays is in remote memory.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void QueryOcclusionMask(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitmask, Event const* waitevent, Event** event) const override;
+
+        // Queries on compact rays and hits.
+        // The calls are asynchronous. Event pointers might be nullptrs.
+        void QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersectionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusionCompact(Buffer const* rays, Buffer const* rayflags, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+        // Find closest intersection for the rays in host memory.
+        // The call is blocking.
+        void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos) const override;
+        // Find any intersection for the rays in host memory.
+        // The call is blocking.
+        void QueryOcclusion(ray const* rays, int numrays, int* hitresults) const override;
+
         /******************************************
         Utility
         ******************************************/
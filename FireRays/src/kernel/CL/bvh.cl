@@ -36,8 +36,10 @@ DEFINES
 /*************************************************************************
  TYPE DEFINITIONS
  **************************************************************************/
-#define STARTIDX(x)     (((int)(x->pmin.w)))
-#define LEAFNODE(x)     (((x).pmin.w) != -1.f)
+// Leaves keep primitive range bit-packed in pmin.w (see PlainBvhTranslator)
+#define STARTIDX(x)     ((as_int(x->pmin.w)) & 0x7FFFFFF)
+#define NUMPRIMS(x)     (((as_int(x->pmin.w)) >> 27) + 1)
+#define LEAFNODE(x)     (as_int((x).pmin.w) >= 0)
 
 typedef struct 
 {
@@ -49,10 +51,18 @@ typedef struct
     __global Face const*          faces;
     // Shape data
     __global ShapeData const*     shapes;
-    // Extra data
-    __global int const*           extra;
+    // Query format, faces are precomputed triangles if QUERY_PRECOMPUTED_TRIANGLES is set
+    int                           format;
 } SceneData;
 
+// Precomputed triangle in world space, v1.w keeps shape index and v2.w primitive ID (see BvhStrategy)
+typedef struct
+{
+    float4 v1;
+    float4 v2;
+    float4 v3;
+} Triangle;
+
 /*************************************************************************
 HELPER FUNCTIONS
 **************************************************************************/
@@ -70,27 +80,30 @@ bool IntersectLeafClosest(
     Intersection* isect          // Intersection structure
     )
 {
-    float3 v1, v2, v3;
     Face face;
+    bool hit = false;
 
     int start = STARTIDX(node);
-    face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
+    int numprims = NUMPRIMS(node);
 
-	int shapemask = scenedata->shapes[face.shapeidx].mask;
+    for (int i = start; i < start + numprims; ++i)
+    {
+        face = scenedata->faces[i];
 
-	if (Ray_GetMask(r) & shapemask)
-	{
-		if (IntersectTriangle(r, v1, v2, v3, isect))
-		{
-			isect->primid = face.id;
-			isect->shapeid = scenedata->shapes[face.shapeidx].id;
-		}
-	}
-        
-    return false;
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
+
+        if (Ray_GetMask(r) & shapemask)
+        {
+            if (IntersectFace(r, scenedata->vertices, &face, isect))
+            {
+                isect->primid = face.id;
+                isect->shapeid = scenedata->shapes[face.shapeidx].id;
+                hit = true;
+            }
+        }
+    }
+
+    return hit;
 }
 
 //  intersect a ray with leaf BVH node
@@ -100,28 +113,91 @@ bool IntersectLeafAny(
     ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     int start = STARTIDX(node);
-    face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
+    int numprims = NUMPRIMS(node);
 
-	int shapemask = scenedata->shapes[face.shapeidx].mask;
+    for (int i = start; i < start + numprims; ++i)
+    {
+        face = scenedata->faces[i];
 
-	if (Ray_GetMask(r) & shapemask)
-	{
-		if (IntersectTriangleP(r, v1, v2, v3))
-		{
-			return true;
-		}
-	}
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
+
+        if (Ray_GetMask(r) & shapemask)
+        {
+            if (IntersectFaceP(r, scenedata->vertices, &face))
+            {
+                return true;
+            }
+        }
+    }
 
     return false;
 }
 
+//  intersect a ray with leaf BVH node of precomputed triangles
+bool IntersectLeafClosestPrecomputed(
+    SceneData const* scenedata,
+    BvhNode const* node,
+    WatertightRay const* wr,     // ray to instersect
+    int mask,                    // ray mask
+    Intersection* isect          // Intersection structure
+    )
+{
+    __global Triangle const* triangles = (__global Triangle const*)scenedata->faces;
+    bool hit = false;
+
+    int start = STARTIDX(node);
+    int numprims = NUMPRIMS(node);
+
+    for (int i = start; i < start + numprims; ++i)
+    {
+        Triangle tri = triangles[i];
+
+        int shapeidx = as_int(tri.v1.w);
+
+        if (mask & scenedata->shapes[shapeidx].mask)
+        {
+            if (IntersectTriangleWatertight(wr, tri.v1.xyz, tri.v2.xyz, tri.v3.xyz, isect))
+            {
+                isect->primid = as_int(tri.v2.w);
+                isect->shapeid = scenedata->shapes[shapeidx].id;
+                hit = true;
+            }
+        }
+    }
+
+    return hit;
+}
+
+//  intersect a ray with leaf BVH node of precomputed triangles
+bool IntersectLeafAnyPrecomputed(
+    SceneData const* scenedata,
+    BvhNode const* node,
+    WatertightRay const* wr,     // ray to instersect
+    int mask,                    // ray mask
+    float maxt                   // ray range
+    )
+{
+    __global Triangle const* triangles = (__global Triangle const*)scenedata->faces;
+
+    int start = STARTIDX(node);
+    int numprims = NUMPRIMS(node);
+
+    for (int i = start; i < start + numprims; ++i)
+    {
+        Triangle tri = triangles[i];
+
+        if ((mask & scenedata->shapes[as_int(tri.v1.w)].mask) &&
+            IntersectTriangleWatertightP(wr, tri.v1.xyz, tri.v2.xyz, tri.v3.xyz, maxt))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
 
 // intersect Ray against the whole BVH structure
 bool IntersectSceneClosest(SceneData const* scenedata,  ray const* r, Intersection* isect)
@@ -132,6 +208,15 @@ bool IntersectSceneClosest(SceneData const* scenedata,  ray const* r, Intersecti
     isect->shapeid = -1;
     isect->primid = -1;
 
+    // Watertight test of precomputed triangles needs ray shear constants
+    bool precomputed = (scenedata->format & QUERY_PRECOMPUTED_TRIANGLES) != 0;
+    WatertightRay wr;
+
+    if (precomputed)
+    {
+        WatertightRay_Init(&wr, r);
+    }
+
     int idx = 0;
 
     while (idx != -1)
@@ -143,7 +228,15 @@ bool IntersectSceneClosest(SceneData const* scenedata,  ray const* r, Intersecti
         {
             if (LEAFNODE(node))
             {
-                IntersectLeafClosest(scenedata, &node, r, isect);
+                if (precomputed)
+                {
+                    IntersectLeafClosestPrecomputed(scenedata, &node, &wr, Ray_GetMask(r), isect);
+                }
+                else
+                {
+                    IntersectLeafClosest(scenedata, &node, r, isect);
+                }
+
                 idx = (int)(node.pmax.w);
             }
             // Traverse child nodes otherwise.
@@ -169,6 +262,15 @@ bool IntersectSceneAny(SceneData const* scenedata,  ray const* r)
 {
     float3 invdir  = make_float3(1.f, 1.f, 1.f)/r->d.xyz;
 
+    // Watertight test of precomputed triangles needs ray shear constants
+    bool precomputed = (scenedata->format & QUERY_PRECOMPUTED_TRIANGLES) != 0;
+    WatertightRay wr;
+
+    if (precomputed)
+    {
+        WatertightRay_Init(&wr, r);
+    }
+
     int idx = 0;
     while (idx != -1)
     {
@@ -179,7 +281,11 @@ bool IntersectSceneAny(SceneData const* scenedata,  ray const* r)
         {
             if (LEAFNODE(node))
             {
-                if (IntersectLeafAny(scenedata, &node, r))
+                bool hit = precomputed ?
+                    IntersectLeafAnyPrecomputed(scenedata, &node, &wr, Ray_GetMask(r), r->o.w) :
+                    IntersectLeafAny(scenedata, &node, r);
+
+                if (hit)
                 {
                     return true;
                 }
@@ -204,8 +310,9 @@ bool IntersectSceneAny(SceneData const* scenedata,  ray const* r)
 }
 
 
+// Persistent threads version, launched with a fixed number of work groups
 __attribute__((reqd_work_group_size(64, 1, 1)))
-__kernel void IntersectClosestAMD(
+__kernel void IntersectClosestPT(
 // Input
 __global BvhNode const* nodes,   // BVH nodes
 __global float3 const* vertices, // Scene positional data
@@ -215,13 +322,14 @@ __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process
 __global Intersection* hits, // Hit datas
-__global int*          raycnt 
-    )
+int format,                // Layout of rays and hits
+__global int2 const* rayflags, // Masks and activity flags of compact rays
+__global int* raycnt         // Counter of fetched rays, zero at launch
+)
 {
-    __local int nextrayidx;
+    __local int batch;
 
-    int global_id  = get_global_id(0);
-    int local_id  = get_local_id(0);
+    int local_id = get_local_id(0);
 
     // Fill scene data 
     SceneData scenedata =
@@ -230,61 +338,53 @@ __global int*          raycnt
         vertices,
         faces,
         shapes,
-        0
+        format
     };
 
-    if (local_id == 0)
-    {
-        nextrayidx = 0;
-    }
-
-    int ridx = 0;
-    Intersection isect;
+    // Groups fetch batches of rays until all of them are processed
+    int n = numrays;
 
-    while (ridx < numrays)
+    for (int first = FetchRayBatch(raycnt, &batch); first < n; first = FetchRayBatch(raycnt, &batch))
     {
-        if (local_id == 0)
+        int global_id = first + local_id;
+
+        if (global_id < n)
         {
-            nextrayidx = atomic_add(raycnt, 64);
+            // Fetch ray
+            ray r = Ray_Load(rays, rayflags, global_id, format);
+
+			if (Ray_IsActive(&r))
+			{
+				// Calculate closest hit
+				Intersection isect;
+				IntersectSceneClosest(&scenedata, &r, &isect);
+
+				// Write data back in case of a hit
+				Intersection_Store(hits, global_id, &isect, format);
+			}
         }
-
-        ridx = nextrayidx + local_id;
-
-        if (ridx >= numrays)
-            break;
-
-        // Fetch ray
-        ray r = rays[ridx];
-
-		if (Ray_IsActive(&r))
-		{
-			// Calculate closest hit
-			IntersectSceneClosest(&scenedata, &r, &isect);
-
-			// Write data back in case of a hit
-			hits[ridx] = isect;
-		}
     }
 }
 
-
+// Persistent threads version, launched with a fixed number of work groups
 __attribute__((reqd_work_group_size(64, 1, 1)))
-__kernel void IntersectAnyAMD(
-    // Input
-    __global BvhNode const* nodes,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
-    __global Face const* faces,    // Scene indices
-	__global ShapeData const* shapes,     // Shapes
-    __global ray const* rays,        // Ray workload
-    int offset,                // Offset in rays array
-    int numrays,               // Number of rays to process					
-    __global int* hitresults,  // Hit results
-    __global int* raycnt
-    )
+__kernel void IntersectAnyPT(
+// Input
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,    // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+int offset,                // Offset in rays array
+int numrays,               // Number of rays to process					
+__global int* hitresults,  // Hit results
+int format,                // Layout of rays and hits
+__global int2 const* rayflags, // Masks and activity flags of compact rays
+__global int* raycnt         // Counter of fetched rays, zero at launch
+)
 {
-    __local int nextrayidx;
+    __local int batch;
 
-    int global_id = get_global_id(0);
     int local_id = get_local_id(0);
 
     // Fill scene data 
@@ -294,55 +394,48 @@ __kernel void IntersectAnyAMD(
         vertices,
         faces,
         shapes,
-        0
+        format
     };
 
-    if (local_id == 0)
-    {
-        nextrayidx = 0;
-    }
+    // Groups fetch batches of rays until all of them are processed
+    int n = numrays;
 
-    int ridx = 0;
-    while (ridx < numrays)
+    for (int first = FetchRayBatch(raycnt, &batch); first < n; first = FetchRayBatch(raycnt, &batch))
     {
-        if (local_id == 0)
+        int global_id = first + local_id;
+
+        if (global_id < n)
         {
-            nextrayidx = atomic_add(raycnt, 64);
+            // Fetch ray
+            ray r = Ray_Load(rays, rayflags, global_id, format);
+
+			if (Ray_IsActive(&r))
+			{
+				// Calculate any intersection
+				hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+			}
         }
-
-        ridx = nextrayidx + local_id;
-
-        if (ridx >= numrays)
-            break;
-
-        // Fetch ray
-        ray r = rays[ridx];
-
-		if (Ray_IsActive(&r))
-		{
-			// Calculate any intersection
-			hitresults[ridx] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
-		}
     }
 }
 
+// Persistent threads version with range check, launched with a fixed number of work groups
 __attribute__((reqd_work_group_size(64, 1, 1)))
-// Version with range check
-__kernel void IntersectClosestRCAMD(
-    __global BvhNode const* nodes,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
-    __global Face const* faces,      // Scene indices
-	__global ShapeData const* shapes,     // Shapes
-    __global ray const* rays,        // Ray workload
-    int offset,                // Offset in rays array
-    __global int const* numrays,     // Number of rays in the workload
-    __global Intersection* hits, // Hit datas
-    __global int* raycnt
-    )
+__kernel void IntersectClosestRCPT(
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,      // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+int offset,                // Offset in rays array
+__global int const* numrays,     // Number of rays in the workload
+__global Intersection* hits, // Hit datas
+int format,                // Layout of rays and hits
+__global int2 const* rayflags, // Masks and activity flags of compact rays
+__global int* raycnt         // Counter of fetched rays, zero at launch
+)
 {
-    __local int nextrayidx;
+    __local int batch;
 
-    int global_id = get_global_id(0);
     int local_id = get_local_id(0);
 
     // Fill scene data 
@@ -352,60 +445,52 @@ __kernel void IntersectClosestRCAMD(
         vertices,
         faces,
         shapes,
-        0
+        format
     };
 
-    if (local_id == 0)
-    {
-        nextrayidx = 0;
-    }
-
-    int ridx = 0;
-    Intersection isect;
+    // Groups fetch batches of rays until all of them are processed
+    int n = *numrays;
 
-    while (ridx < *numrays)
+    for (int first = FetchRayBatch(raycnt, &batch); first < n; first = FetchRayBatch(raycnt, &batch))
     {
-        if (local_id == 0)
+        int global_id = first + local_id;
+
+        if (global_id < n)
         {
-            nextrayidx = atomic_add(raycnt, 64);
+            // Fetch ray
+            ray r = Ray_Load(rays, rayflags, global_id, format);
+
+			if (Ray_IsActive(&r))
+			{
+				// Calculate closest hit
+				Intersection isect;
+				IntersectSceneClosest(&scenedata, &r, &isect);
+				// Write data back in case of a hit
+				Intersection_Store(hits, global_id, &isect, format);
+			}
         }
-
-        ridx = nextrayidx + local_id;
-
-        if (ridx >= *numrays)
-            break;
-
-        // Fetch ray
-		ray r = rays[ridx];
-
-		if (Ray_IsActive(&r))
-		{
-			// Calculate closest hit
-			IntersectSceneClosest(&scenedata, &r, &isect);
-			// Write data back in case of a hit
-			hits[ridx] = isect;
-		}
     }
 }
 
+// Persistent threads version with range check, launched with a fixed number of work groups
 __attribute__((reqd_work_group_size(64, 1, 1)))
-// Version with range check
-__kernel void IntersectAnyRCAMD(
-    // Input
-    __global BvhNode const* nodes,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
-    __global Face const* faces,    // Scene indices
-	__global ShapeData const* shapes,     // Shapes
-    __global ray const* rays,        // Ray workload
-    int offset,                // Offset in rays array
-    __global int const* numrays,     // Number of rays in the workload
-    __global int* hitresults,   // Hit results
-    __global int* raycnt
-    )
+__kernel void IntersectAnyRCPT(
+// Input
+__global BvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,    // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+int offset,                // Offset in rays array
+__global int const* numrays,     // Number of rays in the workload
+__global int* hitresults,   // Hit results
+int format,                // Layout of rays and hits
+__global int2 const* rayflags, // Masks and activity flags of compact rays
+__global int* raycnt         // Counter of fetched rays, zero at launch
+)
 {
-    __local int nextrayidx;
+    __local int batch;
 
-    int global_id = get_global_id(0);
     int local_id = get_local_id(0);
 
     // Fill scene data 
@@ -415,35 +500,27 @@ __kernel void IntersectAnyRCAMD(
         vertices,
         faces,
         shapes,
-        0
+        format
     };
 
-    if (local_id == 0)
-    {
-        nextrayidx = 0;
-    }
+    // Groups fetch batches of rays until all of them are processed
+    int n = *numrays;
 
-    int ridx = 0;
-    while (ridx < *numrays)
+    for (int first = FetchRayBatch(raycnt, &batch); first < n; first = FetchRayBatch(raycnt, &batch))
     {
-        if (local_id == 0)
+        int global_id = first + local_id;
+
+        if (global_id < n)
         {
-            nextrayidx = atomic_add(raycnt, 64);
+            // Fetch ray
+            ray r = Ray_Load(rays, rayflags, global_id, format);
+
+			if (Ray_IsActive(&r))
+			{
+				// Calculate any intersection
+				hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+			}
         }
-
-        ridx = nextrayidx + local_id;
-
-        if (ridx >= *numrays)
-            break;
-
-        // Fetch ray
-        ray r = rays[ridx];
-
-		if (Ray_IsActive(&r))
-		{
-			// Calculate any intersection
-			hitresults[ridx] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
-		}
     }
 }
 
@@ -458,7 +535,9 @@ __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process
-__global Intersection* hits // Hit datas
+__global Intersection* hits, // Hit datas
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
@@ -471,13 +550,13 @@ __global Intersection* hits // Hit datas
         vertices,
         faces,
         shapes,
-        0
+        format
     };
 
     if (global_id < numrays)
     {
         // Fetch ray
-        ray r = rays[global_id];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -486,7 +565,7 @@ __global Intersection* hits // Hit datas
 			IntersectSceneClosest(&scenedata, &r, &isect);
 
 			// Write data back in case of a hit
-			hits[global_id] = isect;
+			Intersection_Store(hits, global_id, &isect, format);
 		}
     }
 }
@@ -501,7 +580,9 @@ __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process					
-__global int* hitresults  // Hit results
+__global int* hitresults,  // Hit results
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
@@ -514,13 +595,13 @@ __global int* hitresults  // Hit results
         vertices,
         faces,
         shapes,
-        0
+        format
     };
 
     if (global_id < numrays)
     {
         // Fetch ray
-        ray r = rays[global_id];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -540,7 +621,9 @@ __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 __global int const* numrays,     // Number of rays in the workload
-__global Intersection* hits // Hit datas
+__global Intersection* hits, // Hit datas
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
@@ -552,14 +635,14 @@ __global Intersection* hits // Hit datas
         vertices,
         faces,
         shapes,
-        0
+        format
     };
 
     // Handle only working subset
     if (global_id < *numrays)
     {
         // Fetch ray
-        ray r = rays[global_id];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -567,7 +650,7 @@ __global Intersection* hits // Hit datas
 			Intersection isect;
 			IntersectSceneClosest(&scenedata, &r, &isect);
 			// Write data back in case of a hit
-			hits[global_id] = isect;
+			Intersection_Store(hits, global_id, &isect, format);
 		}
     }
 }
@@ -583,7 +666,9 @@ __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 __global int const* numrays,     // Number of rays in the workload
-__global int* hitresults   // Hit results
+__global int* hitresults,   // Hit results
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
@@ -595,14 +680,14 @@ __global int* hitresults   // Hit results
         vertices,
         faces,
         shapes,
-        0
+        format
     };
 
     // Handle only working subset
     if (global_id < *numrays)
     {
         // Fetch ray
-        ray r = rays[global_id];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -42,9 +42,11 @@ TYPE DEFINITIONS
 
 
 
-#define STARTIDX(x)     (((int)(x->pmin.w)))
-#define SHAPEIDX(x)     (((int)(x.pmin.w)))
-#define LEAFNODE(x)     (((x).pmin.w) != -1.f)
+// Leaves keep primitive range bit-packed in pmin.w (see PlainBvhTranslator)
+#define STARTIDX(x)     ((as_int(x->pmin.w)) & 0x7FFFFFF)
+#define NUMPRIMS(x)     (((as_int(x->pmin.w)) >> 27) + 1)
+#define SHAPEIDX(x)     ((as_int(x.pmin.w)) & 0x7FFFFFF)
+#define LEAFNODE(x)     (as_int((x).pmin.w) >= 0)
 
 typedef struct
 {
@@ -56,8 +58,10 @@ typedef struct
     __global Face*          faces;
     // Transforms
     __global ShapeData*     shapedata;
-    // Root BVH idx
-    int rootidx;
+    // Top level BVH root idx per motion segment
+    __global int const*     roots;
+    // Number of motion segments
+    int numsegments;
 } SceneData;
 
 
@@ -72,22 +76,24 @@ bool IntersectLeafClosest(
     Intersection* isect          // Intersection structure
     )
 {
-    float3 v1, v2, v3;
     Face face;
+    bool hit = false;
 
     int start = STARTIDX(node);
-    face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
+    int numprims = NUMPRIMS(node);
 
-    if (IntersectTriangle(r, v1, v2, v3, isect))
+    for (int i = start; i < start + numprims; ++i)
     {
-        isect->primid = face.id;
-        return true;
+        face = scenedata->faces[i];
+
+        if (IntersectFace(r, scenedata->vertices, &face, isect))
+        {
+            isect->primid = face.id;
+            hit = true;
+        }
     }
 
-    return false;
+    return hit;
 }
 
 //  intersect a ray with leaf BVH node
@@ -97,23 +103,55 @@ bool IntersectLeafAny(
     ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     int start = STARTIDX(node);
-    face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
+    int numprims = NUMPRIMS(node);
 
-	if (IntersectTriangleP(r, v1, v2, v3))
-	{
-		return true;
-	}
+    for (int i = start; i < start + numprims; ++i)
+    {
+        face = scenedata->faces[i];
+
+        if (IntersectFaceP(r, scenedata->vertices, &face))
+        {
+            return true;
+        }
+    }
 
     return false;
 }
 
+// Transform the ray to object space of the shape at the given time, the shape is
+// moved by its linear velocity in world space and rotated around its origin
+ray transform_ray_motion(ray r, __global ShapeData const* shape, float time)
+{
+    r.o.xyz -= shape->linearvelocity.xyz * time;
+    r = transform_ray(r, shape->m0, shape->m1, shape->m2, shape->m3);
+
+    // Angular velocity is a unit quaternion of the rotation over the shutter interval,
+    // scale its angle by time (slerp from identity)
+    float4 q = shape->angularvelocity;
+
+    if (q.w < 1.f)
+    {
+        float halfangle = acos(max(q.w, -1.f));
+        float s = sin(halfangle);
+
+        if (s > 1e-6f)
+        {
+            float k = sin(halfangle * time) / s;
+            rotate_ray(&r, make_float4(q.x * k, q.y * k, q.z * k, cos(halfangle * time)));
+        }
+    }
+
+    return r;
+}
+
+// Shutter interval [0, 1] is split into segments, each having its own top level BVH
+int GetMotionSegment(float time, int numsegments)
+{
+    return min((int)(time * numsegments), numsegments - 1);
+}
 
 // intersect Ray against the whole BVH2L structure
 bool IntersectSceneClosest2L(SceneData* scenedata, ray* r, Intersection* isect)
@@ -128,9 +166,11 @@ bool IntersectSceneClosest2L(SceneData* scenedata, ray* r, Intersection* isect)
     float3 invdirtop = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
     // We need to keep original ray around for returns from bottom hierarchy
     ray topray = *r;
+    // Shapes are moving within shutter interval [0, 1]
+    float time = clamp(Ray_GetTime(r), 0.f, 1.f);
 
-    // Fetch top level BVH index
-    int idx = scenedata->rootidx;
+    // Fetch top level BVH index of the ray time segment
+    int idx = scenedata->roots[GetMotionSegment(time, scenedata->numsegments)];
     // -1 indicates we are traversing top level
     int topidx = -1;
     // Current shape id
@@ -174,19 +214,8 @@ bool IntersectSceneClosest2L(SceneData* scenedata, ray* r, Intersection* isect)
 						idx = scenedata->shapedata[shapeidx].bvhidx;
 						shapeid = scenedata->shapedata[shapeidx].id;
 
-						// Fetch BVH transform
-						float4 wmi0 = scenedata->shapedata[shapeidx].m0;
-						float4 wmi1 = scenedata->shapedata[shapeidx].m1;
-						float4 wmi2 = scenedata->shapedata[shapeidx].m2;
-						float4 wmi3 = scenedata->shapedata[shapeidx].m3;
-
-						// Apply linear motion blur (world coordinates)
-						//float4 lmv = scenedata->shapedata[shapeidx].linearvelocity;
-						//float4 amv = scenedata->shapedata[SHAPEDATAIDX(node)].angularvelocity;
-						//r->o.xyz -= (lmv.xyz*r->d.w);
-						// Transfrom the ray
-						*r = transform_ray(*r, wmi0, wmi1, wmi2, wmi3);
-						// rotate_ray(r, amv);
+						// Transform the ray to object space at the ray time
+						*r = transform_ray_motion(*r, &scenedata->shapedata[shapeidx], time);
 						// Recalc invdir
 						invdir = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
 						// And continue traversal of the bottom level BVH
@@ -238,9 +267,11 @@ bool IntersectSceneAny2L(SceneData* scenedata, ray* r)
     float3 invdirtop = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
     // We need to keep original ray around for returns from bottom hierarchy
     ray topray = *r;
+    // Shapes are moving within shutter interval [0, 1]
+    float time = clamp(Ray_GetTime(r), 0.f, 1.f);
 
-    // Fetch top level BVH index
-    int idx = scenedata->rootidx;
+    // Fetch top level BVH index of the ray time segment
+    int idx = scenedata->roots[GetMotionSegment(time, scenedata->numsegments)];
     // -1 indicates we are traversing top level
     int topidx = -1;
     while (idx != -1)
@@ -277,19 +308,8 @@ bool IntersectSceneAny2L(SceneData* scenedata, ray* r)
 						// Fetch bottom level BVH index
 						idx = scenedata->shapedata[shapeidx].bvhidx;
 
-						// Fetch BVH transform
-						float4 wmi0 = scenedata->shapedata[shapeidx].m0;
-						float4 wmi1 = scenedata->shapedata[shapeidx].m1;
-						float4 wmi2 = scenedata->shapedata[shapeidx].m2;
-						float4 wmi3 = scenedata->shapedata[shapeidx].m3;
-
-						// Apply linear motion blur (world coordinates)
-						//float4 lmv = scenedata->shapedata[shapeidx].linearvelocity;
-						//float4 amv = scenedata->shapedata[SHAPEDATAIDX(node)].angularvelocity;
-						//r->o.xyz -= (lmv.xyz*r->d.w);
-						// Transfrom the ray
-						*r = transform_ray(*r, wmi0, wmi1, wmi2, wmi3);
-						//rotate_ray(r, amv);
+						// Transform the ray to object space at the ray time
+						*r = transform_ray_motion(*r, &scenedata->shapedata[shapeidx], time);
 						// Recalc invdir
 						invdir = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
 						// And continue traversal of the bottom level BVH
@@ -342,11 +362,14 @@ __global BvhNode* nodes,   // BVH nodes
 __global float3* vertices, // Scene positional data
 __global Face* faces,    // Scene indices
 __global ShapeData* shapedata, // Transforms
-int rootidx,               // BVH root idx
+__global int const* roots, // Top level BVH root idx per motion segment
+int numsegments,           // Number of motion segments
 __global ray* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process
-__global Intersection* hits // Hit datas
+__global Intersection* hits, // Hit datas
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
 
@@ -359,7 +382,8 @@ __global Intersection* hits // Hit datas
         vertices,
         faces,
         shapedata,
-        rootidx
+        roots,
+        numsegments
     };
 
     // Handle only working subset
@@ -367,7 +391,7 @@ __global Intersection* hits // Hit datas
     {
         // Fetch ray
         int idx = offset + global_id;
-        ray r = rays[idx];
+        ray r = Ray_Load(rays, rayflags, idx, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -376,7 +400,7 @@ __global Intersection* hits // Hit datas
 			IntersectSceneClosest2L(&scenedata, &r, &isect);
 
 			// Write data back in case of a hit
-			hits[idx] = isect;
+			Intersection_Store(hits, idx, &isect, format);
 		}
     }
 }
@@ -388,11 +412,14 @@ __global BvhNode* nodes,   // BVH nodes
 __global float3* vertices, // Scene positional data
 __global Face* faces,    // Scene indices
 __global ShapeData* shapedata, // Transforms
-int rootidx,               // BVH root idx
+__global int const* roots, // Top level BVH root idx per motion segment
+int numsegments,           // Number of motion segments
 __global ray* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process
-__global int* hitresults   // Hit results
+__global int* hitresults,   // Hit results
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
@@ -404,14 +431,15 @@ __global int* hitresults   // Hit results
         vertices,
         faces,
         shapedata,
-        rootidx
+        roots,
+        numsegments
     };
 
     // Handle only working subset
     if (global_id < numrays)
     {
         // Fetch ray
-        ray r = rays[offset + global_id];
+        ray r = Ray_Load(rays, rayflags, offset + global_id, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -429,11 +457,14 @@ __global BvhNode* nodes,   // BVH nodes
 __global float3* vertices, // Scene positional data
 __global Face* faces,    // Scene indices
 __global ShapeData* shapedata, // Transforms
-int rootidx,               // BVH root idx
+__global int const* roots, // Top level BVH root idx per motion segment
+int numsegments,           // Number of motion segments
 __global ray* rays,        // Ray workload
 __global int* numrays,     // Number of rays in the workload
 int offset,                // Offset in rays array
-__global Intersection* hits // Hit datas
+__global Intersection* hits, // Hit datas
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
@@ -445,7 +476,8 @@ __global Intersection* hits // Hit datas
         vertices,
         faces,
         shapedata,
-        rootidx
+        roots,
+        numsegments
     };
 
     // Handle only working subset
@@ -453,7 +485,7 @@ __global Intersection* hits // Hit datas
     {
         // Fetch ray
         int idx = offset + global_id;
-        ray r = rays[idx];
+        ray r = Ray_Load(rays, rayflags, idx, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -461,7 +493,7 @@ __global Intersection* hits // Hit datas
 			Intersection isect;
 			IntersectSceneClosest2L(&scenedata, &r, &isect);
 
-			hits[idx] = isect;
+			Intersection_Store(hits, idx, &isect, format);
 		}
     }
 }
@@ -474,11 +506,14 @@ __global BvhNode* nodes,   // BVH nodes
 __global float3* vertices, // Scene positional data
 __global Face* faces,    // Scene indices
 __global ShapeData* shapedata, // Transforms
-int rootidx,               // BVH root idx
+__global int const* roots, // Top level BVH root idx per motion segment
+int numsegments,           // Number of motion segments
 __global ray* rays,        // Ray workload
 __global int* numrays,     // Number of rays in the workload
 int offset,                // Offset in rays array
-__global int* hitresults   // Hit results
+__global int* hitresults,   // Hit results
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
@@ -490,14 +525,15 @@ __global int* hitresults   // Hit results
         vertices,
         faces,
         shapedata,
-        rootidx
+        roots,
+        numsegments
     };
 
     // Handle only working subset
     if (global_id < *numrays)
     {
         // Fetch ray
-        ray r = rays[offset + global_id];
+        ray r = Ray_Load(rays, rayflags, offset + global_id, format);
 
 		if (Ray_IsActive(&r))
 		{
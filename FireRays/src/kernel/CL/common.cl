@@ -64,13 +64,11 @@ typedef bbox BvhNode;
 
 typedef struct _Face
     {
-        // Vertex indices
-        int idx[3];
+        // Vertex indices, the fourth one is -1 for triangles
+        int idx[4];
 		int shapeidx;
         // Primitive ID
         int id;
-        // Idx count
-        int cnt;
     } Face;
 
 #ifndef APPLE
@@ -235,6 +233,137 @@ int IntersectTriangleP(ray const* r, float3 v1, float3 v2, float3 v3)
     return 1;
 }
 
+// Intersect ray against the face, quad is tested as triangles (v1, v2, v3) and (v3, v4, v1)
+// sharing the fetched vertices, uvwt.z is set to the index of the triangle hit
+int IntersectFace(ray const* r, __global float3 const* vertices, Face const* face, Intersection* isect)
+{
+    const float3 v1 = vertices[face->idx[0]];
+    const float3 v3 = vertices[face->idx[2]];
+
+    int hit = IntersectTriangle(r, v1, vertices[face->idx[1]], v3, isect);
+
+    if (face->idx[3] >= 0 && IntersectTriangle(r, v3, vertices[face->idx[3]], v1, isect))
+    {
+        isect->uvwt.z = 1.f;
+        hit = 1;
+    }
+
+    return hit;
+}
+
+int IntersectFaceP(ray const* r, __global float3 const* vertices, Face const* face)
+{
+    const float3 v1 = vertices[face->idx[0]];
+    const float3 v3 = vertices[face->idx[2]];
+
+    return IntersectTriangleP(r, v1, vertices[face->idx[1]], v3) ||
+        (face->idx[3] >= 0 && IntersectTriangleP(r, v3, vertices[face->idx[3]], v1));
+}
+
+// Ray data of the watertight triangle test (Woop et al. 2013), computed once per ray
+typedef struct
+{
+    // Ray origin
+    float3 o;
+    // Shear constants
+    float3 s;
+    // Axis the ray direction is largest along
+    int kz;
+    // Swap the other two axes to keep the winding
+    int swap;
+} WatertightRay;
+
+// Permute vector axes so the z goes along the dominant ray direction
+float3 WatertightRay_Permute(WatertightRay const* wr, float3 v)
+{
+    float3 p = wr->kz == 0 ? v.yzx : (wr->kz == 1 ? v.zxy : v);
+    return wr->swap ? p.yxz : p;
+}
+
+void WatertightRay_Init(WatertightRay* wr, ray const* r)
+{
+    const float3 a = fabs(r->d.xyz);
+
+    wr->kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    wr->swap = 0;
+
+    float3 d = WatertightRay_Permute(wr, r->d.xyz);
+
+    if (d.z < 0.f)
+    {
+        wr->swap = 1;
+        d = d.yxz;
+    }
+
+    wr->o = r->o.xyz;
+    wr->s = make_float3(d.x / d.z, d.y / d.z, 1.f / d.z);
+}
+
+// Watertight ray-triangle test: hits on the shared edges are never missed by both triangles,
+// returns the distance or -1 if there is no hit within maxt
+float IntersectTriangleWatertightT(WatertightRay const* wr, float3 v1, float3 v2, float3 v3, float maxt, float2* uv)
+{
+    const float3 a = WatertightRay_Permute(wr, v1 - wr->o);
+    const float3 b = WatertightRay_Permute(wr, v2 - wr->o);
+    const float3 c = WatertightRay_Permute(wr, v3 - wr->o);
+
+    // Shear vertices to the ray space
+    const float ax = a.x - wr->s.x * a.z;
+    const float ay = a.y - wr->s.y * a.z;
+    const float bx = b.x - wr->s.x * b.z;
+    const float by = b.y - wr->s.y * b.z;
+    const float cx = c.x - wr->s.x * c.z;
+    const float cy = c.y - wr->s.y * c.z;
+
+    // Scaled barycentrics, all of the same sign inside
+    const float u = cx * by - cy * bx;
+    const float v = ax * cy - ay * cx;
+    const float w = bx * ay - by * ax;
+
+    if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f))
+    {
+        return -1.f;
+    }
+
+    const float det = u + v + w;
+
+    if (det == 0.f)
+    {
+        return -1.f;
+    }
+
+    const float invdet = 1.f / det;
+    const float t = (u * a.z + v * b.z + w * c.z) * wr->s.z * invdet;
+
+    if (t < 0.f || t > maxt)
+    {
+        return -1.f;
+    }
+
+    *uv = make_float2(v * invdet, w * invdet);
+    return t;
+}
+
+int IntersectTriangleWatertight(WatertightRay const* wr, float3 v1, float3 v2, float3 v3, Intersection* isect)
+{
+    float2 uv;
+    const float t = IntersectTriangleWatertightT(wr, v1, v2, v3, isect->uvwt.w, &uv);
+
+    if (t < 0.f)
+    {
+        return 0;
+    }
+
+    isect->uvwt = make_float4(uv.x, uv.y, 0.f, t);
+    return 1;
+}
+
+int IntersectTriangleWatertightP(WatertightRay const* wr, float3 v1, float3 v2, float3 v3, float maxt)
+{
+    float2 uv;
+    return IntersectTriangleWatertightT(wr, v1, v2, v3, maxt, &uv) >= 0.f;
+}
+
 // Intersect ray with the axis-aligned box
 int IntersectBox(ray const* r, float3 invdir, bbox box, float maxt)
 {
@@ -282,4 +411,69 @@ float Ray_GetMaxT(ray const* r)
 float Ray_GetTime(ray const* r)
 {
 	return r->d.w;
+}
+
+// Query format flags, have to match QueryFormatFlags
+#define QUERY_COMPACT_RAYS 0x1
+#define QUERY_RAY_FLAGS 0x2
+#define QUERY_COMPACT_HITS 0x4
+// Set by the strategy, faces buffer keeps precomputed triangles
+#define QUERY_PRECOMPUTED_TRIANGLES 0x8
+// Set in the primitive id of compact hits on the second triangle of a quad, has to match CompactIntersection::kQuadTriangleBit
+#define COMPACT_HIT_QUAD_TRIANGLE 0x40000000
+
+// Fetch the ray from the buffer of the query layout,
+// compact ray is the leading 32 bytes of the ray
+ray Ray_Load(__global ray const* rays, __global int2 const* rayflags, int idx, int format)
+{
+	if (format & QUERY_COMPACT_RAYS)
+	{
+		__global float4 const* compact = (__global float4 const*)rays + 2 * idx;
+
+		ray r;
+		r.o = compact[0];
+		r.d = compact[1];
+		// Without the flags stream ray is active and visible to all the shapes
+		r.extra = (format & QUERY_RAY_FLAGS) ? rayflags[idx] : make_int2(-1, 1);
+		r.padding = make_int2(0, 0);
+		return r;
+	}
+
+	return rays[idx];
+}
+
+// Write the hit into the buffer of the query layout, compact hit
+// keeps t, barycentrics as 16-bit unorms, shape and primitive ids,
+// the index of the quad triangle (uvwt.z) goes into the primitive id
+void Intersection_Store(__global Intersection* hits, int idx, Intersection const* isect, int format)
+{
+	if (format & QUERY_COMPACT_HITS)
+	{
+		uint u = (uint)(clamp(isect->uvwt.x, 0.f, 1.f) * 65535.f + 0.5f);
+		uint v = (uint)(clamp(isect->uvwt.y, 0.f, 1.f) * 65535.f + 0.5f);
+		int primid = (isect->primid >= 0 && isect->uvwt.z > 0.f) ? (isect->primid | COMPACT_HIT_QUAD_TRIANGLE) : isect->primid;
+
+		__global int4* compact = (__global int4*)hits;
+		compact[idx] = (int4)(as_int(isect->uvwt.w), as_int(u | (v << 16)), isect->shapeid, primid);
+		return;
+	}
+
+	hits[idx] = *isect;
+}
+
+// Persistent threads: work group fetches the next batch of rays from the
+// global counter, all the items of the group get the first index of the batch
+int FetchRayBatch(__global int* raycnt, __local int* batch)
+{
+	if (get_local_id(0) == 0)
+	{
+		*batch = atomic_add(raycnt, (int)get_local_size(0));
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+	int first = *batch;
+	// Keep the value until all the items have read it
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return first;
 }
\ No newline at end of file
@@ -64,47 +64,122 @@ typedef struct
     __global float3 const* vertices;
     // Scene indices
     __global Face const* faces;
-    // Shape IDs
-    __global int const* shapeids;
-    // Extra data
+    // Shape data
+    __global ShapeData const* shapes;
+    // Voxel primitive references
     __global int const* indices;
     // Grid desc
     __global GridDesc const* grid;
 } SceneData;
 
+// DDA traversal state
+typedef struct
+{
+    // Current voxel
+    int cell[3];
+    // Voxel step direction
+    int step[3];
+    // Voxel index where the ray leaves the grid
+    int out[3];
+    // Distance to the next voxel boundary
+    float tnext[3];
+    // Distance between voxel boundaries
+    float dt[3];
+    // Distance where the ray leaves the grid
+    float tmax;
+} GridWalker;
+
 /*************************************************************************
 HELPER FUNCTIONS
 **************************************************************************/
 
-float3 PosToVoxel(__global GridDesc const* grid,  float3 p)
+// Set up the walk, returns false if the ray misses the grid
+bool GridWalker_Init(__global GridDesc const* grid, ray const* r, float3 invdir, GridWalker* walker)
 {
-    float3 res;
-    res.x = (int)clamp(floor((p.x - grid->bounds.pmin.x) * grid->voxelsizeinv.x), 0.f, (float)(grid->gridres.x - 1));
-    res.y = (int)clamp(floor((p.y - grid->bounds.pmin.y) * grid->voxelsizeinv.y), 0.f, (float)(grid->gridres.y - 1));
-    res.z = (int)clamp(floor((p.z - grid->bounds.pmin.z) * grid->voxelsizeinv.z), 0.f, (float)(grid->gridres.z - 1));
-    return res;
+    const float3 f = (grid->bounds.pmax.xyz - r->o.xyz) * invdir;
+    const float3 n = (grid->bounds.pmin.xyz - r->o.xyz) * invdir;
+
+    const float3 tmax = max(f, n);
+    const float3 tmin = min(f, n);
+
+    const float t1 = min(min(tmax.x, min(tmax.y, tmax.z)), r->o.w);
+    const float t0 = max(max(tmin.x, max(tmin.y, tmin.z)), 0.f);
+
+    if (t0 > t1)
+        return false;
+
+    float o[3], d[3], id[3], bmin[3], vs[3], vsinv[3];
+    int res[3];
+    vstore3(r->o.xyz, 0, o);
+    vstore3(r->d.xyz, 0, d);
+    vstore3(invdir, 0, id);
+    vstore3(grid->bounds.pmin.xyz, 0, bmin);
+    vstore3(grid->voxelsize, 0, vs);
+    vstore3(grid->voxelsizeinv, 0, vsinv);
+    vstore3(grid->gridres.xyz, 0, res);
+
+    walker->tmax = t1;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        // Entry point in voxel units, distances are kept relative to the ray origin
+        float p = (o[i] + d[i] * t0 - bmin[i]) * vsinv[i];
+        walker->cell[i] = clamp((int)floor(p), 0, res[i] - 1);
+
+        if (d[i] > 0.f)
+        {
+            walker->step[i] = 1;
+            walker->out[i] = res[i];
+            walker->tnext[i] = (bmin[i] + (walker->cell[i] + 1) * vs[i] - o[i]) * id[i];
+            walker->dt[i] = vs[i] * id[i];
+        }
+        else if (d[i] < 0.f)
+        {
+            walker->step[i] = -1;
+            walker->out[i] = -1;
+            walker->tnext[i] = (bmin[i] + walker->cell[i] * vs[i] - o[i]) * id[i];
+            walker->dt[i] = -vs[i] * id[i];
+        }
+        else
+        {
+            // Never crosses voxel boundaries along this axis
+            walker->step[i] = 0;
+            walker->out[i] = -1;
+            walker->tnext[i] = INFINITY;
+            walker->dt[i] = 0.f;
+        }
+    }
+
+    return true;
 }
 
-float3 VoxelToPos(__global GridDesc const* grid, float3 v)
+int GridWalker_GetVoxel(__global GridDesc const* grid, GridWalker const* walker)
 {
-    return make_float3(grid->bounds.pmin.x + v.x * grid->voxelsize.x,
-        grid->bounds.pmin.y + v.y * grid->voxelsize.y,
-        grid->bounds.pmin.z + v.z * grid->voxelsize.z);
+    return (walker->cell[2] * grid->gridres.y + walker->cell[1]) * grid->gridres.x + walker->cell[0];
 }
 
-/*float  VoxelToPos(int x, int axis) const
+// Advance to the next voxel unless the ray ends before maxt,
+// returns false when the walk is over
+bool GridWalker_Advance(GridWalker* walker, float maxt)
 {
-    return bounds_.pmin[axis] + x * voxelsize_[axis];
-}*/
+    int axis = walker->tnext[0] < walker->tnext[1] ?
+        (walker->tnext[0] < walker->tnext[2] ? 0 : 2) :
+        (walker->tnext[1] < walker->tnext[2] ? 1 : 2);
 
-int VoxelPlainIndex(__global GridDesc const* grid, float3 v)
-{
-    return (int)(v.z * grid->gridres.x * grid->gridres.y + v.y * grid->gridres.x + v.x);
-}
+    if (walker->tnext[axis] > min(maxt, walker->tmax))
+        return false;
 
+    walker->cell[axis] += walker->step[axis];
+
+    if (walker->cell[axis] == walker->out[axis])
+        return false;
+
+    walker->tnext[axis] += walker->dt[axis];
+    return true;
+}
 
 /*************************************************************************
-BVH FUNCTIONS
+GRID FUNCTIONS
 **************************************************************************/
 //  intersect a ray with grid voxel
 bool IntersectVoxelClosest(
@@ -114,7 +189,6 @@ bool IntersectVoxelClosest(
     Intersection* isect          // Intersection structure
     )
 {
-    float3 v1, v2, v3;
     Face face;
     bool hit = false;
 
@@ -122,65 +196,44 @@ bool IntersectVoxelClosest(
     {
         face = scenedata->faces[scenedata->indices[i]];
 
-        v1 = scenedata->vertices[face.idx[0]];
-        v2 = scenedata->vertices[face.idx[1]];
-        v3 = scenedata->vertices[face.idx[2]];
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
 
-        if (IntersectTriangle(r, v1, v2, v3, isect))
-        {
-            isect->primid = face.id;
-            isect->shapeid = scenedata->shapeids[scenedata->indices[i]];
-            isect->uvwt.z = 0;
-            hit = true;
-        }
-        else if (face.cnt == 4)
+        if (Ray_GetMask(r) & shapemask)
         {
-            v2 = scenedata->vertices[face.idx[3]];
-            if (IntersectTriangle(r, v3, v2, v1, isect))
+            if (IntersectFace(r, scenedata->vertices, &face, isect))
             {
                 isect->primid = face.id;
-                isect->shapeid = scenedata->shapeids[scenedata->indices[i]];
-                isect->uvwt.z = 1;
+                isect->shapeid = scenedata->shapes[face.shapeidx].id;
                 hit = true;
             }
         }
-
     }
 
     return hit;
 }
 
-//  intersect a ray with leaf BVH node
+//  intersect a ray with grid voxel
 bool IntersectVoxelAny(
     SceneData const* scenedata,
     Voxel const* voxel,
     ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     for (int i = voxel->startidx; i < voxel->startidx + voxel->numprims; ++i)
     {
         face = scenedata->faces[scenedata->indices[i]];
 
-        v1 = scenedata->vertices[face.idx[0]];
-        v2 = scenedata->vertices[face.idx[1]];
-        v3 = scenedata->vertices[face.idx[2]];
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
 
-        if (IntersectTriangleP(r, v1, v2, v3))
-        {
-            return true;
-        }
-        else if (face.cnt == 4)
+        if (Ray_GetMask(r) & shapemask)
         {
-            v2 = scenedata->vertices[face.idx[3]];
-            if (IntersectTriangleP(r, v3, v2, v1))
+            if (IntersectFaceP(r, scenedata->vertices, &face))
             {
                 return true;
             }
         }
-
     }
 
     return false;
@@ -190,109 +243,28 @@ bool IntersectVoxelAny(
 bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersection* isect)
 {
     const float3 invdir = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
+
     isect->uvwt = make_float4(0.f, 0.f, 0.f, r->o.w);
     isect->shapeid = -1;
     isect->primid = -1;
 
-    // Check the ray vs scene bounds
-    float t = IntersectBoxF(r, invdir, scenedata->grid->bounds, r->o.w);
-
-    // If no bail out
-    if (t < 0.f)
-    {
-        //printf("Bailing out at initial bbox test % d\n", get_global_id(0));
+    GridWalker walker;
+    if (!GridWalker_Init(scenedata->grid, r, invdir, &walker))
         return false;
-    }
-
-    // Find starting point
-    float3 isectpoint = r->o.xyz + r->d.xyz * t;
-    float3 gridres = make_float3(scenedata->grid->gridres.x, scenedata->grid->gridres.y, scenedata->grid->gridres.z);
-
-    // Perpare the stepping data
-    float3 nexthit;
-    float3 dt;
-    float3 out;
-
-    //for (int axis = 0; axis < 3; ++axis)
-    //{
-    // Voxel position
-    float3 voxelidx = PosToVoxel(scenedata->grid, isectpoint);
-
-    //assert(voxel[0] < gridres_[0] && voxel[1] < gridres_[1] && voxel[2] < gridres_[2]);
-
-    float3 step = r->d.xyz >= 0.f ? 1.f : -1.f;
-    float3 step01 = (step + 1.f) / 2.f;
-
-    // Next hit along this axis in parametric units
-    nexthit = t + (VoxelToPos(scenedata->grid, voxelidx + step01) - isectpoint) * invdir;
 
-    // Delta T
-    dt = scenedata->grid->voxelsize * invdir * step;
-    dt = isinf(dt) ? 0.f : dt;
-    //printf("Dt %f %f %f\n", dt.x, dt.y, dt.z);
-
-    // Last voxel
-    out = step > 0.f ? gridres : -1.f;
-
-    bool hit = false;
-    while ((int)voxelidx.x != (int)out.x && 
-        (int)voxelidx.y != (int)out.y && 
-        (int)voxelidx.z != (int)out.z)
+    do
     {
-        // 
-        //printf("Testing voxel %d %d %d -----> ", (int)voxelidx.x, (int)voxelidx.y, (int)voxelidx.z);
+        Voxel voxel = scenedata->voxels[GridWalker_GetVoxel(scenedata->grid, &walker)];
 
-        // Check current voxel
-        int idx = VoxelPlainIndex(scenedata->grid, voxelidx);
-
-        Voxel voxel = scenedata->voxels[idx];
-
-        if (voxel.startidx != -1)
+        if (voxel.numprims > 0)
         {
-            hit = IntersectVoxelClosest(scenedata, &voxel, r, isect);
-            //printf(" %d\n", hit);
+            IntersectVoxelClosest(scenedata, &voxel, r, isect);
         }
-
-        // Advance to next one
-        int bits = (((nexthit.x < nexthit.y) ? 1 : 0) << 2) +
-            (((nexthit.x < nexthit.z) ? 1 : 0) << 1) +
-            (((nexthit.y < nexthit.z) ? 1 : 0));
-
-        const float3 cmptoaxis[8] = { 
-            { 0.f, 0.f, 1.f },
-            { 0.f, 1.f, 0.f },
-            { 0.f, 0.f, 1.f },
-            { 0.f, 1.f, 0.f },
-            { 0.f, 0.f, 1.f },
-            { 0.f, 0.f, 1.f },
-            { 1.f, 0.f, 0.f },
-            { 1.f, 0.f, 0.f }
-        };
-
-        // Choose axis
-        float3 stepaxis = cmptoaxis[bits];
-        float3 nexthittest = isinf(nexthit) ? 0.f : nexthit;
-
-       // printf("Next hit %f %f %f\n", nexthit.x, nexthit.y, nexthit.z);
-        //printf("Step axis %f %f %f\n", stepaxis.x, stepaxis.y, stepaxis.z);
-
-
-
-        // Early out
-        if (isect->uvwt.w < dot(nexthittest, stepaxis))
-        {
-            //printf("Bailing out at early out step % d\n", get_global_id(0));
-            break;
-        }
-
-        // Advance current position
-        voxelidx += step * stepaxis;
-
-        // Advance next hit
-        nexthit += dt * stepaxis;
     }
+    // Stop as soon as the closest hit is inside the voxels visited so far
+    while (GridWalker_Advance(&walker, isect->uvwt.w));
 
-    return hit;
+    return isect->shapeid >= 0;
 }
 
 // intersect Ray against the whole grid structure
@@ -300,97 +272,24 @@ bool IntersectSceneAny(SceneData const* scenedata, ray const* r)
 {
     const float3 invdir = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
 
-    // Check the ray vs scene bounds
-    float t = IntersectBoxF(r, invdir, scenedata->grid->bounds, r->o.w);
-
-    // If no bail out
-    if (t < 0.f)
-    {
-        //printf("Bailing out at initial bbox test % d\n", get_global_id(0));
+    GridWalker walker;
+    if (!GridWalker_Init(scenedata->grid, r, invdir, &walker))
         return false;
-    }
-
-    // Find starting point
-    float3 isectpoint = r->o.xyz + r->d.xyz * t;
-    float3 gridres = make_float3(scenedata->grid->gridres.x, scenedata->grid->gridres.y, scenedata->grid->gridres.z);
-
-    // Perpare the stepping data
-    float3 nexthit;
-    float3 dt;
-    float3 out;
-
-    //for (int axis = 0; axis < 3; ++axis)
-    //{
-    // Voxel position
-    float3 voxelidx = PosToVoxel(scenedata->grid, isectpoint);
 
-    //assert(voxel[0] < gridres_[0] && voxel[1] < gridres_[1] && voxel[2] < gridres_[2]);
-
-    float3 step = r->d.xyz >= 0.f ? 1.f : -1.f;
-    float3 step01 = (step + 1.f) / 2.f;
-
-    // Next hit along this axis in parametric units
-    nexthit = t + (VoxelToPos(scenedata->grid, voxelidx + step01) - isectpoint) * invdir;
-
-    // Delta T
-    dt = scenedata->grid->voxelsize * invdir * step;
-    dt = isinf(dt) ? 0.f : dt;
-    //printf("Dt %f %f %f\n", dt.x, dt.y, dt.z);
-
-    // Last voxel
-    out = step > 0.f ? gridres : -1.f;
-
-    while ((int)voxelidx.x != (int)out.x &&
-        (int)voxelidx.y != (int)out.y &&
-        (int)voxelidx.z != (int)out.z)
+    do
     {
-        // 
-        //printf("Testing voxel %d %d %d -----> ", (int)voxelidx.x, (int)voxelidx.y, (int)voxelidx.z);
-
-        // Check current voxel
-        int idx = VoxelPlainIndex(scenedata->grid, voxelidx);
+        Voxel voxel = scenedata->voxels[GridWalker_GetVoxel(scenedata->grid, &walker)];
 
-        Voxel voxel = scenedata->voxels[idx];
-
-        if (voxel.startidx != -1)
+        if (voxel.numprims > 0 && IntersectVoxelAny(scenedata, &voxel, r))
         {
-            if (IntersectVoxelAny(scenedata, &voxel, r))
-                return true;
+            return true;
         }
-
-        // Advance to next one
-        int bits = (((nexthit.x < nexthit.y) ? 1 : 0) << 2) +
-            (((nexthit.x < nexthit.z) ? 1 : 0) << 1) +
-            (((nexthit.y < nexthit.z) ? 1 : 0));
-
-        const float3 cmptoaxis[8] = {
-            { 0.f, 0.f, 1.f },
-            { 0.f, 1.f, 0.f },
-            { 0.f, 0.f, 1.f },
-            { 0.f, 1.f, 0.f },
-            { 0.f, 0.f, 1.f },
-            { 0.f, 0.f, 1.f },
-            { 1.f, 0.f, 0.f },
-            { 1.f, 0.f, 0.f }
-        };
-
-        // Choose axis
-        float3 stepaxis = cmptoaxis[bits];
-
-        // printf("Next hit %f %f %f\n", nexthit.x, nexthit.y, nexthit.z);
-        //printf("Step axis %f %f %f\n", stepaxis.x, stepaxis.y, stepaxis.z);
-
-        // Advance current position
-        voxelidx += step * stepaxis;
-
-        // Advance next hit
-        nexthit += dt * stepaxis;
     }
+    while (GridWalker_Advance(&walker, r->o.w));
 
     return false;
 }
 
-
 __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectClosest(
 // Input
@@ -398,16 +297,17 @@ __global Voxel const* voxels,   // Grid voxels
 __global GridDesc const* griddesc, // Grid description
 __global float3 const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
-__global int const* shapeids,    // Shape IDs
+__global ShapeData const* shapes,     // Shapes
 __global int const* indices,    // Grid indices
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process
-__global Intersection* hits // Hit datas
+__global Intersection* hits, // Hit datas
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
-    int local_id = get_local_id(0);
 
     // Fill scene data 
     SceneData scenedata =
@@ -415,26 +315,28 @@ __global Intersection* hits // Hit datas
         voxels,
         vertices,
         faces,
-        shapeids,
+        shapes,
         indices,
         griddesc
     };
 
-    Intersection isect;
     if (global_id < numrays)
     {
         // Fetch ray
-        ray r = rays[global_id + offset];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
-        // Calculate closest hit
-        IntersectSceneClosest(&scenedata, &r, &isect);
+        if (Ray_IsActive(&r))
+        {
+            // Calculate closest hit
+            Intersection isect;
+            IntersectSceneClosest(&scenedata, &r, &isect);
 
-        // Write data back in case of a hit
-        hits[global_id + offset] = isect;
+            // Write data back in case of a hit
+            Intersection_Store(hits, global_id, &isect, format);
+        }
     }
 }
 
-
 __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAny(
 // Input
@@ -442,16 +344,17 @@ __global Voxel const* voxels,   // Grid voxels
 __global GridDesc const* griddesc, // Grid description
 __global float3 const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
-__global int const* shapeids,    // Shape IDs
+__global ShapeData const* shapes,     // Shapes
 __global int const* indices,    // Grid indices
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process
-__global int* hitresults  // Hit results
+__global int* hitresults,  // Hit results
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
-    int local_id = get_local_id(0);
 
     // Fill scene data 
     SceneData scenedata =
@@ -459,7 +362,7 @@ __global int* hitresults  // Hit results
         voxels,
         vertices,
         faces,
-        shapeids,
+        shapes,
         indices,
         griddesc
     };
@@ -467,27 +370,31 @@ __global int* hitresults  // Hit results
     if (global_id < numrays)
     {
         // Fetch ray
-        ray r = rays[global_id];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
-        // Calculate any intersection
-        hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+        if (Ray_IsActive(&r))
+        {
+            // Calculate any intersection
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+        }
     }
 }
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
 // Version with range check
 __kernel void IntersectClosestRC(
-// Input
 __global Voxel const* voxels,   // Grid voxels
 __global GridDesc const* griddesc, // Grid description
 __global float3 const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
-__global int const* shapeids,    // Shape IDs
+__global ShapeData const* shapes,     // Shapes
 __global int const* indices,    // Grid indices
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
-__global int const* numrays,  // Number of rays to process
-__global Intersection* hits // Hit datas
+__global int const* numrays,     // Number of rays in the workload
+__global Intersection* hits, // Hit datas
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
@@ -498,7 +405,7 @@ __global Intersection* hits // Hit datas
         voxels,
         vertices,
         faces,
-        shapeids,
+        shapes,
         indices,
         griddesc
     };
@@ -507,14 +414,17 @@ __global Intersection* hits // Hit datas
     if (global_id < *numrays)
     {
         // Fetch ray
-        ray r = rays[global_id];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
-        // Calculate closest hit
-        Intersection isect;
-        IntersectSceneClosest(&scenedata, &r, &isect);
+        if (Ray_IsActive(&r))
+        {
+            // Calculate closest hit
+            Intersection isect;
+            IntersectSceneClosest(&scenedata, &r, &isect);
 
-        // Write data back in case of a hit
-        hits[global_id] = isect;
+            // Write data back in case of a hit
+            Intersection_Store(hits, global_id, &isect, format);
+        }
     }
 }
 
@@ -526,12 +436,14 @@ __global Voxel const* voxels,   // Grid voxels
 __global GridDesc const* griddesc, // Grid description
 __global float3 const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
-__global int const* shapeids,    // Shape IDs
+__global ShapeData const* shapes,     // Shapes
 __global int const* indices,    // Grid indices
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
-__global int const* numrays,  // Number of rays to process
-__global int* hitresults // Hit datas
+__global int const* numrays,     // Number of rays in the workload
+__global int* hitresults,   // Hit results
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
 )
 {
     int global_id = get_global_id(0);
@@ -542,7 +454,7 @@ __global int* hitresults // Hit datas
         voxels,
         vertices,
         faces,
-        shapeids,
+        shapes,
         indices,
         griddesc
     };
@@ -551,9 +463,12 @@ __global int* hitresults // Hit datas
     if (global_id < *numrays)
     {
         // Fetch ray
-        ray r = rays[global_id];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
-        // Calculate any intersection
-        hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+        if (Ray_IsActive(&r))
+        {
+            // Calculate any intersection
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+        }
     }
-}
\ No newline at end of file
+}
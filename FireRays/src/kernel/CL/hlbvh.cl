@@ -80,19 +80,15 @@ bool IntersectLeafClosest(
 	Intersection* isect          // Intersection structure
 	)
 {
-	float3 v1, v2, v3;
 	Face face;
 
 	face = scenedata->faces[faceidx];
-	v1 = scenedata->vertices[face.idx[0]];
-	v2 = scenedata->vertices[face.idx[1]];
-	v3 = scenedata->vertices[face.idx[2]];
 
 	int shapemask = scenedata->shapes[face.shapeidx].mask;
 
 	if (Ray_GetMask(r) & shapemask)
 	{
-		if (IntersectTriangle(r, v1, v2, v3, isect))
+		if (IntersectFace(r, scenedata->vertices, &face, isect))
 		{
 			isect->primid = face.id;
 			isect->shapeid = scenedata->shapes[face.shapeidx].id;
@@ -110,19 +106,15 @@ bool IntersectLeafAny(
 	ray const* r                      // ray to instersect
 	)
 {
-	float3 v1, v2, v3;
 	Face face;
 
 	face = scenedata->faces[faceidx];
-	v1 = scenedata->vertices[face.idx[0]];
-	v2 = scenedata->vertices[face.idx[1]];
-	v3 = scenedata->vertices[face.idx[2]];
 
 	int shapemask = scenedata->shapes[face.shapeidx].mask;
 
 	if (Ray_GetMask(r) & shapemask)
 	{
-		if (IntersectTriangleP(r, v1, v2, v3))
+		if (IntersectFaceP(r, scenedata->vertices, &face))
 		{
 			return true;
 		}
@@ -537,6 +529,8 @@ __kernel void IntersectClosest(
 	int numrays,               // Number of rays to process
 	__global Intersection* hits // Hit datas
 	, __global int* stack
+	, int format
+	, __global int2 const* rayflags
 	)
 {
 #ifndef LDS_BUG
@@ -561,7 +555,7 @@ __kernel void IntersectClosest(
 	if (global_id < numrays)
 	{
 		// Fetch ray
-		ray r = rays[global_id];
+		ray r = Ray_Load(rays, rayflags, global_id, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -573,7 +567,7 @@ __kernel void IntersectClosest(
 			IntersectSceneClosest(&scenedata, &r, &isect);
 #endif
 			// Write data back in case of a hit
-			hits[global_id] = isect;
+			Intersection_Store(hits, global_id, &isect, format);
 		}
 	}
 }
@@ -592,6 +586,8 @@ __kernel void IntersectAny(
 	int numrays,               // Number of rays to process					
 	__global int* hitresults  // Hit results
 	, __global int* stack
+	, int format
+	, __global int2 const* rayflags
 	)
 {
 
@@ -617,7 +613,7 @@ __kernel void IntersectAny(
 	if (global_id < numrays)
 	{
 		// Fetch ray
-		ray r = rays[global_id];
+		ray r = Ray_Load(rays, rayflags, global_id, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -645,6 +641,8 @@ __kernel void IntersectClosestRC(
 	__global int const* numrays,     // Number of rays in the workload
 	__global Intersection* hits // Hit datas
 	, __global int* stack
+	, int format
+	, __global int2 const* rayflags
 	)
 {
 #ifndef LDS_BUG
@@ -670,7 +668,7 @@ __kernel void IntersectClosestRC(
 	if (global_id < *numrays)
 	{
 		// Fetch ray
-		ray r = rays[global_id];
+		ray r = Ray_Load(rays, rayflags, global_id, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -683,7 +681,7 @@ __kernel void IntersectClosestRC(
 #endif
 
 			// Write data back in case of a hit
-			hits[global_id] = isect;
+			Intersection_Store(hits, global_id, &isect, format);
 		}
 	}
 }
@@ -702,6 +700,8 @@ __kernel void IntersectAnyRC(
 	__global int const* numrays,     // Number of rays in the workload
 	__global int* hitresults   // Hit results
 	, __global int* stack
+	, int format
+	, __global int2 const* rayflags
 	)
 {
 #ifndef LDS_BUG
@@ -726,7 +726,7 @@ __kernel void IntersectAnyRC(
 	if (global_id < *numrays)
 	{
 		// Fetch ray
-		ray r = rays[global_id];
+		ray r = Ray_Load(rays, rayflags, global_id, format);
 
 		if (Ray_IsActive(&r))
 		{
@@ -738,4 +738,268 @@ __kernel void IntersectAnyRC(
 #endif
 		}
 	}
-}
\ No newline at end of file
+}
+
+// Persistent threads version, launched with a fixed number of work groups
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectClosestPT(
+	// Input
+	__global HlbvhNode const* nodes,   // BVH nodes
+	__global bbox const* bounds,   // BVH nodes
+	__global float3 const* vertices, // Scene positional data
+	__global Face const* faces,    // Scene indices
+	__global ShapeData const* shapes, // Shape data
+	__global ray const* rays,        // Ray workload
+	int offset,                // Offset in rays array
+	int numrays,               // Number of rays to process
+	__global Intersection* hits // Hit datas
+	, __global int* stack
+	, int format
+	, __global int2 const* rayflags
+	, __global int* raycnt // Counter of fetched rays, zero at launch
+	)
+{
+#ifndef LDS_BUG
+	__local int ldsstack[SHORT_STACK_SIZE * 64];
+#endif
+
+	__local int batch;
+
+	int local_id = get_local_id(0);
+	int group_id = get_group_id(0);
+
+	// Fill scene data
+	SceneData scenedata =
+	{
+		nodes,
+		bounds,
+		vertices,
+		faces,
+		shapes,
+		0
+	};
+
+	// Groups fetch batches of rays until all of them are processed
+	int n = numrays;
+
+	for (int first = FetchRayBatch(raycnt, &batch); first < n; first = FetchRayBatch(raycnt, &batch))
+	{
+		int global_id = first + local_id;
+
+		if (global_id < n)
+		{
+			// Fetch ray
+			ray r = Ray_Load(rays, rayflags, global_id, format);
+
+			if (Ray_IsActive(&r))
+			{
+				// Calculate closest hit
+				Intersection isect;
+#ifndef LDS_BUG
+				IntersectSceneClosest(&scenedata, &r, &isect, stack + group_id * 64 * 32 + local_id * 32, ldsstack + local_id);
+#else
+				IntersectSceneClosest(&scenedata, &r, &isect);
+#endif
+				// Write data back in case of a hit
+				Intersection_Store(hits, global_id, &isect, format);
+			}
+		}
+	}
+}
+
+// Persistent threads version, launched with a fixed number of work groups
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectAnyPT(
+	// Input
+	// Input
+	__global HlbvhNode const* nodes,   // BVH nodes
+	__global bbox const* bounds,   // BVH nodes
+	__global float3 const* vertices, // Scene positional data
+	__global Face const* faces,    // Scene indices
+	__global ShapeData const* shapes,     // Shape data
+	__global ray const* rays,        // Ray workload
+	int offset,                // Offset in rays array
+	int numrays,               // Number of rays to process					
+	__global int* hitresults  // Hit results
+	, __global int* stack
+	, int format
+	, __global int2 const* rayflags
+	, __global int* raycnt // Counter of fetched rays, zero at launch
+	)
+{
+
+#ifndef LDS_BUG
+	__local int ldsstack[SHORT_STACK_SIZE * 64];
+#endif
+
+	__local int batch;
+
+	int local_id = get_local_id(0);
+	int group_id = get_group_id(0);
+
+	// Fill scene data 
+	SceneData scenedata =
+	{
+		nodes,
+		bounds,
+		vertices,
+		faces,
+		shapes,
+		0
+	};
+
+	// Groups fetch batches of rays until all of them are processed
+	int n = numrays;
+
+	for (int first = FetchRayBatch(raycnt, &batch); first < n; first = FetchRayBatch(raycnt, &batch))
+	{
+		int global_id = first + local_id;
+
+		if (global_id < n)
+		{
+			// Fetch ray
+			ray r = Ray_Load(rays, rayflags, global_id, format);
+
+			if (Ray_IsActive(&r))
+			{
+				// Calculate any intersection
+#ifndef LDS_BUG
+				hitresults[global_id] = IntersectSceneAny(&scenedata, &r, stack + group_id * 64 * 32 + local_id * 32, ldsstack + local_id) ? 1 : -1;
+#else
+				hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+#endif
+			}
+		}
+	}
+}
+
+// Persistent threads version with range check, launched with a fixed number of work groups
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectClosestRCPT(
+	// Input
+	__global HlbvhNode const* nodes,   // BVH nodes
+	__global bbox const* bounds,   // BVH nodes
+	__global float3 const* vertices, // Scene positional data
+	__global Face const* faces,      // Scene indices
+	__global ShapeData const* shapes,     // Shape data
+	__global ray const* rays,        // Ray workload
+	int offset,                // Offset in rays array
+	__global int const* numrays,     // Number of rays in the workload
+	__global Intersection* hits // Hit datas
+	, __global int* stack
+	, int format
+	, __global int2 const* rayflags
+	, __global int* raycnt // Counter of fetched rays, zero at launch
+	)
+{
+#ifndef LDS_BUG
+	__local int ldsstack[SHORT_STACK_SIZE * 64];
+#endif
+
+	__local int batch;
+
+	int local_id = get_local_id(0);
+	int group_id = get_group_id(0);
+
+	// Fill scene data 
+	SceneData scenedata =
+	{
+		nodes,
+		bounds,
+		vertices,
+		faces,
+		shapes,
+		0
+	};
+
+	// Groups fetch batches of rays until all of them are processed
+	int n = *numrays;
+
+	for (int first = FetchRayBatch(raycnt, &batch); first < n; first = FetchRayBatch(raycnt, &batch))
+	{
+		int global_id = first + local_id;
+
+		if (global_id < n)
+		{
+			// Fetch ray
+			ray r = Ray_Load(rays, rayflags, global_id, format);
+
+			if (Ray_IsActive(&r))
+			{
+				// Calculate closest hit
+				Intersection isect;
+#ifndef LDS_BUG
+				IntersectSceneClosest(&scenedata, &r, &isect, stack + group_id * 64 * 32 + local_id * 32, ldsstack + local_id);
+#else
+				IntersectSceneClosest(&scenedata, &r, &isect);
+#endif
+
+				// Write data back in case of a hit
+				Intersection_Store(hits, global_id, &isect, format);
+			}
+		}
+	}
+}
+
+// Persistent threads version with range check, launched with a fixed number of work groups
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void IntersectAnyRCPT(
+	// Input
+	__global HlbvhNode const* nodes,   // BVH nodes
+	__global bbox const* bounds,   // BVH nodes
+	__global float3 const* vertices, // Scene positional data
+	__global Face const* faces,    // Scene indices
+	__global ShapeData const* shapes,     // Shape data
+	__global ray const* rays,        // Ray workload
+	int offset,                // Offset in rays array
+	__global int const* numrays,     // Number of rays in the workload
+	__global int* hitresults   // Hit results
+	, __global int* stack
+	, int format
+	, __global int2 const* rayflags
+	, __global int* raycnt // Counter of fetched rays, zero at launch
+	)
+{
+#ifndef LDS_BUG
+	__local int ldsstack[SHORT_STACK_SIZE * 64];
+#endif
+	__local int batch;
+
+	int local_id = get_local_id(0);
+	int group_id = get_group_id(0);
+
+	// Fill scene data 
+	SceneData scenedata =
+	{
+		nodes,
+		bounds,
+		vertices,
+		faces,
+		shapes,
+		0
+	};
+
+	// Groups fetch batches of rays until all of them are processed
+	int n = *numrays;
+
+	for (int first = FetchRayBatch(raycnt, &batch); first < n; first = FetchRayBatch(raycnt, &batch))
+	{
+		int global_id = first + local_id;
+
+		if (global_id < n)
+		{
+			// Fetch ray
+			ray r = Ray_Load(rays, rayflags, global_id, format);
+
+			if (Ray_IsActive(&r))
+			{
+				// Calculate any intersection
+#ifndef LDS_BUG
+				hitresults[global_id] = IntersectSceneAny(&scenedata, &r, stack + group_id * 64 * 32 + local_id * 32, ldsstack + local_id) ? 1 : -1;
+#else
+				hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+#endif
+			}
+		}
+	}
+}
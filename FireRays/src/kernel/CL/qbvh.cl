@@ -20,605 +20,426 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 
+/*************************************************************************
+ INCLUDES
+ **************************************************************************/
+#include <../FireRays/src/kernel/CL/common.cl>
 /*************************************************************************
 EXTENSIONS
 **************************************************************************/
 
-
 /*************************************************************************
 DEFINES
 **************************************************************************/
 #define PI 3.14159265358979323846f
 
-#define LEAFNODE(x)     (((x).typecnt & 0xF) == 0)
-#define NUMPRIMS(x)     (((x).typecnt) >> 4)
-
+// Traversal stack size, QbvhStrategy checks the tree fits into it
+#define QBVH_STACK_SIZE 64
 
 /*************************************************************************
-TYPE DEFINITIONS
-**************************************************************************/
-typedef struct _bbox
-{
-    float3 pmin;
-    float3 pmax;
-} bbox;
-
-typedef struct _ray
-{
-    float3 o;
-    float3 d;
-    float2 range;
-    float  time;
-    float  padding;
-} ray;
-
-typedef struct _Intersection
-{
-    float2 uv;
-    int instanceid;
-    int shapeid;
-    int primid;
-    int extra;
-} Intersection;
-
-
-typedef struct _BvhNode
+ TYPE DEFINITIONS
+ **************************************************************************/
+// 4-wide node (see QbvhTranslator), child bounds are kept in SoA layout
+// count == 0: internal child, child is node index
+// count > 0: leaf child, child is the first primitive index
+// count == -1: unused slot
+typedef struct
 {
-    bbox bounds;
-    // 4-bit mask + prim count
-    uint typecnt;
-
-    union
-    {
-        // Start primitive index in case of a leaf node
-        uint start;
-        // Children indices
-        uint c[3];
-    };
-
-    // Next node during traversal
-    uint next;
-    uint padding;
-    uint padding1;
-    uint padding2;
-} BvhNode;
-
-typedef struct _Face
-{
-    // Vertex indices
-    int idx[4];
-    // Primitive ID
-    int id;
-    // Idx count
-    int cnt;
-} Face;
-
-#define NUMPRIMS(x)     (((x).typecnt) >> 1)
-#define BVHROOTIDX(x)   (((x).start))
-#define TRANSFROMIDX(x) (((x).typecnt) >> 1)
-#define LEAFNODE(x)     (((x).typecnt & 0x1) == 0)
+    float4 bminx;
+    float4 bmaxx;
+    float4 bminy;
+    float4 bmaxy;
+    float4 bminz;
+    float4 bmaxz;
+    int4 child;
+    int4 count;
+} QbvhNode;
 
 typedef struct 
 {
     // BVH structure
-    __global BvhNode*       nodes;
+    __global QbvhNode const*      nodes;
     // Scene positional data
-    __global float3*        vertices;
+    __global float3 const*        vertices;
     // Scene indices
-    __global Face*          faces;
-    // Shape IDs
-    __global int*           shapeids;
-
+    __global Face const*          faces;
+    // Shape data
+    __global ShapeData const*     shapes;
+    // Extra data
+    __global int const*           extra;
 } SceneData;
 
-
 /*************************************************************************
 HELPER FUNCTIONS
 **************************************************************************/
-
-#ifndef APPLE
-
-float4 make_float4(float x, float y, float z, float w)
+// Intersect ray with 4 child boxes, returns per child entry distance or -1 on miss
+float4 IntersectBox4(ray const* r, float3 invdir, __global QbvhNode const* node, float maxt)
 {
-    float4 res;
-    res.x = x;
-    res.y = y;
-    res.z = z;
-    res.w = w;
-    return res;
-}
-
-float3 make_float3(float x, float y, float z)
-{
-    float3 res;
-    res.x = x;
-    res.y = y;
-    res.z = z;
-    return res;
-}
+    const float4 tx0 = (node->bminx - r->o.x) * invdir.x;
+    const float4 tx1 = (node->bmaxx - r->o.x) * invdir.x;
+    const float4 ty0 = (node->bminy - r->o.y) * invdir.y;
+    const float4 ty1 = (node->bmaxy - r->o.y) * invdir.y;
+    const float4 tz0 = (node->bminz - r->o.z) * invdir.z;
+    const float4 tz1 = (node->bmaxz - r->o.z) * invdir.z;
 
-float2 make_float2(float x, float y)
-{
-    float2 res;
-    res.x = x;
-    res.y = y;
-    return res;
-}
+    const float4 tmin = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), 0.f));
+    const float4 tmax = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), maxt));
 
-int2 make_int2(int x, int y)
-{
-    int2 res;
-    res.x = x;
-    res.y = y;
-    return res;
-}
+    const int4 hit = (tmin <= tmax) & (node->count >= 0);
 
-int3 make_int3(int x, int y, int z)
-{
-    int3 res;
-    res.x = x;
-    res.y = y;
-    res.z = z;
-    return res;
+    return select((float4)(-1.f), tmin, hit);
 }
 
-#endif
-
-float3 transform_point(float3 p, float16 m)
-{
-    float3 res;
-    res.x = m.s0 * p.x + m.s1 * p.y + m.s2 * p.z + m.s3;
-    res.y = m.s4 * p.x + m.s5 * p.y + m.s6 * p.z + m.s7;
-    res.z = m.s8 * p.x + m.s9 * p.y + m.sA * p.z + m.sB;
-    return res;
-}
-
-float3 transform_vector(float3 p, float16 m)
-{
-    float3 res;
-    res.x = m.s0 * p.x + m.s1 * p.y + m.s2 * p.z;
-    res.y = m.s4 * p.x + m.s5 * p.y + m.s6 * p.z;
-    res.z = m.s8 * p.x + m.s9 * p.y + m.sA * p.z;
-    return res;
-}
-
-ray transform_ray(ray r, float16 m)
-{
-    ray res;
-    res.o = transform_point(r.o, m);
-    res.d = transform_vector(r.d, m);
-    res.range = r.range;
-    res.time = r.time;
-    return res;
-}
-
-// Intersect Ray against triangle
-bool IntersectTriangle(ray* r, float3 v1, float3 v2, float3 v3, float* a, float* b)
-{
-    float3 e1 = v2 - v1;
-    float3 e2 = v3 - v1;
-    float3 s1 = cross(r->d, e2);
-    float  invd = 1.f / dot(s1, e1);
-    float3 d = r->o - v1;
-    float  b1 = dot(d, s1) * invd;
-    float3 s2 = cross(d, e1);
-    float  b2 = dot(r->d, s2) * invd;   
-    float temp = dot(e2, s2) * invd;
-
-    if (b1 < 0.f || b1 > 1.f || b2 < 0.f || b1 + b2 > 1.f 
-        || temp < r->range.x || temp > r->range.y)
-    {
-        return false;
-    }
-    else
-    {
-        r->range.y = temp;
-        *a = b1;
-        *b = b2;
-        return true;
-    }
-}
-
-bool IntersectTriangleP(ray* r, float3 v1, float3 v2, float3 v3)
-{
-    float3 e1 = v2 - v1;
-    float3 e2 = v3 - v1;
-    float3 s1 = cross(r->d, e2);
-    float  invd = 1.f / dot(s1, e1);
-    float3 d = r->o - v1;
-    float  b1 = dot(d, s1) * invd;
-    float3 s2 = cross(d, e1);
-    float  b2 = dot(r->d, s2) * invd;   
-    float temp = dot(e2, s2) * invd;
-
-    if (b1 < 0.f || b1 > 1.f || b2 < 0.f || b1 + b2 > 1.f 
-        || temp < r->range.x || temp > r->range.y)
-    {
-        return false;
-    }
-
-    return true;
-}
-
-// Intersect ray with the axis-aligned box
-bool IntersectBox(ray* r, float3 invdir, bbox box)
-{
-    float3 f = (box.pmax - r->o) * invdir;
-    float3 n = (box.pmin - r->o) * invdir;
-
-    float3 tmax = max(f, n); 
-    float3 tmin = min(f, n); 
-
-    float t1 = min(min(tmax.x, min(tmax.y, tmax.z)), r->range.y);
-    float t0 = max(max(tmin.x, max(tmin.y, tmin.z)), r->range.x);
-
-    return (t1 >= t0);
-}
-
-//  intersect a ray with leaf BVH node
-bool IntersectLeafClosest( 
-    SceneData* scenedata,
-    BvhNode* node,
-    ray* r,                      // ray to instersect
+/*************************************************************************
+BVH FUNCTIONS
+**************************************************************************/
+//  intersect a ray with leaf primitive range
+bool IntersectLeafClosest(
+    SceneData const* scenedata,
+    int start,
+    int numprims,
+    ray const* r,                // ray to instersect
     Intersection* isect          // Intersection structure
     )
 {
-    bool hit = false;
-    int thishit = 0;
-    float a;
-    float b;
-    float3 v1, v2, v3, v4;
     Face face;
+    bool hit = false;
 
-    for (int i=0; i<4; ++i)
+    for (int i = start; i < start + numprims; ++i)
     {
-        thishit = false;
+        face = scenedata->faces[i];
 
-        face = scenedata->faces[node->start + i];
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
 
-        v1 = scenedata->vertices[face.idx[0]];
-        v2 = scenedata->vertices[face.idx[1]];
-        v3 = scenedata->vertices[face.idx[2]];
-
-        switch (face.cnt)
+        if (Ray_GetMask(r) & shapemask)
         {
-        case 3:
-            {
-                // Triangle
-                if (IntersectTriangle(r, v1, v2, v3, &a, &b))
-                {
-                    thishit = 1;
-                }
-
-                break;
-            }
-        case 4:
+            if (IntersectFace(r, scenedata->vertices, &face, isect))
             {
-                // Quad
-                v4 = scenedata->vertices[face.idx[3]];
-                if (IntersectTriangle(r, v1, v2, v3, &a, &b))
-                {
-                   thishit = 1;
-                }
-                else if (IntersectTriangle(r, v3, v4, v1, &a, &b))
-                {
-                    thishit = 2;
-                }
-
-                break;
+                isect->primid = face.id;
+                isect->shapeid = scenedata->shapes[face.shapeidx].id;
+                hit = true;
             }
         }
-
-        if (thishit > 0)
-        {
-            hit = true;
-            isect->uv = make_float2(a,b);
-            isect->primid = face.id;
-            isect->shapeid = scenedata->shapeids[node->start + i];
-            isect->extra = thishit - 1;
-            isect->instanceid = -1;
-        }
-
-        if (i + 1 >= NUMPRIMS(*node)) return hit;
     }
 
     return hit;
 }
 
-//  intersect a ray with leaf BVH node
+//  intersect a ray with leaf primitive range
 bool IntersectLeafAny(
-    SceneData* scenedata,
-    BvhNode* node,
-    ray* r                      // ray to instersect
+    SceneData const* scenedata,
+    int start,
+    int numprims,
+    ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3, v4;
-    Face face; 
+    Face face;
 
-    for (int i = 0; i < 4; ++i)
+    for (int i = start; i < start + numprims; ++i)
     {
-        face = scenedata->faces[node->start + i];
+        face = scenedata->faces[i];
 
-        v1 = scenedata->vertices[face.idx[0]];
-        v2 = scenedata->vertices[face.idx[1]];
-        v3 = scenedata->vertices[face.idx[2]];
+        int shapemask = scenedata->shapes[face.shapeidx].mask;
 
-        switch (face.cnt)
+        if (Ray_GetMask(r) & shapemask)
         {
-        case 3:
+            if (IntersectFaceP(r, scenedata->vertices, &face))
             {
-                // Triangle
-                if (IntersectTriangleP(r, v1, v2, v3))
-                {
-                    return true;
-                }
-
-                break;
-            }
-        case 4:
-            {
-                v4 = scenedata->vertices[face.idx[3]];
-                // Quad
-                if (IntersectTriangleP(r, v1, v2, v3) || IntersectTriangleP(r, v3, v4, v1))
-                {
-                    return true;
-                }
-
-                break;
+                return true;
             }
         }
-
-        if (i + 1 >= NUMPRIMS(*node)) break;
     }
 
     return false;
 }
 
 // intersect Ray against the whole BVH structure
-bool IntersectSceneClosest(SceneData* scenedata,  ray* r, Intersection* isect)
+bool IntersectSceneClosest(SceneData const* scenedata,  ray const* r, Intersection* isect)
 {
-    bool hit = false;
-    float3 invdir  = make_float3(1.f, 1.f, 1.f)/r->d;
+    const float3 invdir  = make_float3(1.f, 1.f, 1.f)/r->d.xyz;
 
-    uint idx = 0;
-    while (idx != 0xFFFFFFFF)
+    isect->uvwt = make_float4(0.f, 0.f, 0.f, r->o.w);
+    isect->shapeid = -1;
+    isect->primid = -1;
+
+    int stack[QBVH_STACK_SIZE];
+    int* sptr = stack;
+    *sptr++ = -1;
+
+    int idx = 0;
+
+    while (idx != -1)
     {
-        // Try intersecting against current node's bounding box.
-        // If this is the leaf try to intersect against contained triangle.
-        BvhNode node = scenedata->nodes[idx];
-        if (IntersectBox(r, invdir, node.bounds))
+        __global QbvhNode const* node = scenedata->nodes + idx;
+
+        float t[4];
+        int child[4];
+        int count[4];
+        vstore4(IntersectBox4(r, invdir, node, isect->uvwt.w), 0, t);
+        vstore4(node->child, 0, child);
+        vstore4(node->count, 0, count);
+
+        // Internal children sorted by entry distance
+        int next[4];
+        float nextt[4];
+        int numnext = 0;
+
+        for (int i = 0; i < 4; ++i)
         {
-            if (LEAFNODE(node))
-            {
-                hit |= IntersectLeafClosest(scenedata, &node, r, isect);
-                idx = node.next;
+            if (t[i] < 0.f)
                 continue;
+
+            if (count[i] > 0)
+            {
+                IntersectLeafClosest(scenedata, child[i], count[i], r, isect);
             }
-            // Traverse child nodes otherwise.
             else
             {
-                idx = idx + 1;
-                continue;
+                int j = numnext++;
+                for (; j > 0 && nextt[j - 1] > t[i]; --j)
+                {
+                    next[j] = next[j - 1];
+                    nextt[j] = nextt[j - 1];
+                }
+
+                next[j] = child[i];
+                nextt[j] = t[i];
             }
         }
+
+        if (numnext == 0)
+        {
+            idx = *--sptr;
+        }
         else
         {
-            idx = node.next;
+            // Visit closest child first, defer the others
+            for (int i = numnext - 1; i > 0; --i)
+            {
+                *sptr++ = next[i];
+            }
+
+            idx = next[0];
         }
-    };
+    }
 
-    return hit;
+    return isect->shapeid >= 0;
 }
 
 // intersect Ray against the whole BVH structure
-bool IntersectSceneAny(SceneData* scenedata,  ray* r)
+bool IntersectSceneAny(SceneData const* scenedata,  ray const* r)
 {
-    float3 invdir  = make_float3(1.f, 1.f, 1.f)/r->d;
+    const float3 invdir  = make_float3(1.f, 1.f, 1.f)/r->d.xyz;
+
+    int stack[QBVH_STACK_SIZE];
+    int* sptr = stack;
+    *sptr++ = -1;
 
-    uint idx = 0;
-    while (idx != 0xFFFFFFFF)
+    int idx = 0;
+
+    while (idx != -1)
     {
-        // Try intersecting against current node's bounding box.
-        // If this is the leaf try to intersect against contained triangle.
-        BvhNode node = scenedata->nodes[idx];
-        if (IntersectBox(r, invdir, node.bounds))
+        __global QbvhNode const* node = scenedata->nodes + idx;
+
+        float t[4];
+        int child[4];
+        int count[4];
+        vstore4(IntersectBox4(r, invdir, node, r->o.w), 0, t);
+        vstore4(node->child, 0, child);
+        vstore4(node->count, 0, count);
+
+        for (int i = 0; i < 4; ++i)
         {
-            if (LEAFNODE(node))
+            if (t[i] < 0.f)
+                continue;
+
+            if (count[i] > 0)
             {
-                if (IntersectLeafAny(scenedata, &node, r))
+                if (IntersectLeafAny(scenedata, child[i], count[i], r))
                 {
                     return true;
                 }
-                else
-                {
-                    idx = node.next;
-                    continue;
-                }
             }
-            // Traverse child nodes otherwise.
+            // Any hit terminates traversal, so the order does not matter
             else
             {
-                idx = idx + 1;
-                continue;
+                *sptr++ = child[i];
             }
         }
-        else
-        {
-            idx = node.next;
-        }
-    };
+
+        idx = *--sptr;
+    }
 
     return false;
 }
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectClosest(
-    // Input
-    __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
-    __global Face* faces,    // Scene indices
-    __global int* shapeids,    // Shape IDs
-    __global ray* rays,        // Ray workload
-    int offset,                // Offset in rays array
-    int numrays,               // Number of rays to process					
-    __global int* hitresults,  // Hit results
-    __global Intersection* hits // Hit datas
-    )
+// Input
+__global QbvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,    // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+int offset,                // Offset in rays array
+int numrays,               // Number of rays to process
+__global Intersection* hits, // Hit datas
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
+)
 {
-
-    int global_id  = get_global_id(0);
+    int global_id = get_global_id(0);
 
     // Fill scene data 
-    SceneData scenedata = 
+    SceneData scenedata =
     {
         nodes,
         vertices,
         faces,
-        shapeids
+        shapes,
+        0
     };
 
-    // Handle only working subset
     if (global_id < numrays)
     {
         // Fetch ray
-        int idx = offset + global_id;
-        ray r = rays[idx];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
-        // Calculate closest hit
-        Intersection isect;
-        int hit = (int)IntersectSceneClosest(&scenedata, &r, &isect);
-
-        // Write data back in case of a hit
-        if (hit)
+        if (Ray_IsActive(&r))
         {
-            hitresults[idx] = 1;
-            rays[idx] = r;
-            hits[idx] = isect;
-        }
-        else
-        {
-            hitresults[idx] = 0;
+            // Calculate closest hit
+            Intersection isect;
+            IntersectSceneClosest(&scenedata, &r, &isect);
+
+            // Write data back in case of a hit
+            Intersection_Store(hits, global_id, &isect, format);
         }
     }
 }
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAny(
-    // Input
-    __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
-    __global Face* faces,    // Scene indices
-    __global int* shapeids,    // Shape IDs
-    __global ray* rays,        // Ray workload
-    int offset,                // Offset in rays array
-    int numrays,               // Number of rays to process					
-    __global int* hitresults   // Hit results
-    )
+// Input
+__global QbvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,    // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+int offset,                // Offset in rays array
+int numrays,               // Number of rays to process
+__global int* hitresults,  // Hit results
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
+)
 {
-    int global_id  = get_global_id(0);
+    int global_id = get_global_id(0);
 
     // Fill scene data 
-    SceneData scenedata = 
+    SceneData scenedata =
     {
         nodes,
         vertices,
         faces,
-        shapeids
+        shapes,
+        0
     };
 
-    // Handle only working subset
     if (global_id < numrays)
     {
         // Fetch ray
-        ray r = rays[offset + global_id];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
-        // Calculate any intersection
-        hitresults[offset + global_id] = (int)IntersectSceneAny(&scenedata, &r);
+        if (Ray_IsActive(&r))
+        {
+            // Calculate any intersection
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+        }
     }
 }
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
+// Version with range check
 __kernel void IntersectClosestRC(
-    // Input
-    __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
-    __global Face* faces,    // Scene indices
-    __global int* shapeids,    // Shape IDs
-    __global ray* rays,        // Ray workload
-    __global int* rayindices,
-    int offset,                // Offset in rays array
-    __global int* numrays,               // Number of rays to process					
-    __global Intersection* hits // Hit datas
-    )
+__global QbvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,      // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+int offset,                // Offset in rays array
+__global int const* numrays,     // Number of rays in the workload
+__global Intersection* hits, // Hit datas
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
+)
 {
-
-    int global_id  = get_global_id(0);
+    int global_id = get_global_id(0);
 
     // Fill scene data 
-    SceneData scenedata = 
+    SceneData scenedata =
     {
         nodes,
         vertices,
         faces,
-        shapeids
+        shapes,
+        0
     };
 
     // Handle only working subset
     if (global_id < *numrays)
     {
         // Fetch ray
-        int idx = offset + global_id;
-        ray r = rays[idx];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
-        // Calculate closest hit
-        Intersection isect;
-        int hit = (int)IntersectSceneClosest(&scenedata, &r, &isect);
-
-        // Write data back in case of a hit
-        if (hit)
+        if (Ray_IsActive(&r))
         {
-            hitresults[idx] = 1;
-            rays[idx] = r;
-            hits[idx] = isect;
-        }
-        else
-        {
-            hitresults[idx] = 0;
+            // Calculate closest hit
+            Intersection isect;
+            IntersectSceneClosest(&scenedata, &r, &isect);
+
+            // Write data back in case of a hit
+            Intersection_Store(hits, global_id, &isect, format);
         }
     }
 }
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
+// Version with range check
 __kernel void IntersectAnyRC(
-    // Input
-    __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
-    __global Face* faces,      // Scene indices
-    __global int* shapeids,    // Shape IDs
-    __global ray* rays,        // Ray workload
-    int offset,                // Offset in rays array
-    __global int* numrays,     // Number of rays to process
-    __global int* hitresults   // Hit results
-    )
+// Input
+__global QbvhNode const* nodes,   // BVH nodes
+__global float3 const* vertices, // Scene positional data
+__global Face const* faces,    // Scene indices
+__global ShapeData const* shapes,     // Shapes
+__global ray const* rays,        // Ray workload
+int offset,                // Offset in rays array
+__global int const* numrays,     // Number of rays in the workload
+__global int* hitresults,   // Hit results
+int format,                // Layout of rays and hits
+__global int2 const* rayflags // Masks and activity flags of compact rays
+)
 {
-    int global_id  = get_global_id(0);
+    int global_id = get_global_id(0);
 
     // Fill scene data 
-    SceneData scenedata = 
+    SceneData scenedata =
     {
         nodes,
         vertices,
         faces,
-        shapeids
+        shapes,
+        0
     };
 
     // Handle only working subset
     if (global_id < *numrays)
     {
         // Fetch ray
-        ray r = rays[offset + global_id];
+        ray r = Ray_Load(rays, rayflags, global_id, format);
 
-        // Calculate any intersection
-        hitresults[offset + global_id] = (int)IntersectSceneAny(&scenedata, &r);
+        if (Ray_IsActive(&r))
+        {
+            // Calculate any intersection
+            hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+        }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,153 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/*************************************************************************
+ INCLUDES
+ **************************************************************************/
+#include <../FireRays/src/kernel/CL/common.cl>
+
+/*************************************************************************
+DEFINES
+**************************************************************************/
+// Number of bits per axis of quantized ray origin
+#define ORIGIN_BITS 9
+// Key of disabled rays, moves them past all the active ones
+#define INACTIVE_KEY (1 << 30)
+
+// Expands a 10-bit integer into 30 bits
+// by inserting 2 zeros after each bit.
+static unsigned int ExpandBits(unsigned int v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Direction octant goes to the upper 3 bits, Morton code
+// of the origin quantized within the scene bounds to the lower 27.
+int CalcRayKey(ray const* r, float3 scenemin, float3 invextent)
+{
+    if (!Ray_IsActive(r))
+    {
+        return INACTIVE_KEY;
+    }
+
+    float const scale = (float)((1 << ORIGIN_BITS) - 1);
+    float3 p = clamp((r->o.xyz - scenemin) * invextent, 0.f, 1.f) * scale;
+
+    unsigned int morton = ExpandBits((unsigned int)p.x) * 4 + ExpandBits((unsigned int)p.y) * 2 + ExpandBits((unsigned int)p.z);
+    unsigned int octant = (r->d.x < 0.f ? 4 : 0) | (r->d.y < 0.f ? 2 : 0) | (r->d.z < 0.f ? 1 : 0);
+
+    return (int)((octant << (3 * ORIGIN_BITS)) | morton);
+}
+
+// Compute sort keys of the rays along with their indices
+__kernel void CalcRayKeys(
+    // Rays
+    __global ray const* rays,
+    // Number of rays
+    int numrays,
+    // Scene bounds minimum
+    float4 scenemin,
+    // Reciprocal scene extent
+    float4 invextent,
+    // Sort keys
+    __global int* keys,
+    // Ray indices
+    __global int* indices,
+    // Query layout
+    int format,
+    // Ray masks and activity flags
+    __global int2 const* rayflags
+    )
+{
+    int globalid = get_global_id(0);
+
+    if (globalid < numrays)
+    {
+        ray r = Ray_Load(rays, rayflags, globalid, format);
+        keys[globalid] = CalcRayKey(&r, scenemin.xyz, invextent.xyz);
+        indices[globalid] = globalid;
+    }
+}
+
+// Fetch the rays in the sorted order, compact rays are expanded
+__kernel void GatherRays(
+    // Rays
+    __global ray const* rays,
+    // Number of rays
+    int numrays,
+    // Sorted ray indices
+    __global int const* indices,
+    // Sorted rays
+    __global ray* sortedrays,
+    // Query layout
+    int format,
+    // Ray masks and activity flags
+    __global int2 const* rayflags
+    )
+{
+    int globalid = get_global_id(0);
+
+    if (globalid < numrays)
+    {
+        sortedrays[globalid] = Ray_Load(rays, rayflags, indices[globalid], format);
+    }
+}
+
+// Write hits of the sorted rays back in the original order,
+// disabled rays keep the previous contents as usual
+__kernel void ScatterHits(
+    // Sorted rays
+    __global ray const* sortedrays,
+    // Number of rays
+    int numrays,
+    // Sorted ray indices
+    __global int const* indices,
+    // Size of the hit in ints
+    int hitsize,
+    // Hits of the sorted rays
+    __global int const* sortedhits,
+    // Hits
+    __global int* hits
+    )
+{
+    int globalid = get_global_id(0);
+
+    if (globalid < numrays)
+    {
+        ray r = sortedrays[globalid];
+
+        if (Ray_IsActive(&r))
+        {
+            int dst = indices[globalid] * hitsize;
+            int src = globalid * hitsize;
+
+            for (int i = 0; i < hitsize; ++i)
+            {
+                hits[dst + i] = sortedhits[src + i];
+            }
+        }
+    }
+}
@@ -0,0 +1,279 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "native_common.h"
+
+namespace FireRays
+{
+    namespace Native
+    {
+        // Native port of bvh2l.cl: stackless traversal of the top level
+        // BVH descending into bottom level ones in object space
+        namespace
+        {
+            struct SceneData
+            {
+                // BVH structure
+                BvhNode const* nodes;
+                // Scene positional data
+                float3 const* vertices;
+                // Scene indices
+                Face const* faces;
+                // Transforms
+                ShapeData const* shapedata;
+                // Top level BVH root idx per motion segment
+                int const* roots;
+                // Number of motion segments
+                int numsegments;
+            };
+
+            SceneData GetSceneData(Calc::NativeArgs const& args)
+            {
+                SceneData scenedata =
+                {
+                    args.GetBuffer<BvhNode const>(0),
+                    args.GetBuffer<float3 const>(1),
+                    args.GetBuffer<Face const>(2),
+                    args.GetBuffer<ShapeData const>(3),
+                    args.GetBuffer<int const>(4),
+                    args.GetValue<int>(5)
+                };
+
+                return scenedata;
+            }
+
+            //  intersect a ray with leaf BVH node
+            bool IntersectLeafClosest(SceneData const& scenedata, BvhNode const& node, ray const& r, Intersection& isect)
+            {
+                int const start = GetPlainStartIdx(node);
+                int const end = start + GetPlainNumPrims(node);
+                bool hit = false;
+
+                for (int i = start; i < end; ++i)
+                {
+                    Face const& face = scenedata.faces[i];
+
+                    if (IntersectFace(r, scenedata.vertices, face, isect))
+                    {
+                        isect.primid = face.id;
+                        hit = true;
+                    }
+                }
+
+                return hit;
+            }
+
+            //  intersect a ray with leaf BVH node
+            bool IntersectLeafAny(SceneData const& scenedata, BvhNode const& node, ray const& r)
+            {
+                int const start = GetPlainStartIdx(node);
+                int const end = start + GetPlainNumPrims(node);
+
+                for (int i = start; i < end; ++i)
+                {
+                    Face const& face = scenedata.faces[i];
+
+                    if (IntersectFaceP(r, scenedata.vertices, face))
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            // Transform the ray to object space of the shape at the given time, the shape is
+            // moved by its linear velocity in world space and rotated around its origin
+            ray TransformRayMotion(ray r, ShapeData const& shape, float time)
+            {
+                r.o -= shape.linearvelocity * time;
+
+                if (shape.angularvelocity.w < 1.f)
+                {
+                    // Inverse of the rotation is its transpose
+                    matrix rotation = quaternion_to_matrix(slerp(quaternion(), shape.angularvelocity, time));
+                    return TransformRay(r, rotation.transpose() * shape.minv);
+                }
+
+                return TransformRay(r, shape.minv);
+            }
+
+            // intersect Ray against the whole BVH2L structure
+            template <bool any> bool IntersectScene2L(SceneData const& scenedata, ray const& topray, Intersection& isect)
+            {
+                InitIntersection(topray, isect);
+
+                // Current ray might be in object space of some shape
+                ray r = topray;
+                float3 const invdirtop = GetInvDir(topray);
+                float3 invdir = invdirtop;
+
+                // Shapes are moving within shutter interval [0, 1], which is
+                // split into segments each having its own top level BVH
+                float const time = std::min(std::max(topray.GetTime(), 0.f), 1.f);
+                int const segment = std::min((int)(time * scenedata.numsegments), scenedata.numsegments - 1);
+
+                // Fetch top level BVH index
+                int idx = scenedata.roots[segment];
+                // -1 indicates we are traversing top level
+                int topidx = -1;
+                // Current shape id
+                int shapeid = -1;
+                while (idx != -1)
+                {
+                    BvhNode const& node = scenedata.nodes[idx];
+
+                    if (IntersectBox(r, invdir, node, any ? r.o.w : isect.uvwt.w))
+                    {
+                        if (IsPlainLeaf(node))
+                        {
+                            // This is bottom level, so intersect with a primitives
+                            if (topidx != -1)
+                            {
+                                if (any)
+                                {
+                                    if (IntersectLeafAny(scenedata, node, r))
+                                        return true;
+                                }
+                                else if (IntersectLeafClosest(scenedata, node, r, isect))
+                                {
+                                    // Adjust shapeid as it might be instance
+                                    isect.shapeid = shapeid;
+                                }
+
+                                idx = GetNextIdx(node);
+                            }
+                            // This is top level hierarchy leaf
+                            else
+                            {
+                                topidx = idx;
+
+                                ShapeData const& shape = scenedata.shapedata[GetPlainStartIdx(node)];
+
+                                // Drill into 2nd level BVH only if the geometry is not masked vs current ray
+                                if (r.GetMask() && shape.mask)
+                                {
+                                    idx = shape.bvhidx;
+                                    shapeid = shape.id;
+
+                                    r = TransformRayMotion(r, shape, time);
+                                    invdir = GetInvDir(r);
+                                    continue;
+                                }
+                                else
+                                {
+                                    idx = -1;
+                                }
+                            }
+                        }
+                        // Left child follows the node
+                        else
+                        {
+                            ++idx;
+                        }
+                    }
+                    else
+                    {
+                        idx = GetNextIdx(node);
+                    }
+
+                    // Return from bottom level BVH to the next top level node
+                    if (idx == -1 && topidx != -1)
+                    {
+                        idx = GetNextIdx(scenedata.nodes[topidx]);
+                        topidx = -1;
+                        r = topray;
+                        invdir = invdirtop;
+                    }
+                }
+
+                return !any && isect.shapeid >= 0;
+            }
+
+            void IntersectClosestRange(Calc::NativeArgs const& args, int offset, int numrays, std::size_t begin, std::size_t end)
+            {
+                auto scenedata = GetSceneData(args);
+                auto rays = args.GetBuffer<void const>(6);
+                auto hits = args.GetBuffer<void>(9);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(10));
+                auto rayflags = args.GetBuffer<int2 const>(11);
+
+                Intersection isect;
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    auto r = LoadRay(rays, rayflags, offset + i, format);
+                    if (r.IsActive())
+                    {
+                        IntersectScene2L<false>(scenedata, r, isect);
+                        StoreHit(hits, offset + i, isect, format);
+                    }
+                }
+            }
+
+            void IntersectAnyRange(Calc::NativeArgs const& args, int offset, int numrays, std::size_t begin, std::size_t end)
+            {
+                auto scenedata = GetSceneData(args);
+                auto rays = args.GetBuffer<void const>(6);
+                auto hitresults = args.GetBuffer<int>(9);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(10));
+                auto rayflags = args.GetBuffer<int2 const>(11);
+
+                Intersection isect;
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    auto r = LoadRay(rays, rayflags, offset + i, format);
+                    if (r.IsActive())
+                    {
+                        hitresults[offset + i] = IntersectScene2L<true>(scenedata, r, isect) ? 1 : -1;
+                    }
+                }
+            }
+        }
+
+        void RegisterBvh2lKernels()
+        {
+            Calc::RegisterNativeKernel("bvh2l.cl", "IntersectClosest2L",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectClosestRange(args, args.GetValue<int>(7), args.GetValue<int>(8), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("bvh2l.cl", "IntersectAny2L",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectAnyRange(args, args.GetValue<int>(7), args.GetValue<int>(8), begin, end);
+            });
+
+            // Range checked versions take number of rays buffer before the offset
+            Calc::RegisterNativeKernel("bvh2l.cl", "IntersectClosestRC2L",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectClosestRange(args, args.GetValue<int>(8), *args.GetBuffer<int const>(7), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("bvh2l.cl", "IntersectAnyRC2L",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectAnyRange(args, args.GetValue<int>(8), *args.GetBuffer<int const>(7), begin, end);
+            });
+        }
+    }
+}
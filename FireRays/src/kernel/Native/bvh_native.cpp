@@ -0,0 +1,355 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "native_common.h"
+
+namespace FireRays
+{
+    namespace Native
+    {
+        // Native port of bvh.cl: stackless traversal of
+        // the plain BVH using miss links stored in pmax.w
+        namespace
+        {
+            struct SceneData
+            {
+                // BVH structure
+                BvhNode const* nodes;
+                // Scene positional data
+                float3 const* vertices;
+                // Scene indices
+                Face const* faces;
+                // Shape data
+                ShapeData const* shapes;
+                // Query format, faces are precomputed triangles if kPrecomputedTriangles is set
+                std::uint32_t format;
+            };
+
+            // Precomputed triangle, v1.w keeps shape index and v2.w primitive ID
+            struct Triangle
+            {
+                float3 v1;
+                float3 v2;
+                float3 v3;
+            };
+
+            inline int GetTriangleInt(float f)
+            {
+                int i;
+                std::memcpy(&i, &f, sizeof(int));
+                return i;
+            }
+
+            SceneData GetSceneData(Calc::NativeArgs const& args)
+            {
+                SceneData scenedata =
+                {
+                    args.GetBuffer<BvhNode const>(0),
+                    args.GetBuffer<float3 const>(1),
+                    args.GetBuffer<Face const>(2),
+                    args.GetBuffer<ShapeData const>(3),
+                    static_cast<std::uint32_t>(args.GetValue<int>(8))
+                };
+
+                return scenedata;
+            }
+
+            //  intersect a ray with leaf BVH node
+            void IntersectLeafClosest(SceneData const& scenedata, BvhNode const& node, ray const& r, Intersection& isect)
+            {
+                int const start = GetPlainStartIdx(node);
+                int const end = start + GetPlainNumPrims(node);
+
+                for (int i = start; i < end; ++i)
+                {
+                    Face const& face = scenedata.faces[i];
+                    ShapeData const& shape = scenedata.shapes[face.shapeidx];
+
+                    if (r.GetMask() & shape.mask)
+                    {
+                        if (IntersectFace(r, scenedata.vertices, face, isect))
+                        {
+                            isect.primid = face.id;
+                            isect.shapeid = shape.id;
+                        }
+                    }
+                }
+            }
+
+            //  intersect a ray with leaf BVH node
+            bool IntersectLeafAny(SceneData const& scenedata, BvhNode const& node, ray const& r)
+            {
+                int const start = GetPlainStartIdx(node);
+                int const end = start + GetPlainNumPrims(node);
+
+                for (int i = start; i < end; ++i)
+                {
+                    Face const& face = scenedata.faces[i];
+
+                    if ((r.GetMask() & scenedata.shapes[face.shapeidx].mask) &&
+                        IntersectFaceP(r, scenedata.vertices, face))
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            //  intersect a ray with leaf BVH node of precomputed triangles
+            void IntersectLeafClosestPrecomputed(SceneData const& scenedata, BvhNode const& node, WatertightRay const& wr, int mask, Intersection& isect)
+            {
+                auto triangles = reinterpret_cast<Triangle const*>(scenedata.faces);
+                int const start = GetPlainStartIdx(node);
+                int const end = start + GetPlainNumPrims(node);
+
+                for (int i = start; i < end; ++i)
+                {
+                    Triangle const& tri = triangles[i];
+                    ShapeData const& shape = scenedata.shapes[GetTriangleInt(tri.v1.w)];
+
+                    if (mask & shape.mask)
+                    {
+                        if (IntersectTriangleWatertight(wr, tri.v1, tri.v2, tri.v3, isect))
+                        {
+                            isect.primid = GetTriangleInt(tri.v2.w);
+                            isect.shapeid = shape.id;
+                        }
+                    }
+                }
+            }
+
+            //  intersect a ray with leaf BVH node of precomputed triangles
+            bool IntersectLeafAnyPrecomputed(SceneData const& scenedata, BvhNode const& node, WatertightRay const& wr, int mask, float maxt)
+            {
+                auto triangles = reinterpret_cast<Triangle const*>(scenedata.faces);
+                int const start = GetPlainStartIdx(node);
+                int const end = start + GetPlainNumPrims(node);
+
+                for (int i = start; i < end; ++i)
+                {
+                    Triangle const& tri = triangles[i];
+
+                    if ((mask & scenedata.shapes[GetTriangleInt(tri.v1.w)].mask) &&
+                        IntersectTriangleWatertightP(wr, tri.v1, tri.v2, tri.v3, maxt))
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            // intersect Ray against the whole BVH structure
+            bool IntersectSceneClosest(SceneData const& scenedata, ray const& r, Intersection& isect)
+            {
+                float3 const invdir = GetInvDir(r);
+
+                InitIntersection(r, isect);
+
+                bool const precomputed = (scenedata.format & kPrecomputedTriangles) != 0;
+                WatertightRay const wr = precomputed ? GetWatertightRay(r) : WatertightRay();
+
+                int idx = 0;
+                while (idx != -1)
+                {
+                    BvhNode const& node = scenedata.nodes[idx];
+
+                    if (IntersectBox(r, invdir, node, isect.uvwt.w))
+                    {
+                        if (IsPlainLeaf(node))
+                        {
+                            if (precomputed)
+                            {
+                                IntersectLeafClosestPrecomputed(scenedata, node, wr, r.GetMask(), isect);
+                            }
+                            else
+                            {
+                                IntersectLeafClosest(scenedata, node, r, isect);
+                            }
+
+                            idx = GetNextIdx(node);
+                        }
+                        // Left child follows the node
+                        else
+                        {
+                            ++idx;
+                        }
+                    }
+                    else
+                    {
+                        idx = GetNextIdx(node);
+                    }
+                }
+
+                return isect.shapeid >= 0;
+            }
+
+            // intersect Ray against the whole BVH structure
+            bool IntersectSceneAny(SceneData const& scenedata, ray const& r)
+            {
+                float3 const invdir = GetInvDir(r);
+
+                bool const precomputed = (scenedata.format & kPrecomputedTriangles) != 0;
+                WatertightRay const wr = precomputed ? GetWatertightRay(r) : WatertightRay();
+
+                int idx = 0;
+                while (idx != -1)
+                {
+                    BvhNode const& node = scenedata.nodes[idx];
+
+                    if (IntersectBox(r, invdir, node, r.o.w))
+                    {
+                        if (IsPlainLeaf(node))
+                        {
+                            bool const hit = precomputed ?
+                                IntersectLeafAnyPrecomputed(scenedata, node, wr, r.GetMask(), r.o.w) :
+                                IntersectLeafAny(scenedata, node, r);
+
+                            if (hit)
+                            {
+                                return true;
+                            }
+
+                            idx = GetNextIdx(node);
+                        }
+                        // Left child follows the node
+                        else
+                        {
+                            ++idx;
+                        }
+                    }
+                    else
+                    {
+                        idx = GetNextIdx(node);
+                    }
+                }
+
+                return false;
+            }
+
+            void IntersectClosestRange(Calc::NativeArgs const& args, int numrays, std::size_t begin, std::size_t end)
+            {
+                auto scenedata = GetSceneData(args);
+                auto rays = args.GetBuffer<void const>(4);
+                auto hits = args.GetBuffer<void>(7);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(8));
+                auto rayflags = args.GetBuffer<int2 const>(9);
+
+                Intersection isect;
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    auto r = LoadRay(rays, rayflags, i, format);
+                    if (r.IsActive())
+                    {
+                        IntersectSceneClosest(scenedata, r, isect);
+                        StoreHit(hits, i, isect, format);
+                    }
+                }
+            }
+
+            void IntersectAnyRange(Calc::NativeArgs const& args, int numrays, std::size_t begin, std::size_t end)
+            {
+                auto scenedata = GetSceneData(args);
+                auto rays = args.GetBuffer<void const>(4);
+                auto hitresults = args.GetBuffer<int>(7);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(8));
+                auto rayflags = args.GetBuffer<int2 const>(9);
+
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    auto r = LoadRay(rays, rayflags, i, format);
+                    if (r.IsActive())
+                    {
+                        hitresults[i] = IntersectSceneAny(scenedata, r) ? 1 : -1;
+                    }
+                }
+            }
+        }
+
+        void RegisterBvhKernels()
+        {
+            Calc::RegisterNativeKernel("bvh.cl", "IntersectClosest",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectClosestRange(args, args.GetValue<int>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("bvh.cl", "IntersectAny",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectAnyRange(args, args.GetValue<int>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("bvh.cl", "IntersectClosestRC",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectClosestRange(args, *args.GetBuffer<int const>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("bvh.cl", "IntersectAnyRC",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectAnyRange(args, *args.GetBuffer<int const>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("bvh.cl", "IntersectClosestPT",
+                [](Calc::NativeArgs const& args, std::size_t, std::size_t)
+            {
+                int numrays = args.GetValue<int>(6);
+                ForEachRayBatch(args.GetBuffer<int>(10), numrays, [&args, numrays](std::size_t first, std::size_t last)
+                {
+                    IntersectClosestRange(args, numrays, first, last);
+                });
+            });
+
+            Calc::RegisterNativeKernel("bvh.cl", "IntersectAnyPT",
+                [](Calc::NativeArgs const& args, std::size_t, std::size_t)
+            {
+                int numrays = args.GetValue<int>(6);
+                ForEachRayBatch(args.GetBuffer<int>(10), numrays, [&args, numrays](std::size_t first, std::size_t last)
+                {
+                    IntersectAnyRange(args, numrays, first, last);
+                });
+            });
+
+            Calc::RegisterNativeKernel("bvh.cl", "IntersectClosestRCPT",
+                [](Calc::NativeArgs const& args, std::size_t, std::size_t)
+            {
+                int numrays = *args.GetBuffer<int const>(6);
+                ForEachRayBatch(args.GetBuffer<int>(10), numrays, [&args, numrays](std::size_t first, std::size_t last)
+                {
+                    IntersectClosestRange(args, numrays, first, last);
+                });
+            });
+
+            Calc::RegisterNativeKernel("bvh.cl", "IntersectAnyRCPT",
+                [](Calc::NativeArgs const& args, std::size_t, std::size_t)
+            {
+                int numrays = *args.GetBuffer<int const>(6);
+                ForEachRayBatch(args.GetBuffer<int>(10), numrays, [&args, numrays](std::size_t first, std::size_t last)
+                {
+                    IntersectAnyRange(args, numrays, first, last);
+                });
+            });
+        }
+    }
+}
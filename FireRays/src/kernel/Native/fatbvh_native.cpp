@@ -0,0 +1,284 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "native_common.h"
+#include "../../except/except.h"
+
+namespace FireRays
+{
+    namespace Native
+    {
+        // Native port of fatbvh.cl: stack based traversal of the BVH
+        // storing both child bounds in a node, closest child first.
+        // Stack lives on the native thread stack, so device side
+        // stack buffer passed by the strategy is not used.
+        namespace
+        {
+            // Max depth of traversal stack
+            int const kStackSize = 128;
+
+            struct SceneData
+            {
+                // BVH structure
+                FatBvhNode const* nodes;
+                // Scene positional data
+                float3 const* vertices;
+                // Scene indices
+                Face const* faces;
+                // Shape data
+                ShapeData const* shapes;
+            };
+
+            SceneData GetSceneData(Calc::NativeArgs const& args)
+            {
+                SceneData scenedata =
+                {
+                    args.GetBuffer<FatBvhNode const>(0),
+                    args.GetBuffer<float3 const>(1),
+                    args.GetBuffer<Face const>(2),
+                    args.GetBuffer<ShapeData const>(3)
+                };
+
+                return scenedata;
+            }
+
+            //  intersect a ray with leaf BVH node
+            bool IntersectLeafClosest(SceneData const& scenedata, int faceidx, ray const& r, Intersection& isect)
+            {
+                Face const& face = scenedata.faces[faceidx];
+                ShapeData const& shape = scenedata.shapes[face.shapeidx];
+
+                if (r.GetMask() & shape.mask)
+                {
+                    if (IntersectFace(r, scenedata.vertices, face, isect))
+                    {
+                        isect.primid = face.id;
+                        isect.shapeid = shape.id;
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            //  intersect a ray with leaf BVH node
+            bool IntersectLeafAny(SceneData const& scenedata, int faceidx, ray const& r)
+            {
+                Face const& face = scenedata.faces[faceidx];
+
+                if (r.GetMask() & scenedata.shapes[face.shapeidx].mask)
+                {
+                    return IntersectFaceP(r, scenedata.vertices, face);
+                }
+
+                return false;
+            }
+
+            // intersect Ray against the whole BVH structure
+            template <bool any> bool IntersectScene(SceneData const& scenedata, ray const& r, Intersection& isect)
+            {
+                float3 const invdir = GetInvDir(r);
+
+                InitIntersection(r, isect);
+
+                if (r.o.w < 0.f)
+                    return false;
+
+                int stack[kStackSize];
+                int* sptr = stack;
+                *sptr++ = -1;
+
+                int idx = 0;
+                while (idx > -1)
+                {
+                    FatBvhNode const& node = scenedata.nodes[idx];
+                    float const maxt = any ? r.o.w : isect.uvwt.w;
+
+                    bool const leftleaf = IsLeaf(node.lbound);
+                    bool const rightleaf = IsLeaf(node.rbound);
+
+                    float const lefthit = leftleaf ? -1.f : IntersectBoxF(r, invdir, node.lbound, maxt);
+                    float const righthit = rightleaf ? -1.f : IntersectBoxF(r, invdir, node.rbound, maxt);
+
+                    if (leftleaf)
+                    {
+                        if (any)
+                        {
+                            if (IntersectLeafAny(scenedata, GetStartIdx(node.lbound), r))
+                                return true;
+                        }
+                        else
+                        {
+                            IntersectLeafClosest(scenedata, GetStartIdx(node.lbound), r, isect);
+                        }
+                    }
+
+                    if (rightleaf)
+                    {
+                        if (any)
+                        {
+                            if (IntersectLeafAny(scenedata, GetStartIdx(node.rbound), r))
+                                return true;
+                        }
+                        else
+                        {
+                            IntersectLeafClosest(scenedata, GetStartIdx(node.rbound), r, isect);
+                        }
+                    }
+
+                    if (lefthit > 0.f && righthit > 0.f)
+                    {
+                        // Visit closest child first, defer the other one
+                        bool const leftfirst = lefthit <= righthit;
+                        idx = GetNextIdx(leftfirst ? node.lbound : node.rbound);
+
+                        if (sptr - stack >= kStackSize)
+                        {
+                            Throw("Native traversal stack overflow");
+                        }
+
+                        *sptr++ = GetNextIdx(leftfirst ? node.rbound : node.lbound);
+                    }
+                    else if (lefthit > 0.f)
+                    {
+                        idx = GetNextIdx(node.lbound);
+                    }
+                    else if (righthit > 0.f)
+                    {
+                        idx = GetNextIdx(node.rbound);
+                    }
+                    else
+                    {
+                        idx = *--sptr;
+                    }
+                }
+
+                return !any && isect.shapeid >= 0;
+            }
+
+            void IntersectClosestRange(Calc::NativeArgs const& args, int numrays, std::size_t begin, std::size_t end)
+            {
+                auto scenedata = GetSceneData(args);
+                auto rays = args.GetBuffer<void const>(4);
+                auto hits = args.GetBuffer<void>(7);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(9));
+                auto rayflags = args.GetBuffer<int2 const>(10);
+
+                Intersection isect;
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    auto r = LoadRay(rays, rayflags, i, format);
+                    if (r.IsActive())
+                    {
+                        IntersectScene<false>(scenedata, r, isect);
+                        StoreHit(hits, i, isect, format);
+                    }
+                }
+            }
+
+            void IntersectAnyRange(Calc::NativeArgs const& args, int numrays, std::size_t begin, std::size_t end)
+            {
+                auto scenedata = GetSceneData(args);
+                auto rays = args.GetBuffer<void const>(4);
+                auto hitresults = args.GetBuffer<int>(7);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(9));
+                auto rayflags = args.GetBuffer<int2 const>(10);
+
+                Intersection isect;
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    auto r = LoadRay(rays, rayflags, i, format);
+                    if (r.IsActive())
+                    {
+                        hitresults[i] = IntersectScene<true>(scenedata, r, isect) ? 1 : -1;
+                    }
+                }
+            }
+        }
+
+        void RegisterFatBvhKernels()
+        {
+            Calc::RegisterNativeKernel("fatbvh.cl", "IntersectClosest",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectClosestRange(args, args.GetValue<int>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("fatbvh.cl", "IntersectAny",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectAnyRange(args, args.GetValue<int>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("fatbvh.cl", "IntersectClosestRC",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectClosestRange(args, *args.GetBuffer<int const>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("fatbvh.cl", "IntersectAnyRC",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectAnyRange(args, *args.GetBuffer<int const>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("fatbvh.cl", "IntersectClosestPT",
+                [](Calc::NativeArgs const& args, std::size_t, std::size_t)
+            {
+                int numrays = args.GetValue<int>(6);
+                ForEachRayBatch(args.GetBuffer<int>(11), numrays, [&args, numrays](std::size_t first, std::size_t last)
+                {
+                    IntersectClosestRange(args, numrays, first, last);
+                });
+            });
+
+            Calc::RegisterNativeKernel("fatbvh.cl", "IntersectAnyPT",
+                [](Calc::NativeArgs const& args, std::size_t, std::size_t)
+            {
+                int numrays = args.GetValue<int>(6);
+                ForEachRayBatch(args.GetBuffer<int>(11), numrays, [&args, numrays](std::size_t first, std::size_t last)
+                {
+                    IntersectAnyRange(args, numrays, first, last);
+                });
+            });
+
+            Calc::RegisterNativeKernel("fatbvh.cl", "IntersectClosestRCPT",
+                [](Calc::NativeArgs const& args, std::size_t, std::size_t)
+            {
+                int numrays = *args.GetBuffer<int const>(6);
+                ForEachRayBatch(args.GetBuffer<int>(11), numrays, [&args, numrays](std::size_t first, std::size_t last)
+                {
+                    IntersectClosestRange(args, numrays, first, last);
+                });
+            });
+
+            Calc::RegisterNativeKernel("fatbvh.cl", "IntersectAnyRCPT",
+                [](Calc::NativeArgs const& args, std::size_t, std::size_t)
+            {
+                int numrays = *args.GetBuffer<int const>(6);
+                ForEachRayBatch(args.GetBuffer<int>(11), numrays, [&args, numrays](std::size_t first, std::size_t last)
+                {
+                    IntersectAnyRange(args, numrays, first, last);
+                });
+            });
+        }
+    }
+}
@@ -0,0 +1,306 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "native_common.h"
+#include "../../accelerator/grid.h"
+
+#include <cmath>
+#include <limits>
+
+namespace FireRays
+{
+    namespace Native
+    {
+        // Native port of grid.cl: 3D DDA walk over the uniform grid voxels
+        namespace
+        {
+            typedef Grid::Voxel Voxel;
+            typedef Grid::Desc GridDesc;
+
+            struct SceneData
+            {
+                // Grid voxels structure
+                Voxel const* voxels;
+                // Scene positional data
+                float3 const* vertices;
+                // Scene indices
+                Face const* faces;
+                // Shape data
+                ShapeData const* shapes;
+                // Voxel primitive references
+                int const* indices;
+                // Grid desc
+                GridDesc const* grid;
+            };
+
+            SceneData GetSceneData(Calc::NativeArgs const& args)
+            {
+                SceneData scenedata =
+                {
+                    args.GetBuffer<Voxel const>(0),
+                    args.GetBuffer<float3 const>(2),
+                    args.GetBuffer<Face const>(3),
+                    args.GetBuffer<ShapeData const>(4),
+                    args.GetBuffer<int const>(5),
+                    args.GetBuffer<GridDesc const>(1)
+                };
+
+                return scenedata;
+            }
+
+            // DDA traversal state
+            struct GridWalker
+            {
+                // Current voxel
+                int cell[3];
+                // Voxel step direction
+                int step[3];
+                // Voxel index where the ray leaves the grid
+                int out[3];
+                // Distance to the next voxel boundary
+                float tnext[3];
+                // Distance between voxel boundaries
+                float dt[3];
+                // Distance where the ray leaves the grid
+                float tmax;
+
+                // Set up the walk, returns false if the ray misses the grid
+                bool Init(GridDesc const& grid, ray const& r, float3 const& invdir)
+                {
+                    float3 const f = (grid.bounds.pmax - r.o) * invdir;
+                    float3 const n = (grid.bounds.pmin - r.o) * invdir;
+
+                    float3 const bmax = vmax(f, n);
+                    float3 const bmin = vmin(f, n);
+
+                    float const t1 = std::min(std::min(bmax.x, std::min(bmax.y, bmax.z)), r.o.w);
+                    float const t0 = std::max(std::max(bmin.x, std::max(bmin.y, bmin.z)), 0.f);
+
+                    if (t0 > t1)
+                        return false;
+
+                    tmax = t1;
+
+                    for (int i = 0; i < 3; ++i)
+                    {
+                        // Entry point in voxel units, distances are kept relative to the ray origin
+                        float const p = (r.o[i] + r.d[i] * t0 - grid.bounds.pmin[i]) * grid.voxelsizeinv[i];
+                        cell[i] = std::min(std::max((int)std::floor(p), 0), grid.gridres[i] - 1);
+
+                        if (r.d[i] > 0.f)
+                        {
+                            step[i] = 1;
+                            out[i] = grid.gridres[i];
+                            tnext[i] = (grid.bounds.pmin[i] + (cell[i] + 1) * grid.voxelsize[i] - r.o[i]) * invdir[i];
+                            dt[i] = grid.voxelsize[i] * invdir[i];
+                        }
+                        else if (r.d[i] < 0.f)
+                        {
+                            step[i] = -1;
+                            out[i] = -1;
+                            tnext[i] = (grid.bounds.pmin[i] + cell[i] * grid.voxelsize[i] - r.o[i]) * invdir[i];
+                            dt[i] = -grid.voxelsize[i] * invdir[i];
+                        }
+                        else
+                        {
+                            // Never crosses voxel boundaries along this axis
+                            step[i] = 0;
+                            out[i] = -1;
+                            tnext[i] = std::numeric_limits<float>::infinity();
+                            dt[i] = 0.f;
+                        }
+                    }
+
+                    return true;
+                }
+
+                int GetVoxel(GridDesc const& grid) const
+                {
+                    return (cell[2] * grid.gridres[1] + cell[1]) * grid.gridres[0] + cell[0];
+                }
+
+                // Advance to the next voxel unless the ray ends before maxt,
+                // returns false when the walk is over
+                bool Advance(float maxt)
+                {
+                    int const axis = tnext[0] < tnext[1] ?
+                        (tnext[0] < tnext[2] ? 0 : 2) :
+                        (tnext[1] < tnext[2] ? 1 : 2);
+
+                    if (tnext[axis] > std::min(maxt, tmax))
+                        return false;
+
+                    cell[axis] += step[axis];
+
+                    if (cell[axis] == out[axis])
+                        return false;
+
+                    tnext[axis] += dt[axis];
+                    return true;
+                }
+            };
+
+            //  intersect a ray with grid voxel
+            void IntersectVoxelClosest(SceneData const& scenedata, Voxel const& voxel, ray const& r, Intersection& isect)
+            {
+                for (int i = voxel.startidx; i < voxel.startidx + voxel.numprims; ++i)
+                {
+                    Face const& face = scenedata.faces[scenedata.indices[i]];
+                    ShapeData const& shape = scenedata.shapes[face.shapeidx];
+
+                    if (r.GetMask() & shape.mask)
+                    {
+                        if (IntersectFace(r, scenedata.vertices, face, isect))
+                        {
+                            isect.primid = face.id;
+                            isect.shapeid = shape.id;
+                        }
+                    }
+                }
+            }
+
+            //  intersect a ray with grid voxel
+            bool IntersectVoxelAny(SceneData const& scenedata, Voxel const& voxel, ray const& r)
+            {
+                for (int i = voxel.startidx; i < voxel.startidx + voxel.numprims; ++i)
+                {
+                    Face const& face = scenedata.faces[scenedata.indices[i]];
+
+                    if ((r.GetMask() & scenedata.shapes[face.shapeidx].mask) &&
+                        IntersectFaceP(r, scenedata.vertices, face))
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            // intersect Ray against the whole grid structure
+            void IntersectSceneClosest(SceneData const& scenedata, ray const& r, Intersection& isect)
+            {
+                InitIntersection(r, isect);
+
+                GridWalker walker;
+                if (!walker.Init(*scenedata.grid, r, GetInvDir(r)))
+                    return;
+
+                do
+                {
+                    Voxel const& voxel = scenedata.voxels[walker.GetVoxel(*scenedata.grid)];
+
+                    if (voxel.numprims > 0)
+                    {
+                        IntersectVoxelClosest(scenedata, voxel, r, isect);
+                    }
+                }
+                // Stop as soon as the closest hit is inside the voxels visited so far
+                while (walker.Advance(isect.uvwt.w));
+            }
+
+            // intersect Ray against the whole grid structure
+            bool IntersectSceneAny(SceneData const& scenedata, ray const& r)
+            {
+                GridWalker walker;
+                if (!walker.Init(*scenedata.grid, r, GetInvDir(r)))
+                    return false;
+
+                do
+                {
+                    Voxel const& voxel = scenedata.voxels[walker.GetVoxel(*scenedata.grid)];
+
+                    if (voxel.numprims > 0 && IntersectVoxelAny(scenedata, voxel, r))
+                    {
+                        return true;
+                    }
+                }
+                while (walker.Advance(r.o.w));
+
+                return false;
+            }
+
+            void IntersectClosestRange(Calc::NativeArgs const& args, int numrays, std::size_t begin, std::size_t end)
+            {
+                auto scenedata = GetSceneData(args);
+                auto rays = args.GetBuffer<void const>(6);
+                auto hits = args.GetBuffer<void>(9);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(10));
+                auto rayflags = args.GetBuffer<int2 const>(11);
+
+                Intersection isect;
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    auto r = LoadRay(rays, rayflags, i, format);
+                    if (r.IsActive())
+                    {
+                        IntersectSceneClosest(scenedata, r, isect);
+                        StoreHit(hits, i, isect, format);
+                    }
+                }
+            }
+
+            void IntersectAnyRange(Calc::NativeArgs const& args, int numrays, std::size_t begin, std::size_t end)
+            {
+                auto scenedata = GetSceneData(args);
+                auto rays = args.GetBuffer<void const>(6);
+                auto hitresults = args.GetBuffer<int>(9);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(10));
+                auto rayflags = args.GetBuffer<int2 const>(11);
+
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    auto r = LoadRay(rays, rayflags, i, format);
+                    if (r.IsActive())
+                    {
+                        hitresults[i] = IntersectSceneAny(scenedata, r) ? 1 : -1;
+                    }
+                }
+            }
+        }
+
+        void RegisterGridKernels()
+        {
+            Calc::RegisterNativeKernel("grid.cl", "IntersectClosest",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectClosestRange(args, args.GetValue<int>(8), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("grid.cl", "IntersectAny",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectAnyRange(args, args.GetValue<int>(8), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("grid.cl", "IntersectClosestRC",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectClosestRange(args, *args.GetBuffer<int const>(8), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("grid.cl", "IntersectAnyRC",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectAnyRange(args, *args.GetBuffer<int const>(8), begin, end);
+            });
+        }
+    }
+}
@@ -0,0 +1,411 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef NATIVE_COMMON_H
+#define NATIVE_COMMON_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+#include "firerays.h"
+#include "math/bbox.h"
+#include "math/float3.h"
+#include "../../translator/plain_bvh_translator.h"
+#include "math/matrix.h"
+#include "math/mathutils.h"
+#include "math/quaternion.h"
+#include "math/ray.h"
+
+#include "native_kernel.h"
+#include "../../strategy/strategy.h"
+
+namespace FireRays
+{
+    ///< Host counterparts of the data structures and helper functions
+    ///< from common.cl. Layouts must match the ones strategies upload
+    ///< to the device, since native kernels consume the same buffers.
+    ///<
+    namespace Native
+    {
+        typedef bbox BvhNode;
+
+        struct FatBvhNode
+        {
+            bbox lbound;
+            bbox rbound;
+        };
+
+        struct Face
+        {
+            // Vertex indices, the fourth one is -1 for triangles
+            int idx[4];
+            // Shape index
+            int shapeidx;
+            // Primitive ID
+            int id;
+        };
+
+        struct ShapeData
+        {
+            // Transform
+            matrix minv;
+            // Motion blur data
+            float3 linearvelocity;
+            // Angular veocity (quaternion)
+            quaternion angularvelocity;
+            // Shape ID
+            Id id;
+            // Index of root bvh node
+            int bvhidx;
+            // Shape mask
+            int mask;
+            int padding1;
+        };
+
+        // Fat BVH leaves keep primitive index in pmin.w, internal ones have -1 there
+        inline bool IsLeaf(bbox const& node)
+        {
+            return node.pmin.w != -1.f;
+        }
+
+        inline int GetStartIdx(bbox const& node)
+        {
+            return static_cast<int>(node.pmin.w);
+        }
+
+        // Plain BVH leaves keep bit-packed primitive range in pmin.w
+        inline int GetPlainLeafData(bbox const& node)
+        {
+            int data;
+            std::memcpy(&data, &node.pmin.w, sizeof(int));
+            return data;
+        }
+
+        inline bool IsPlainLeaf(bbox const& node)
+        {
+            return GetPlainLeafData(node) >= 0;
+        }
+
+        inline int GetPlainStartIdx(bbox const& node)
+        {
+            return PlainBvhTranslator::DecodeLeafStart(GetPlainLeafData(node));
+        }
+
+        inline int GetPlainNumPrims(bbox const& node)
+        {
+            return PlainBvhTranslator::DecodeLeafCount(GetPlainLeafData(node));
+        }
+
+        inline int GetNextIdx(bbox const& node)
+        {
+            return static_cast<int>(node.pmax.w);
+        }
+
+        inline float3 GetInvDir(ray const& r)
+        {
+            return float3(1.f / r.d.x, 1.f / r.d.y, 1.f / r.d.z);
+        }
+
+        // Transform the ray keeping maxt, time and flags intact
+        inline ray TransformRay(ray const& r, matrix const& m)
+        {
+            ray res = r;
+            res.o = transform_point(r.o, m);
+            res.d = transform_vector(r.d, m);
+            res.o.w = r.o.w;
+            res.d.w = r.d.w;
+            return res;
+        }
+
+        // Intersect ray against triangle
+        inline bool IntersectTriangle(ray const& r, float3 const& v1, float3 const& v2, float3 const& v3, Intersection& isect)
+        {
+            float3 const e1 = v2 - v1;
+            float3 const e2 = v3 - v1;
+            float3 const s1 = cross(r.d, e2);
+            float const invd = 1.f / dot(s1, e1);
+            float3 const d = r.o - v1;
+            float const b1 = dot(d, s1) * invd;
+            float3 const s2 = cross(d, e1);
+            float const b2 = dot(r.d, s2) * invd;
+            float const temp = dot(e2, s2) * invd;
+
+            if (b1 < 0.f || b1 > 1.f || b2 < 0.f || b1 + b2 > 1.f
+                || temp < 0.f || temp > isect.uvwt.w)
+            {
+                return false;
+            }
+
+            isect.uvwt = float4(b1, b2, 0.f, temp);
+            return true;
+        }
+
+        // Intersect ray against triangle, just check if there is any hit within ray range
+        inline bool IntersectTriangleP(ray const& r, float3 const& v1, float3 const& v2, float3 const& v3)
+        {
+            float3 const e1 = v2 - v1;
+            float3 const e2 = v3 - v1;
+            float3 const s1 = cross(r.d, e2);
+            float const invd = 1.f / dot(s1, e1);
+            float3 const d = r.o - v1;
+            float const b1 = dot(d, s1) * invd;
+            float3 const s2 = cross(d, e1);
+            float const b2 = dot(r.d, s2) * invd;
+            float const temp = dot(e2, s2) * invd;
+
+            return !(b1 < 0.f || b1 > 1.f || b2 < 0.f || b1 + b2 > 1.f
+                || temp < 0.f || temp > r.o.w);
+        }
+
+        // Intersect ray against the face, quad is tested as triangles (v1, v2, v3) and (v3, v4, v1),
+        // uvwt.z is set to the index of the triangle hit
+        inline bool IntersectFace(ray const& r, float3 const* vertices, Face const& face, Intersection& isect)
+        {
+            float3 const& v1 = vertices[face.idx[0]];
+            float3 const& v3 = vertices[face.idx[2]];
+
+            bool hit = IntersectTriangle(r, v1, vertices[face.idx[1]], v3, isect);
+
+            if (face.idx[3] >= 0 && IntersectTriangle(r, v3, vertices[face.idx[3]], v1, isect))
+            {
+                isect.uvwt.z = 1.f;
+                hit = true;
+            }
+
+            return hit;
+        }
+
+        inline bool IntersectFaceP(ray const& r, float3 const* vertices, Face const& face)
+        {
+            float3 const& v1 = vertices[face.idx[0]];
+            float3 const& v3 = vertices[face.idx[2]];
+
+            return IntersectTriangleP(r, v1, vertices[face.idx[1]], v3) ||
+                (face.idx[3] >= 0 && IntersectTriangleP(r, v3, vertices[face.idx[3]], v1));
+        }
+
+        // Ray data of the watertight triangle test (see WatertightRay in common.cl)
+        struct WatertightRay
+        {
+            // Ray origin
+            float3 o;
+            // Shear constants
+            float3 s;
+            // Permuted axes, z goes along the dominant ray direction
+            int kx, ky, kz;
+        };
+
+        inline WatertightRay GetWatertightRay(ray const& r)
+        {
+            WatertightRay wr;
+            float3 const a(std::abs(r.d.x), std::abs(r.d.y), std::abs(r.d.z));
+
+            wr.kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+            wr.kx = (wr.kz + 1) % 3;
+            wr.ky = (wr.kx + 1) % 3;
+
+            // Swap the other two axes to keep the winding
+            if (r.d[wr.kz] < 0.f)
+            {
+                std::swap(wr.kx, wr.ky);
+            }
+
+            wr.o = r.o;
+            wr.s = float3(r.d[wr.kx] / r.d[wr.kz], r.d[wr.ky] / r.d[wr.kz], 1.f / r.d[wr.kz]);
+            return wr;
+        }
+
+        // Watertight ray-triangle test, returns the distance or -1 if there is no hit within maxt
+        inline float IntersectTriangleWatertightT(WatertightRay const& wr, float3 const& v1, float3 const& v2, float3 const& v3, float maxt, float& u, float& v)
+        {
+            float3 const a = v1 - wr.o;
+            float3 const b = v2 - wr.o;
+            float3 const c = v3 - wr.o;
+
+            // Shear vertices to the ray space
+            float const az = a[wr.kz];
+            float const bz = b[wr.kz];
+            float const cz = c[wr.kz];
+            float const ax = a[wr.kx] - wr.s.x * az;
+            float const ay = a[wr.ky] - wr.s.y * az;
+            float const bx = b[wr.kx] - wr.s.x * bz;
+            float const by = b[wr.ky] - wr.s.y * bz;
+            float const cx = c[wr.kx] - wr.s.x * cz;
+            float const cy = c[wr.ky] - wr.s.y * cz;
+
+            // Scaled barycentrics, all of the same sign inside
+            float const bu = cx * by - cy * bx;
+            float const bv = ax * cy - ay * cx;
+            float const bw = bx * ay - by * ax;
+
+            if ((bu < 0.f || bv < 0.f || bw < 0.f) && (bu > 0.f || bv > 0.f || bw > 0.f))
+            {
+                return -1.f;
+            }
+
+            float const det = bu + bv + bw;
+
+            if (det == 0.f)
+            {
+                return -1.f;
+            }
+
+            float const invdet = 1.f / det;
+            float const t = (bu * az + bv * bz + bw * cz) * wr.s.z * invdet;
+
+            if (t < 0.f || t > maxt)
+            {
+                return -1.f;
+            }
+
+            u = bv * invdet;
+            v = bw * invdet;
+            return t;
+        }
+
+        inline bool IntersectTriangleWatertight(WatertightRay const& wr, float3 const& v1, float3 const& v2, float3 const& v3, Intersection& isect)
+        {
+            float u, v;
+            float const t = IntersectTriangleWatertightT(wr, v1, v2, v3, isect.uvwt.w, u, v);
+
+            if (t < 0.f)
+            {
+                return false;
+            }
+
+            isect.uvwt = float4(u, v, 0.f, t);
+            return true;
+        }
+
+        inline bool IntersectTriangleWatertightP(WatertightRay const& wr, float3 const& v1, float3 const& v2, float3 const& v3, float maxt)
+        {
+            float u, v;
+            return IntersectTriangleWatertightT(wr, v1, v2, v3, maxt, u, v) >= 0.f;
+        }
+
+        // Intersect ray with the axis-aligned box
+        inline bool IntersectBox(ray const& r, float3 const& invdir, bbox const& box, float maxt)
+        {
+            float3 const f = (box.pmax - r.o) * invdir;
+            float3 const n = (box.pmin - r.o) * invdir;
+
+            float3 const tmax = vmax(f, n);
+            float3 const tmin = vmin(f, n);
+
+            float const t1 = std::min(std::min(tmax.x, std::min(tmax.y, tmax.z)), maxt);
+            float const t0 = std::max(std::max(tmin.x, std::max(tmin.y, tmin.z)), 0.f);
+
+            return t1 >= t0;
+        }
+
+        // Intersect ray with the axis-aligned box returning the distance or -1 on miss
+        inline float IntersectBoxF(ray const& r, float3 const& invdir, bbox const& box, float maxt)
+        {
+            float3 const f = (box.pmax - r.o) * invdir;
+            float3 const n = (box.pmin - r.o) * invdir;
+
+            float3 const tmax = vmax(f, n);
+            float3 const tmin = vmin(f, n);
+
+            float const t1 = std::min(std::min(tmax.x, std::min(tmax.y, tmax.z)), maxt);
+            float const t0 = std::max(std::max(tmin.x, std::max(tmin.y, tmin.z)), 0.f);
+
+            return (t1 >= t0) ? (t0 > 0.f ? t0 : t1) : -1.f;
+        }
+
+        // Reset intersection before the traversal
+        inline void InitIntersection(ray const& r, Intersection& isect)
+        {
+            isect.uvwt = float4(0.f, 0.f, 0.f, r.o.w);
+            isect.shapeid = kNullId;
+            isect.primid = kNullId;
+        }
+
+        // Fetch the ray from the buffer of the query layout (see Ray_Load in common.cl)
+        inline ray LoadRay(void const* rays, int2 const* rayflags, std::size_t idx, std::uint32_t format)
+        {
+            if (format & kCompactRays)
+            {
+                compact_ray const& src = static_cast<compact_ray const*>(rays)[idx];
+
+                ray r;
+                r.o = src.o;
+                r.d = src.d;
+                r.extra = (format & kRayFlags) ? rayflags[idx] : int2(-1, 1);
+                return r;
+            }
+
+            return static_cast<ray const*>(rays)[idx];
+        }
+
+        // Write the hit into the buffer of the query layout (see Intersection_Store in common.cl)
+        inline void StoreHit(void* hits, std::size_t idx, Intersection const& isect, std::uint32_t format)
+        {
+            if (format & kCompactHits)
+            {
+                std::uint32_t const u = static_cast<std::uint32_t>(clamp(isect.uvwt.x, 0.f, 1.f) * 65535.f + 0.5f);
+                std::uint32_t const v = static_cast<std::uint32_t>(clamp(isect.uvwt.y, 0.f, 1.f) * 65535.f + 0.5f);
+
+                CompactIntersection& dst = static_cast<CompactIntersection*>(hits)[idx];
+                dst.t = isect.uvwt.w;
+                dst.uv = u | (v << 16);
+                dst.shapeid = isect.shapeid;
+                dst.primid = (isect.primid >= 0 && isect.uvwt.z > 0.f) ? (isect.primid | CompactIntersection::kQuadTriangleBit) : isect.primid;
+                return;
+            }
+
+            static_cast<Intersection*>(hits)[idx] = isect;
+        }
+
+        // Clamp work item range to the number of rays
+        inline std::size_t ClampRange(std::size_t end, int numrays)
+        {
+            return std::min(end, static_cast<std::size_t>(std::max(numrays, 0)));
+        }
+
+        // Rays fetched at once by persistent threads kernels, same as their work group size
+        static int const kPersistentBatchSize = 64;
+
+        // Fetch batches of rays from the shared counter until all of them are taken (see FetchRayBatch in common.cl)
+        template <typename F>
+        inline void ForEachRayBatch(int* raycnt, int numrays, F f)
+        {
+            auto counter = reinterpret_cast<std::atomic<int>*>(raycnt);
+
+            for (int first = counter->fetch_add(kPersistentBatchSize); first < numrays; first = counter->fetch_add(kPersistentBatchSize))
+            {
+                f(static_cast<std::size_t>(first), static_cast<std::size_t>(std::min(first + kPersistentBatchSize, numrays)));
+            }
+        }
+
+        // Kernel registration for the programs having native implementation
+        void RegisterBvhKernels();
+        void RegisterBvh2lKernels();
+        void RegisterFatBvhKernels();
+        void RegisterQbvhKernels();
+        void RegisterGridKernels();
+        void RegisterSortRaysKernels();
+    }
+}
+
+#endif // NATIVE_COMMON_H
@@ -0,0 +1,58 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "native_kernels.h"
+#include "native_common.h"
+
+#ifdef FR_EMBED_KERNELS
+#include "../CL/cache/kernels.h"
+#endif
+
+#include <mutex>
+
+namespace FireRays
+{
+    void RegisterNativeKernels()
+    {
+        static std::once_flag s_once;
+
+        std::call_once(s_once, []()
+        {
+            Native::RegisterBvhKernels();
+            Native::RegisterBvh2lKernels();
+            Native::RegisterFatBvhKernels();
+            Native::RegisterQbvhKernels();
+            Native::RegisterGridKernels();
+            Native::RegisterSortRaysKernels();
+
+#ifdef FR_EMBED_KERNELS
+            // Strategies compile embedded programs from source,
+            // so native device needs to know which one is which
+            Calc::RegisterNativeProgramSource("bvh.cl", cl_bvh);
+            Calc::RegisterNativeProgramSource("bvh2l.cl", cl_bvh2l);
+            Calc::RegisterNativeProgramSource("fatbvh.cl", cl_fatbvh);
+            Calc::RegisterNativeProgramSource("qbvh.cl", cl_qbvh);
+            Calc::RegisterNativeProgramSource("grid.cl", cl_grid);
+            Calc::RegisterNativeProgramSource("sort_rays.cl", cl_sort_rays);
+#endif
+        });
+    }
+}
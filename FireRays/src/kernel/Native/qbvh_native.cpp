@@ -0,0 +1,311 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "native_common.h"
+#include "../../translator/qbvh_translator.h"
+#include "../../except/except.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QBVH_USE_SSE
+#include <emmintrin.h>
+#endif
+
+namespace FireRays
+{
+    namespace Native
+    {
+        // Native port of qbvh.cl: stack based traversal of the 4-wide BVH,
+        // all 4 child boxes of a node are tested at once (SSE if available),
+        // internal children are visited closest first.
+        namespace
+        {
+            typedef QbvhTranslator::Node QbvhNode;
+
+            // Max depth of traversal stack, matches QBVH_STACK_SIZE in qbvh.cl
+            int const kStackSize = 64;
+
+            struct SceneData
+            {
+                // BVH structure
+                QbvhNode const* nodes;
+                // Scene positional data
+                float3 const* vertices;
+                // Scene indices
+                Face const* faces;
+                // Shape data
+                ShapeData const* shapes;
+            };
+
+            SceneData GetSceneData(Calc::NativeArgs const& args)
+            {
+                SceneData scenedata =
+                {
+                    args.GetBuffer<QbvhNode const>(0),
+                    args.GetBuffer<float3 const>(1),
+                    args.GetBuffer<Face const>(2),
+                    args.GetBuffer<ShapeData const>(3)
+                };
+
+                return scenedata;
+            }
+
+            // Intersect ray with 4 child boxes, returns the mask of hit
+            // children and their entry distances
+            inline int IntersectBox4(ray const& r, float3 const& invdir, QbvhNode const& node, float maxt, float* tentry)
+            {
+#ifdef QBVH_USE_SSE
+                __m128 const ox = _mm_set1_ps(r.o.x);
+                __m128 const oy = _mm_set1_ps(r.o.y);
+                __m128 const oz = _mm_set1_ps(r.o.z);
+                __m128 const idx = _mm_set1_ps(invdir.x);
+                __m128 const idy = _mm_set1_ps(invdir.y);
+                __m128 const idz = _mm_set1_ps(invdir.z);
+
+                __m128 const tx0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bminx), ox), idx);
+                __m128 const tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmaxx), ox), idx);
+                __m128 const ty0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bminy), oy), idy);
+                __m128 const ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmaxy), oy), idy);
+                __m128 const tz0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bminz), oz), idz);
+                __m128 const tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmaxz), oz), idz);
+
+                __m128 const tmin = _mm_max_ps(
+                    _mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                    _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+                __m128 const tmax = _mm_min_ps(
+                    _mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                    _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(maxt)));
+
+                _mm_storeu_ps(tentry, tmin);
+
+                // Unused slots are masked out by their negative count
+                __m128i const used = _mm_cmpgt_epi32(_mm_loadu_si128((__m128i const*)node.count), _mm_set1_epi32(-1));
+
+                return _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(tmin, tmax), _mm_castsi128_ps(used)));
+#else
+                int mask = 0;
+
+                for (int i = 0; i < QbvhTranslator::kNumChildren; ++i)
+                {
+                    float const tx0 = (node.bminx[i] - r.o.x) * invdir.x;
+                    float const tx1 = (node.bmaxx[i] - r.o.x) * invdir.x;
+                    float const ty0 = (node.bminy[i] - r.o.y) * invdir.y;
+                    float const ty1 = (node.bmaxy[i] - r.o.y) * invdir.y;
+                    float const tz0 = (node.bminz[i] - r.o.z) * invdir.z;
+                    float const tz1 = (node.bmaxz[i] - r.o.z) * invdir.z;
+
+                    float const tmin = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.f));
+                    float const tmax = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), maxt));
+
+                    tentry[i] = tmin;
+
+                    if (tmin <= tmax && node.count[i] >= 0)
+                    {
+                        mask |= (1 << i);
+                    }
+                }
+
+                return mask;
+#endif
+            }
+
+            //  intersect a ray with leaf primitive range
+            void IntersectLeafClosest(SceneData const& scenedata, int start, int numprims, ray const& r, Intersection& isect)
+            {
+                for (int i = start; i < start + numprims; ++i)
+                {
+                    Face const& face = scenedata.faces[i];
+                    ShapeData const& shape = scenedata.shapes[face.shapeidx];
+
+                    if (r.GetMask() & shape.mask)
+                    {
+                        if (IntersectFace(r, scenedata.vertices, face, isect))
+                        {
+                            isect.primid = face.id;
+                            isect.shapeid = shape.id;
+                        }
+                    }
+                }
+            }
+
+            //  intersect a ray with leaf primitive range
+            bool IntersectLeafAny(SceneData const& scenedata, int start, int numprims, ray const& r)
+            {
+                for (int i = start; i < start + numprims; ++i)
+                {
+                    Face const& face = scenedata.faces[i];
+
+                    if ((r.GetMask() & scenedata.shapes[face.shapeidx].mask) &&
+                        IntersectFaceP(r, scenedata.vertices, face))
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            // intersect Ray against the whole BVH structure
+            template <bool any> bool IntersectScene(SceneData const& scenedata, ray const& r, Intersection& isect)
+            {
+                float3 const invdir = GetInvDir(r);
+
+                InitIntersection(r, isect);
+
+                int stack[kStackSize];
+                int* sptr = stack;
+                *sptr++ = -1;
+
+                int idx = 0;
+                while (idx > -1)
+                {
+                    QbvhNode const& node = scenedata.nodes[idx];
+                    float const maxt = any ? r.o.w : isect.uvwt.w;
+
+                    float tentry[QbvhTranslator::kNumChildren];
+                    int hitmask = IntersectBox4(r, invdir, node, maxt, tentry);
+
+                    // Internal children sorted by entry distance
+                    int next[QbvhTranslator::kNumChildren];
+                    float nextt[QbvhTranslator::kNumChildren];
+                    int numnext = 0;
+
+                    for (int i = 0; i < QbvhTranslator::kNumChildren; ++i)
+                    {
+                        if (!(hitmask & (1 << i)))
+                            continue;
+
+                        if (node.count[i] > 0)
+                        {
+                            if (any)
+                            {
+                                if (IntersectLeafAny(scenedata, node.child[i], node.count[i], r))
+                                    return true;
+                            }
+                            else
+                            {
+                                IntersectLeafClosest(scenedata, node.child[i], node.count[i], r, isect);
+                            }
+                        }
+                        else
+                        {
+                            int j = numnext++;
+                            for (; j > 0 && nextt[j - 1] > tentry[i]; --j)
+                            {
+                                next[j] = next[j - 1];
+                                nextt[j] = nextt[j - 1];
+                            }
+
+                            next[j] = node.child[i];
+                            nextt[j] = tentry[i];
+                        }
+                    }
+
+                    if (numnext == 0)
+                    {
+                        idx = *--sptr;
+                        continue;
+                    }
+
+                    // Visit closest child first, defer the others
+                    if (sptr - stack + numnext - 1 > kStackSize)
+                    {
+                        Throw("Native traversal stack overflow");
+                    }
+
+                    for (int i = numnext - 1; i > 0; --i)
+                    {
+                        *sptr++ = next[i];
+                    }
+
+                    idx = next[0];
+                }
+
+                return !any && isect.shapeid >= 0;
+            }
+
+            void IntersectClosestRange(Calc::NativeArgs const& args, int numrays, std::size_t begin, std::size_t end)
+            {
+                auto scenedata = GetSceneData(args);
+                auto rays = args.GetBuffer<void const>(4);
+                auto hits = args.GetBuffer<void>(7);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(8));
+                auto rayflags = args.GetBuffer<int2 const>(9);
+
+                Intersection isect;
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    auto r = LoadRay(rays, rayflags, i, format);
+                    if (r.IsActive())
+                    {
+                        IntersectScene<false>(scenedata, r, isect);
+                        StoreHit(hits, i, isect, format);
+                    }
+                }
+            }
+
+            void IntersectAnyRange(Calc::NativeArgs const& args, int numrays, std::size_t begin, std::size_t end)
+            {
+                auto scenedata = GetSceneData(args);
+                auto rays = args.GetBuffer<void const>(4);
+                auto hitresults = args.GetBuffer<int>(7);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(8));
+                auto rayflags = args.GetBuffer<int2 const>(9);
+
+                Intersection isect;
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    auto r = LoadRay(rays, rayflags, i, format);
+                    if (r.IsActive())
+                    {
+                        hitresults[i] = IntersectScene<true>(scenedata, r, isect) ? 1 : -1;
+                    }
+                }
+            }
+        }
+
+        void RegisterQbvhKernels()
+        {
+            Calc::RegisterNativeKernel("qbvh.cl", "IntersectClosest",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectClosestRange(args, args.GetValue<int>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("qbvh.cl", "IntersectAny",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectAnyRange(args, args.GetValue<int>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("qbvh.cl", "IntersectClosestRC",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectClosestRange(args, *args.GetBuffer<int const>(6), begin, end);
+            });
+
+            Calc::RegisterNativeKernel("qbvh.cl", "IntersectAnyRC",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                IntersectAnyRange(args, *args.GetBuffer<int const>(6), begin, end);
+            });
+        }
+    }
+}
@@ -0,0 +1,126 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "native_common.h"
+
+namespace FireRays
+{
+    namespace Native
+    {
+        // Native port of sort_rays.cl: sort keys, gather
+        // of the rays and scatter of the hits
+        namespace
+        {
+            // Number of bits per axis of quantized ray origin
+            int const kOriginBits = 9;
+            // Key of disabled rays, moves them past all the active ones
+            int const kInactiveKey = 1 << 30;
+
+            // Expands a 10-bit integer into 30 bits
+            // by inserting 2 zeros after each bit.
+            std::uint32_t ExpandBits(std::uint32_t v)
+            {
+                v = (v * 0x00010001u) & 0xFF0000FFu;
+                v = (v * 0x00000101u) & 0x0F00F00Fu;
+                v = (v * 0x00000011u) & 0xC30C30C3u;
+                v = (v * 0x00000005u) & 0x49249249u;
+                return v;
+            }
+
+            int CalcRayKey(ray const& r, float3 const& scenemin, float3 const& invextent)
+            {
+                if (!r.IsActive())
+                {
+                    return kInactiveKey;
+                }
+
+                float const scale = static_cast<float>((1 << kOriginBits) - 1);
+                float3 const p = (r.o - scenemin) * invextent;
+
+                std::uint32_t const x = static_cast<std::uint32_t>(clamp(p.x, 0.f, 1.f) * scale);
+                std::uint32_t const y = static_cast<std::uint32_t>(clamp(p.y, 0.f, 1.f) * scale);
+                std::uint32_t const z = static_cast<std::uint32_t>(clamp(p.z, 0.f, 1.f) * scale);
+
+                std::uint32_t const morton = ExpandBits(x) * 4 + ExpandBits(y) * 2 + ExpandBits(z);
+                std::uint32_t const octant = (r.d.x < 0.f ? 4 : 0) | (r.d.y < 0.f ? 2 : 0) | (r.d.z < 0.f ? 1 : 0);
+
+                return static_cast<int>((octant << (3 * kOriginBits)) | morton);
+            }
+        }
+
+        void RegisterSortRaysKernels()
+        {
+            Calc::RegisterNativeKernel("sort_rays.cl", "CalcRayKeys",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                auto rays = args.GetBuffer<void const>(0);
+                auto numrays = args.GetValue<int>(1);
+                auto scenemin = args.GetValue<float3>(2);
+                auto invextent = args.GetValue<float3>(3);
+                auto keys = args.GetBuffer<int>(4);
+                auto indices = args.GetBuffer<int>(5);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(6));
+                auto rayflags = args.GetBuffer<int2 const>(7);
+
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    keys[i] = CalcRayKey(LoadRay(rays, rayflags, i, format), scenemin, invextent);
+                    indices[i] = static_cast<int>(i);
+                }
+            });
+
+            Calc::RegisterNativeKernel("sort_rays.cl", "GatherRays",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                auto rays = args.GetBuffer<void const>(0);
+                auto numrays = args.GetValue<int>(1);
+                auto indices = args.GetBuffer<int const>(2);
+                auto sortedrays = args.GetBuffer<ray>(3);
+                auto format = static_cast<std::uint32_t>(args.GetValue<int>(4));
+                auto rayflags = args.GetBuffer<int2 const>(5);
+
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    sortedrays[i] = LoadRay(rays, rayflags, indices[i], format);
+                }
+            });
+
+            Calc::RegisterNativeKernel("sort_rays.cl", "ScatterHits",
+                [](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+            {
+                auto sortedrays = args.GetBuffer<ray const>(0);
+                auto numrays = args.GetValue<int>(1);
+                auto indices = args.GetBuffer<int const>(2);
+                auto hitsize = args.GetValue<int>(3);
+                auto sortedhits = args.GetBuffer<int const>(4);
+                auto hits = args.GetBuffer<int>(5);
+
+                for (auto i = begin; i < ClampRange(end, numrays); ++i)
+                {
+                    if (sortedrays[i].IsActive())
+                    {
+                        std::copy(sortedhits + i * hitsize, sortedhits + (i + 1) * hitsize, hits + indices[i] * hitsize);
+                    }
+                }
+            });
+        }
+    }
+}
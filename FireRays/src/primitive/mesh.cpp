@@ -30,10 +30,59 @@ namespace FireRays
 {
     Mesh::Mesh(float const* vertices, int vnum, int vstride,
         int const* vidx, int vistride,
-        int* nfaceverts,
-        int nfaces)
+        int const* nfaceverts,
+        int nfaces,
+        bool shared)
 		: puretriangle_(true)
+        , shared_(shared)
+        , sharedvertices_(nullptr)
+        , vstride_(0)
+        , sharedindices_(nullptr)
+        , istride_(0)
+        , nfaceverts_(nullptr)
+        , numvertices_(vnum)
+        , numfaces_(nfaces)
     {
+        // Shared meshes only keep the pointers and strides
+        if (shared)
+        {
+            sharedvertices_ = vertices;
+            vstride_ = (vstride == 0) ? (3 * sizeof(float)) : vstride;
+            sharedindices_ = vidx;
+            istride_ = (vistride == 0) ? (3 * sizeof(int)) : vistride;
+
+            if (nfaceverts)
+            {
+                for (int i = 0; i < nfaces; ++i)
+                {
+                    ThrowIf(nfaceverts[i] != 3 && nfaceverts[i] != 4, "Wrong number of vertices per face");
+
+                    puretriangle_ = puretriangle_ && nfaceverts[i] == 3;
+                }
+            }
+
+            // Face sizes are only needed for meshes containing quads
+            if (!puretriangle_)
+            {
+                nfaceverts_ = nfaceverts;
+
+                // Densely packed mixed faces can't be addressed by stride
+                if (vistride == 0)
+                {
+                    faceoffsets_.resize(nfaces);
+
+                    std::size_t offset = 0;
+                    for (int i = 0; i < nfaces; ++i)
+                    {
+                        faceoffsets_[i] = offset;
+                        offset += nfaceverts[i] * sizeof(int);
+                    }
+                }
+            }
+
+            return;
+        }
+
         // Handle vertices
         // Allocate space in advance
         vertices_.resize(vnum);
@@ -112,38 +161,57 @@ namespace FireRays
         }
     }
 
-    void Mesh::GetFaceBounds(int faceidx, bool objectspace, bbox& bounds) const
+    void Mesh::UpdateVertices(float const* vertices, int startidx, int vnum, int vstride)
     {
-        if (objectspace)
+        ThrowIf(startidx < 0 || vnum < 0 || startidx + vnum > num_vertices(), "Vertex range is out of bounds");
+
+        // Shared meshes are updated by the caller directly in its memory
+        if (shared_)
         {
-            float3 p1 = vertices_[faces_[faceidx].i0];
-            float3 p2 = vertices_[faces_[faceidx].i1];
-            float3 p3 = vertices_[faces_[faceidx].i2];
+            ThrowIf(vertices != nullptr, "Shared mesh vertices should be updated in place");
+            statechange_ |= kStateChangeVertices;
+            return;
+        }
 
-            bounds = bbox(p1, p2);
-            bounds.grow(p3);
+        ThrowIf(!vertices, "Vertex data is null");
 
-            if (faces_[faceidx].type_ == FaceType::QUAD)
-            {
-                float3 p4 = vertices_[faces_[faceidx].i3];
-                bounds.grow(p4);
-            }
-        }
-        else
+        // Calculate vertex stride, assume dense packing if non passed
+        vstride = (vstride == 0) ? (3 * sizeof(float)) : vstride;
+
+#pragma omp parallel for
+        for (int i = 0; i < vnum; ++i)
         {
-            float3 p1 = transform_point(vertices_[faces_[faceidx].i0], worldmat_);
-            float3 p2 = transform_point(vertices_[faces_[faceidx].i1], worldmat_);
-            float3 p3 = transform_point(vertices_[faces_[faceidx].i2], worldmat_);
+            float const* current = (float const*)((char const*)vertices + i*vstride);
 
-            bounds = bbox(p1, p2);
-            bounds.grow(p3);
+            float3& temp = vertices_[startidx + i];
+            temp.x = current[0];
+            temp.y = current[1];
+            temp.z = current[2];
+        }
 
-            if (faces_[faceidx].type_ == FaceType::QUAD)
-            {
-                float3 p4 = transform_point(vertices_[faces_[faceidx].i3], worldmat_);
-                bounds.grow(p4);
-            }
+        statechange_ |= kStateChangeVertices;
+    }
+
+    void Mesh::GetFaceBounds(int faceidx, bool objectspace, bbox& bounds) const
+    {
+        Face face = GetFace(faceidx);
+
+        float3 p1 = GetVertex(face.i0);
+        float3 p2 = GetVertex(face.i1);
+        float3 p3 = GetVertex(face.i2);
+        float3 p4 = face.type_ == FaceType::QUAD ? GetVertex(face.i3) : p3;
+
+        if (!objectspace)
+        {
+            p1 = transform_point(p1, worldmat_);
+            p2 = transform_point(p2, worldmat_);
+            p3 = transform_point(p3, worldmat_);
+            p4 = transform_point(p4, worldmat_);
         }
+
+        bounds = bbox(p1, p2);
+        bounds.grow(p3);
+        bounds.grow(p4);
     }
 
     Mesh::~Mesh()
@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include <vector>
 #include <memory>
 #include <cassert>
+#include <cstddef>
 
 #include "shapeimpl.h"
 #include "math/bbox.h"
@@ -36,6 +37,8 @@ namespace FireRays
     ///< Transformable primitive implementation which represents
     ///< triangle mesh. Vertices, normals and uvs are indixed separately
     ///< using their own index buffers each.
+    ///< Shared meshes do not copy the data, but reference caller owned
+    ///< memory (along with its strides) which has to outlive the mesh.
     ///<
     class Mesh : public ShapeImpl
     {
@@ -66,8 +69,9 @@ namespace FireRays
         //
         Mesh(float const* vertices, int vnum, int vstride,
             int const* vidx, int vistride,
-            int* nfaceverts,
-            int nfaces);
+            int const* nfaceverts,
+            int nfaces,
+            bool shared = false);
         
         //
         ~Mesh();
@@ -75,14 +79,18 @@ namespace FireRays
         int num_faces() const;
         //
         int num_vertices() const;
+        // Replace positions of vertices [startidx, startidx + vnum)
+        void UpdateVertices(float const* vertices, int startidx, int vnum, int vstride);
         // 
         void GetFaceBounds(int faceidx, bool objectspace, bbox& bounds) const;
         //
-        float3 const* GetVertexData() const { return &vertices_[0]; }
+        float3 GetVertex(int i) const;
         //
-        Face const* GetFaceData() const { return &faces_[0]; }
+        Face GetFace(int i) const;
         // True if the mesh consists of triangles only
 		bool puretriangle() const { return puretriangle_;  }
+        // True if the mesh references caller owned memory
+        bool shared() const { return shared_; }
 
 
     private:
@@ -96,18 +104,72 @@ namespace FireRays
         std::vector<Face> faces_;
 		/// Pure triangle flag
 		bool puretriangle_;
+
+        /// Caller owned data for shared meshes
+        bool shared_;
+        float const* sharedvertices_;
+        int vstride_;
+        int const* sharedindices_;
+        int istride_;
+        int const* nfaceverts_;
+        int numvertices_;
+        int numfaces_;
+        /// Byte offsets of faces in index data for mixed shared meshes
+        std::vector<std::size_t> faceoffsets_;
     };
 
     //
     inline int Mesh::num_faces() const
     {
-        return (int)faces_.size();
+        return numfaces_;
     }
 
     //
     inline int Mesh::num_vertices() const
     {
-        return (int)vertices_.size();
+        return numvertices_;
+    }
+
+    //
+    inline float3 Mesh::GetVertex(int i) const
+    {
+        if (!shared_)
+        {
+            return vertices_[i];
+        }
+
+        float const* current = (float const*)((char const*)sharedvertices_ + (std::size_t)i * vstride_);
+        return float3(current[0], current[1], current[2]);
+    }
+
+    //
+    inline Mesh::Face Mesh::GetFace(int i) const
+    {
+        if (!shared_)
+        {
+            return faces_[i];
+        }
+
+        Face face;
+        std::size_t offset = faceoffsets_.empty() ? (std::size_t)i * istride_ : faceoffsets_[i];
+        int const* current = (int const*)((char const*)sharedindices_ + offset);
+
+        face.i0 = current[0];
+        face.i1 = current[1];
+        face.i2 = current[2];
+
+        if (nfaceverts_ && nfaceverts_[i] == 4)
+        {
+            face.i3 = current[3];
+            face.type_ = QUAD;
+        }
+        else
+        {
+            face.i3 = 0;
+            face.type_ = TRIANGLE;
+        }
+
+        return face;
     }
 }
 
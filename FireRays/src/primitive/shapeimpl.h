@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include "firerays.h"
 #include "math/float3.h"
 #include "math/matrix.h"
+#include "../except/except.h"
 
 namespace FireRays
 {
@@ -41,7 +42,8 @@ namespace FireRays
             kStateChangeTransform = 0x1,
             kStateChangeMotion = 0x2,
             kStateChangeId = 0x4,
-			kStateChangeMask = 0x5
+			kStateChangeMask = 0x5,
+            kStateChangeVertices = 0x8
         };
         
 		// Constructor
@@ -82,6 +84,9 @@ namespace FireRays
 
 		// Get intersection mask
 		int  GetMask() const;
+
+        // Vertex update, not supported by default
+        void UpdateVertices(float const* vertices, int startidx, int vnum, int vstride);
         
         // Get state changes since last OnCommit
         int GetStateChange() const;
@@ -182,6 +187,11 @@ namespace FireRays
 	{
 		return mask_;
 	}
+
+    inline void ShapeImpl::UpdateVertices(float const*, int, int, int)
+    {
+        Throw("Vertex update is not supported by this shape type");
+    }
 }
 
 
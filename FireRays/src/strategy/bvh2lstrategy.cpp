@@ -20,6 +20,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "bvh2lstrategy.h"
+#include "bvh_options.h"
 #include "../accelerator/bvh.h"
 #include "../translator/plain_bvh_translator.h"
 #include "../world/world.h"
@@ -35,9 +36,15 @@ THE SOFTWARE.
 #include "device.h"
 #include "executable.h"
 
+#include <algorithm>
+#include <cmath>
+#include <map>
 #include <set>
 
 static int const kWorkGroupSize = 64;
+// Moving shapes are split into motion segments if the surface area
+// of their swept bounds is that many times larger than the static one
+static float const kMotionSplitRatio = 2.f;
 
 namespace FireRays
 {
@@ -59,12 +66,12 @@ namespace FireRays
 
 	struct Bvh2lStrategy::Face
 	{
-		// Up to 4 indices
+		// Vertex indices, the fourth one is -1 for triangles
 		int idx[4];
+		// Shape index, unused since bottom level BVHs are shared between instances
+		int shapeidx;
 		// Primitive ID within the mesh
 		int id;
-		// Idx count
-		int cnt;
 	};
 
 	struct Bvh2lStrategy::GpuData
@@ -79,8 +86,18 @@ namespace FireRays
 		Calc::Buffer* faces;
 		// Shape IDs
 		Calc::Buffer* shapes;
+		// Top level BVH root indices per motion segment
+		Calc::Buffer* roots;
 
-		int bvhrootidx;
+		// Number of motion segments (top level BVHs)
+		int numsegments;
+
+		// Buffer capacities in elements
+		int nodecapacity;
+		int vertexcapacity;
+		int facecapacity;
+		int shapecapacity;
+		int rootcapacity;
 
 		Calc::Executable* executable;
 		Calc::Function* isect_func;
@@ -94,16 +111,31 @@ namespace FireRays
 			, vertices(nullptr)
 			, faces(nullptr)
 			, shapes(nullptr)
-			, bvhrootidx(-1)
+			, roots(nullptr)
+			, numsegments(1)
+			, nodecapacity(0)
+			, vertexcapacity(0)
+			, facecapacity(0)
+			, shapecapacity(0)
+			, rootcapacity(0)
 		{
 		}
 
-		~GpuData()
+		// Release geometry buffers, shape and root buffers are managed separately
+		void Release()
 		{
 			device->DeleteBuffer(bvh);
 			device->DeleteBuffer(vertices);
 			device->DeleteBuffer(faces);
+			bvh = vertices = faces = nullptr;
+			nodecapacity = vertexcapacity = facecapacity = 0;
+		}
+
+		~GpuData()
+		{
+			Release();
 			device->DeleteBuffer(shapes);
+			device->DeleteBuffer(roots);
 			executable->DeleteFunction(isect_func);
 			executable->DeleteFunction(occlude_func);
 			executable->DeleteFunction(isect_indirect_func);
@@ -113,18 +145,90 @@ namespace FireRays
 	};
 
 
+	struct Bvh2lStrategy::MeshData
+	{
+		// Bottom level BVH of the mesh
+		std::unique_ptr<Bvh> bvh;
+		// Start indices of the mesh nodes, vertices and faces in GPU buffers, -1 if not uploaded yet
+		int nodestart;
+		int vertexstart;
+		int facestart;
+	};
+
 	struct Bvh2lStrategy::CpuData
 	{
-		std::vector<int> mesh_vertices_start_idx;
-		std::vector<int> mesh_faces_start_idx;
-		std::vector<Bvh const*> bvhptrs;
+		// Bottom level BVHs cached between commits, so only new
+		// or deformed meshes are built and uploaded
+		std::map<Shape const*, MeshData> meshes;
+		// Top level BVH per motion segment
+		std::vector<std::unique_ptr<Bvh>> toplevels;
 		std::vector<ShapeData> shapedata;
-		std::vector<bbox> bounds;
+		// Value of "bvh.motion.segments" option of the last build
+		int motionsegments;
+		// Builder settings of the cached bottom level BVHs
+		BvhBuildSettings settings;
+
+		// Used parts of GPU buffers, data of detached meshes is left in place
+		// until it takes too much space and everything is uploaded again
+		int numnodes;
+		int numvertices;
+		int numfaces;
 
 		PlainBvhTranslator translator;
+
+		CpuData()
+			: motionsegments(1)
+			, settings()
+			, numnodes(0)
+			, numvertices(0)
+			, numfaces(0)
+		{
+		}
 	};
 
-	Bvh2lStrategy::Bvh2lStrategy(Calc::Device* device)
+	// Angular velocity as a unit quaternion
+	static quaternion GetRotation(ShapeImpl const* shape)
+	{
+		quaternion q = shape->GetAngularVelocity();
+		return q.sqnorm() > 0.f ? normalize(q) : quaternion();
+	}
+
+	// World space bounds of the object space box moving within the time range [t0, t1].
+	// Points are swept along arcs by the rotation, so the range is split into
+	// steps of at most 45 degrees and the boxes at the ends of each step are
+	// grown by the sagitta of the arc.
+	static bbox GetMotionBounds(bbox const& b, matrix const& m, float3 const& velocity, quaternion const& rotation, float t0, float t1)
+	{
+		float const kMaxStepAngle = 0.785398163f;
+		float angle = 2.f * std::acos(std::min(std::max(rotation.w, -1.f), 1.f)) * (t1 - t0);
+		int numsteps = std::max((int)std::ceil(angle / kMaxStepAngle), 1);
+
+		// Distance of the farthest box point from the rotation center
+		float3 farthest = float3(std::max(std::abs(b.pmin.x), std::abs(b.pmax.x)),
+			std::max(std::abs(b.pmin.y), std::abs(b.pmax.y)),
+			std::max(std::abs(b.pmin.z), std::abs(b.pmax.z)));
+		float sagitta = std::sqrt(farthest.sqnorm()) * (1.f - std::cos(0.5f * angle / numsteps));
+
+		bbox prevbounds = transform_bbox(b, quaternion_to_matrix(slerp(quaternion(), rotation, t0)));
+		bbox objbounds = prevbounds;
+
+		for (int i = 1; i <= numsteps; ++i)
+		{
+			bbox nextbounds = transform_bbox(b, quaternion_to_matrix(slerp(quaternion(), rotation, t0 + (t1 - t0) * i / numsteps)));
+			bbox stepbounds = bboxunion(prevbounds, nextbounds);
+			stepbounds.grow(stepbounds.pmin - float3(sagitta, sagitta, sagitta));
+			stepbounds.grow(stepbounds.pmax + float3(sagitta, sagitta, sagitta));
+			objbounds = bboxunion(objbounds, stepbounds);
+			prevbounds = nextbounds;
+		}
+
+		// Translation sweeps world space box along the segment
+		bbox bounds = transform_bbox(objbounds, m);
+		return bboxunion(bbox(bounds.pmin + velocity * t0, bounds.pmax + velocity * t0),
+			bbox(bounds.pmin + velocity * t1, bounds.pmax + velocity * t1));
+	}
+
+	Bvh2lStrategy::Bvh2lStrategy(Calc::Device* device, Calc::ExecutableCache* cache)
 		: Strategy(device)
 		, m_gpudata(new GpuData(device))
 		, m_cpudata(new CpuData)
@@ -134,10 +238,10 @@ namespace FireRays
 
 		int numheaders = sizeof(headers) / sizeof(char const*);
 
-		m_gpudata->executable = m_device->CompileExecutable("../FireRays/src/kernel/CL/bvh2l.cl", headers, numheaders);
+		m_gpudata->executable = cache->CompileExecutable("../FireRays/src/kernel/CL/bvh2l.cl", headers, numheaders);
 
 #else
-		m_gpudata->executable = m_device->CompileExecutable(cl_bvh2l, std::strlen(cl_bvh2l), nullptr);
+		m_gpudata->executable = cache->CompileExecutable(cl_bvh2l, std::strlen(cl_bvh2l), nullptr);
 #endif
 
 		m_gpudata->isect_func = m_gpudata->executable->CreateFunction("IntersectClosest2L");
@@ -148,465 +252,474 @@ namespace FireRays
 
 	void Bvh2lStrategy::Preprocess(World const& world)
 	{
-		// If something has been changed we need to rebuild BVH
-		int statechange = world.GetStateChange();
+		// Number of motion segments for fast moving shapes
+		auto optsegments = world.options_.GetOption("bvh.motion.segments");
+		int motionsegments = optsegments ? std::max((int)optsegments->AsFloat(), 1) : 1;
+		// Bottom level builder settings, options are not tracked by the world
+		auto settings = GetBvhBuildSettings(world, false);
+
+		// Nothing to do if neither the set of shapes nor any of them has been changed
+		if (m_gpudata->bvh && !world.has_changed() && world.GetStateChange() == ShapeImpl::kStateChangeNone &&
+			motionsegments == m_cpudata->motionsegments && settings == m_cpudata->settings)
+		{
+			return;
+		}
 
-		// Full rebuild in case number of objects changes
-		if (m_bvhs.size() == 0 || world.has_changed())
+		m_cpudata->motionsegments = motionsegments;
+
+		// Cached BVHs have been built with other settings
+		if (settings != m_cpudata->settings)
 		{
-			//std::cout << "Rebuild\n";
-			auto builder = world.options_.GetOption("bvh.builder");
-			bool enablesah = false;
+			m_cpudata->meshes.clear();
+			m_cpudata->settings = settings;
+		}
 
-			if (builder && builder->AsString() == "sah")
-			{
-				enablesah = true;
-			}
+		// Copy the shapes here to be able to partition them and handle more efficiently
+		// #22: we need to be able to handle instances whos base shapes are not present 
+		// in the scene, so we have to add them manually here.
+		std::vector<Shape const*> shapes;
+		std::set<Shape const*> shapes_disabled;
 
-			// Copy the shapes here to be able to partition them and handle more efficiently
-			// #22: we need to be able to handle instances whos base shapes are not present 
-			// in the scene, so we have to add them manually here.
-			std::vector<Shape const*> shapes;
-			std::set<Shape const*> shapes_disabled;
+		for (auto s : world.shapes_)
+		{
+			auto shapeimpl = static_cast<ShapeImpl const*>(s);
 
-			for (auto s : world.shapes_)
+			if (shapeimpl->is_instance())
 			{
-				auto shapeimpl = static_cast<ShapeImpl const*>(s);
+				// Here we know this is an instance, need to check if its base shape has been added as well
+				auto instance = static_cast<Instance const*>(shapeimpl);
+				auto base_shape = instance->GetBaseShape();
 
-				if (shapeimpl->is_instance())
+				if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend() &&
+					shapes_disabled.find(base_shape) == shapes_disabled.cend())
 				{
-					// Here we know this is an instance, need to check if its base shape has been added as well
-					auto instance = static_cast<Instance const*>(shapeimpl);
-					auto base_shape = instance->GetBaseShape();
-
-					if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend())
-					{
-						// Need to add the shape to the list
-						shapes.push_back(base_shape);
-						// And mark it disabled
-						shapes_disabled.insert(base_shape);
-					}
+					// Need to add the shape to the list
+					shapes.push_back(base_shape);
+					// And mark it disabled
+					shapes_disabled.insert(base_shape);
 				}
-
-				shapes.push_back(s);
 			}
 
-			// Now partition the range into meshes and instances
-			auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
-			{
-				return !static_cast<ShapeImpl const*>(shape)->is_instance();
-			});
-
-			// Count the number of meshes
-			int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-			// Count the number of instances
-			int numinstances = (int)std::distance(firstinst, shapes.end());
-
-			int numvertices = 0;
-			int numfaces = 0;
-
-			// This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
-			m_cpudata->mesh_vertices_start_idx.resize(nummeshes);
-			m_cpudata->mesh_faces_start_idx.resize(nummeshes);
-			m_cpudata->bvhptrs.resize(nummeshes + 1);
-			m_cpudata->shapedata.resize(nummeshes + numinstances);
-
-			// [0...numshapes-1] contain bottom level BVHs
-			// [numshapes] is the top level one
-			m_bvhs.resize(nummeshes + 1);
-			// Create actual BVH objects
-			for (int i = 0; i < nummeshes + 1; ++i)
-			{
-				m_bvhs[i].reset(new Bvh(enablesah));
-				m_cpudata->bvhptrs[i] = m_bvhs[i].get();
-			}
+			shapes.push_back(s);
+		}
 
-			// Prepare necessary offsets in the arrays
-			// in order to be able to parallelize
-			for (int i = 0; i < nummeshes; ++i)
-			{
-				Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+		// Now partition the range into meshes and instances
+		auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
+		{
+			return !static_cast<ShapeImpl const*>(shape)->is_instance();
+		});
 
-				m_cpudata->mesh_faces_start_idx[i] = numfaces;
-				m_cpudata->mesh_vertices_start_idx[i] = numvertices;
+		// Count the number of meshes
+		int nummeshes = (int)std::distance(shapes.begin(), firstinst);
+		// Count the number of instances
+		int numinstances = (int)std::distance(firstinst, shapes.end());
 
-				numfaces += mesh->num_faces();
-				numvertices += mesh->num_vertices();
-			}
+		// Pick cached BVHs of the meshes, the ones of detached meshes are released
+		std::map<Shape const*, MeshData> cache;
+		cache.swap(m_cpudata->meshes);
 
-			// We can't avoild allocating it here, since bounds aren't stored anywhere
-			m_cpudata->bounds.resize(numfaces);
+		std::vector<MeshData*> meshdata(nummeshes);
+		std::vector<int> newmeshes;
 
-			// We are storing individual object bounds here to build top level BVH
-			std::vector<bbox> object_bounds(nummeshes + numinstances);
+		for (int i = 0; i < nummeshes; ++i)
+		{
+			auto shapeimpl = static_cast<ShapeImpl const*>(shapes[i]);
+			auto iter = cache.find(shapes[i]);
 
-			matrix m, minv;
+			// Deleted shape address might have been reused by a new mesh
+			bool valid = iter != cache.end() &&
+				!(world.GetDirtyFlags(shapes[i]) & World::kDirtyDeleted) &&
+				!(shapeimpl->GetStateChange() & ShapeImpl::kStateChangeVertices);
 
-			// Handle simple shapes
-#pragma omp parallel for
-			for (int i = 0; i < nummeshes; ++i)
+			MeshData& data = m_cpudata->meshes[shapes[i]];
+
+			if (valid)
 			{
+				data = std::move(iter->second);
+			}
+			else
+			{
+				data.bvh.reset(CreateBvh(settings));
+				data.nodestart = data.vertexstart = data.facestart = -1;
+				newmeshes.push_back(i);
+			}
 
-				Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-				// Get transform to apply to object bounds
-				mesh->GetTransform(m, minv);
+			meshdata[i] = &data;
+		}
 
-				for (int j = 0; j < mesh->num_faces(); ++j)
-				{
-					// Request bounds in object space since we build BVHs for objects locally
-					mesh->GetFaceBounds(j, true, m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i] + j]);
-				}
+		cache.clear();
 
-				// Build BVH for current mesh
-				m_bvhs[i]->Build(&m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i]], mesh->num_faces());
+		// Build BVHs for new and deformed meshes
+#pragma omp parallel for
+		for (int i = 0; i < (int)newmeshes.size(); ++i)
+		{
+			Mesh const* mesh = static_cast<Mesh const*>(shapes[newmeshes[i]]);
 
-				// Extract and store bounds. Note they are in object space and we need to translate them to world space
-				object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
+			// Request bounds in object space since we build BVHs for objects locally
+			std::vector<bbox> bounds(mesh->num_faces());
 
-				// Collect BVH pointers for toip level build
-				m_cpudata->bvhptrs[i] = m_bvhs[i].get();
+			for (int j = 0; j < mesh->num_faces(); ++j)
+			{
+				mesh->GetFaceBounds(j, true, bounds[j]);
 			}
 
-			// Handle instances
-#pragma omp parallel for
-			for (int i = nummeshes; i < nummeshes + numinstances; ++i)
-			{
+			meshdata[newmeshes[i]]->bvh->Build(bounds.empty() ? nullptr : &bounds[0], mesh->num_faces());
+		}
 
-				Instance const* instance = static_cast<Instance const*>(shapes[i]);
-				// Get transform to apply to object bounds
-				instance->GetTransform(m, minv);
+		int numshapes = nummeshes + numinstances;
 
-				// Find BVH for the instance
-				Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+		// Mesh BVH index for every shape
+		std::vector<int> bvhindices(numshapes);
+		// We are storing individual object bounds here to build top level BVH,
+		// swept ones for moving shapes
+		std::vector<bbox> object_bounds(numshapes);
+		// Fast moving shapes get their bounds per motion segment
+		std::vector<int> fastmoving;
 
-				// It should be there
-				auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+		for (int i = 0; i < numshapes; ++i)
+		{
+			if (i < nummeshes)
+			{
+				bvhindices[i] = i;
+			}
+			else
+			{
+				// Find BVH for the instance
+				Instance const* instance = static_cast<Instance const*>(shapes[i]);
+				auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, instance->GetBaseShape());
 
 				// TODO: should be assert
 				ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
 
-				int bvhidx = (int)std::distance(shapes.cbegin(), iter);
-
-				// Extract and store bounds. Note they are in object space and we need to translate them to world space
-				object_bounds[i] = transform_bbox(m_bvhs[bvhidx]->Bounds(), m);
+				bvhindices[i] = (int)std::distance(shapes.cbegin(), iter);
 			}
 
-			// Calculate top level BVH
-			m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
-			m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
-
-			m_cpudata->translator.Flush();
-			// TODO: parallelize this
-			m_cpudata->translator.Process(&m_cpudata->bvhptrs[0], &m_cpudata->mesh_faces_start_idx[0], nummeshes);
-
-			// Update GPU data
-			// Copy translated nodes first
-			m_gpudata->bvh = m_device->CreateBuffer(m_cpudata->translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::kRead, &m_cpudata->translator.nodes_[0]);
-			m_gpudata->bvhrootidx = m_cpudata->translator.root_;
+			// Extract and store bounds. Note they are in object space and we need to translate them to world space
+			auto shapeimpl = static_cast<ShapeImpl const*>(shapes[i]);
+			matrix m, minv;
+			shapeimpl->GetTransform(m, minv);
+			bbox const& bounds = meshdata[bvhindices[i]]->bvh->Bounds();
+			object_bounds[i] = transform_bbox(bounds, m);
 
+			float3 velocity = shapeimpl->GetLinearVelocity();
+			quaternion rotation = GetRotation(shapeimpl);
 
-			// Create vertex buffer
+			if (velocity.sqnorm() > 0.f || rotation.w < 1.f)
 			{
-				// Vertices
-				m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::kRead);
-
-				// Get the pointer to mapped data
-				float3* vertexdata = nullptr;
-				Calc::Event* e = nullptr;
+				bbox motionbounds = GetMotionBounds(bounds, m, velocity, rotation, 0.f, 1.f);
 
-				m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
-
-				e->Wait();
-				m_device->DeleteEvent(e);
-
-				// Here we need to put data in world space rather than object space
-				// So we need to get the transform from the mesh and multiply each vertex
-				matrix m, minv;
-
-#pragma omp parallel for
-				for (int i = 0; i < nummeshes; ++i)
+				if (motionbounds.surface_area() > kMotionSplitRatio * object_bounds[i].surface_area())
 				{
-					// Get the mesh
-					Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-					// Get vertex buffer of the current mesh
-					float3 const* myvertexdata = mesh->GetVertexData();
-
-					// Iterate thru vertices multiply and append them to GPU buffer
-					for (int j = 0; j < mesh->num_vertices(); ++j)
-					{
-						vertexdata[m_cpudata->mesh_vertices_start_idx[i] + j] = myvertexdata[j];
-					}
+					fastmoving.push_back(i);
 				}
 
-				m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
-
-				e->Wait();
-				m_device->DeleteEvent(e);
+				object_bounds[i] = motionbounds;
 			}
+		}
 
-			// Create face buffer
-			{
-				// Create face buffer
-				m_gpudata->faces = m_device->CreateBuffer(numfaces * sizeof(Face), Calc::kRead);
-
-				// Get the pointer to mapped data
-				Face* facedata = nullptr;
-				Calc::Event* e = nullptr;
+		// Shutter interval is split into segments only if there are fast moving shapes, every
+		// segment has its own top level BVH where these shapes are bounded within segment time range
+		int numsegments = fastmoving.empty() ? 1 : motionsegments;
 
-				m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * sizeof(Face), Calc::MapType::kMapWrite, (void**)&facedata, &e);
+		m_cpudata->toplevels.resize(numsegments);
 
-				e->Wait();
-				m_device->DeleteEvent(e);
+		int numtopnodes = 0;
 
-				// Here the point is to add mesh starting index to actual index contained within the mesh,
-				// getting absolute index in the buffer.
-				// Besides that we need to permute the faces accorningly to BVH reordering, whihc
-				// is contained within bvh.primids_
+		for (int i = 0; i < numsegments; ++i)
+		{
+			if (numsegments > 1)
+			{
+				float t0 = (float)i / numsegments;
+				float t1 = (float)(i + 1) / numsegments;
 
 #pragma omp parallel for
-				for (int i = 0; i < nummeshes; ++i)
+				for (int j = 0; j < (int)fastmoving.size(); ++j)
 				{
-					// Reordering indices for a given mesh
-					int const* reordering = m_bvhs[i]->GetIndices();
-
-					// Get the mesh
-					Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+					auto shapeimpl = static_cast<ShapeImpl const*>(shapes[fastmoving[j]]);
+					matrix m, minv;
+					shapeimpl->GetTransform(m, minv);
+					bbox const& bounds = meshdata[bvhindices[fastmoving[j]]]->bvh->Bounds();
 
-					Mesh::Face const* myfaces = mesh->GetFaceData();
+					object_bounds[fastmoving[j]] = GetMotionBounds(bounds, m, shapeimpl->GetLinearVelocity(), GetRotation(shapeimpl), t0, t1);
+				}
+			}
 
-					int startidx = m_cpudata->mesh_vertices_start_idx[i];
+			// Calculate top level BVH
+			auto& toplevel = m_cpudata->toplevels[i];
+			// Top level leaves always hold a single shape
+			toplevel.reset(CreateBvh(world, false, 1));
+			toplevel->Build(&object_bounds[0], numshapes);
 
-					for (int j = 0; j < mesh->num_faces(); ++j)
-					{
-						// Copy face data to GPU buffer
-						int myidx = m_cpudata->mesh_faces_start_idx[i] + j;
-						int faceidx = reordering[j];
+			numtopnodes += toplevel->GetNumNodes();
+		}
 
-						facedata[myidx].idx[0] = myfaces[faceidx].idx[0] + startidx;
-						facedata[myidx].idx[1] = myfaces[faceidx].idx[1] + startidx;
-						facedata[myidx].idx[2] = myfaces[faceidx].idx[2] + startidx;
-						facedata[myidx].idx[3] = myfaces[faceidx].idx[3] + startidx;
+		// Sizes of the data in use and the one to append
+		int livenodes = 0, livevertices = 0, livefaces = 0;
+		int newnodes = 0, newvertices = 0, newfaces = 0;
 
-						facedata[myidx].cnt = (myfaces[faceidx].type_ == Mesh::FaceType::QUAD ? 4 : 3);
-						facedata[myidx].id = faceidx;
-					}
-				}
+		for (int i = 0; i < nummeshes; ++i)
+		{
+			Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-				m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+			livenodes += meshdata[i]->bvh->GetNumNodes();
+			livevertices += mesh->num_vertices();
+			livefaces += mesh->num_faces();
 
-				e->Wait();
-				m_device->DeleteEvent(e);
+			if (meshdata[i]->nodestart < 0)
+			{
+				newnodes += meshdata[i]->bvh->GetNumNodes();
+				newvertices += mesh->num_vertices();
+				newfaces += mesh->num_faces();
 			}
+		}
 
+		// Upload everything again if new data doesn't fit or
+		// detached meshes take more space than the ones in use
+		bool reupload = !m_gpudata->bvh ||
+			m_cpudata->numnodes + newnodes + numtopnodes > m_gpudata->nodecapacity ||
+			m_cpudata->numvertices + newvertices > m_gpudata->vertexcapacity ||
+			m_cpudata->numfaces + newfaces > m_gpudata->facecapacity ||
+			m_cpudata->numvertices - (livevertices - newvertices) > livevertices ||
+			m_cpudata->numfaces - (livefaces - newfaces) > livefaces;
 
-			// Now we need to collect shapdata
-			int const* topindices = m_bvhs[nummeshes]->GetIndices();
-
-#pragma omp parallel for
-			for (int i = 0; i < nummeshes + numinstances; ++i)
+		if (reupload)
+		{
+			for (int i = 0; i < nummeshes; ++i)
 			{
-				// Get the mesh
-				ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
+				meshdata[i]->nodestart = meshdata[i]->vertexstart = meshdata[i]->facestart = -1;
+			}
 
-				m_cpudata->shapedata[i].id = shapeimpl->GetId();
+			m_cpudata->numnodes = m_cpudata->numvertices = m_cpudata->numfaces = 0;
 
-				// For disabled shapes force mask to zero since these shapes 
-				// present only virtually (they have not been added to the scene)
-				// and we need to skip them while doing traversal.
-				if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
-				{
-					m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
-				}
-				else
-				{
-					m_cpudata->shapedata[i].mask = 0x0;
-				}
+			m_gpudata->Release();
 
-				shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
+			// Leave some room for meshes attached later
+			m_gpudata->nodecapacity = std::max(livenodes + numtopnodes + (livenodes + numtopnodes) / 2, 1);
+			m_gpudata->vertexcapacity = std::max(livevertices + livevertices / 2, 1);
+			m_gpudata->facecapacity = std::max(livefaces + livefaces / 2, 1);
 
-				if (!shapeimpl->is_instance())
-				{
-					m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[topindices[i]];
-				}
-				else
-				{
-					Instance const* instance = static_cast<Instance const*>(shapes[topindices[i]]);
+			m_gpudata->bvh = m_device->CreateBuffer(m_gpudata->nodecapacity * sizeof(PlainBvhTranslator::Node), Calc::kRead);
+			m_gpudata->vertices = m_device->CreateBuffer(m_gpudata->vertexcapacity * sizeof(float3), Calc::kRead);
+			m_gpudata->faces = m_device->CreateBuffer(m_gpudata->facecapacity * sizeof(Face), Calc::kRead);
+		}
 
-					// Find corresponding mesh
-					Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+		// Append new meshes at the end of used ranges
+		int firstnode = m_cpudata->numnodes;
+		int firstvertex = m_cpudata->numvertices;
+		int firstface = m_cpudata->numfaces;
 
-					// It should be there
-					auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+		std::vector<int> appended;
 
-					// TODO: should be assert
-					ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+		for (int i = 0; i < nummeshes; ++i)
+		{
+			if (meshdata[i]->nodestart < 0)
+			{
+				Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-					int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+				meshdata[i]->nodestart = m_cpudata->numnodes;
+				meshdata[i]->vertexstart = m_cpudata->numvertices;
+				meshdata[i]->facestart = m_cpudata->numfaces;
 
-					m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
-				}
-			}
+				m_cpudata->numnodes += meshdata[i]->bvh->GetNumNodes();
+				m_cpudata->numvertices += mesh->num_vertices();
+				m_cpudata->numfaces += mesh->num_faces();
 
-			// Create face ID buffer
-			m_gpudata->shapes = m_device->CreateBuffer((nummeshes + numinstances) * sizeof(ShapeData), Calc::kRead, &m_cpudata->shapedata[0]);
+				appended.push_back(i);
+			}
 		}
-		// Refit
-		else if (statechange != ShapeImpl::kStateChangeNone)
-		{
-			//std::cout << "Refit\n";
 
-			// Copy the shapes here to be able to partition them and handle more efficiently
-			// #22: we need to be able to handle instances whos base shapes are not present 
-			// in the scene, so we have to add them manually here.
-			std::vector<Shape const*> shapes;
-			std::set<Shape const*> shapes_disabled;
+		// Translate appended bottom level BVHs and the top level one right after them
+		auto& translator = m_cpudata->translator;
+		translator.nodes_.resize(m_cpudata->numnodes + numtopnodes);
 
-			for (auto s : world.shapes_)
-			{
-				auto shapeimpl = static_cast<ShapeImpl const*>(s);
+#pragma omp parallel for
+		for (int i = 0; i < (int)appended.size(); ++i)
+		{
+			MeshData const* data = meshdata[appended[i]];
+			translator.Process(*data->bvh, data->nodestart, data->facestart);
+		}
 
-				if (shapeimpl->is_instance())
-				{
-					// Here we know this is an instance, need to check if its base shape has been added as well
-					auto instance = static_cast<Instance const*>(shapeimpl);
-					auto base_shape = instance->GetBaseShape();
-
-					if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend())
-					{
-						// Need to add the shape to the list
-						shapes.push_back(base_shape);
-						// And mark it disabled
-						shapes_disabled.insert(base_shape);
-					}
-				}
+		// Leaves of every top level BVH refer to their own range of shape data
+		std::vector<int> roots(numsegments);
+		translator.root_ = m_cpudata->numnodes;
 
-				shapes.push_back(s);
-			}
+		for (int i = 0, startidx = translator.root_; i < numsegments; ++i)
+		{
+			roots[i] = startidx;
+			translator.Process(*m_cpudata->toplevels[i], startidx, i * numshapes);
+			startidx += m_cpudata->toplevels[i]->GetNumNodes();
+		}
 
-			// Now partition the range into meshes and instances
-			auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
-			{
-				return !static_cast<ShapeImpl const*>(shape)->is_instance();
-			});
+		translator.nodecnt_ = m_cpudata->numnodes + numtopnodes;
 
-			// Count the number of meshes
-			int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-			// Count the number of instances
-			int numinstances = (int)std::distance(firstinst, shapes.end());
+		// Update GPU data
+		// Copy translated nodes first, appended ones and top level are contiguous
+		{
+			Calc::Event* e = nullptr;
+			m_device->WriteBuffer(m_gpudata->bvh, 0, firstnode * sizeof(PlainBvhTranslator::Node), (translator.nodecnt_ - firstnode) * sizeof(PlainBvhTranslator::Node), &translator.nodes_[firstnode], &e);
 
-			std::vector<bbox> object_bounds(nummeshes + numinstances);
+			e->Wait();
+			m_device->DeleteEvent(e);
+		}
 
-			matrix m, minv;
+		// Update top level roots
+		if (numsegments > m_gpudata->rootcapacity)
+		{
+			m_device->DeleteBuffer(m_gpudata->roots);
+			m_gpudata->rootcapacity = numsegments;
+			m_gpudata->roots = m_device->CreateBuffer(m_gpudata->rootcapacity * sizeof(int), Calc::kRead);
+		}
 
-			// Go over meshes and rebuild BVH bounds
-#pragma omp parallel for
-			for (int i = 0; i < nummeshes; ++i)
-			{
-				Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-				// Get transform to apply to object bounds
-				mesh->GetTransform(m, minv);
-				// Extract and store bounds. Note they are in object space and we need to translate them to world space
-				object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
-			}
+		{
+			Calc::Event* e = nullptr;
+			m_device->WriteBuffer(m_gpudata->roots, 0, 0, numsegments * sizeof(int), &roots[0], &e);
 
-#pragma omp parallel for
-			for (int i = nummeshes; i < nummeshes + numinstances; ++i)
-			{
+			e->Wait();
+			m_device->DeleteEvent(e);
+		}
 
-				Instance const* instance = static_cast<Instance const*>(shapes[i]);
-				// Get transform to apply to object bounds
-				instance->GetTransform(m, minv);
+		m_gpudata->numsegments = numsegments;
 
-				// Find BVH for the instance
-				Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+		// Append vertices
+		if (m_cpudata->numvertices > firstvertex)
+		{
+			// Get the pointer to mapped data
+			float3* vertexdata = nullptr;
+			Calc::Event* e = nullptr;
 
-				// It should be there
-				auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+			m_device->MapBuffer(m_gpudata->vertices, 0, firstvertex * sizeof(float3), (m_cpudata->numvertices - firstvertex) * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
 
-				// TODO: should be assert
-				ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+			e->Wait();
+			m_device->DeleteEvent(e);
 
-				int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+			// Bottom level BVHs are in object space, so are the vertices
+#pragma omp parallel for
+			for (int i = 0; i < (int)appended.size(); ++i)
+			{
+				// Get the mesh
+				Mesh const* mesh = static_cast<Mesh const*>(shapes[appended[i]]);
+				int startidx = meshdata[appended[i]]->vertexstart - firstvertex;
 
-				// Extract and store bounds. Note they are in object space and we need to translate them to world space
-				object_bounds[i] = transform_bbox(m_bvhs[bvhidx]->Bounds(), m);
+				// Iterate thru vertices and append them to GPU buffer
+				for (int j = 0; j < mesh->num_vertices(); ++j)
+				{
+					vertexdata[startidx + j] = mesh->GetVertex(j);
+				}
 			}
 
-			// Calculate top level BVH
-			m_bvhs[nummeshes].reset(new Bvh());
-			m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
-			m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
-
+			m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
 
-			// TODO: parallelize this
-			m_cpudata->translator.UpdateTopLevel(*m_bvhs[nummeshes]);
+			e->Wait();
+			m_device->DeleteEvent(e);
+		}
 
-			// Update GPU data
-			// Copy only top BVH data
+		// Append faces
+		if (m_cpudata->numfaces > firstface)
+		{
+			// Get the pointer to mapped data
+			Face* facedata = nullptr;
 			Calc::Event* e = nullptr;
-			m_device->WriteBuffer(m_gpudata->bvh, 0, m_cpudata->translator.root_ * sizeof(PlainBvhTranslator::Node), (2 * (nummeshes + numinstances) - 1) * sizeof(PlainBvhTranslator::Node), (char*)&m_cpudata->translator.nodes_[m_cpudata->translator.root_], &e);
+
+			m_device->MapBuffer(m_gpudata->faces, 0, firstface * sizeof(Face), (m_cpudata->numfaces - firstface) * sizeof(Face), Calc::MapType::kMapWrite, (void**)&facedata, &e);
 
 			e->Wait();
 			m_device->DeleteEvent(e);
 
-			// Now we need to collect shapdata
-			int const* topindices = m_bvhs[nummeshes]->GetIndices();
-
+			// Here the point is to add mesh starting index to actual index contained within the mesh,
+			// getting absolute index in the buffer.
+			// Besides that we need to permute the faces accorningly to BVH reordering, whihc
+			// is contained within bvh.primids_
 #pragma omp parallel for
-			for (int i = 0; i < nummeshes + numinstances; ++i)
+			for (int i = 0; i < (int)appended.size(); ++i)
 			{
+				MeshData const* data = meshdata[appended[i]];
+
+				// Reordering indices for a given mesh
+				int const* reordering = data->bvh->GetIndices();
+
 				// Get the mesh
-				ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
+				Mesh const* mesh = static_cast<Mesh const*>(shapes[appended[i]]);
 
-				m_cpudata->shapedata[i].id = shapeimpl->GetId();
-				// For disabled shapes force mask to zero since these shapes 
-				// present only virtually (they have not been added to the scene)
-				// and we need to skip them while doing traversal.
-				if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
-				{
-					m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
-				}
-				else
+				int startidx = data->vertexstart;
+
+				for (int j = 0; j < mesh->num_faces(); ++j)
 				{
-					m_cpudata->shapedata[i].mask = 0x0;
+					// Copy face data to GPU buffer
+					int myidx = data->facestart - firstface + j;
+					int faceidx = reordering[j];
+					Mesh::Face myface = mesh->GetFace(faceidx);
+
+					facedata[myidx].idx[0] = myface.idx[0] + startidx;
+					facedata[myidx].idx[1] = myface.idx[1] + startidx;
+					facedata[myidx].idx[2] = myface.idx[2] + startidx;
+					facedata[myidx].idx[3] = myface.type_ == Mesh::FaceType::QUAD ? myface.idx[3] + startidx : -1;
+
+					facedata[myidx].shapeidx = 0;
+					facedata[myidx].id = faceidx;
 				}
+			}
 
-				shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
+			m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
 
-				if (!shapeimpl->is_instance())
-				{
-					m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[topindices[i]];
-				}
-				else
-				{
-					Instance const* instance = static_cast<Instance const*>(shapes[topindices[i]]);
+			e->Wait();
+			m_device->DeleteEvent(e);
+		}
 
-					// Find corresponding mesh
-					Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+		// Now we need to collect shapdata, copy per top level BVH
+		int numleaves = numsegments * numshapes;
+		m_cpudata->shapedata.resize(numleaves);
 
-					// It should be there
-					auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+#pragma omp parallel for
+		for (int i = 0; i < numleaves; ++i)
+		{
+			int const* topindices = m_cpudata->toplevels[i / numshapes]->GetIndices();
+			int shapeidx = topindices[i % numshapes];
 
-					// TODO: should be assert
-					ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+			// Get the mesh
+			ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[shapeidx]);
 
-					int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+			m_cpudata->shapedata[i].id = shapeimpl->GetId();
 
-					m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
-				}
+			// For disabled shapes force mask to zero since these shapes 
+			// present only virtually (they have not been added to the scene)
+			// and we need to skip them while doing traversal.
+			if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
+			{
+				m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
+			}
+			else
+			{
+				m_cpudata->shapedata[i].mask = 0x0;
 			}
 
-			// Create face ID buffer
-			m_device->WriteBuffer(m_gpudata->shapes, 0, 0, (nummeshes + numinstances) * sizeof(ShapeData), (char*)&m_cpudata->shapedata[0], &e);
+			matrix m;
+			shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
+
+			m_cpudata->shapedata[i].linearvelocity = shapeimpl->GetLinearVelocity();
+			m_cpudata->shapedata[i].angularvelocity = GetRotation(shapeimpl);
+			m_cpudata->shapedata[i].bvhidx = meshdata[bvhindices[shapeidx]]->nodestart;
+		}
+
+		// Create shape buffer
+		if (numleaves > m_gpudata->shapecapacity)
+		{
+			m_device->DeleteBuffer(m_gpudata->shapes);
+			m_gpudata->shapecapacity = numleaves + numleaves / 2;
+			m_gpudata->shapes = m_device->CreateBuffer(m_gpudata->shapecapacity * sizeof(ShapeData), Calc::kRead);
+		}
+
+		{
+			Calc::Event* e = nullptr;
+			m_device->WriteBuffer(m_gpudata->shapes, 0, 0, numleaves * sizeof(ShapeData), &m_cpudata->shapedata[0], &e);
 
 			e->Wait();
 			m_device->DeleteEvent(e);
-
-			m_device->Finish(0);
 		}
+
+		m_device->Finish(0);
 	}
 
-	void Bvh2lStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
+	void Bvh2lStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event **event) const
 	{
 		auto& func = m_gpudata->isect_func;
 
@@ -618,11 +731,13 @@ namespace FireRays
 		func->SetArg(arg++, m_gpudata->vertices);
 		func->SetArg(arg++, m_gpudata->faces);
 		func->SetArg(arg++, m_gpudata->shapes);
-		func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
+		func->SetArg(arg++, m_gpudata->roots);
+		func->SetArg(arg++, sizeof(int), &m_gpudata->numsegments);
 		func->SetArg(arg++, rays);
 		func->SetArg(arg++, sizeof(offset), &offset);
 		func->SetArg(arg++, sizeof(numrays), &numrays);
 		func->SetArg(arg++, hits);
+		SetFormatArgs(func, arg, rays, format);
 
 		size_t localsize = kWorkGroupSize;
 		size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
@@ -630,7 +745,7 @@ namespace FireRays
 		m_device->Execute(func, queueidx, globalsize, localsize, event);
 	}
 
-	void Bvh2lStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
+	void Bvh2lStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event **event) const
 	{
 		auto& func = m_gpudata->occlude_func;
 
@@ -642,11 +757,13 @@ namespace FireRays
 		func->SetArg(arg++, m_gpudata->vertices);
 		func->SetArg(arg++, m_gpudata->faces);
 		func->SetArg(arg++, m_gpudata->shapes);
-		func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
+		func->SetArg(arg++, m_gpudata->roots);
+		func->SetArg(arg++, sizeof(int), &m_gpudata->numsegments);
 		func->SetArg(arg++, rays);
 		func->SetArg(arg++, sizeof(offset), &offset);
 		func->SetArg(arg++, sizeof(numrays), &numrays);
 		func->SetArg(arg++, hits);
+		SetFormatArgs(func, arg, rays, format);
 
 		size_t localsize = kWorkGroupSize;
 		size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
@@ -654,7 +771,7 @@ namespace FireRays
 		m_device->Execute(func, queueidx, globalsize, localsize, event);
 	}
 
-	void Bvh2lStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+	void Bvh2lStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event) const
 	{
 		auto& func = m_gpudata->isect_indirect_func;
 
@@ -666,11 +783,13 @@ namespace FireRays
 		func->SetArg(arg++, m_gpudata->vertices);
 		func->SetArg(arg++, m_gpudata->faces);
 		func->SetArg(arg++, m_gpudata->shapes);
-		func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
+		func->SetArg(arg++, m_gpudata->roots);
+		func->SetArg(arg++, sizeof(int), &m_gpudata->numsegments);
 		func->SetArg(arg++, rays);
-		func->SetArg(arg++, sizeof(numrays), &numrays);
+		func->SetArg(arg++, numrays);
 		func->SetArg(arg++, sizeof(offset), &offset);
 		func->SetArg(arg++, hits);
+		SetFormatArgs(func, arg, rays, format);
 
 		size_t localsize = kWorkGroupSize;
 		size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
@@ -678,7 +797,7 @@ namespace FireRays
 		m_device->Execute(func, queueidx, globalsize, localsize, event);
 	}
 
-	void Bvh2lStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+	void Bvh2lStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event) const
 	{
 		auto& func = m_gpudata->occlude_indirect_func;
 
@@ -690,11 +809,13 @@ namespace FireRays
 		func->SetArg(arg++, m_gpudata->vertices);
 		func->SetArg(arg++, m_gpudata->faces);
 		func->SetArg(arg++, m_gpudata->shapes);
-		func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
+		func->SetArg(arg++, m_gpudata->roots);
+		func->SetArg(arg++, sizeof(int), &m_gpudata->numsegments);
 		func->SetArg(arg++, rays);
-		func->SetArg(arg++, sizeof(numrays), &numrays);
+		func->SetArg(arg++, numrays);
 		func->SetArg(arg++, sizeof(offset), &offset);
 		func->SetArg(arg++, hits);
+		SetFormatArgs(func, arg, rays, format);
 
 		size_t localsize = kWorkGroupSize;
 		size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
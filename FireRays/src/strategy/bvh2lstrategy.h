@@ -34,7 +34,7 @@ namespace FireRays
     class Bvh2lStrategy : public Strategy
     {
     public:
-        Bvh2lStrategy(Calc::Device* device);
+        Bvh2lStrategy(Calc::Device* device, Calc::ExecutableCache* cache);
         
         void Preprocess(World const& world) override;
         
@@ -42,6 +42,7 @@ namespace FireRays
                                Calc::Buffer const* rays,
                                std::uint32_t numrays,
                                Calc::Buffer* hits,
+                               QueryFormat const& format,
                                Calc::Event const* waitevent,
                                Calc::Event** event) const override;
         
@@ -49,6 +50,7 @@ namespace FireRays
                             Calc::Buffer const* rays,
                             std::uint32_t numrays,
                             Calc::Buffer* hits,
+                            QueryFormat const& format,
                             Calc::Event const* waitevent,
                             Calc::Event** event) const override;
         
@@ -57,6 +59,7 @@ namespace FireRays
                                Calc::Buffer const* numrays,
                                std::uint32_t maxrays,
                                Calc::Buffer* hits,
+                               QueryFormat const& format,
                                Calc::Event const* waitevent,
                                Calc::Event** event) const override;
         
@@ -65,6 +68,7 @@ namespace FireRays
                             Calc::Buffer const* numrays,
                             std::uint32_t maxrays,
                             Calc::Buffer* hits,
+                            QueryFormat const& format,
                             Calc::Event const* waitevent,
                             Calc::Event** event) const override;
 
@@ -75,10 +79,10 @@ namespace FireRays
         struct CpuData;
         struct ShapeData;
         struct Face;
+        struct MeshData;
 
         std::unique_ptr<GpuData> m_gpudata;
         std::unique_ptr<CpuData> m_cpudata;
-        std::vector<std::unique_ptr<Bvh> > m_bvhs;
     };
 }
 
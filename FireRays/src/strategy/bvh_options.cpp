@@ -0,0 +1,91 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "bvh_options.h"
+
+#include "../accelerator/bvh.h"
+#include "../accelerator/split_bvh.h"
+#include "../world/world.h"
+
+namespace FireRays
+{
+	bool BvhBuildSettings::operator == (BvhBuildSettings const& rhs) const
+	{
+		return usesah == rhs.usesah && maxprimsperleaf == rhs.maxprimsperleaf && numbins == rhs.numbins &&
+			usesplits == rhs.usesplits && minoverlap == rhs.minoverlap && maxdepth == rhs.maxdepth;
+	}
+
+	BvhBuildSettings GetBvhBuildSettings(World const& world, bool allowsplits, int maxprimsperleaf)
+	{
+		BvhBuildSettings settings;
+
+		// First check if we need to use SAH
+		auto builder = world.options_.GetOption("bvh.builder");
+		settings.usesah = builder && builder->AsString() == "sah";
+
+		// Leaf size limit
+		auto optmaxprims = world.options_.GetOption("bvh.sah.maxprimsperleaf");
+		settings.maxprimsperleaf = maxprimsperleaf > 0 ? maxprimsperleaf : (optmaxprims ? (int)optmaxprims->AsFloat() : 4);
+
+		auto optnumbins = world.options_.GetOption("bvh.sah.numbins");
+		settings.numbins = optnumbins ? (int)optnumbins->AsFloat() : 64;
+
+		// Spatial splits are only available with SAH builder and clip faces as triangles
+		auto optsplits = world.options_.GetOption("bvh.sah.usesplits");
+		settings.usesplits = allowsplits && settings.usesah && optsplits && optsplits->AsFloat() > 0.f && !world.HasQuads();
+
+		auto optoverlap = world.options_.GetOption("bvh.sah.overlaparea");
+		auto optmaxdepth = world.options_.GetOption("bvh.sah.maxdepth");
+		settings.minoverlap = settings.usesplits && optoverlap ? optoverlap->AsFloat() : 0.0001f;
+		settings.maxdepth = settings.usesplits && optmaxdepth ? (int)optmaxdepth->AsFloat() : 10;
+
+		// Builder threading
+		auto optthreads = world.options_.GetOption("bvh.builder.threads");
+		auto optdeterministic = world.options_.GetOption("bvh.builder.deterministic");
+		settings.numthreads = optthreads ? (int)optthreads->AsFloat() : 0;
+		settings.deterministic = optdeterministic && optdeterministic->AsFloat() > 0.f;
+
+		return settings;
+	}
+
+	Bvh* CreateBvh(BvhBuildSettings const& settings)
+	{
+		Bvh* bvh = nullptr;
+
+		if (settings.usesplits)
+		{
+			bvh = new SplitBvh(settings.maxprimsperleaf, settings.minoverlap, settings.maxdepth);
+		}
+		else
+		{
+			bvh = new Bvh(settings.usesah, settings.maxprimsperleaf, settings.numbins);
+		}
+
+		bvh->SetBuildThreads(settings.numthreads, settings.deterministic);
+
+		return bvh;
+	}
+
+	Bvh* CreateBvh(World const& world, bool allowsplits, int maxprimsperleaf)
+	{
+		return CreateBvh(GetBvhBuildSettings(world, allowsplits, maxprimsperleaf));
+	}
+}
@@ -0,0 +1,59 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef BVH_OPTIONS_H
+#define BVH_OPTIONS_H
+
+namespace FireRays
+{
+	class Bvh;
+	class World;
+
+	// BVH builder settings given by bvh.builder, bvh.sah.* and bvh.builder.* options of the world
+	struct BvhBuildSettings
+	{
+		bool usesah;
+		int maxprimsperleaf;
+		int numbins;
+		// Spatial splits and their limits
+		bool usesplits;
+		float minoverlap;
+		int maxdepth;
+		// Threading, deterministic builds do not depend on the number of threads
+		int numthreads;
+		bool deterministic;
+
+		// Trees built with equal settings are the same, threading is ignored
+		bool operator == (BvhBuildSettings const& rhs) const;
+		bool operator != (BvhBuildSettings const& rhs) const { return !(*this == rhs); }
+	};
+
+	// Positive maxprimsperleaf overrides bvh.sah.maxprimsperleaf for the trees which need a fixed
+	// leaf size. Spatial splits clip faces, so they are only used if the caller sets allowsplits
+	// and builds the tree out of world space triangles.
+	BvhBuildSettings GetBvhBuildSettings(World const& world, bool allowsplits, int maxprimsperleaf = 0);
+
+	// Create BVH builder with the settings
+	Bvh* CreateBvh(BvhBuildSettings const& settings);
+	Bvh* CreateBvh(World const& world, bool allowsplits, int maxprimsperleaf = 0);
+}
+
+#endif // BVH_OPTIONS_H
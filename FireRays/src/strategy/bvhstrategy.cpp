@@ -20,6 +20,8 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "bvhstrategy.h"
+#include "bvh_options.h"
+#include "flat_geometry.h"
 
 #include "../accelerator/bvh.h"
 #include "../primitive/mesh.h"
@@ -35,6 +37,7 @@ THE SOFTWARE.
 #include "device.h"
 #include "executable.h"
 #include <algorithm>
+#include <cstring>
 
 // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
@@ -58,6 +61,14 @@ namespace FireRays
 		int padding1;
 	};
 
+	struct BvhStrategy::Triangle
+	{
+		// World space vertices, v1.w keeps shape index and v2.w primitive ID
+		float3 v1;
+		float3 v2;
+		float3 v3;
+	};
+
 	struct BvhStrategy::GpuData
 	{
 		// Device
@@ -70,14 +81,17 @@ namespace FireRays
 		Calc::Buffer* faces;
 		// Shape IDs
 		Calc::Buffer* shapes;
-		// Counter
-		Calc::Buffer* raycnt;
 
 		Calc::Executable* executable;
 		Calc::Function* isect_func;
 		Calc::Function* occlude_func;
 		Calc::Function* isect_indirect_func;
 		Calc::Function* occlude_indirect_func;
+		// Persistent threads versions
+		Calc::Function* isect_pt_func;
+		Calc::Function* occlude_pt_func;
+		Calc::Function* isect_indirect_pt_func;
+		Calc::Function* occlude_indirect_pt_func;
 
 		GpuData(Calc::Device* d)
 			: device(d)
@@ -85,395 +99,487 @@ namespace FireRays
 			, vertices(nullptr)
 			, faces(nullptr)
 			, shapes(nullptr)
-			, raycnt(nullptr)
 		{
 		}
 
-		~GpuData()
+		void Release()
 		{
 			device->DeleteBuffer(bvh);
 			device->DeleteBuffer(vertices);
 			device->DeleteBuffer(faces);
 			device->DeleteBuffer(shapes);
-			device->DeleteBuffer(raycnt);
+			bvh = vertices = faces = shapes = nullptr;
+		}
+
+		~GpuData()
+		{
+			Release();
 			executable->DeleteFunction(isect_func);
 			executable->DeleteFunction(occlude_func);
 			executable->DeleteFunction(isect_indirect_func);
 			executable->DeleteFunction(occlude_indirect_func);
+			executable->DeleteFunction(isect_pt_func);
+			executable->DeleteFunction(occlude_pt_func);
+			executable->DeleteFunction(isect_indirect_pt_func);
+			executable->DeleteFunction(occlude_indirect_pt_func);
 			device->DeleteExecutable(executable);
 		}
 	};
 
-	BvhStrategy::BvhStrategy(Calc::Device* device)
+	struct BvhStrategy::CpuData
+	{
+		// Shapes in the order they have been put into the BVH, meshes go first
+		std::vector<Shape const*> shapes;
+		int nummeshes;
+		// Start indices of shape vertices and faces in GPU buffers
+		std::vector<int> mesh_vertices_start_idx;
+		std::vector<int> mesh_faces_start_idx;
+		// World space face bounds
+		std::vector<bbox> bounds;
+		// SAH cost of the BVH right after the build
+		float sahcost;
+	};
+
+	BvhStrategy::BvhStrategy(Calc::Device* device, Calc::ExecutableCache* cache)
 		: Strategy(device)
 		, m_gpudata(new GpuData(device))
 		, m_bvh(nullptr)
+		, m_persistent(false)
+		, m_precomputed(false)
 	{
 #ifndef FR_EMBED_KERNELS
 		char const* headers[] = { "../FireRays/src/kernel/CL/common.cl" };
 
 		int numheaders = sizeof(headers) / sizeof(char const*);
 
-		m_gpudata->executable = m_device->CompileExecutable("../FireRays/src/kernel/CL/bvh.cl", headers, numheaders);
+		m_gpudata->executable = cache->CompileExecutable("../FireRays/src/kernel/CL/bvh.cl", headers, numheaders);
 
 #else
-		m_gpudata->executable = m_device->CompileExecutable(cl_bvh, std::strlen(cl_bvh), nullptr);
+		m_gpudata->executable = cache->CompileExecutable(cl_bvh, std::strlen(cl_bvh), nullptr);
 #endif
 
 		m_gpudata->isect_func = m_gpudata->executable->CreateFunction("IntersectClosest");
 		m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny");
 		m_gpudata->isect_indirect_func= m_gpudata->executable->CreateFunction("IntersectClosestRC");
 		m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC");
+		m_gpudata->isect_pt_func = m_gpudata->executable->CreateFunction("IntersectClosestPT");
+		m_gpudata->occlude_pt_func = m_gpudata->executable->CreateFunction("IntersectAnyPT");
+		m_gpudata->isect_indirect_pt_func = m_gpudata->executable->CreateFunction("IntersectClosestRCPT");
+		m_gpudata->occlude_indirect_pt_func = m_gpudata->executable->CreateFunction("IntersectAnyRCPT");
 	}
 
 	void BvhStrategy::Preprocess(World const& world)
 	{
-		// If something has been changed we need to rebuild BVH
-		if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+		auto optpersistent = world.options_.GetOption("query.persistent");
+		m_persistent = optpersistent && optpersistent->AsFloat() > 0.f;
+
+		auto optprecomputed = world.options_.GetOption("bvh.triangles.precomputed");
+		// Precomputed layout stores a single triangle per face, so quads need the indexed one
+		bool precomputed = optprecomputed && optprecomputed->AsFloat() > 0.f && !world.HasQuads();
+
+		bool rebuild = !m_bvh || world.has_changed() || precomputed != m_precomputed;
+		m_precomputed = precomputed;
+
+		// If shapes have only been moved or deformed try to refit BVH
+		if (!rebuild && world.GetStateChange() != ShapeImpl::kStateChangeNone)
 		{
-			int numshapes = (int)world.shapes_.size();
-			int numvertices = 0;
-			int numfaces = 0;
+			rebuild = !Refit(world);
+		}
 
-			// This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
-			std::vector<int> mesh_vertices_start_idx(numshapes);
-			std::vector<int> mesh_faces_start_idx(numshapes);
+		// If something has been changed we need to rebuild BVH
+		if (rebuild)
+		{
+			FlatGeometry geometry(world);
+			int numshapes = (int)geometry.shapes.size();
 
 			// Recreate it
+			m_bvh.reset(CreateBvh(world, true));
+
+			// We can't avoild allocating it here, since bounds aren't stored anywhere
+			std::vector<bbox> bounds;
+			geometry.GetFaceBounds(bounds);
+			geometry.BuildBvh(*m_bvh, bounds);
 
-			// First check if we need to use SAH
-			auto builder = world.options_.GetOption("bvh.builder");
-			bool enablesah = false;
+			std::vector<ShapeData> shapedata(numshapes);
 
-			if (builder && builder->AsString() == "sah")
+			for (int i = 0; i < numshapes; ++i)
 			{
-				enablesah = true;
+				shapedata[i].id = geometry.shapes[i]->GetId();
+				shapedata[i].mask = geometry.shapes[i]->GetMask();
 			}
 
-			m_bvh.reset(new Bvh(enablesah));
-
-			// Partition the array into meshes and instances
-			std::vector<Shape const*> shapes(world.shapes_);
-			
-            auto firstinst = std::partition(shapes.begin(), shapes.end(),
-			[&](Shape const* shape)
-            {
-                return !static_cast<ShapeImpl const*>(shape)->is_instance();
-            });
-
-            // Count the number of meshes
-            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-            // Count the number of instances
-            int numinstances = (int)std::distance(firstinst, shapes.end());
+			PlainBvhTranslator translator;
+			translator.Process(*m_bvh);
 
-			for (int i = 0; i < nummeshes; ++i)
-			{
-				Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+			// Release data of the previous build
+			m_gpudata->Release();
 
-				mesh_faces_start_idx[i] = numfaces;
-				mesh_vertices_start_idx[i] = numvertices;
+			// Update GPU data
+			// Copy translated nodes first
+			m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
 
-				numfaces += mesh->num_faces();
-				numvertices += mesh->num_vertices();
-			}
+			// Spatial splits might duplicate faces
+			int numindices = m_bvh->GetNumIndices();
 
-			for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+			// Precomputed triangles keep their own copy of vertices
+			if (m_precomputed)
 			{
-				Instance const* instance = static_cast<Instance const*>(shapes[i]);
-				Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+				m_gpudata->faces = m_device->CreateBuffer(numindices * sizeof(Triangle), Calc::BufferType::kRead);
 
-				mesh_faces_start_idx[i] = numfaces;
-				mesh_vertices_start_idx[i] = numvertices;
-
-				numfaces += mesh->num_faces();
-				numvertices += mesh->num_vertices();
+				UpdateTriangles(geometry.shapes, geometry.nummeshes, geometry.mesh_faces_start_idx);
 			}
-
-			// We can't avoild allocating it here, since bounds aren't stored anywhere
-			std::vector<bbox> bounds(numfaces);
-			std::vector<ShapeData> shapedata(numshapes);
-
-			// We handle meshes first collecting their world space bounds
-#pragma omp parallel for
-			for (int i = 0; i < nummeshes; ++i)
+			else
 			{
-				Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+				// Vertices in world space and faces in BVH leaf order
+				m_gpudata->vertices = geometry.CreateVertexBuffer(m_device);
+				m_gpudata->faces = geometry.CreateFaceBuffer(m_device, m_bvh->GetIndices(), numindices);
+			}
 
-				for (int j = 0; j < mesh->num_faces(); ++j)
-				{
-					// Here we directly get world space bounds
-					mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
-				}
+			// Create shapes buffer
+			m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapedata[0]);
 
-				shapedata[i].id = mesh->GetId();
-				shapedata[i].mask = mesh->GetMask();
-			}
+			// Keep what is needed to refit BVH on the next commit
+			auto optrefit = world.options_.GetOption("bvh.refit.threshold");
+			m_cpudata.reset();
 
-			// Then we handle instances. Need to flatten them into actual geometry.
-#pragma omp parallel for
-			for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+			if (optrefit && optrefit->AsFloat() > 0.f)
 			{
-				Instance const* instance = static_cast<Instance const*>(shapes[i]);
-				Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-				
-				// Instance is using its own transform for base shape geometry
-				// so we need to get object space bounds and transform them manually
-				matrix m, minv;
-				instance->GetTransform(m, minv);
-
-				for (int j = 0; j < mesh->num_faces(); ++j)
-				{
-					bbox tmp;
-					mesh->GetFaceBounds(j, true, tmp);
-					bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m);
-				}
-
-				shapedata[i].id = instance->GetId();
-				shapedata[i].mask = instance->GetMask();
+				m_cpudata.reset(new CpuData);
+				m_cpudata->shapes.swap(geometry.shapes);
+				m_cpudata->nummeshes = geometry.nummeshes;
+				m_cpudata->mesh_vertices_start_idx.swap(geometry.mesh_vertices_start_idx);
+				m_cpudata->mesh_faces_start_idx.swap(geometry.mesh_faces_start_idx);
+				m_cpudata->bounds.swap(bounds);
+				m_cpudata->sahcost = m_bvh->GetSahCost();
 			}
-			
-			m_bvh->Build(&bounds[0], numfaces);
 
-			PlainBvhTranslator translator;
-			translator.Process(*m_bvh);
+			// Make sure everything is commited
+			m_device->Finish(0);
+		}
+	}
 
-			// Update GPU data
-			// Copy translated nodes first
-			m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
+	bool BvhStrategy::Refit(World const& world)
+	{
+		auto optrefit = world.options_.GetOption("bvh.refit.threshold");
+		float threshold = optrefit ? optrefit->AsFloat() : 0.f;
 
-			// Create vertex buffer
-			{
-				// Vertices
-				m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+		if (!m_cpudata || threshold <= 0.f)
+		{
+			return false;
+		}
 
-				// Get the pointer to mapped data
-				float3* vertexdata = nullptr;
-				Calc::Event* e = nullptr;
-				m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+		auto const& shapes = m_cpudata->shapes;
+		int numshapes = (int)shapes.size();
+		int nummeshes = m_cpudata->nummeshes;
 
-				e->Wait();
-				m_device->DeleteEvent(e);
+		// Find shapes which have been moved or deformed (directly or via their base mesh)
+		std::vector<int> moved;
+		for (int i = 0; i < numshapes; ++i)
+		{
+			int statechange = static_cast<ShapeImpl const*>(shapes[i])->GetStateChange();
 
-				// Here we need to put data in world space rather than object space
-				// So we need to get the transform from the mesh and multiply each vertex
-				matrix m, minv;
+			if (i >= nummeshes)
+			{
+				auto baseshape = static_cast<Instance const*>(shapes[i])->GetBaseShape();
+				statechange |= static_cast<ShapeImpl const*>(baseshape)->GetStateChange();
+			}
 
+			if (statechange & (ShapeImpl::kStateChangeTransform | ShapeImpl::kStateChangeVertices))
+			{
+				moved.push_back(i);
+			}
+		}
+
+		if (!moved.empty())
+		{
+			// Update world space bounds of moved shapes
 #pragma omp parallel for
-				for (int i = 0; i < nummeshes; ++i)
+			for (int k = 0; k < (int)moved.size(); ++k)
+			{
+				int i = moved[k];
+				bbox* bounds = &m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i]];
+
+				if (i < nummeshes)
 				{
-					// Get the mesh
 					Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-					// Get vertex buffer of the current mesh
-					float3 const* myvertexdata = mesh->GetVertexData();
-					// Get mesh transform
-					mesh->GetTransform(m, minv);
-
-					//#pragma omp parallel for
-					// Iterate thru vertices multiply and append them to GPU buffer
-					for (int j = 0; j < mesh->num_vertices(); ++j)
+
+					for (int j = 0; j < mesh->num_faces(); ++j)
 					{
-						vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+						mesh->GetFaceBounds(j, false, bounds[j]);
 					}
 				}
-
-#pragma omp parallel for
-				for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+				else
 				{
 					Instance const* instance = static_cast<Instance const*>(shapes[i]);
-					// Get the mesh
 					Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-					// Get vertex buffer of the current mesh
-					float3 const* myvertexdata = mesh->GetVertexData();
-					// Get mesh transform
+
+					matrix m, minv;
 					instance->GetTransform(m, minv);
 
-					//#pragma omp parallel for
-					// Iterate thru vertices multiply and append them to GPU buffer
-					for (int j = 0; j < mesh->num_vertices(); ++j)
+					for (int j = 0; j < mesh->num_faces(); ++j)
 					{
-						vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+						bbox tmp;
+						mesh->GetFaceBounds(j, true, tmp);
+						bounds[j] = transform_bbox(tmp, m);
 					}
 				}
+			}
 
-				m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
+			m_bvh->Refit(&m_cpudata->bounds[0]);
 
-				e->Wait();
-				m_device->DeleteEvent(e);
+			// Rebuild if refitted BVH has become too slow to traverse
+			if (m_bvh->GetSahCost() > threshold * m_cpudata->sahcost)
+			{
+				return false;
 			}
 
-			// Create face buffer
+			PlainBvhTranslator translator;
+			translator.Process(*m_bvh);
+
+			// Update GPU data
+			// Node bounds have changed, but the layout is the same
+			Calc::Event* e = nullptr;
+			m_device->WriteBuffer(m_gpudata->bvh, 0, 0, translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), &translator.nodes_[0], &e);
+
+			e->Wait();
+			m_device->DeleteEvent(e);
+
+			// Triangles of moved shapes are scattered over the leaves, so all of them are uploaded
+			if (m_precomputed)
 			{
-				struct Face
-				{
-					// Up to 3 indices
-					int idx[3];
-					// Shape index
-					int shapeidx;
-					// Primitive ID within the mesh
-					int id;
-					// Idx count
-					int cnt;
-				};
-
-				// Create face buffer
-				m_gpudata->faces = m_device->CreateBuffer(numfaces * sizeof(Face), Calc::BufferType::kRead);
-
-				// Get the pointer to mapped data
-				Face* facedata = nullptr;
-				Calc::Event* e = nullptr;
-
-				m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * sizeof(Face), Calc::BufferType::kWrite, (void**)&facedata, &e);
-
-				e->Wait();
-				m_device->DeleteEvent(e);
-
-				// Here the point is to add mesh starting index to actual index contained within the mesh,
-				// getting absolute index in the buffer.
-				// Besides that we need to permute the faces accorningly to BVH reordering, whihc
-				// is contained within bvh.primids_
-				int const* reordering = m_bvh->GetIndices();
-				for (int i = 0; i < numfaces; ++i)
+				UpdateTriangles(shapes, nummeshes, m_cpudata->mesh_faces_start_idx);
+			}
+			else
+			{
+				// Only vertices of moved shapes need to be uploaded
+				for (int i : moved)
 				{
-					int indextolook4 = reordering[i];
+					Mesh const* mesh = i < nummeshes ?
+						static_cast<Mesh const*>(shapes[i]) :
+						static_cast<Mesh const*>(static_cast<Instance const*>(shapes[i])->GetBaseShape());
 
-					// We need to find a shape corresponding to current face
-					auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+					int numvertices = mesh->num_vertices();
 
-					// Find the index of the shape
-					int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+					matrix m, minv;
+					shapes[i]->GetTransform(m, minv);
 
-					// Get the mesh directly or out of instance
-					Mesh const* mesh = nullptr;
-					if (shapeidx < nummeshes)
-					{
-						mesh = static_cast<Mesh const*>(shapes[shapeidx]);
-					}
-					else
+					float3* vertexdata = nullptr;
+					m_device->MapBuffer(m_gpudata->vertices, 0, m_cpudata->mesh_vertices_start_idx[i] * sizeof(float3), numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+
+					e->Wait();
+					m_device->DeleteEvent(e);
+
+					for (int j = 0; j < numvertices; ++j)
 					{
-						mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
+						vertexdata[j] = transform_point(mesh->GetVertex(j), m);
 					}
 
-					// Get vertex buffer of the current mesh
-					Mesh::Face const* myfacedata = mesh->GetFaceData();
-					// Find face idx
-					int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
-					// Find mesh start idx
-					int mystartidx = mesh_vertices_start_idx[shapeidx];
-
-					// Copy face data to GPU buffer
-					facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-					facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-					facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
-
-					facedata[i].shapeidx = shapeidx;
-					facedata[i].cnt = 0;
-					facedata[i].id = faceidx;
+					m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
+
+					e->Wait();
+					m_device->DeleteEvent(e);
 				}
+			}
+		}
 
-				m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+		// Ids and masks might have been changed as well
+		std::vector<ShapeData> shapedata(numshapes);
+		for (int i = 0; i < numshapes; ++i)
+		{
+			ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[i]);
+			shapedata[i].id = shapeimpl->GetId();
+			shapedata[i].mask = shapeimpl->GetMask();
+		}
 
-				e->Wait();
-				m_device->DeleteEvent(e);
-			}
+		Calc::Event* e = nullptr;
+		m_device->WriteBuffer(m_gpudata->shapes, 0, 0, numshapes * sizeof(ShapeData), &shapedata[0], &e);
 
-			// Create shapes buffer
-			m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapedata[0]);
-			// Create helper raycounter buffer
-			m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+		e->Wait();
+		m_device->DeleteEvent(e);
 
-			// Make sure everything is commited
-			m_device->Finish(0);
+		// Make sure everything is commited
+		m_device->Finish(0);
+
+		return true;
+	}
+
+	void BvhStrategy::UpdateTriangles(std::vector<Shape const*> const& shapes, int nummeshes, std::vector<int> const& mesh_faces_start_idx)
+	{
+		int numindices = m_bvh->GetNumIndices();
+
+		// Get the pointer to mapped data
+		Triangle* triangledata = nullptr;
+		Calc::Event* e = nullptr;
+
+		m_device->MapBuffer(m_gpudata->faces, 0, 0, numindices * sizeof(Triangle), Calc::MapType::kMapWrite, (void**)&triangledata, &e);
+
+		e->Wait();
+		m_device->DeleteEvent(e);
+
+		// Same as for the indexed faces, but vertices are transformed
+		// to world space and stored right in the BVH leaf order
+		int const* reordering = m_bvh->GetIndices();
+
+#pragma omp parallel for
+		for (int i = 0; i < numindices; ++i)
+		{
+			int indextolook4 = reordering[i];
+
+			// We need to find a shape corresponding to current face
+			auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+
+			// Find the index of the shape
+			int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+
+			// Get the mesh directly or out of instance
+			Mesh const* mesh = shapeidx < nummeshes ?
+				static_cast<Mesh const*>(shapes[shapeidx]) :
+				static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
+
+			matrix m, minv;
+			shapes[shapeidx]->GetTransform(m, minv);
+
+			int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+			Mesh::Face myface = mesh->GetFace(faceidx);
+
+			Triangle& triangle = triangledata[i];
+			triangle.v1 = transform_point(mesh->GetVertex(myface.idx[0]), m);
+			triangle.v2 = transform_point(mesh->GetVertex(myface.idx[1]), m);
+			triangle.v3 = transform_point(mesh->GetVertex(myface.idx[2]), m);
+
+			// Keep face data in w to avoid another fetch
+			std::memcpy(&triangle.v1.w, &shapeidx, sizeof(int));
+			std::memcpy(&triangle.v2.w, &faceidx, sizeof(int));
+			triangle.v3.w = 0.f;
 		}
+
+		m_device->UnmapBuffer(m_gpudata->faces, 0, triangledata, &e);
+
+		e->Wait();
+		m_device->DeleteEvent(e);
 	}
 
-	void BvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
+	QueryFormat BvhStrategy::GetKernelFormat(QueryFormat const& format) const
+	{
+		return m_precomputed ? QueryFormat(format.flags | kPrecomputedTriangles, format.rayflags) : format;
+	}
+
+	void BvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event **event) const
     {
-        auto& func = m_gpudata->isect_func;
+        auto& func = m_persistent ? m_gpudata->isect_pt_func : m_gpudata->isect_func;
         
 		// Set args
 		int arg = 0;
 		int offset = 0;
 
 		func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, m_gpudata->vertices);
+        // Vertices are not used with precomputed triangles, but the argument has to be valid
+        func->SetArg(arg++, m_precomputed ? m_gpudata->faces : m_gpudata->vertices);
         func->SetArg(arg++, m_gpudata->faces);
         func->SetArg(arg++, m_gpudata->shapes);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
+        SetFormatArgs(func, arg, rays, GetKernelFormat(format));
 
         size_t localsize = kWorkGroupSize;
 		size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
+        if (m_persistent)
+        {
+            globalsize = SetPersistentArgs(func, arg, queueidx, numrays, localsize);
+        }
+
         m_device->Execute(func, queueidx, globalsize, localsize, event);
 	}
 
-    void BvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
+    void BvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event **event) const
     {
-        auto& func = m_gpudata->occlude_func;
+        auto& func = m_persistent ? m_gpudata->occlude_pt_func : m_gpudata->occlude_func;
         
         // Set args
         int arg = 0;
         int offset = 0;
         
         func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, m_gpudata->vertices);
+        // Vertices are not used with precomputed triangles, but the argument has to be valid
+        func->SetArg(arg++, m_precomputed ? m_gpudata->faces : m_gpudata->vertices);
         func->SetArg(arg++, m_gpudata->faces);
         func->SetArg(arg++, m_gpudata->shapes);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
+        SetFormatArgs(func, arg, rays, GetKernelFormat(format));
         
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        if (m_persistent)
+        {
+            globalsize = SetPersistentArgs(func, arg, queueidx, numrays, localsize);
+        }
         
         m_device->Execute(func, queueidx, globalsize, localsize, event);
     }
 
-    void BvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    void BvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event) const
 	{
-        auto& func = m_gpudata->isect_indirect_func;
+        auto& func = m_persistent ? m_gpudata->isect_indirect_pt_func : m_gpudata->isect_indirect_func;
         
         // Set args
         int arg = 0;
         int offset = 0;
         
         func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, m_gpudata->vertices);
+        // Vertices are not used with precomputed triangles, but the argument has to be valid
+        func->SetArg(arg++, m_precomputed ? m_gpudata->faces : m_gpudata->vertices);
         func->SetArg(arg++, m_gpudata->faces);
         func->SetArg(arg++, m_gpudata->shapes);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
+        SetFormatArgs(func, arg, rays, GetKernelFormat(format));
         
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        if (m_persistent)
+        {
+            globalsize = SetPersistentArgs(func, arg, queueidx, maxrays, localsize);
+        }
         
         m_device->Execute(func, queueidx, globalsize, localsize, event);
     }
 
-    void BvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    void BvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->occlude_indirect_func;
+        auto& func = m_persistent ? m_gpudata->occlude_indirect_pt_func : m_gpudata->occlude_indirect_func;
         
         // Set args
         int arg = 0;
         int offset = 0;
         
         func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, m_gpudata->vertices);
+        // Vertices are not used with precomputed triangles, but the argument has to be valid
+        func->SetArg(arg++, m_precomputed ? m_gpudata->faces : m_gpudata->vertices);
         func->SetArg(arg++, m_gpudata->faces);
         func->SetArg(arg++, m_gpudata->shapes);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
+        SetFormatArgs(func, arg, rays, GetKernelFormat(format));
         
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        if (m_persistent)
+        {
+            globalsize = SetPersistentArgs(func, arg, queueidx, maxrays, localsize);
+        }
         
         m_device->Execute(func, queueidx, globalsize, localsize, event);
     }
@@ -35,7 +35,7 @@ namespace FireRays
 	class BvhStrategy : public Strategy
 	{
 	public:
-		BvhStrategy(Calc::Device* device);
+		BvhStrategy(Calc::Device* device, Calc::ExecutableCache* cache);
 
 		void Preprocess(World const& world) override;
         
@@ -43,6 +43,7 @@ namespace FireRays
                                Calc::Buffer const* rays,
                                std::uint32_t numrays,
                                Calc::Buffer* hits,
+                               QueryFormat const& format,
                                Calc::Event const* waitevent,
                                Calc::Event** event) const override;
         
@@ -50,6 +51,7 @@ namespace FireRays
                             Calc::Buffer const* rays,
                             std::uint32_t numrays,
                             Calc::Buffer* hits,
+                            QueryFormat const& format,
                             Calc::Event const* waitevent,
                             Calc::Event** event) const override;
         
@@ -58,6 +60,7 @@ namespace FireRays
                                Calc::Buffer const* numrays,
                                std::uint32_t maxrays,
                                Calc::Buffer* hits,
+                               QueryFormat const& format,
                                Calc::Event const* waitevent,
                                Calc::Event** event) const override;
         
@@ -66,17 +69,33 @@ namespace FireRays
                             Calc::Buffer const* numrays,
                             std::uint32_t maxrays,
                             Calc::Buffer* hits,
+                            QueryFormat const& format,
                             Calc::Event const* waitevent,
                             Calc::Event** event) const override;
 
 	private:
+		// Update BVH and GPU data for moved shapes, returns false if BVH needs to be rebuilt
+		bool Refit(World const& world);
+		// Write world space triangles into faces buffer in BVH leaf order
+		void UpdateTriangles(std::vector<Shape const*> const& shapes, int nummeshes, std::vector<int> const& mesh_faces_start_idx);
+		// Query format passed to the kernels
+		QueryFormat GetKernelFormat(QueryFormat const& format) const;
+
 		struct GpuData;
+		struct CpuData;
 		struct ShapeData;
+		struct Triangle;
 
 		// Implementation data
 		std::unique_ptr<GpuData> m_gpudata;
+		// Data kept for refitting
+		std::unique_ptr<CpuData> m_cpudata;
 		// Bvh data structure
 		std::unique_ptr<Bvh> m_bvh;
+		// Use persistent threads kernels
+		bool m_persistent;
+		// Faces buffer keeps precomputed triangles instead of indices
+		bool m_precomputed;
 	};
 }
 
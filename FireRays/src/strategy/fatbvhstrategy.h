@@ -34,7 +34,7 @@ namespace FireRays
     class FatBvhStrategy : public Strategy
     {
     public:
-        FatBvhStrategy(Calc::Device* device);
+        FatBvhStrategy(Calc::Device* device, Calc::ExecutableCache* cache);
         
         void Preprocess(World const& world) override;
         
@@ -42,6 +42,7 @@ namespace FireRays
                                Calc::Buffer const* rays,
                                std::uint32_t numrays,
                                Calc::Buffer* hits,
+                               QueryFormat const& format,
                                Calc::Event const* waitevent,
                                Calc::Event** event) const override;
         
@@ -49,6 +50,7 @@ namespace FireRays
                             Calc::Buffer const* rays,
                             std::uint32_t numrays,
                             Calc::Buffer* hits,
+                            QueryFormat const& format,
                             Calc::Event const* waitevent,
                             Calc::Event** event) const override;
         
@@ -57,6 +59,7 @@ namespace FireRays
                                Calc::Buffer const* numrays,
                                std::uint32_t maxrays,
                                Calc::Buffer* hits,
+                               QueryFormat const& format,
                                Calc::Event const* waitevent,
                                Calc::Event** event) const override;
         
@@ -65,6 +68,7 @@ namespace FireRays
                             Calc::Buffer const* numrays,
                             std::uint32_t maxrays,
                             Calc::Buffer* hits,
+                            QueryFormat const& format,
                             Calc::Event const* waitevent,
                             Calc::Event** event) const override;
         
@@ -76,6 +80,8 @@ namespace FireRays
         std::unique_ptr<GpuData> m_gpudata;
         // Bvh data structure
         std::unique_ptr<Bvh> m_bvh;
+        // Use persistent threads kernels
+        bool m_persistent;
     };
 }
 
@@ -0,0 +1,234 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "flat_geometry.h"
+
+#include "../accelerator/bvh.h"
+#include "../accelerator/split_bvh.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../world/world.h"
+
+#include "buffer.h"
+#include "event.h"
+#include <algorithm>
+
+namespace FireRays
+{
+	FlatGeometry::FlatGeometry(World const& world)
+		: shapes(world.shapes_)
+		, numvertices(0)
+		, numfaces(0)
+		, mesh_vertices_start_idx(world.shapes_.size())
+		, mesh_faces_start_idx(world.shapes_.size())
+	{
+		// Partition the array into meshes and instances
+		auto firstinst = std::partition(shapes.begin(), shapes.end(),
+		[&](Shape const* shape)
+		{
+			return !static_cast<ShapeImpl const*>(shape)->is_instance();
+		});
+
+		// Count the number of meshes
+		nummeshes = (int)std::distance(shapes.begin(), firstinst);
+		// Count the number of instances
+		numinstances = (int)std::distance(firstinst, shapes.end());
+
+		for (int i = 0; i < nummeshes + numinstances; ++i)
+		{
+			Mesh const* mesh = GetMesh(i);
+
+			mesh_faces_start_idx[i] = numfaces;
+			mesh_vertices_start_idx[i] = numvertices;
+
+			numfaces += mesh->num_faces();
+			numvertices += mesh->num_vertices();
+		}
+	}
+
+	Mesh const* FlatGeometry::GetMesh(int shapeidx) const
+	{
+		return shapeidx < nummeshes ?
+			static_cast<Mesh const*>(shapes[shapeidx]) :
+			static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
+	}
+
+	void FlatGeometry::GetFaceBounds(std::vector<bbox>& bounds) const
+	{
+		bounds.resize(numfaces);
+
+		// We handle meshes first collecting their world space bounds
+#pragma omp parallel for
+		for (int i = 0; i < nummeshes; ++i)
+		{
+			Mesh const* mesh = GetMesh(i);
+
+			for (int j = 0; j < mesh->num_faces(); ++j)
+			{
+				// Here we directly get world space bounds
+				mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
+			}
+		}
+
+		// Then we handle instances. Need to flatten them into actual geometry.
+#pragma omp parallel for
+		for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+		{
+			Mesh const* mesh = GetMesh(i);
+
+			// Instance is using its own transform for base shape geometry
+			// so we need to get object space bounds and transform them manually
+			matrix m, minv;
+			shapes[i]->GetTransform(m, minv);
+
+			for (int j = 0; j < mesh->num_faces(); ++j)
+			{
+				bbox tmp;
+				mesh->GetFaceBounds(j, true, tmp);
+				bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m);
+			}
+		}
+	}
+
+	void FlatGeometry::BuildBvh(Bvh& bvh, std::vector<bbox> const& bounds) const
+	{
+		bbox const* facebounds = bounds.empty() ? nullptr : &bounds[0];
+		auto splitbvh = dynamic_cast<SplitBvh*>(&bvh);
+
+		if (!splitbvh)
+		{
+			bvh.Build(facebounds, numfaces);
+			return;
+		}
+
+		// Spatial splits clip triangles, so the builder needs world space vertices
+		std::vector<float3> trivertices(numfaces * 3);
+
+#pragma omp parallel for
+		for (int i = 0; i < nummeshes + numinstances; ++i)
+		{
+			Mesh const* mesh = GetMesh(i);
+
+			matrix m, minv;
+			shapes[i]->GetTransform(m, minv);
+
+			for (int j = 0; j < mesh->num_faces(); ++j)
+			{
+				Mesh::Face face = mesh->GetFace(j);
+
+				for (int k = 0; k < 3; ++k)
+				{
+					trivertices[3 * (mesh_faces_start_idx[i] + j) + k] = transform_point(mesh->GetVertex(face.idx[k]), m);
+				}
+			}
+		}
+
+		splitbvh->Build(facebounds, trivertices.empty() ? nullptr : &trivertices[0], numfaces);
+	}
+
+	Calc::Buffer* FlatGeometry::CreateVertexBuffer(Calc::Device* device) const
+	{
+		auto buffer = device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+
+		// Get the pointer to mapped data
+		float3* vertexdata = nullptr;
+		Calc::Event* e = nullptr;
+		device->MapBuffer(buffer, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+
+		e->Wait();
+		device->DeleteEvent(e);
+
+		// Here we need to put data in world space rather than object space
+		// So we need to get the transform from the shape and multiply each vertex
+#pragma omp parallel for
+		for (int i = 0; i < nummeshes + numinstances; ++i)
+		{
+			Mesh const* mesh = GetMesh(i);
+
+			// Instances use their own transform for base mesh vertices
+			matrix m, minv;
+			shapes[i]->GetTransform(m, minv);
+
+			for (int j = 0; j < mesh->num_vertices(); ++j)
+			{
+				vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
+			}
+		}
+
+		device->UnmapBuffer(buffer, 0, vertexdata, &e);
+
+		e->Wait();
+		device->DeleteEvent(e);
+
+		return buffer;
+	}
+
+	Calc::Buffer* FlatGeometry::CreateFaceBuffer(Calc::Device* device, int const* reordering, int numindices) const
+	{
+		auto buffer = device->CreateBuffer(numindices * sizeof(Face), Calc::BufferType::kRead);
+
+		// Get the pointer to mapped data
+		Face* facedata = nullptr;
+		Calc::Event* e = nullptr;
+		device->MapBuffer(buffer, 0, 0, numindices * sizeof(Face), Calc::MapType::kMapWrite, (void**)&facedata, &e);
+
+		e->Wait();
+		device->DeleteEvent(e);
+
+		// Here the point is to add mesh starting index to actual index contained within the mesh,
+		// getting absolute index in the buffer. Besides that BVH strategies need the faces to be
+		// permuted accordingly to BVH reordering, which might also duplicate faces.
+#pragma omp parallel for
+		for (int i = 0; i < numindices; ++i)
+		{
+			int indextolook4 = reordering ? reordering[i] : i;
+
+			// We need to find a shape corresponding to current face
+			auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+
+			// Find the index of the shape
+			int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+
+			// Find face idx
+			int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+			// Get face data of the current mesh
+			Mesh::Face myface = GetMesh(shapeidx)->GetFace(faceidx);
+			// Find mesh start idx
+			int mystartidx = mesh_vertices_start_idx[shapeidx];
+
+			// Copy face data to GPU buffer
+			facedata[i].idx[0] = myface.idx[0] + mystartidx;
+			facedata[i].idx[1] = myface.idx[1] + mystartidx;
+			facedata[i].idx[2] = myface.idx[2] + mystartidx;
+			facedata[i].idx[3] = myface.type_ == Mesh::FaceType::QUAD ? myface.idx[3] + mystartidx : -1;
+
+			facedata[i].shapeidx = shapeidx;
+			facedata[i].id = faceidx;
+		}
+
+		device->UnmapBuffer(buffer, 0, facedata, &e);
+
+		e->Wait();
+		device->DeleteEvent(e);
+
+		return buffer;
+	}
+}
@@ -0,0 +1,81 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef FLAT_GEOMETRY_H
+#define FLAT_GEOMETRY_H
+
+#include "firerays.h"
+#include "calc.h"
+#include "device.h"
+#include "math/bbox.h"
+
+#include <vector>
+
+namespace FireRays
+{
+	class Bvh;
+	class Mesh;
+	class World;
+
+	///< Meshes and instances of the world flattened into world space vertex and face arrays,
+	///< which is the geometry layout of the single level strategies. Meshes go first,
+	///< instances are flattened into copies of their base meshes.
+	///<
+	struct FlatGeometry
+	{
+		// Face layout of the kernels
+		struct Face
+		{
+			// Vertex indices, the fourth one is -1 for triangles
+			int idx[4];
+			// Shape index
+			int shapeidx;
+			// Primitive ID within the mesh
+			int id;
+		};
+
+		explicit FlatGeometry(World const& world);
+
+		// Mesh the shape is made of, base one for instances
+		Mesh const* GetMesh(int shapeidx) const;
+		// World space bounds of all the faces
+		void GetFaceBounds(std::vector<bbox>& bounds) const;
+		// Build BVH over the faces, spatial splits get world space triangles as well
+		void BuildBvh(Bvh& bvh, std::vector<bbox> const& bounds) const;
+
+		// Create buffer of world space vertices
+		Calc::Buffer* CreateVertexBuffer(Calc::Device* device) const;
+		// Create buffer of faces in BVH leaf order if reordering is passed in and in the original order otherwise
+		Calc::Buffer* CreateFaceBuffer(Calc::Device* device, int const* reordering, int numindices) const;
+
+		// Shapes partitioned into meshes and instances
+		std::vector<Shape const*> shapes;
+		int nummeshes;
+		int numinstances;
+		int numvertices;
+		int numfaces;
+		// Start indices of shape vertices and faces as mesh face indices are relative to 0
+		std::vector<int> mesh_vertices_start_idx;
+		std::vector<int> mesh_faces_start_idx;
+	};
+}
+
+#endif // FLAT_GEOMETRY_H
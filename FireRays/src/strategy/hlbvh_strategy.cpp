@@ -70,64 +70,89 @@ namespace FireRays
 		Calc::Buffer* faces;
 		// Shape IDs
 		Calc::Buffer* shapes;
-		// Counter
-		Calc::Buffer* raycnt;
-		// Traversal stack
-		Calc::Buffer* stack;
 
 		Calc::Executable* executable;
 		Calc::Function* isect_func;
 		Calc::Function* occlude_func;
 		Calc::Function* isect_indirect_func;
 		Calc::Function* occlude_indirect_func;
+		// Persistent threads versions
+		Calc::Function* isect_pt_func;
+		Calc::Function* occlude_pt_func;
+		Calc::Function* isect_indirect_pt_func;
+		Calc::Function* occlude_indirect_pt_func;
 
 		GpuData(Calc::Device* d)
 			: device(d)
 			, vertices(nullptr)
 			, faces(nullptr)
 			, shapes(nullptr)
-			, raycnt(nullptr)
+			, executable(nullptr)
+			, isect_func(nullptr)
+			, occlude_func(nullptr)
+			, isect_indirect_func(nullptr)
+			, occlude_indirect_func(nullptr)
+			, isect_pt_func(nullptr)
+			, occlude_pt_func(nullptr)
+			, isect_indirect_pt_func(nullptr)
+			, occlude_indirect_pt_func(nullptr)
 		{
 		}
 
+		// Construction might fail half way (e.g. there are no kernels for the device)
 		~GpuData()
 		{
-			device->DeleteBuffer(vertices);
-			device->DeleteBuffer(faces);
-			device->DeleteBuffer(shapes);
-			device->DeleteBuffer(raycnt);
-			executable->DeleteFunction(isect_func);
-			executable->DeleteFunction(occlude_func);
-			executable->DeleteFunction(isect_indirect_func);
-			executable->DeleteFunction(occlude_indirect_func);
-			device->DeleteExecutable(executable);
+			if (vertices) device->DeleteBuffer(vertices);
+			if (faces) device->DeleteBuffer(faces);
+			if (shapes) device->DeleteBuffer(shapes);
+
+			if (executable)
+			{
+				Calc::Function* funcs[] = { isect_func, occlude_func, isect_indirect_func, occlude_indirect_func,
+					isect_pt_func, occlude_pt_func, isect_indirect_pt_func, occlude_indirect_pt_func };
+
+				for (auto func : funcs)
+				{
+					if (func) executable->DeleteFunction(func);
+				}
+
+				device->DeleteExecutable(executable);
+			}
 		}
 	};
 
-	HlbvhStrategy::HlbvhStrategy(Calc::Device* device)
+	HlbvhStrategy::HlbvhStrategy(Calc::Device* device, Calc::ExecutableCache* cache)
 		: Strategy(device)
 		, m_gpudata(new GpuData(device))
 		, m_bvh(nullptr)
+		, m_persistent(false)
 	{
 #ifndef FR_EMBED_KERNELS
 		char const* headers[] = { "../FireRays/src/kernel/CL/common.cl" };
 
 		int numheaders = sizeof(headers) / sizeof(char const*);
 
-		m_gpudata->executable = m_device->CompileExecutable("../FireRays/src/kernel/CL/hlbvh.cl", headers, numheaders);
+		m_gpudata->executable = cache->CompileExecutable("../FireRays/src/kernel/CL/hlbvh.cl", headers, numheaders);
 
 #else
-		m_gpudata->executable = m_device->CompileExecutable(cl_hlbvh, std::strlen(cl_hlbvh), nullptr);
+		m_gpudata->executable = cache->CompileExecutable(cl_hlbvh, std::strlen(cl_hlbvh), nullptr);
 #endif
 
 		m_gpudata->isect_func = m_gpudata->executable->CreateFunction("IntersectClosest");
 		m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny");
 		m_gpudata->isect_indirect_func = m_gpudata->executable->CreateFunction("IntersectClosestRC");
 		m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC");
+		m_gpudata->isect_pt_func = m_gpudata->executable->CreateFunction("IntersectClosestPT");
+		m_gpudata->occlude_pt_func = m_gpudata->executable->CreateFunction("IntersectAnyPT");
+		m_gpudata->isect_indirect_pt_func = m_gpudata->executable->CreateFunction("IntersectClosestRCPT");
+		m_gpudata->occlude_indirect_pt_func = m_gpudata->executable->CreateFunction("IntersectAnyRCPT");
 	}
 
 	void HlbvhStrategy::Preprocess(World const& world)
 	{
+		auto optpersistent = world.options_.GetOption("query.persistent");
+		m_persistent = optpersistent && optpersistent->AsFloat() > 0.f;
+
 		// If something has been changed we need to rebuild BVH
 		if (!m_bvh || world.has_changed())
 		{
@@ -197,8 +222,6 @@ namespace FireRays
 				{
 					// Get the mesh
 					Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-					// Get vertex buffer of the current mesh
-					float3 const* myvertexdata = mesh->GetVertexData();
 					// Get mesh transform
 					mesh->GetTransform(m, minv);
 
@@ -206,7 +229,7 @@ namespace FireRays
 					// Iterate thru vertices multiply and append them to GPU buffer
 					for (int j = 0; j < mesh->num_vertices(); ++j)
 					{
-						vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+						vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
 					}
 				}
 				m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e); 
@@ -220,28 +243,24 @@ namespace FireRays
 			{
 				struct Face
 				{
-					// Up to 3 indices
-					int idx[3];
+					// Vertex indices, the fourth one is -1 for triangles
+					int idx[4];
 					// Shape idx
 					int shapeidx;
 					// Primitive ID within the mesh
 					int id;
-					// Idx count
-					int cnt;
 				};
 
 				// Create face buffer
 				{
 					struct Face
 					{
-						// Up to 3 indices
-						int idx[3];
+						// Vertex indices, the fourth one is -1 for triangles
+						int idx[4];
 						// Shape index
 						int shapeidx;
 						// Primitive ID within the mesh
 						int id;
-						// Idx count
-						int cnt;
 					};
 
 					// Create face buffer
@@ -272,20 +291,20 @@ namespace FireRays
 
 						// Get the mesh
 						Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[shapeidx]);
-						// Get vertex buffer of the current mesh
-						Mesh::Face const* myfacedata = mesh->GetFaceData();
 						// Find face idx
 						int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+						// Get face data of the current mesh
+						Mesh::Face myface = mesh->GetFace(faceidx);
 						// Find mesh start idx
 						int mystartidx = mesh_vertices_start_idx[shapeidx];
 
 						// Copy face data to GPU buffer
-						facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-						facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-						facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+						facedata[i].idx[0] = myface.idx[0] + mystartidx;
+						facedata[i].idx[1] = myface.idx[1] + mystartidx;
+						facedata[i].idx[2] = myface.idx[2] + mystartidx;
+						facedata[i].idx[3] = myface.type_ == Mesh::FaceType::QUAD ? myface.idx[3] + mystartidx : -1;
 
 						facedata[i].shapeidx = shapeidx;
-						facedata[i].cnt = (myfacedata[faceidx].type_ == Mesh::FaceType::QUAD ? 4 : 3);
 						facedata[i].id = faceidx;
 					}
 
@@ -298,10 +317,6 @@ namespace FireRays
 
 			// Create shapes buffer
 			m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapes[0]);
-			// Create helper raycounter buffer
-			m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
-			// Stack
-			m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
 			// Make sure everything is commited
 			m_device->Finish(0);
 		}
@@ -369,8 +384,6 @@ namespace FireRays
 				{
 					// Get the mesh
 					Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-					// Get vertex buffer of the current mesh
-					float3 const* myvertexdata = mesh->GetVertexData();
 					// Get mesh transform
 					mesh->GetTransform(m, minv);
 
@@ -378,7 +391,7 @@ namespace FireRays
 					// Iterate thru vertices multiply and append them to GPU buffer
 					for (int j = 0; j < mesh->num_vertices(); ++j)
 					{
-						vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+						vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
 					}
 				}
 				m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
@@ -389,7 +402,7 @@ namespace FireRays
 		}
 	}
 
-	void HlbvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
+	void HlbvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event **event) const
 	{
 		// Check if we can allocate enough stack memory
 		if (numrays >= kMaxBatchSize)
@@ -397,7 +410,7 @@ namespace FireRays
 			throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
 		}
 
-		auto& func = m_gpudata->isect_func;
+		auto& func = m_persistent ? m_gpudata->isect_pt_func : m_gpudata->isect_func;
 
 		// Set args
 		int arg = 0;
@@ -412,15 +425,21 @@ namespace FireRays
 		func->SetArg(arg++, sizeof(offset), &offset);
 		func->SetArg(arg++, sizeof(numrays), &numrays);
 		func->SetArg(arg++, hits);
-		func->SetArg(arg++, m_gpudata->stack);
+		func->SetArg(arg++, GetStack(queueidx, kMaxBatchSize*kMaxStackSize));
+		SetFormatArgs(func, arg, rays, format);
 
 		size_t localsize = kWorkGroupSize;
 		size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
+		if (m_persistent)
+		{
+			globalsize = SetPersistentArgs(func, arg, queueidx, numrays, localsize);
+		}
+
 		m_device->Execute(func, queueidx, globalsize, localsize, event);
 	}
 
-	void HlbvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
+	void HlbvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event **event) const
 	{
 		// Check if we can allocate enough stack memory
 		if (numrays >= kMaxBatchSize)
@@ -428,7 +447,7 @@ namespace FireRays
 			throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
 		}
 
-		auto& func = m_gpudata->occlude_func;
+		auto& func = m_persistent ? m_gpudata->occlude_pt_func : m_gpudata->occlude_func;
 
 		// Set args
 		int arg = 0;
@@ -443,15 +462,21 @@ namespace FireRays
 		func->SetArg(arg++, sizeof(offset), &offset);
 		func->SetArg(arg++, sizeof(numrays), &numrays);
 		func->SetArg(arg++, hits);
-		func->SetArg(arg++, m_gpudata->stack);
+		func->SetArg(arg++, GetStack(queueidx, kMaxBatchSize*kMaxStackSize));
+		SetFormatArgs(func, arg, rays, format);
 
 		size_t localsize = kWorkGroupSize;
 		size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
+		if (m_persistent)
+		{
+			globalsize = SetPersistentArgs(func, arg, queueidx, numrays, localsize);
+		}
+
 		m_device->Execute(func, queueidx, globalsize, localsize, event);
 	}
 
-	void HlbvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+	void HlbvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event) const
 	{
 		// Check if we can allocate enough stack memory
 		if (maxrays >= kMaxBatchSize)
@@ -459,7 +484,7 @@ namespace FireRays
 			throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
 		}
 
-		auto& func = m_gpudata->isect_indirect_func;
+		auto& func = m_persistent ? m_gpudata->isect_indirect_pt_func : m_gpudata->isect_indirect_func;
 
 		// Set args
 		int arg = 0;
@@ -474,15 +499,21 @@ namespace FireRays
 		func->SetArg(arg++, sizeof(offset), &offset);
 		func->SetArg(arg++, numrays);
 		func->SetArg(arg++, hits);
-		func->SetArg(arg++, m_gpudata->stack);
+		func->SetArg(arg++, GetStack(queueidx, kMaxBatchSize*kMaxStackSize));
+		SetFormatArgs(func, arg, rays, format);
 
 		size_t localsize = kWorkGroupSize;
 		size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
+		if (m_persistent)
+		{
+			globalsize = SetPersistentArgs(func, arg, queueidx, maxrays, localsize);
+		}
+
 		m_device->Execute(func, queueidx, globalsize, localsize, event);
 	}
 
-	void HlbvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+	void HlbvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event) const
 	{
 		// Check if we can allocate enough stack memory
 		if (maxrays >= kMaxBatchSize)
@@ -490,7 +521,7 @@ namespace FireRays
 			throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
 		}
 
-		auto& func = m_gpudata->occlude_indirect_func;
+		auto& func = m_persistent ? m_gpudata->occlude_indirect_pt_func : m_gpudata->occlude_indirect_func;
 
 		// Set args
 		int arg = 0;
@@ -505,11 +536,17 @@ namespace FireRays
 		func->SetArg(arg++, sizeof(offset), &offset);
 		func->SetArg(arg++, numrays);
 		func->SetArg(arg++, hits);
-		func->SetArg(arg++, m_gpudata->stack);
+		func->SetArg(arg++, GetStack(queueidx, kMaxBatchSize*kMaxStackSize));
+		SetFormatArgs(func, arg, rays, format);
 
 		size_t localsize = kWorkGroupSize;
 		size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
+		if (m_persistent)
+		{
+			globalsize = SetPersistentArgs(func, arg, queueidx, maxrays, localsize);
+		}
+
 		m_device->Execute(func, queueidx, globalsize, localsize, event);
 	}
 
@@ -0,0 +1,284 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "qbvhstrategy.h"
+#include "bvh_options.h"
+#include "flat_geometry.h"
+
+#include "../accelerator/bvh.h"
+#include "../primitive/shapeimpl.h"
+#include "../world/world.h"
+
+#include "../translator/qbvh_translator.h"
+#include "../except/except.h"
+
+#ifdef FR_EMBED_KERNELS
+#include "../kernel/CL/cache/kernels.h"
+#endif
+
+#include "device.h"
+#include "executable.h"
+#include <algorithm>
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+// Traversal stack size, should match QBVH_STACK_SIZE in qbvh.cl
+static int const kMaxStackSize = 64;
+
+namespace FireRays
+{
+	struct QbvhStrategy::ShapeData
+	{
+		// Transform
+		matrix minv;
+		// Motion blur data
+		float3 linearvelocity;
+		// Angular veocity (quaternion)
+		quaternion angularvelocity;
+		// Shape ID
+		Id id;
+		// Index of root bvh node
+		int bvhidx;
+		// Shape mask
+		int mask;
+		int padding1;
+	};
+
+	struct QbvhStrategy::GpuData
+	{
+		// Device
+		Calc::Device* device;
+		// BVH nodes
+		Calc::Buffer* bvh;
+		// Vertex positions
+		Calc::Buffer* vertices;
+		// Indices
+		Calc::Buffer* faces;
+		// Shape IDs
+		Calc::Buffer* shapes;
+
+		Calc::Executable* executable;
+		Calc::Function* isect_func;
+		Calc::Function* occlude_func;
+		Calc::Function* isect_indirect_func;
+		Calc::Function* occlude_indirect_func;
+
+		GpuData(Calc::Device* d)
+			: device(d)
+			, bvh(nullptr)
+			, vertices(nullptr)
+			, faces(nullptr)
+			, shapes(nullptr)
+		{
+		}
+
+		void Release()
+		{
+			device->DeleteBuffer(bvh);
+			device->DeleteBuffer(vertices);
+			device->DeleteBuffer(faces);
+			device->DeleteBuffer(shapes);
+			bvh = vertices = faces = shapes = nullptr;
+		}
+
+		~GpuData()
+		{
+			Release();
+			executable->DeleteFunction(isect_func);
+			executable->DeleteFunction(occlude_func);
+			executable->DeleteFunction(isect_indirect_func);
+			executable->DeleteFunction(occlude_indirect_func);
+			device->DeleteExecutable(executable);
+		}
+	};
+
+	QbvhStrategy::QbvhStrategy(Calc::Device* device, Calc::ExecutableCache* cache)
+		: Strategy(device)
+		, m_gpudata(new GpuData(device))
+		, m_bvh(nullptr)
+	{
+#ifndef FR_EMBED_KERNELS
+		char const* headers[] = { "../FireRays/src/kernel/CL/common.cl" };
+
+		int numheaders = sizeof(headers) / sizeof(char const*);
+
+		m_gpudata->executable = cache->CompileExecutable("../FireRays/src/kernel/CL/qbvh.cl", headers, numheaders);
+
+#else
+		m_gpudata->executable = cache->CompileExecutable(cl_qbvh, std::strlen(cl_qbvh), nullptr);
+#endif
+
+		m_gpudata->isect_func = m_gpudata->executable->CreateFunction("IntersectClosest");
+		m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny");
+		m_gpudata->isect_indirect_func= m_gpudata->executable->CreateFunction("IntersectClosestRC");
+		m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC");
+	}
+
+	void QbvhStrategy::Preprocess(World const& world)
+	{
+		// If something has been changed we need to rebuild BVH
+		if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+		{
+			FlatGeometry geometry(world);
+			int numshapes = (int)geometry.shapes.size();
+
+			// Recreate it
+			m_bvh.reset(CreateBvh(world, true));
+
+			// We can't avoild allocating it here, since bounds aren't stored anywhere
+			std::vector<bbox> bounds;
+			geometry.GetFaceBounds(bounds);
+			geometry.BuildBvh(*m_bvh, bounds);
+
+			std::vector<ShapeData> shapedata(numshapes);
+
+			for (int i = 0; i < numshapes; ++i)
+			{
+				shapedata[i].id = geometry.shapes[i]->GetId();
+				shapedata[i].mask = geometry.shapes[i]->GetMask();
+			}
+
+			QbvhTranslator translator;
+			translator.Process(*m_bvh);
+
+			// Check if the traversal stack is deep enough for the tree
+			if (translator.maxstack_ >= kMaxStackSize)
+			{
+				m_bvh.reset(nullptr);
+				throw ExceptionImpl("qbvh accelerator can cause stack overflow for this scene, try using bvh instead");
+			}
+
+			// Release data of the previous build
+			m_gpudata->Release();
+
+			// Update GPU data
+			// Copy translated nodes first
+			m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(QbvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
+
+			// Vertices in world space and faces in BVH leaf order, spatial splits might duplicate faces
+			m_gpudata->vertices = geometry.CreateVertexBuffer(m_device);
+			m_gpudata->faces = geometry.CreateFaceBuffer(m_device, m_bvh->GetIndices(), m_bvh->GetNumIndices());
+
+			// Create shapes buffer
+			m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapedata[0]);
+
+			// Make sure everything is commited
+			m_device->Finish(0);
+		}
+	}
+
+	void QbvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event **event) const
+    {
+        auto& func = m_gpudata->isect_func;
+        
+		// Set args
+		int arg = 0;
+		int offset = 0;
+
+		func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, hits);
+        SetFormatArgs(func, arg, rays, format);
+
+        size_t localsize = kWorkGroupSize;
+		size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+	}
+
+    void QbvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event **event) const
+    {
+        auto& func = m_gpudata->occlude_func;
+        
+        // Set args
+        int arg = 0;
+        int offset = 0;
+        
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, sizeof(numrays), &numrays);
+        func->SetArg(arg++, hits);
+        SetFormatArgs(func, arg, rays, format);
+        
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void QbvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event) const
+	{
+        auto& func = m_gpudata->isect_indirect_func;
+        
+        // Set args
+        int arg = 0;
+        int offset = 0;
+        
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, numrays);
+        func->SetArg(arg++, hits);
+        SetFormatArgs(func, arg, rays, format);
+        
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+    void QbvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, QueryFormat const& format, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        auto& func = m_gpudata->occlude_indirect_func;
+        
+        // Set args
+        int arg = 0;
+        int offset = 0;
+        
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, numrays);
+        func->SetArg(arg++, hits);
+        SetFormatArgs(func, arg, rays, format);
+        
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        
+        m_device->Execute(func, queueidx, globalsize, localsize, event);
+    }
+
+}
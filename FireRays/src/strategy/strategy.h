@@ -24,21 +24,69 @@ THE SOFTWARE.
 
 #include "firerays.h"
 #include "calc.h"
+#include "device.h"
 #include "buffer.h"
 #include "event.h"
+#include "executable.h"
+#include "executable_cache.h"
+
+#include <algorithm>
+#include <vector>
 
 namespace FireRays
 {
 	class World;
 
+    // Layout flags of ray and hit buffers passed to the queries, values are shared with common.cl
+    enum QueryFormatFlags
+    {
+        // Rays are 32-byte compact_ray instead of ray
+        kCompactRays = 0x1,
+        // Masks and activity flags of compact rays come in a separate int2 buffer
+        kRayFlags = 0x2,
+        // Hits are 16-byte CompactIntersection instead of Intersection
+        kCompactHits = 0x4,
+        // Set by the strategy itself if faces buffer keeps precomputed triangles
+        kPrecomputedTriangles = 0x8
+    };
+
+    // Layout of ray and hit buffers of a query, default one is plain ray and Intersection
+    struct QueryFormat
+    {
+        QueryFormat(std::uint32_t flags = 0, Calc::Buffer const* rayflags = nullptr)
+            : flags(flags)
+            , rayflags(rayflags)
+        {
+        }
+
+        std::uint32_t flags;
+        // Ray masks and activity flags if kRayFlags is set
+        Calc::Buffer const* rayflags;
+    };
+
 	///< Interface for a specific intersection algorithm based on Calc.
     ///< CalcIntersectionDevice uses this interface to select different algorithms.
 	class Strategy
 	{
 	public:
         // Pass Calc::Device in
-		Strategy(Calc::Device* device) : m_device(device) {}
-		virtual ~Strategy() = default;
+		Strategy(Calc::Device* device)
+            : m_device(device)
+            , m_num_compute_units(GetNumComputeUnits(device))
+        {
+        }
+		virtual ~Strategy()
+        {
+            for (auto counter : m_raycounters)
+            {
+                m_device->DeleteBuffer(counter);
+            }
+
+            for (auto stack : m_stacks)
+            {
+                m_device->DeleteBuffer(stack);
+            }
+        }
 
         // Perform scene preprocessing
 		virtual void Preprocess(World const& world) = 0;
@@ -48,6 +96,7 @@ namespace FireRays
                                        Calc::Buffer const* rays,
                                        std::uint32_t numrays,
                                        Calc::Buffer* hits,
+                                       QueryFormat const& format,
                                        Calc::Event const* waitevent,
                                        Calc::Event** event) const = 0;
         
@@ -56,6 +105,7 @@ namespace FireRays
                                     Calc::Buffer const* rays,
                                     std::uint32_t numrays,
                                     Calc::Buffer* hits,
+                                    QueryFormat const& format,
                                     Calc::Event const* waitevent,
                                     Calc::Event** event) const = 0;
         
@@ -65,6 +115,7 @@ namespace FireRays
                                        Calc::Buffer const* numrays,
                                        std::uint32_t maxrays,
                                        Calc::Buffer* hits,
+                                       QueryFormat const& format,
                                        Calc::Event const* waitevent,
                                        Calc::Event** event) const = 0;
         
@@ -74,6 +125,7 @@ namespace FireRays
                                     Calc::Buffer const* numrays,
                                     std::uint32_t maxrays,
                                     Calc::Buffer* hits,
+                                    QueryFormat const& format,
                                     Calc::Event const* waitevent,
                                     Calc::Event** event) const = 0;
 
@@ -81,7 +133,81 @@ namespace FireRays
 		Strategy& operator = (Strategy const&) = delete;
 
 	protected:
+        // Set format arguments, all the query kernels take them after the regular ones
+        void SetFormatArgs(Calc::Function* func, int& arg, Calc::Buffer const* rays, QueryFormat const& format) const
+        {
+            int flags = static_cast<int>(format.flags);
+            func->SetArg(arg++, sizeof(flags), &flags);
+            // Kernels do not read the flags buffer unless kRayFlags is set
+            func->SetArg(arg++, format.rayflags ? format.rayflags : rays);
+        }
+
+        // Set ray counter argument of persistent threads kernels and return global size to launch them with.
+        // Counter is reset on the same queue right before the launch, so each queue gets its own one.
+        std::size_t SetPersistentArgs(Calc::Function* func, int& arg, std::uint32_t queueidx, std::size_t maxrays, std::size_t localsize) const
+        {
+            auto counter = GetQueueBuffer(m_raycounters, queueidx, sizeof(int));
+
+            // The write is ordered before the launch by the in-order queue, so there is no need to wait for it
+            static int zero = 0;
+            Calc::Event* reset_event = nullptr;
+            m_device->WriteBuffer(counter, queueidx, 0, sizeof(int), &zero, &reset_event);
+            m_device->DeleteEvent(reset_event);
+
+            func->SetArg(arg++, counter);
+
+            // Enough groups to keep every compute unit busy, but never more than there are batches
+            std::size_t numbatches = (maxrays + localsize - 1) / localsize;
+            std::size_t numgroups = m_num_compute_units * kPersistentGroupsPerUnit;
+
+            return std::max<std::size_t>(std::min(numbatches, numgroups), 1) * localsize;
+        }
+
+        // Traversal stack of the queue, queries on different queues run concurrently,
+        // so kernels indexing the stack by global id can't share a single one
+        Calc::Buffer* GetStack(std::uint32_t queueidx, std::size_t size) const
+        {
+            return GetQueueBuffer(m_stacks, queueidx, size);
+        }
+
 		Calc::Device* m_device;
+
+    private:
+        // Number of compute units of the device, at least one
+        static std::size_t GetNumComputeUnits(Calc::Device* device)
+        {
+            Calc::DeviceSpec spec;
+            device->GetSpec(spec);
+            return std::max<std::size_t>(spec.num_compute_units, 1);
+        }
+
+        // Per queue buffer created on the first query of the queue, callers serialize submission
+        Calc::Buffer* GetQueueBuffer(std::vector<Calc::Buffer*>& buffers, std::uint32_t queueidx, std::size_t size) const
+        {
+            if (queueidx >= buffers.size())
+            {
+                buffers.resize(queueidx + 1, nullptr);
+            }
+
+            auto& buffer = buffers[queueidx];
+
+            if (!buffer)
+            {
+                buffer = m_device->CreateBuffer(size, Calc::BufferType::kWrite);
+            }
+
+            return buffer;
+        }
+
+        // Number of resident work groups per compute unit for persistent threads kernels
+        static std::size_t const kPersistentGroupsPerUnit = 16;
+        // Queried once, persistent threads launches are sized by it
+        std::size_t m_num_compute_units;
+
+        // Per queue ray counters of persistent threads kernels
+        mutable std::vector<Calc::Buffer*> m_raycounters;
+        // Per queue traversal stacks of the strategies using them
+        mutable std::vector<Calc::Buffer*> m_stacks;
 	};
 }
 
@@ -26,73 +26,62 @@ THE SOFTWARE.
 #include "../except/except.h"
 
 #include <cassert>
-#include <queue>
+#include <vector>
 #include <iostream>
 
 namespace FireRays
 {
     void FatNodeBvhTranslator::Process(Bvh& bvh)
     {
-        // WARNING: this is crucial in order for the nodes not to migrate in memory as push_back adds nodes
-        nodecnt_ = 0;
-        int newsize = bvh.nodecnt_;
-        nodes_.resize(newsize);
-        extra_.resize(newsize);
+        int numnodes = bvh.GetNumNodes();
+        Bvh::Node const* bvhnodes = bvh.GetNodes();
 
         // Check if we have been initialized
-        assert(bvh.root_);
-
-        // Process root
-        ProcessRootNode(bvh.root_);
-    }
+        assert(numnodes > 0);
 
+        // Fat nodes are only created for internal nodes
+        // keeping their depth first order, find their indices first
+        std::vector<int> fatidx(numnodes);
 
-    int FatNodeBvhTranslator::ProcessRootNode(Bvh::Node const* root)
-    {
-        // Keep the nodes to process here
-        std::queue<std::pair<Bvh::Node const*, int> > workqueue;
+        nodecnt_ = 0;
+        for (int i = 0; i < numnodes; ++i)
+        {
+            fatidx[i] = nodecnt_;
+            nodecnt_ += bvhnodes[i].is_leaf() ? 0 : 1;
+        }
 
-        workqueue.push(std::make_pair(root, 0));
+        nodes_.resize(nodecnt_);
 
-        while (!workqueue.empty())
+        for (int i = 0; i < numnodes; ++i)
         {
-            auto current = workqueue.front();
-            workqueue.pop();
+            if (bvhnodes[i].is_leaf()) continue;
 
-            Node& node(nodes_[nodecnt_++]);
+            Node& node(nodes_[fatidx[i]]);
 
-            node.lbound = current.first->lc->bounds;
-            if (current.first->lc->type == Bvh::NodeType::kInternal)
+            int left = i + 1;
+            int right = bvhnodes[i].index;
+
+            node.lbound = bvhnodes[left].bounds();
+            if (!bvhnodes[left].is_leaf())
             {
                 node.lbound.pmin.w = -1.f;
-                workqueue.push(std::make_pair(current.first->lc, nodecnt_));
+                node.lbound.pmax.w = (float)fatidx[left];
             }
             else
             {
-                node.lbound.pmin.w = (float)(current.first->lc->startidx);
+                node.lbound.pmin.w = (float)(bvhnodes[left].index);
             }
 
-            node.rbound = current.first->rc->bounds;
-            if (current.first->rc->type == Bvh::NodeType::kInternal)
+            node.rbound = bvhnodes[right].bounds();
+            if (!bvhnodes[right].is_leaf())
             {
                 node.rbound.pmin.w = -1.f;
-                workqueue.push(std::make_pair(current.first->rc, -nodecnt_));
+                node.rbound.pmax.w = (float)fatidx[right];
             }
             else
             {
-                node.rbound.pmin.w = (float)(current.first->rc->startidx);
-            }
-
-            if (current.second > 0)
-            {
-                nodes_[current.second - 1].lbound.pmax.w = (float)(nodecnt_ - 1);
-            }
-            else if(current.second < 0)
-            {
-                nodes_[-current.second - 1].rbound.pmax.w = (float)(nodecnt_ - 1);
+                node.rbound.pmin.w = (float)(bvhnodes[right].index);
             }
         }
-
-        return 0;
     }
-}
\ No newline at end of file
+}
@@ -35,7 +35,7 @@ namespace FireRays
 {
     /// Fatnode translator transforms regular binary BVH into the form where:
     /// * Each node contains bounding boxes of its children
-    /// * Both children follow parent node in the layuot (breadth first)
+    /// * Internal nodes keep depth first order of the source BVH
     /// * No parent informantion is stored for the node => stacked traversal only
     /// 
     class FatNodeBvhTranslator
@@ -71,9 +71,6 @@ namespace FireRays
         int root_;
 
     private:
-        int ProcessRootNode(Bvh::Node const* node);
-        //int ProcessNode(Bvh::Node const* n, int offset);
-
         FatNodeBvhTranslator(FatNodeBvhTranslator const&);
         FatNodeBvhTranslator& operator =(FatNodeBvhTranslator const&);
     };
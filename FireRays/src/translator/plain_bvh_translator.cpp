@@ -26,85 +26,42 @@ THE SOFTWARE.
 #include "../except/except.h"
 
 #include <cassert>
+#include <cstring>
 #include <stack>
 #include <iostream>
 
 namespace FireRays
 {
+    int PlainBvhTranslator::EncodeLeaf(int startidx, int numprims)
+    {
+        ThrowIf(startidx > kLeafStartMask, "PlainBvhTranslator: too many primitives for BVH leaf encoding");
+        ThrowIf(numprims < 1 || numprims > Bvh::kMaxPrimsPerLeaf, "PlainBvhTranslator: invalid number of primitives in BVH leaf");
+
+        return startidx | ((numprims - 1) << kLeafStartBits);
+    }
+
     void PlainBvhTranslator::Process(Bvh& bvh)
     {
-        // WARNING: this is crucial in order for the nodes not to migrate in memory as push_back adds nodes
         nodecnt_ = 0;
-        int newsize = bvh.nodecnt_;
-        nodes_.resize(newsize);
-        extra_.resize(newsize);
+        root_ = 0;
+        nodes_.resize(bvh.GetNumNodes());
 
         // Check if we have been initialized
-        assert(bvh.root_);
-
-        // Save current root position
-        int rootidx = 0;
-
-        // Process root
-        ProcessNode(bvh.root_);
-
-        // Set next ptr
-        nodes_[rootidx].bounds.pmax.w = -1;
+        assert(bvh.GetNumNodes() > 0);
 
-        //
-        for (int i = rootidx; i < (int)nodes_.size(); ++i)
-        {
-            if (nodes_[i].bounds.pmin.w != -1.f)
-            {
-                nodes_[i + 1].bounds.pmax.w = nodes_[i].bounds.pmin.w;
-                nodes_[(int)(nodes_[i].bounds.pmin.w)].bounds.pmax.w = nodes_[i].bounds.pmax.w;
-            }
-        }
-
-        for (int i = rootidx; i < (int)nodes_.size(); ++i)
-        {
-            if (nodes_[i].bounds.pmin.w == -1.f)
-            {
-                nodes_[i].bounds.pmin.w = (float)extra_[i];
-            }
-            else
-            {
-                nodes_[i].bounds.pmin.w = -1.f;
-            }
-        }
+        nodecnt_ = ProcessNodes(bvh, 0, 0);
     }
 
     void PlainBvhTranslator::UpdateTopLevel(Bvh const& bvh)
     {
-        nodecnt_ = root_;
-
-        // Process root
-        ProcessNode(bvh.root_);
-
-        // Set next ptr
-        nodes_[root_].bounds.pmax.w = -1;
-
-        for (int j = root_; j < root_ + bvh.nodecnt_; ++j)
-        {
-            if (nodes_[j].bounds.pmin.w != -1.f)
-            {
-                nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-                nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
-            }
-        }
+        nodecnt_ = ProcessNodes(bvh, root_, 0);
+    }
 
-        for (int j = root_; j < root_ + bvh.nodecnt_; ++j)
-        {
-            if (nodes_[j].bounds.pmin.w == -1.f)
-            {
-                nodes_[j].bounds.pmin.w = (float)extra_[j];
-            }
-            else
-            {
-                nodes_[j].bounds.pmin.w = -1.f;
-            }
-        }
+    void PlainBvhTranslator::Process(Bvh const& bvh, int startidx, int offset)
+    {
+        assert(startidx + bvh.GetNumNodes() <= (int)nodes_.size());
 
+        ProcessNodes(bvh, startidx, offset);
     }
 
     void PlainBvhTranslator::Process(Bvh const** bvhs, int const* offsets, int numbvhs)
@@ -118,11 +75,11 @@ namespace FireRays
                 continue;
             }
 
-            nodecnt += bvhs[i]->nodecnt_;
+            nodecnt += bvhs[i]->GetNumNodes();
         }
 
+        nodecnt_ = 0;
         nodes_.resize(nodecnt);
-        extra_.resize(nodecnt);
         roots_.resize(numbvhs);
 
         for (int i = 0; i < numbvhs; ++i)
@@ -132,114 +89,51 @@ namespace FireRays
                 continue;
             }
 
-            int currentroot = nodecnt_;
-
-            roots_[i] = currentroot;
-            
-            // Process root
-            ProcessNode(bvhs[i]->root_, offsets[i]);
-
-            // Set next ptr
-            nodes_[currentroot].bounds.pmax.w = -1;
+            roots_[i] = nodecnt_;
 
-            for (int j = currentroot; j < currentroot + bvhs[i]->nodecnt_; ++j)
-            {
-                if (nodes_[j].bounds.pmin.w != -1.f)
-                {
-                    nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-                    nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
-                }
-            }
-
-            for (int j = currentroot; j < currentroot + bvhs[i]->nodecnt_; ++j)
-            {
-                if (nodes_[j].bounds.pmin.w == -1.f)
-                {
-                    nodes_[j].bounds.pmin.w = (float)extra_[j];
-                }
-                else
-                {
-                    nodes_[j].bounds.pmin.w = -1.f;
-                }
-            }
+            nodecnt_ = ProcessNodes(*bvhs[i], nodecnt_, offsets[i]);
         }
 
         // The final one
         root_ = nodecnt_;
 
-        // Process root
-        ProcessNode(bvhs[numbvhs]->root_);
+        nodecnt_ = ProcessNodes(*bvhs[numbvhs], nodecnt_, 0);
+    }
+
+    int PlainBvhTranslator::ProcessNodes(Bvh const& bvh, int startidx, int offset)
+    {
+        // Bvh nodes are already in depth first order with left children
+        // following their parents, so they are translated one by one
+        int root = startidx;
+        int numnodes = bvh.GetNumNodes();
+        Bvh::Node const* bvhnodes = bvh.GetNodes();
 
         // Set next ptr
-        nodes_[root_].bounds.pmax.w = -1;
+        nodes_[root].bounds.pmax.w = -1.f;
 
-        for (int j = root_; j < root_ + bvhs[numbvhs]->nodecnt_; ++j)
+        for (int i = 0; i < numnodes; ++i)
         {
-            if (nodes_[j].bounds.pmin.w != -1.f)
-            {
-                nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-                nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
-            }
-        }
+            // Keep pmax.w as it has been already set by the parent
+            Node& node = nodes_[root + i];
+            node.bounds.pmin = float3(bvhnodes[i].pmin[0], bvhnodes[i].pmin[1], bvhnodes[i].pmin[2]);
+            node.bounds.pmax = float3(bvhnodes[i].pmax[0], bvhnodes[i].pmax[1], bvhnodes[i].pmax[2], node.bounds.pmax.w);
 
-        for (int j = root_; j < root_ + bvhs[numbvhs]->nodecnt_; ++j)
-        {
-            if (nodes_[j].bounds.pmin.w == -1.f)
+            if (bvhnodes[i].is_leaf())
             {
-                nodes_[j].bounds.pmin.w = (float)extra_[j];
+                int leaf = EncodeLeaf(bvhnodes[i].index + offset, bvhnodes[i].numprims);
+                std::memcpy(&node.bounds.pmin.w, &leaf, sizeof(int));
             }
             else
             {
-                nodes_[j].bounds.pmin.w = -1.f;
+                // Left child goes to its sibling on a miss, the right one goes where its parent does
+                int right = root + bvhnodes[i].index;
+                node.bounds.pmin.w = -1.f;
+                nodes_[root + i + 1].bounds.pmax.w = (float)right;
+                nodes_[right].bounds.pmax.w = node.bounds.pmax.w;
             }
         }
 
-    }
-
-    int PlainBvhTranslator::ProcessNode(Bvh::Node const* n)
-    {
-        int idx = nodecnt_;
-        //std::cout << "Index " << idx << "\n";
-        Node& node = nodes_[nodecnt_];
-        node.bounds = n->bounds;
-        int& extra = extra_[nodecnt_++];
-
-        if (n->type == Bvh::kLeaf)
-        {
-            int startidx = n->startidx;
-            extra = startidx;
-            node.bounds.pmin.w = -1.f;
-        }
-        else
-        {
-            ProcessNode(n->lc);
-            node.bounds.pmin.w = (float)ProcessNode(n->rc);
-        }
-
-        return idx;
-    }
-
-    int PlainBvhTranslator::ProcessNode(Bvh::Node const* n, int offset)
-    {
-        int idx = nodecnt_;
-        //std::cout << "Index " << idx << "\n";
-        Node& node = nodes_[nodecnt_];
-        node.bounds = n->bounds;
-        int& extra = extra_[nodecnt_++];
-
-        if (n->type == Bvh::kLeaf)
-        {
-            int startidx = n->startidx + offset;
-            extra = startidx;
-            node.bounds.pmin.w = -1.f;
-        }
-        else
-        {
-            ProcessNode(n->lc, offset);
-            node.bounds.pmin.w = (float)ProcessNode(n->rc, offset);
-        }
-
-        return idx;
+        return root + numnodes;
     }
 
 
@@ -249,6 +143,5 @@ namespace FireRays
         root_ = 0;
         roots_.resize(0);
         nodes_.resize(0);
-        extra_.resize(0);
     }
 }
@@ -33,8 +33,8 @@ THE SOFTWARE.
 
 namespace FireRays
 {
-    /// This class translates pointer based BVH representation into
-    /// index based one suitable for feeding to GPU or any other accelerator
+    /// This class translates BVH representation into the one
+    /// with skip links suitable for feeding to GPU or any other accelerator
     //
     class PlainBvhTranslator
     {
@@ -53,20 +53,34 @@ namespace FireRays
             bbox bounds;
         };
 
+        // Leaf primitive range is packed into pmin.w bits: 27 bits of
+        // starting index and 4 bits of primitive count minus one.
+        // Sign bit is always clear, so leaves are told apart from
+        // internal nodes (pmin.w == -1.f) with an integer comparison.
+        static const int kLeafStartBits = 27;
+        static const int kLeafStartMask = (1 << kLeafStartBits) - 1;
+
+        static int EncodeLeaf(int startidx, int numprims);
+        static int DecodeLeafStart(int leaf) { return leaf & kLeafStartMask; }
+        static int DecodeLeafCount(int leaf) { return (leaf >> kLeafStartBits) + 1; }
+
         void Flush();
         void Process(Bvh& bvh);
         void Process(Bvh const** bvhs, int const* offsets, int numbvhs);
         void UpdateTopLevel(Bvh const& bvh);
+        // Translate single bvh to nodes_ starting at startidx, offset is added to primitive indices.
+        // nodes_ should be large enough, translating into disjoint ranges can be done concurrently.
+        void Process(Bvh const& bvh, int startidx, int offset);
 
         std::vector<Node> nodes_;
-        std::vector<int>  extra_;
         std::vector<int>  roots_;
         int nodecnt_;
         int root_;
 
     private:
-        int ProcessNode(Bvh::Node const* node);
-        int ProcessNode(Bvh::Node const* n, int offset);
+        // Translate bvh nodes to startidx position, offset is added to primitive indices,
+        // returns the index past the last translated node
+        int ProcessNodes(Bvh const& bvh, int startidx, int offset);
 
         PlainBvhTranslator(PlainBvhTranslator const&);
         PlainBvhTranslator& operator =(PlainBvhTranslator const&);
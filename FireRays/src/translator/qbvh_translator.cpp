@@ -0,0 +1,166 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "qbvh_translator.h"
+
+#include "../except/except.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+namespace FireRays
+{
+    void QbvhTranslator::Process(Bvh const& bvh)
+    {
+        int numnodes = bvh.GetNumNodes();
+        Bvh::Node const* bvhnodes = bvh.GetNodes();
+
+        // Check if we have been initialized
+        assert(numnodes > 0);
+
+        // Every 4-wide node absorbs at least one binary internal node
+        nodes_.clear();
+        nodes_.reserve(numnodes / 2 + 1);
+
+        nodecnt_ = 0;
+        maxstack_ = 0;
+
+        ProcessNode(bvhnodes, 0, 0);
+    }
+
+    void QbvhTranslator::ProcessNode(Bvh::Node const* bvhnodes, int bvhidx, int stackdepth)
+    {
+        // Gather up to 4 children opening the largest internal node each time
+        int children[kNumChildren];
+        int numchildren = 0;
+
+        // Leaf root is kept as a single child
+        if (bvhnodes[bvhidx].is_leaf())
+        {
+            children[numchildren++] = bvhidx;
+        }
+        else
+        {
+            children[numchildren++] = bvhidx + 1;
+            children[numchildren++] = bvhnodes[bvhidx].index;
+        }
+
+        while (numchildren < kNumChildren)
+        {
+            int best = -1;
+            float bestarea = -1.f;
+
+            for (int i = 0; i < numchildren; ++i)
+            {
+                Bvh::Node const& node = bvhnodes[children[i]];
+
+                if (!node.is_leaf())
+                {
+                    float area = node.bounds().surface_area();
+
+                    if (area > bestarea)
+                    {
+                        bestarea = area;
+                        best = i;
+                    }
+                }
+            }
+
+            if (best == -1)
+            {
+                break;
+            }
+
+            // Replace the node with its children keeping spatial order
+            int opened = children[best];
+
+            for (int i = numchildren; i > best + 1; --i)
+            {
+                children[i] = children[i - 1];
+            }
+
+            children[best] = opened + 1;
+            children[best + 1] = bvhnodes[opened].index;
+            ++numchildren;
+        }
+
+        int nodeidx = nodecnt_++;
+        nodes_.resize(nodecnt_);
+
+        // Traversal pushes all internal children but the closest one
+        int numinternal = 0;
+        for (int i = 0; i < numchildren; ++i)
+        {
+            numinternal += bvhnodes[children[i]].is_leaf() ? 0 : 1;
+        }
+
+        int childstackdepth = stackdepth + std::max(numinternal - 1, 0);
+
+        if (childstackdepth > maxstack_)
+        {
+            maxstack_ = childstackdepth;
+        }
+
+        for (int i = 0; i < kNumChildren; ++i)
+        {
+            // Unused slots get empty bounds and are masked out by their count
+            if (i >= numchildren)
+            {
+                Node& node = nodes_[nodeidx];
+
+                node.bminx[i] = node.bminy[i] = node.bminz[i] = std::numeric_limits<float>::max();
+                node.bmaxx[i] = node.bmaxy[i] = node.bmaxz[i] = -std::numeric_limits<float>::max();
+                node.child[i] = 0;
+                node.count[i] = -1;
+                continue;
+            }
+
+            Bvh::Node const& bvhnode = bvhnodes[children[i]];
+
+            {
+                Node& node = nodes_[nodeidx];
+
+                node.bminx[i] = bvhnode.pmin[0];
+                node.bminy[i] = bvhnode.pmin[1];
+                node.bminz[i] = bvhnode.pmin[2];
+                node.bmaxx[i] = bvhnode.pmax[0];
+                node.bmaxy[i] = bvhnode.pmax[1];
+                node.bmaxz[i] = bvhnode.pmax[2];
+            }
+
+            if (bvhnode.is_leaf())
+            {
+                nodes_[nodeidx].child[i] = bvhnode.index;
+                nodes_[nodeidx].count[i] = bvhnode.numprims;
+            }
+            else
+            {
+                // Child subtree goes right after the current one (depth first order),
+                // nodes_ might be reallocated, so the node is accessed by index only
+                nodes_[nodeidx].child[i] = nodecnt_;
+                nodes_[nodeidx].count[i] = 0;
+
+                ProcessNode(bvhnodes, children[i], childstackdepth);
+            }
+        }
+    }
+}
@@ -0,0 +1,91 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef QBVH_TRANSLATOR_H
+#define QBVH_TRANSLATOR_H
+
+#include <vector>
+
+#include "firerays.h"
+#include "../accelerator/bvh.h"
+
+#include "math/float3.h"
+
+namespace FireRays
+{
+    /// QBVH translator collapses regular binary BVH into 4-wide form where:
+    /// * Each node contains bounding boxes of up to 4 children in SoA layout
+    /// * Binary nodes with the largest surface area are opened first, since
+    ///   they are the most likely ones to be visited (SAH)
+    /// * Nodes are stored in depth first order, root goes first
+    /// * Leaves are not stored, children reference primitive ranges directly
+    /// * No parent informantion is stored for the node => stacked traversal only
+    ///
+    class QbvhTranslator
+    {
+    public:
+        // Constructor
+        QbvhTranslator()
+            : nodecnt_(0)
+            , maxstack_(0)
+        {
+        }
+
+        static const int kNumChildren = 4;
+
+        // 4-wide BVH node (128 bytes)
+        // Encoding:
+        // count[i] == 0 if i-th child is an internal node, child[i] is its node index
+        // count[i] > 0 if i-th child is a leaf, child[i] is the first primitive index
+        // count[i] == -1 for unused slots
+        //
+        struct Node
+        {
+            // Children bounding boxes
+            float bminx[kNumChildren];
+            float bmaxx[kNumChildren];
+            float bminy[kNumChildren];
+            float bmaxy[kNumChildren];
+            float bminz[kNumChildren];
+            float bmaxz[kNumChildren];
+            int child[kNumChildren];
+            int count[kNumChildren];
+        };
+
+        void Process(Bvh const& bvh);
+
+        std::vector<Node> nodes_;
+        int nodecnt_;
+        // Max number of traversal stack entries the tree might need
+        int maxstack_;
+
+    private:
+        // Collapse binary subtree at bvhidx into a node at nodecnt_ position,
+        // stackdepth is the number of entries pushed to the stack before visiting it
+        void ProcessNode(Bvh::Node const* bvhnodes, int bvhidx, int stackdepth);
+
+        QbvhTranslator(QbvhTranslator const&);
+        QbvhTranslator& operator =(QbvhTranslator const&);
+    };
+}
+
+
+#endif // QBVH_TRANSLATOR_H
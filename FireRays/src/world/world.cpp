@@ -22,6 +22,8 @@ THE SOFTWARE.
 #include "world.h"
 
 #include "../primitive/shapeimpl.h"
+#include "../primitive/instance.h"
+#include "../primitive/mesh.h"
 
 namespace FireRays
 {
@@ -30,6 +32,7 @@ namespace FireRays
         if (std::find(shapes_.cbegin(), shapes_.cend(), shape) == shapes_.cend())
         {
             shapes_.push_back(shape);
+            shapes_dirty_[shape] |= kDirtyAttached;
             has_changed_ = true;
         }
     }
@@ -40,10 +43,22 @@ namespace FireRays
         if (iter != shapes_.end())
         {
             shapes_.erase(iter);
+            shapes_dirty_[shape] |= kDirtyDetached;
             has_changed_ = true;
         }
     }
 
+    void World::OnDeleteShape(Shape const* shape)
+    {
+        shapes_dirty_[shape] |= kDirtyDeleted;
+    }
+
+    int World::GetDirtyFlags(Shape const* shape) const
+    {
+        auto iter = shapes_dirty_.find(shape);
+        return iter != shapes_dirty_.cend() ? iter->second : kDirtyNone;
+    }
+
     int World::GetStateChange() const
     {
         int statechange_ = ShapeImpl::kStateChangeNone;
@@ -53,11 +68,55 @@ namespace FireRays
             ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(*iter);
 
             statechange_ |= shapeimpl->GetStateChange();
+
+            // Base shape might be deformed without being attached itself
+            if (shapeimpl->is_instance())
+            {
+                auto baseshape = static_cast<ShapeImpl const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape());
+
+                statechange_ |= baseshape->GetStateChange() & ShapeImpl::kStateChangeVertices;
+            }
         }
 
         return statechange_;
     }
 
+    bool World::HasQuads() const
+    {
+        for (auto iter = shapes_.cbegin(); iter != shapes_.cend(); ++iter)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(*iter);
+
+            auto mesh = shapeimpl->is_instance() ?
+                static_cast<Mesh const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape()) :
+                static_cast<Mesh const*>(shapeimpl);
+
+            if (!mesh->puretriangle())
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool World::HasMotion() const
+    {
+        for (auto iter = shapes_.cbegin(); iter != shapes_.cend(); ++iter)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(*iter);
+            quaternion rotation = shapeimpl->GetAngularVelocity();
+
+            if (shapeimpl->GetLinearVelocity().sqnorm() > 0.f ||
+                rotation.x != 0.f || rotation.y != 0.f || rotation.z != 0.f)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
     void World::OnCommit()
     {
         for (auto iter = shapes_.cbegin(); iter != shapes_.cend(); ++iter)
@@ -65,8 +124,14 @@ namespace FireRays
             auto shapeimpl = static_cast<ShapeImpl const*>(*iter);
 
             shapeimpl->OnCommit();
+
+            if (shapeimpl->is_instance())
+            {
+                static_cast<ShapeImpl const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape())->OnCommit();
+            }
         }
 
+        shapes_dirty_.clear();
         has_changed_ = false;
     }
 }
\ No newline at end of file
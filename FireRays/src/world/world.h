@@ -22,6 +22,7 @@ THE SOFTWARE.
 #ifndef WORLD_H
 #define WORLD_H
 
+#include <map>
 #include <memory>
 #include <vector>
 
@@ -38,6 +39,16 @@ namespace FireRays
     class World
     {
     public:
+        // Per shape changes since the last commit
+        enum DirtyFlags
+        {
+            kDirtyNone = 0x0,
+            kDirtyAttached = 0x1,
+            kDirtyDetached = 0x2,
+            // Shape has been destroyed, its address might be reused by a new one
+            kDirtyDeleted = 0x4
+        };
+
         //
         World();
         //
@@ -46,21 +57,29 @@ namespace FireRays
         void AttachShape(Shape const* shape);
         // Detach the shape 
         void DetachShape(Shape const* shape);
+        // Call this before the shape is destroyed
+        void OnDeleteShape(Shape const* shape);
         // Call this as scene has been commited
         void OnCommit();
         // 
         bool has_changed() const;
         //
         int GetStateChange() const;
+        // Dirty flags of the shape since the last commit
+        int GetDirtyFlags(Shape const* shape) const;
+        // Check if any of the meshes (or instanced meshes) has quad faces
+        bool HasQuads() const;
+        // Check if any of the shapes has linear or angular velocity
+        bool HasMotion() const;
 
 
     public:
         // Shapes in the scene
         std::vector<Shape const*> shapes_;
-        // Flags to indicate shapes have been changed
-        std::vector<int> shapes_dirty_;
+        // Dirty flags of the shapes changed since the last commit
+        std::map<Shape const*, int> shapes_dirty_;
 
-        // TODO: Do more preciese dirty flags tracking
+        // Set of shapes has changed
         bool has_changed_;
         // Global flags
         int hint_;
@@ -1,9 +1,11 @@
 project "UnitTest"
     location "../UnitTest"
     kind "ConsoleApp"
-	includedirs { "../FireRays/include", "../Gtest/include", "../CLW", "../Calc/inc", "." }
+	includedirs { "../FireRays/include", "../FireRays/src", "../Gtest/include", "../CLW", "../Calc/inc", "." }
     links {"Gtest", "FireRays", "CLW", "Calc"}
     files { "**.cpp", "**.h" }
+    -- BVH builder is internal to FireRays, so its tests build it in
+    files { "../FireRays/src/accelerator/bvh.cpp", "../FireRays/src/async/task_scheduler.cpp" }
     
     if os.is("macosx") then
         buildoptions "-std=c++11 -stdlib=libc++"
@@ -0,0 +1,127 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <vector>
+#include <cstring>
+
+#include "gtest/gtest.h"
+#include "accelerator/bvh.h"
+
+using namespace FireRays;
+
+// Bvh builder fixture, prepares primitive bounds large enough for the parallel builder
+class BvhBuilder : public ::testing::Test
+{
+public:
+    virtual void SetUp()
+    {
+        // Triangle-like boxes scattered with a fixed LCG, so the bounds are the same in every run
+        unsigned seed = 1234567u;
+        auto rnd = [&seed]()
+        {
+            seed = seed * 1664525u + 1013904223u;
+            return (seed >> 8) * (1.f / 16777216.f);
+        };
+
+        bounds_.resize(kNumBounds);
+        for (auto& b : bounds_)
+        {
+            float3 p(rnd() * 100.f, rnd() * 100.f, rnd() * 100.f);
+            b = bbox(p, p + float3(rnd(), rnd(), rnd()));
+        }
+    }
+
+    // Builds the tree by numthreads threads
+    void Build(Bvh& bvh, int numthreads, bool deterministic)
+    {
+        bvh.SetBuildThreads(numthreads, deterministic);
+        bvh.Build(&bounds_[0], (int)bounds_.size());
+    }
+
+    // Checks both trees have the same nodes and the same leaf primitives
+    void ExpectSame(Bvh const& serial, Bvh const& parallel)
+    {
+        ASSERT_EQ(serial.GetNumNodes(), parallel.GetNumNodes());
+        ASSERT_EQ(serial.GetNumIndices(), parallel.GetNumIndices());
+        ASSERT_EQ(0, std::memcmp(serial.GetNodes(), parallel.GetNodes(), serial.GetNumNodes() * sizeof(Bvh::Node)));
+        ASSERT_EQ(0, std::memcmp(serial.GetIndices(), parallel.GetIndices(), serial.GetNumIndices() * sizeof(int)));
+    }
+
+    // Above the parallel build threshold (64K primitives)
+    static int const kNumBounds = 100000;
+
+    std::vector<bbox> bounds_;
+};
+
+// The test checks deterministic median split build gives the same tree for any number of threads
+TEST_F(BvhBuilder, Deterministic_Median)
+{
+    Bvh serial(false, 4);
+    ASSERT_NO_THROW(Build(serial, 1, true));
+
+    int threads[] = { 2, 4, 7 };
+    for (auto numthreads : threads)
+    {
+        Bvh parallel(false, 4);
+        ASSERT_NO_THROW(Build(parallel, numthreads, true));
+        ExpectSame(serial, parallel);
+    }
+}
+
+// The test checks deterministic SAH build gives the same tree for any number of threads
+TEST_F(BvhBuilder, Deterministic_Sah)
+{
+    Bvh serial(true, 4);
+    ASSERT_NO_THROW(Build(serial, 1, true));
+
+    int threads[] = { 2, 4, 7 };
+    for (auto numthreads : threads)
+    {
+        Bvh parallel(true, 4);
+        ASSERT_NO_THROW(Build(parallel, numthreads, true));
+        ExpectSame(serial, parallel);
+    }
+}
+
+// The test checks fast parallel build covers every primitive exactly once with the same root bounds
+TEST_F(BvhBuilder, Parallel_Fast)
+{
+    Bvh serial(true, 4);
+    ASSERT_NO_THROW(Build(serial, 1, false));
+
+    Bvh parallel(true, 4);
+    ASSERT_NO_THROW(Build(parallel, 4, false));
+
+    ASSERT_EQ(serial.GetNumIndices(), parallel.GetNumIndices());
+    for (int i = 0; i < 3; ++i)
+    {
+        ASSERT_EQ(serial.GetNodes()[0].pmin[i], parallel.GetNodes()[0].pmin[i]);
+        ASSERT_EQ(serial.GetNodes()[0].pmax[i], parallel.GetNodes()[0].pmax[i]);
+    }
+
+    std::vector<int> count(kNumBounds, 0);
+    for (int i = 0; i < parallel.GetNumIndices(); ++i)
+    {
+        ASSERT_EQ(1, ++count[parallel.GetIndices()[i]]);
+    }
+}
@@ -0,0 +1,284 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "gtest/gtest.h"
+#include "calc.h"
+#include "device.h"
+#include "buffer.h"
+#include "except.h"
+#include "event.h"
+#include "executable.h"
+#include "primitives.h"
+#include "native_kernel.h"
+#include "executable_cache.h"
+
+// Native device fixture, looks up CPU device implemented in native code
+class CalcNativeTest : public ::testing::Test
+{
+public:
+	virtual void SetUp()
+	{
+		m_calc = Calc::CreateCalc(0);
+		m_device = nullptr;
+
+		for (auto i = 0U; i < m_calc->GetDeviceCount(); ++i)
+		{
+			Calc::DeviceSpec spec;
+			m_calc->GetDeviceSpec(i, spec);
+
+			if (spec.type == Calc::DeviceType::kCpu && std::strcmp(spec.name, "Native CPU") == 0)
+			{
+				m_device = m_calc->CreateDevice(i);
+			}
+		}
+
+		ASSERT_TRUE(m_device != nullptr);
+	}
+
+	virtual void TearDown()
+	{
+		if (m_device)
+		{
+			m_calc->DeleteDevice(m_device);
+		}
+
+		Calc::DeleteCalc(m_calc);
+	}
+
+	Calc::Calc* m_calc;
+	Calc::Device* m_device;
+};
+
+TEST_F(CalcNativeTest, MapBuffer)
+{
+	const auto kBufferSize = 1000;
+	std::vector<int> numbers(kBufferSize);
+	std::generate(numbers.begin(), numbers.end(), std::rand);
+
+	Calc::Buffer* buffer = nullptr;
+	ASSERT_NO_THROW(buffer = m_device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite, &numbers[0]));
+
+	int* mapdata = nullptr;
+	Calc::Event* e = nullptr;
+	ASSERT_NO_THROW(m_device->MapTypedBuffer(buffer, 0, 0, kBufferSize, Calc::MapType::kMapRead, &mapdata, &e));
+
+	e->Wait();
+	m_device->DeleteEvent(e);
+
+	for (auto i = 0; i < kBufferSize; ++i)
+	{
+		ASSERT_EQ(numbers[i], mapdata[i]);
+	}
+
+	ASSERT_NO_THROW(m_device->UnmapBuffer(buffer, 0, mapdata, nullptr));
+	ASSERT_NO_THROW(m_device->DeleteBuffer(buffer));
+}
+
+TEST_F(CalcNativeTest, Execute)
+{
+	Calc::RegisterNativeKernel("calc_test.cl", "AddValue",
+		[](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+	{
+		auto data = args.GetBuffer<int>(0);
+		auto value = args.GetValue<int>(1);
+		auto size = static_cast<std::size_t>(args.GetValue<int>(2));
+
+		for (auto i = begin; i < std::min(end, size); ++i)
+		{
+			data[i] += value;
+		}
+	});
+
+	const int kBufferSize = 100003;
+	std::vector<int> numbers(kBufferSize);
+	std::iota(numbers.begin(), numbers.end(), 0);
+
+	Calc::Buffer* buffer = m_device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite, &numbers[0]);
+
+	Calc::Executable* executable = nullptr;
+	ASSERT_NO_THROW(executable = m_device->CompileExecutable("kernels/calc_test.cl", nullptr, 0));
+	ASSERT_THROW(executable->CreateFunction("NoSuchKernel"), Calc::Exception);
+
+	Calc::Function* func = nullptr;
+	ASSERT_NO_THROW(func = executable->CreateFunction("AddValue"));
+
+	int value = 3;
+	func->SetArg(0, buffer);
+	func->SetArg(1, sizeof(int), &value);
+	func->SetArg(2, sizeof(int), const_cast<int*>(&kBufferSize));
+
+	Calc::Event* e = nullptr;
+	ASSERT_NO_THROW(m_device->Execute(func, 0, ((kBufferSize + 63) / 64) * 64, 64, &e));
+
+	// Arguments are captured at launch, so changing them does not affect the first run
+	value = 5;
+	func->SetArg(1, sizeof(int), &value);
+	ASSERT_NO_THROW(m_device->Execute(func, 0, ((kBufferSize + 63) / 64) * 64, 64, nullptr));
+
+	e->Wait();
+	m_device->DeleteEvent(e);
+
+	std::vector<int> numbers_calc(kBufferSize);
+	ASSERT_NO_THROW(m_device->ReadTypedBuffer(buffer, 0, 0, kBufferSize, &numbers_calc[0], nullptr));
+
+	for (auto i = 0; i < kBufferSize; ++i)
+	{
+		ASSERT_EQ(numbers[i] + 8, numbers_calc[i]);
+	}
+
+	executable->DeleteFunction(func);
+	m_device->DeleteExecutable(executable);
+	m_device->DeleteBuffer(buffer);
+}
+
+TEST_F(CalcNativeTest, SortRadix)
+{
+	ASSERT_TRUE(m_device->HasBuiltinPrimitives());
+
+	const auto kBufferSize = 100000;
+	std::vector<int> keys(kBufferSize);
+	std::vector<int> values(kBufferSize);
+	std::generate(keys.begin(), keys.end(), std::rand);
+	std::iota(values.begin(), values.end(), 0);
+
+	auto from_key = m_device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kRead, &keys[0]);
+	auto to_key = m_device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite);
+	auto from_value = m_device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kRead, &values[0]);
+	auto to_value = m_device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite);
+
+	auto prims = m_device->CreatePrimitives();
+	ASSERT_NO_THROW(prims->SortRadixInt32(0, from_key, to_key, from_value, to_value, kBufferSize, nullptr));
+
+	std::vector<int> sorted_keys(kBufferSize);
+	std::vector<int> sorted_values(kBufferSize);
+	m_device->ReadTypedBuffer(to_key, 0, 0, kBufferSize, &sorted_keys[0], nullptr);
+	m_device->ReadTypedBuffer(to_value, 0, 0, kBufferSize, &sorted_values[0], nullptr);
+
+	ASSERT_TRUE(std::is_sorted(sorted_keys.begin(), sorted_keys.end()));
+
+	for (auto i = 0; i < kBufferSize; ++i)
+	{
+		ASSERT_EQ(keys[sorted_values[i]], sorted_keys[i]);
+	}
+
+	m_device->DeletePrimitives(prims);
+	m_device->DeleteBuffer(from_key);
+	m_device->DeleteBuffer(to_key);
+	m_device->DeleteBuffer(from_value);
+	m_device->DeleteBuffer(to_value);
+}
+
+TEST_F(CalcNativeTest, ExecutableCache)
+{
+	static char const* kSource = "__kernel void Fill(__global int* data, int value) { data[get_global_id(0)] = value; }";
+
+	Calc::RegisterNativeProgramSource("calc_cache_test.cl", kSource);
+	Calc::RegisterNativeKernel("calc_cache_test.cl", "Fill",
+		[](Calc::NativeArgs const& args, std::size_t begin, std::size_t end)
+	{
+		auto data = args.GetBuffer<int>(0);
+		auto value = args.GetValue<int>(1);
+
+		for (auto i = begin; i < end; ++i)
+		{
+			data[i] = value;
+		}
+	});
+
+	// Unique cache directory in the system temp location
+	std::string path = "calc_cache_test";
+	char const* tmpvars[] = { "TMPDIR", "TEMP", "TMP" };
+	for (auto var : tmpvars)
+	{
+		if (auto tmp = std::getenv(var))
+		{
+			path = std::string(tmp) + "/" + path;
+			break;
+		}
+	}
+
+	path += "_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+
+	Calc::ExecutableCache cache(m_device, path);
+	auto entry = cache.GetEntryFileName(kSource, std::strlen(kSource), nullptr);
+
+	// First call populates the cache, second one loads the binary back
+	for (auto pass = 0; pass < 2; ++pass)
+	{
+		Calc::Executable* executable = nullptr;
+		ASSERT_NO_THROW(executable = cache.CompileExecutable(kSource, std::strlen(kSource), nullptr));
+		ASSERT_GT(m_device->GetExecutableBinarySize(executable), 0U);
+
+		// The entry is stored by the first pass and only loaded by the second one
+		ASSERT_TRUE(std::ifstream(entry, std::ios::in | std::ios::binary).good());
+		ASSERT_EQ(1U, cache.GetNumMisses());
+		ASSERT_EQ((std::uint32_t)pass, cache.GetNumHits());
+
+		Calc::Function* func = nullptr;
+		ASSERT_NO_THROW(func = executable->CreateFunction("Fill"));
+
+		const int kBufferSize = 256;
+		auto buffer = m_device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite);
+
+		int value = pass + 1;
+		func->SetArg(0, buffer);
+		func->SetArg(1, sizeof(int), &value);
+		ASSERT_NO_THROW(m_device->Execute(func, 0, kBufferSize, 64, nullptr));
+
+		std::vector<int> result(kBufferSize);
+		m_device->ReadTypedBuffer(buffer, 0, 0, kBufferSize, &result[0], nullptr);
+
+		for (auto i = 0; i < kBufferSize; ++i)
+		{
+			ASSERT_EQ(value, result[i]);
+		}
+
+		m_device->DeleteBuffer(buffer);
+		executable->DeleteFunction(func);
+		m_device->DeleteExecutable(executable);
+	}
+
+	// Bail out
+	ASSERT_EQ(0, std::remove(entry.c_str()));
+#ifdef _WIN32
+	ASSERT_EQ(0, _rmdir(path.c_str()));
+#else
+	ASSERT_EQ(0, rmdir(path.c_str()));
+#endif
+}
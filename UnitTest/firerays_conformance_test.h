@@ -118,6 +118,20 @@ public:
 
     void BrutforceTrace(ray& r, Intersection& isect);
 
+    // Option set on both APIs, either string or float one
+    struct ApiOption
+    {
+        ApiOption(char const* n, char const* v) : name(n), value(v), floatvalue(0.f) {}
+        ApiOption(char const* n, float v) : name(n), value(nullptr), floatvalue(v) {}
+
+        char const* name;
+        char const* value;
+        float floatvalue;
+    };
+
+    // Traces random rays with both APIs configured by options and checks hits against brute force
+    void BrutforceConformance(std::vector<ApiOption> const& options);
+
     // CPU api
     IntersectionApi* apicpu_;
     // GPU api
@@ -831,6 +845,16 @@ TEST_F(ApiConformance, CornellBox_1000Rays_Brutforce_FatBvh)
 	ASSERT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer_gpu));
 }
 
+TEST_F(ApiConformance, CornellBox_1000Rays_Brutforce_Qbvh)
+{
+	BrutforceConformance({ { "acc.type", "qbvh" }, { "bvh.builder", "sah" } });
+}
+
+TEST_F(ApiConformance, CornellBox_1000Rays_Brutforce_Grid)
+{
+	BrutforceConformance({ { "acc.type", "grid" } });
+}
+
 TEST_F(ApiConformance, CornellBox_1000Rays_Brutforce_HlBvh)
 {
 	apicpu_->SetOption("acc.type", "hlbvh");
@@ -1007,6 +1031,16 @@ TEST_F(ApiConformance, CornellBox_1000Rays_Brutforce_2level)
 	ASSERT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer_gpu));
 }
 
+TEST_F(ApiConformance, CornellBox_1000Rays_Brutforce_MaxPrimsPerLeaf)
+{
+	BrutforceConformance({ { "bvh.sah.maxprimsperleaf", 16.f } });
+}
+
+TEST_F(ApiConformance, CornellBox_1000Rays_Brutforce_SpatialSplits)
+{
+	BrutforceConformance({ { "bvh.builder", "sah" }, { "bvh.sah.usesplits", 1.f } });
+}
+
 
 inline void ApiConformance::BrutforceTrace(ray& r, Intersection& isect)
 {
@@ -1066,4 +1100,105 @@ inline void ApiConformance::BrutforceTrace(ray& r, Intersection& isect)
 }
 
 
+inline void ApiConformance::BrutforceConformance(std::vector<ApiOption> const& options)
+{
+	for (auto const& option : options)
+	{
+		if (option.value)
+		{
+			apicpu_->SetOption(option.name, option.value);
+			apigpu_->SetOption(option.name, option.value);
+		}
+		else
+		{
+			apicpu_->SetOption(option.name, option.floatvalue);
+			apigpu_->SetOption(option.name, option.floatvalue);
+		}
+	}
+
+	int const kNumRays = 1000;
+	srand((unsigned)time(0));
+
+	ASSERT_NO_THROW(apicpu_->Commit());
+	ASSERT_NO_THROW(apigpu_->Commit());
+
+	auto ray_buffer_cpu = apicpu_->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+	auto isect_buffer_cpu = apicpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+	auto ray_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+	auto isect_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+	std::vector<ray> r_gold(kNumRays);
+
+	ray* r_cpu = nullptr;
+	ray* r_gpu = nullptr;
+
+	std::vector<Intersection> isect_gold(kNumRays);
+
+	Event* ecpu, *egpu;
+	ASSERT_NO_THROW(apicpu_->MapBuffer(ray_buffer_cpu, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&r_cpu, &ecpu));
+	ASSERT_NO_THROW(apigpu_->MapBuffer(ray_buffer_gpu, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&r_gpu, &egpu));
+	ecpu->Wait(); apicpu_->DeleteEvent(ecpu);
+	egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+	for (int i = 0; i<kNumRays; ++i)
+	{
+		r_gold[i].o = r_gpu[i].o = r_cpu[i].o = float4(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+		r_gold[i].d = r_gpu[i].d = r_cpu[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+
+		r_gpu[i].SetActive(true);
+		r_cpu[i].SetActive(true);
+		r_gold[i].SetActive(true);
+
+		r_gpu[i].SetMask(0xFFFFFFFF);
+		r_cpu[i].SetMask(0xFFFFFFFF);
+		r_gold[i].SetMask(0xFFFFFFFF);
+
+		BrutforceTrace(r_gold[i], isect_gold[i]);
+	}
+
+	ASSERT_NO_THROW(apicpu_->UnmapBuffer(ray_buffer_cpu, r_cpu, &ecpu));
+	ASSERT_NO_THROW(apigpu_->UnmapBuffer(ray_buffer_gpu, r_gpu, &egpu));
+	ecpu->Wait(); apicpu_->DeleteEvent(ecpu);
+	egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+	// Intersect
+	ASSERT_NO_THROW(apicpu_->QueryIntersection(ray_buffer_cpu, kNumRays, isect_buffer_cpu, nullptr, nullptr));
+	ASSERT_NO_THROW(apigpu_->QueryIntersection(ray_buffer_gpu, kNumRays, isect_buffer_gpu, nullptr, nullptr));
+
+	Intersection* isect_cpu = nullptr;
+	Intersection* isect_gpu = nullptr;
+	ASSERT_NO_THROW(apicpu_->MapBuffer(isect_buffer_cpu, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect_cpu, &ecpu));
+	ASSERT_NO_THROW(apigpu_->MapBuffer(isect_buffer_gpu, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect_gpu, &egpu));
+	ecpu->Wait(); apicpu_->DeleteEvent(ecpu);
+	egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+	for (int i = 0; i<kNumRays; ++i)
+	{
+		// Same shape or a miss for both, so neither missed nor false hits pass
+		ASSERT_EQ(isect_cpu[i].shapeid, isect_gold[i].shapeid);
+		ASSERT_EQ(isect_gpu[i].shapeid, isect_gold[i].shapeid);
+
+		if (isect_gold[i].shapeid >= 0)
+		{
+			float dist1 = (isect_cpu[i].uvwt.w - isect_gold[i].uvwt.w) * (isect_cpu[i].uvwt.w - isect_gold[i].uvwt.w);
+			float dist2 = (isect_gpu[i].uvwt.w - isect_gold[i].uvwt.w) * (isect_gpu[i].uvwt.w - isect_gold[i].uvwt.w);
+
+			ASSERT_LE(dist1, 0.0001f);
+			ASSERT_LE(dist2, 0.0001f);
+		}
+	}
+
+	ASSERT_NO_THROW(apicpu_->UnmapBuffer(isect_buffer_cpu, isect_cpu, &ecpu));
+	ASSERT_NO_THROW(apigpu_->UnmapBuffer(isect_buffer_gpu, isect_gpu, &egpu));
+	ecpu->Wait(); apicpu_->DeleteEvent(ecpu);
+	egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+	ASSERT_NO_THROW(apicpu_->DeleteBuffer(ray_buffer_cpu));
+	ASSERT_NO_THROW(apigpu_->DeleteBuffer(ray_buffer_gpu));
+	ASSERT_NO_THROW(apicpu_->DeleteBuffer(isect_buffer_cpu));
+	ASSERT_NO_THROW(apigpu_->DeleteBuffer(isect_buffer_gpu));
+}
+
+
 #endif // FIRERAYS_CONFORMANCE_TEST_H
@@ -133,5 +133,18 @@ TEST_F(ApiPerformance, BvhBuild)
     std::cout << "Bvh build time: " << delta << " ms\n";
 }
 
+TEST_F(ApiPerformance, BvhBuild_SingleThread)
+{
+    api_->SetOption("acc.type", "bvh");
+    api_->SetOption("bvh.builder", "sah");
+    api_->SetOption("bvh.builder.threads", 1.f);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    api_->Commit();
+    auto delta = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+
+    std::cout << "Bvh build time (single thread): " << delta << " ms\n";
+}
+
 
 #endif
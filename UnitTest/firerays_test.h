@@ -29,6 +29,13 @@ THE SOFTWARE.
 #include "firerays.h"
 #include "math/quaternion.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <vector>
+
 using namespace FireRays;
 
 #include "tiny_obj_loader.h"
@@ -40,6 +47,7 @@ public:
     virtual void SetUp()
     {
         int nativeidx = -1;
+        int cpuidx = -1;
         for (int idx=0; idx < IntersectionApi::GetDeviceCount(); ++idx)
         {
             DeviceInfo devinfo;
@@ -49,6 +57,17 @@ public:
             {
                 nativeidx = idx;
             }
+
+            if (devinfo.type == DeviceInfo::kCpu && cpuidx == -1)
+            {
+                cpuidx = idx;
+            }
+        }
+
+        // Machines without a GPU run the tests on the CPU (native one if there is no OpenCL)
+        if (nativeidx == -1)
+        {
+            nativeidx = cpuidx;
         }
 
         ASSERT_NE(nativeidx, -1);
@@ -127,6 +146,50 @@ TEST_F(Api, EmptyScene)
 	ASSERT_THROW(api_->Commit(), Exception);
 }
 
+// The test checks queries issued before the first commit are reported as errors
+TEST_F(Api, QueryBeforeCommit)
+{
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+
+    int indices[] = {0, 1, 2};
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, nullptr, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    Intersection isect;
+    int occluded = -1;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto mask_buffer = api_->CreateBuffer(sizeof(int), nullptr);
+
+    // No acceleration structure yet, every query path reports it
+    ASSERT_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr), Exception);
+    ASSERT_THROW(api_->QueryOcclusion(ray_buffer, 1, mask_buffer, nullptr, nullptr), Exception);
+    ASSERT_THROW(api_->QueryOcclusionMask(ray_buffer, 1, mask_buffer, nullptr, nullptr), Exception);
+    ASSERT_THROW(api_->QueryIntersectionCompact(ray_buffer, nullptr, 1, isect_buffer, nullptr, nullptr), Exception);
+    ASSERT_THROW(api_->QueryIntersection(&r, 1, &isect), Exception);
+    ASSERT_THROW(api_->QueryOcclusion(&r, 1, &occluded), Exception);
+
+    // Queries work once the scene is committed
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(&r, 1, &isect));
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(mask_buffer));
+}
+
 // The test creates a single triangle mesh and tests attach/detach functionality
 TEST_F(Api, MeshStrided)
 {
@@ -765,6 +828,1571 @@ TEST_F(Api, Intersection_1Ray_DynamicGeo)
 	ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
+// The test checks intersection after in place vertex update
+TEST_F(Api, Intersection_1Ray_DeformedGeo)
+{
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+        
+    };
+
+    // Indices
+    int indices[] = {0, 1, 2};
+    // Number of vertices for the face
+    int numfaceverts[] = { 3 };
+
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_TRUE(mesh != nullptr);
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+	Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+	Wait();
+
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 10.f, 0.01f);
+
+    // Move the last two vertices only, the triangle is now tilted
+    float update[] = {
+        1.f,-1.f,-2.f,
+        0.f,1.f,-2.f
+    };
+
+    Id id = mesh->GetId();
+    ASSERT_NO_THROW(mesh->UpdateVertices(update, 1, 2, 0));
+    ASSERT_THROW(mesh->UpdateVertices(update, 2, 2, 0), Exception);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+	Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+	Wait();
+
+    // Check results
+    ASSERT_EQ(mesh->GetId(), id);
+    ASSERT_EQ(isect.shapeid, id);
+    ASSERT_NEAR(isect.uvwt.w, 8.5f, 0.01f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+	ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+	ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks refitted BVH gives the same hits as the rebuilt one and gets rebuilt once it is too slow
+TEST_F(Api, Intersection_Refit)
+{
+    // Checkerboard of triangles, even cells go to the first mesh and odd ones to the second,
+    // so BVH nodes mix both meshes and refitting them after moving one mesh away is slow
+    int const res = 128;
+    std::vector<float> vertices[2];
+    std::vector<int> indices[2];
+
+    for (int y = 0; y < res; ++y)
+    {
+        for (int x = 0; x < res; ++x)
+        {
+            int m = (x + y) % 2;
+            int v = (int)vertices[m].size() / 3;
+            float triangle[] = { (float)x, (float)y, 0.f, x + 1.f, (float)y, 0.f, x + 1.f, y + 1.f, 0.f };
+            vertices[m].insert(vertices[m].end(), triangle, triangle + 9);
+            indices[m].push_back(v);
+            indices[m].push_back(v + 1);
+            indices[m].push_back(v + 2);
+        }
+    }
+
+    Shape* meshes[2] = { nullptr, nullptr };
+    for (int m = 0; m < 2; ++m)
+    {
+        int numvertices = (int)vertices[m].size() / 3;
+        int numfaces = (int)indices[m].size() / 3;
+        ASSERT_NO_THROW(meshes[m] = api_->CreateMesh(&vertices[m][0], numvertices, 3*sizeof(float), &indices[m][0], 0, nullptr, numfaces));
+        ASSERT_NO_THROW(api_->AttachShape(meshes[m]));
+    }
+
+    Shape* instance = nullptr;
+    ASSERT_NO_THROW(instance = api_->CreateInstance(meshes[1]));
+    matrix m = translation(float3(200.f, 0.f, 0.f));
+    ASSERT_NO_THROW(instance->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+
+    // Flat BVH is the one refitting, instances would force 2 level BVH otherwise
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.forceflat", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.refit.threshold", 1000000.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Move the first mesh and the instance, raise the second mesh (and so the instance)
+    m = translation(float3(0.f, 0.f, 1.f));
+    ASSERT_NO_THROW(meshes[0]->SetTransform(m, inverse(m)));
+    m = translation(float3(300.f, 0.f, 0.f));
+    ASSERT_NO_THROW(instance->SetTransform(m, inverse(m)));
+
+    std::vector<float> raised = vertices[1];
+    for (std::size_t i = 2; i < raised.size(); i += 3)
+    {
+        raised[i] = 0.5f;
+    }
+
+    ASSERT_NO_THROW(meshes[1]->UpdateVertices(&raised[0], 0, (int)raised.size() / 3, 0));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Rays go through the cells of the meshes and of the instance
+    std::vector<ray> rays;
+    for (int y = 0; y < res; ++y)
+    {
+        for (int x = 0; x < res; ++x)
+        {
+            rays.push_back(ray(float3(x + 0.75f, y + 0.25f, -10.f), float3(0.f, 0.f, 1.f), 1000.f));
+            rays.push_back(ray(float3(x + 300.75f, y + 0.25f, -10.f), float3(0.f, 0.f, 1.f), 1000.f));
+        }
+    }
+
+    std::vector<Intersection> refitted(rays.size());
+    ASSERT_NO_THROW(api_->QueryIntersection(&rays[0], (int)rays.size(), &refitted[0]));
+
+    // Reattaching the shape changes the set of shapes, so BVH is built from scratch
+    ASSERT_NO_THROW(api_->DetachShape(meshes[0]));
+    ASSERT_NO_THROW(api_->AttachShape(meshes[0]));
+    ASSERT_NO_THROW(api_->Commit());
+
+    std::vector<Intersection> rebuilt(rays.size());
+    ASSERT_NO_THROW(api_->QueryIntersection(&rays[0], (int)rays.size(), &rebuilt[0]));
+
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        int cell = i / 2;
+        bool odd = (cell % res + cell / res) % 2 == 1;
+        Id expected = (i % 2) ? (odd ? instance->GetId() : kNullId) : meshes[odd ? 1 : 0]->GetId();
+
+        ASSERT_EQ(refitted[i].shapeid, expected);
+        ASSERT_EQ(rebuilt[i].shapeid, expected);
+
+        if (expected != kNullId)
+        {
+            ASSERT_EQ(refitted[i].primid, rebuilt[i].primid);
+            ASSERT_NEAR(refitted[i].uvwt.w, odd ? 10.5f : 11.f, 0.001f);
+            ASSERT_NEAR(rebuilt[i].uvwt.w, odd ? 10.5f : 11.f, 0.001f);
+        }
+    }
+
+    // Time to trace the rays with the current BVH
+    auto trace = [&]()
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        api_->QueryIntersection(&rays[0], (int)rays.size(), &refitted[0]);
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    };
+
+    // Moving the second mesh far away makes all the refitted nodes huge
+    m = translation(float3(1000.f, 1000.f, 0.f));
+    ASSERT_NO_THROW(meshes[1]->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(api_->Commit());
+    double refittime = trace();
+
+    // Such a BVH is way over the threshold, so the next move makes it rebuilt
+    ASSERT_NO_THROW(api_->SetOption("bvh.refit.threshold", 2.f));
+    m = translation(float3(1000.f, 1001.f, 0.f));
+    ASSERT_NO_THROW(meshes[1]->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(api_->Commit());
+    double rebuildtime = trace();
+
+    ASSERT_GT(refittime, 4.0 * rebuildtime);
+
+    for (int i = 0; i < (int)rays.size(); i += 2)
+    {
+        int cell = i / 2;
+        bool odd = (cell % res + cell / res) % 2 == 1;
+        ASSERT_EQ(refitted[i].shapeid, odd ? kNullId : meshes[0]->GetId());
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.forceflat", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.refit.threshold", 0.f));
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DetachShape(meshes[0]));
+    ASSERT_NO_THROW(api_->DetachShape(meshes[1]));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(meshes[0]));
+    ASSERT_NO_THROW(api_->DeleteShape(meshes[1]));
+}
+
+// The test checks BVH built by several threads gives the same hits as the one built by a single thread
+TEST_F(Api, Intersection_ParallelBuild)
+{
+    // Heightfield large enough for the parallel builder (64K faces and more)
+    int const res = 256;
+    std::vector<float> vertices;
+    std::vector<int> indices;
+
+    for (int y = 0; y <= res; ++y)
+    {
+        for (int x = 0; x <= res; ++x)
+        {
+            vertices.push_back((float)x);
+            vertices.push_back((float)y);
+            vertices.push_back(std::sin(x * 0.37f) * std::cos(y * 0.23f) * 4.f);
+        }
+    }
+
+    for (int y = 0; y < res; ++y)
+    {
+        for (int x = 0; x < res; ++x)
+        {
+            int v = y * (res + 1) + x;
+            int cell[] = { v, v + 1, v + res + 2, v, v + res + 2, v + res + 1 };
+            indices.insert(indices.end(), cell, cell + 6);
+        }
+    }
+
+    Shape* mesh = nullptr;
+    int numfaces = (int)indices.size() / 3;
+    ASSERT_GE(numfaces, 64 * 1024);
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(&vertices[0], (int)vertices.size() / 3, 3*sizeof(float), &indices[0], 0, nullptr, numfaces));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays go from above through face centroids, so each of them hits the surface away from the edges
+    std::vector<ray> rays;
+    for (int i = 0; i < numfaces; i += 3)
+    {
+        float3 target;
+        for (int j = 0; j < 3; ++j)
+        {
+            int v = indices[i * 3 + j];
+            target += float3(vertices[v * 3], vertices[v * 3 + 1], vertices[v * 3 + 2]) * (1.f / 3.f);
+        }
+
+        float3 origin(res * 0.5f, res * 0.5f, 100.f);
+        rays.push_back(ray(origin, normalize(target - origin), 1000.f));
+    }
+
+    // Reattaching the shape changes the set of shapes, so BVH is built from scratch,
+    // thread count is explicit to run the parallel builder on any machine
+    auto build_and_query = [&](int numthreads, bool deterministic, std::vector<Intersection>& isect)
+    {
+        api_->SetOption("bvh.builder.threads", (float)numthreads);
+        api_->SetOption("bvh.builder.deterministic", deterministic ? 1.f : 0.f);
+        api_->DetachShape(mesh);
+        api_->AttachShape(mesh);
+        api_->Commit();
+
+        isect.resize(rays.size());
+        api_->QueryIntersection(&rays[0], (int)rays.size(), &isect[0]);
+    };
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+
+    char const* builders[] = { "median", "sah" };
+    for (auto builder : builders)
+    {
+        ASSERT_NO_THROW(api_->SetOption("bvh.builder", builder));
+
+        std::vector<Intersection> serial;
+        std::vector<Intersection> parallel;
+        std::vector<Intersection> fast;
+        ASSERT_NO_THROW(build_and_query(1, true, serial));
+        ASSERT_NO_THROW(build_and_query(4, true, parallel));
+        ASSERT_NO_THROW(build_and_query(4, false, fast));
+
+        for (int i = 0; i < (int)rays.size(); ++i)
+        {
+            ASSERT_EQ(serial[i].shapeid, mesh->GetId());
+
+            // Deterministic build gives the same tree, so the hits are bit exact
+            ASSERT_EQ(parallel[i].shapeid, serial[i].shapeid);
+            ASSERT_EQ(parallel[i].primid, serial[i].primid);
+            ASSERT_EQ(parallel[i].uvwt.x, serial[i].uvwt.x);
+            ASSERT_EQ(parallel[i].uvwt.y, serial[i].uvwt.y);
+            ASSERT_EQ(parallel[i].uvwt.w, serial[i].uvwt.w);
+
+            // Tree might differ otherwise, but the closest hit is still the same
+            ASSERT_EQ(fast[i].shapeid, serial[i].shapeid);
+            ASSERT_EQ(fast[i].primid, serial[i].primid);
+            ASSERT_NEAR(fast[i].uvwt.w, serial[i].uvwt.w, 0.001f);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "median"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder.threads", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder.deterministic", 0.f));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks intersection with a mesh referencing application memory
+TEST_F(Api, Intersection_1Ray_SharedGeo)
+{
+    // Mesh vertices, should outlive the mesh
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+        
+    };
+
+    // Indices
+    int indices[] = {0, 1, 2};
+    // Number of vertices for the face
+    int numfaceverts[] = { 3 };
+
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMeshShared(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_TRUE(mesh != nullptr);
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+	Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+	Wait();
+
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 10.f, 0.01f);
+
+    // Move the triangle closer in application memory
+    vertices[2] = vertices[5] = vertices[8] = -2.f;
+
+    ASSERT_THROW(mesh->UpdateVertices(vertices, 0, 3, 0), Exception);
+    ASSERT_NO_THROW(mesh->UpdateVertices(nullptr, 0, 3, 0));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+	Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+	Wait();
+
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 8.f, 0.01f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+	ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+	ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks only the attached meshes are visible as
+// the scene changes between commits with 2-level BVH
+TEST_F(Api, Intersection_1Ray_AttachAfterCommit_2level)
+{
+    api_->SetOption("bvh.force2level", 1.f);
+
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+
+    // The same triangle closer to the ray origin
+    float vertices_near[] = {
+        -1.f,-1.f,-2.f,
+        1.f,-1.f,-2.f,
+        0.f,1.f,-2.f,
+    };
+
+    // Indices
+    int indices[] = {0, 1, 2};
+    // Number of vertices for the face
+    int numfaceverts[] = { 3 };
+
+    Shape* mesh = nullptr;
+    Shape* mesh_near = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    auto query = [&]()
+    {
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        isect = *tmp;
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    };
+
+    query();
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 10.f, 0.01f);
+
+    // Attach a new mesh in front of the first one
+    ASSERT_NO_THROW(mesh_near = api_->CreateMesh(vertices_near, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh_near));
+
+    query();
+    ASSERT_EQ(isect.shapeid, mesh_near->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 8.f, 0.01f);
+
+    // Delete it and create another one in its place, which might reuse the address
+    ASSERT_NO_THROW(api_->DetachShape(mesh_near));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh_near));
+    ASSERT_NO_THROW(mesh_near = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(mesh->SetMask(0x0));
+    ASSERT_NO_THROW(api_->AttachShape(mesh_near));
+
+    query();
+    ASSERT_EQ(isect.shapeid, mesh_near->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 10.f, 0.01f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DetachShape(mesh_near));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh_near));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks that queries switch to the new scene once asynchronous commit is completed
+TEST_F(Api, Intersection_1Ray_CommitAsync)
+{
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+
+    float vertices1[] = {
+        -1.f,-1.f,-1.f,
+        1.f,-1.f,-1.f,
+        0.f,1.f,-1.f,
+    };
+
+    // Indices
+    int indices[] = {0, 1, 2};
+    // Number of vertices for the face
+    int numfaceverts[] = { 3 };
+
+    Shape* closemesh = nullptr;
+    Shape* farmesh = nullptr;
+
+    ASSERT_NO_THROW(farmesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(closemesh = api_->CreateMesh(vertices1, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    auto query = [&](Event const* waitevent)
+    {
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, waitevent, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        isect = *tmp;
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    };
+
+    // Blocking asynchronous commit
+    ASSERT_NO_THROW(api_->AttachShape(farmesh));
+    ASSERT_NO_THROW(api_->CommitAsync(nullptr));
+
+    query(nullptr);
+    ASSERT_EQ(isect.shapeid, farmesh->GetId());
+
+    // Queries depending on the commit event see the closer mesh
+    Event* commit = nullptr;
+    ASSERT_NO_THROW(api_->AttachShape(closemesh));
+    ASSERT_NO_THROW(api_->CommitAsync(&commit));
+
+    query(commit);
+    ASSERT_EQ(isect.shapeid, closemesh->GetId());
+    ASSERT_TRUE(commit->Complete());
+    ASSERT_NO_THROW(commit->Wait());
+    ASSERT_NO_THROW(api_->DeleteEvent(commit));
+
+    // Regular commit picks up the changes made after the asynchronous one
+    ASSERT_NO_THROW(api_->DetachShape(closemesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    query(nullptr);
+    ASSERT_EQ(isect.shapeid, farmesh->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(farmesh));
+    ASSERT_NO_THROW(api_->DeleteShape(farmesh));
+    ASSERT_NO_THROW(api_->DeleteShape(closemesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks queries issued while the first asynchronous commit is in progress wait for it
+TEST_F(Api, Intersection_CommitAsync_FirstQuery)
+{
+    // Large enough mesh to keep the build busy for a while
+    int const res = 256;
+    std::vector<float> vertices;
+    std::vector<int> indices;
+
+    for (int y = 0; y < res; ++y)
+    {
+        for (int x = 0; x < res; ++x)
+        {
+            int v = (int)vertices.size() / 3;
+            float triangle[] = { (float)x, (float)y, 0.f, x + 1.f, (float)y, 0.f, x + 1.f, y + 1.f, 0.f };
+            vertices.insert(vertices.end(), triangle, triangle + 9);
+            indices.push_back(v);
+            indices.push_back(v + 1);
+            indices.push_back(v + 2);
+        }
+    }
+
+    Shape* mesh = nullptr;
+    int numfaces = (int)indices.size() / 3;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(&vertices[0], (int)vertices.size() / 3, 3*sizeof(float), &indices[0], 0, nullptr, numfaces));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ray r(float3(0.75f, 0.25f, -10.f), float3(0.f, 0.f, 1.f), 1000.f);
+    Intersection isect;
+
+    // No waitevent, so the query relies on the device waiting for the first strategy
+    Event* commit = nullptr;
+    ASSERT_NO_THROW(api_->CommitAsync(&commit));
+    ASSERT_NO_THROW(api_->QueryIntersection(&r, 1, &isect));
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_EQ(isect.primid, 0);
+
+    ASSERT_NO_THROW(commit->Wait());
+    ASSERT_NO_THROW(api_->DeleteEvent(commit));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks queries issued from several threads at once
+TEST_F(Api, Intersection_MultipleThreads)
+{
+    static const int kNumThreads = 4;
+    static const int kNumRays = 1024;
+
+    // One triangle per thread at different depth
+    std::vector<float> vertices;
+    for (int i = 0; i < kNumThreads; ++i)
+    {
+        float z = (float)i;
+        float tri[] = { -1.f,-1.f,z, 1.f,-1.f,z, 0.f,1.f,z };
+        vertices.insert(vertices.end(), tri, tri + 9);
+    }
+
+    int indices[] = {0, 1, 2};
+    int numfaceverts[] = { 3 };
+
+    std::vector<Shape*> meshes(kNumThreads);
+    for (int i = 0; i < kNumThreads; ++i)
+    {
+        ASSERT_NO_THROW(meshes[i] = api_->CreateMesh(&vertices[i * 9], 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+        ASSERT_NO_THROW(api_->AttachShape(meshes[i]));
+    }
+
+    // Stack based traversal keeps its stack on the device, concurrent queries must not share it
+    char const* acctypes[] = { "bvh", "fatbvh" };
+
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+        ASSERT_NO_THROW(api_->Commit());
+
+        std::atomic<int> failures(0);
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < kNumThreads; ++t)
+        {
+            threads.emplace_back([this, t, &meshes, &failures]()
+            {
+                // Rays of thread t start right in front of mesh t
+                std::vector<ray> rays(kNumRays);
+                for (auto& r : rays)
+                {
+                    r.o = float4(0.f, 0.f, (float)t - 0.5f, 1000.f);
+                    r.d = float3(0.f, 0.f, 1.f);
+                }
+
+                auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), &rays[0]);
+                auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+                for (int iter = 0; iter < 10; ++iter)
+                {
+                    Event* e = nullptr;
+                    api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr);
+
+                    Intersection* tmp = nullptr;
+                    api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&tmp, &e);
+                    e->Wait();
+                    api_->DeleteEvent(e);
+
+                    for (int i = 0; i < kNumRays; ++i)
+                    {
+                        if (tmp[i].shapeid != meshes[t]->GetId())
+                        {
+                            ++failures;
+                            break;
+                        }
+                    }
+
+                    api_->UnmapBuffer(isect_buffer, tmp, &e);
+                    e->Wait();
+                    api_->DeleteEvent(e);
+                }
+
+                api_->DeleteBuffer(ray_buffer);
+                api_->DeleteBuffer(isect_buffer);
+            });
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        ASSERT_EQ(failures, 0);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    for (int i = 0; i < kNumThreads; ++i)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(meshes[i]));
+        ASSERT_NO_THROW(api_->DeleteShape(meshes[i]));
+    }
+}
+
+// The test checks ray batches distributed over the queues with the overlapping upload, traversal and download
+TEST_F(Api, Intersection_PipelinedQueues)
+{
+    static const int kNumBatches = 8;
+    static const int kNumBuffers = 3;
+
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+
+    int indices[] = {0, 1, 2};
+    int numfaceverts[] = { 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    int numqueues = api_->GetQueueCount();
+    ASSERT_GE(numqueues, 1);
+    ASSERT_ANY_THROW(api_->SetQueue(numqueues));
+
+    Buffer* ray_buffers[kNumBuffers];
+    Buffer* isect_buffers[kNumBuffers];
+    Event* download[kNumBuffers];
+    Intersection* results[kNumBuffers];
+
+    for (int i = 0; i < kNumBuffers; ++i)
+    {
+        ray_buffers[i] = api_->CreateBuffer(sizeof(ray), nullptr);
+        isect_buffers[i] = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    }
+
+    // Batch b misses the mesh if b is odd
+    for (int b = 0; b < kNumBatches + kNumBuffers; ++b)
+    {
+        int idx = b % kNumBuffers;
+        ASSERT_NO_THROW(api_->SetQueue(idx % numqueues));
+
+        // Consume the batch submitted kNumBuffers iterations ago
+        if (b >= kNumBuffers)
+        {
+            download[idx]->Wait();
+            api_->DeleteEvent(download[idx]);
+            ASSERT_EQ(results[idx]->shapeid, ((b - kNumBuffers) & 1) ? kNullId : mesh->GetId());
+            ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffers[idx], results[idx], nullptr));
+        }
+
+        if (b < kNumBatches)
+        {
+            ray* r = nullptr;
+            ASSERT_NO_THROW(api_->MapBuffer(ray_buffers[idx], kMapWrite, 0, sizeof(ray), (void**)&r, &e_));
+            Wait();
+            r->o = float4((b & 1) ? 10.f : 0.f, 0.f, -10.f, 1000.f);
+            r->d = float3(0.f, 0.f, 1.f);
+            r->SetActive(true);
+            r->SetMask(0xFFFFFFFF);
+            ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffers[idx], r, nullptr));
+
+            ASSERT_NO_THROW(api_->QueryIntersection(ray_buffers[idx], 1, isect_buffers[idx], nullptr, nullptr));
+            ASSERT_NO_THROW(api_->MapBuffer(isect_buffers[idx], kMapRead, 0, sizeof(Intersection), (void**)&results[idx], &download[idx]));
+        }
+    }
+
+    // Bail out
+    for (int i = 0; i < kNumBuffers; ++i)
+    {
+        ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffers[i]));
+        ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffers[i]));
+    }
+
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks fast path queries on host memory arrays
+TEST_F(Api, Intersection_HostMemory)
+{
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+
+    int indices[] = {0, 1, 2};
+    int numfaceverts[] = { 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Even rays hit the mesh, odd ones miss it, the batch spans several chunks
+    std::vector<ray> rays(200000);
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        rays[i].o = float4((i & 1) ? 10.f : 0.f, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    std::vector<Intersection> isect(rays.size());
+    std::vector<int> occluded(rays.size());
+
+    // Chunks of a single query run on different queues, with fatbvh they use different stacks
+    char const* acctypes[] = { "bvh", "fatbvh" };
+
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+        ASSERT_NO_THROW(api_->Commit());
+
+        // Results of the previous pass must not hide missing ones
+        for (auto& hit : isect)
+        {
+            hit.shapeid = -2;
+        }
+        std::fill(occluded.begin(), occluded.end(), -2);
+
+        ASSERT_NO_THROW(api_->QueryIntersection(&rays[0], (int)rays.size(), &isect[0]));
+        ASSERT_NO_THROW(api_->QueryOcclusion(&rays[0], (int)rays.size(), &occluded[0]));
+
+        for (int i = 0; i < (int)rays.size(); ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, (i & 1) ? kNullId : mesh->GetId());
+            ASSERT_EQ(occluded[i], (i & 1) ? -1 : 1);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks occlusion results packed into bit mask
+TEST_F(Api, Intersection_OcclusionMask)
+{
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+
+    int indices[] = {0, 1, 2};
+    int numfaceverts[] = { 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Every third ray hits the mesh unless disabled, the last word of the mask is partial
+    std::vector<ray> rays(1000);
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        rays[i].o = float4((i % 3) ? 10.f : 0.f, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+        rays[i].SetActive(i % 5 != 0);
+    }
+
+    int numwords = ((int)rays.size() + 31) / 32;
+    Buffer* ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), &rays[0]);
+    Buffer* mask_buffer = api_->CreateBuffer(numwords * sizeof(std::uint32_t), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryOcclusionMask(ray_buffer, (int)rays.size(), mask_buffer, nullptr, &e_));
+    Wait();
+
+    std::uint32_t* mask = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(mask_buffer, kMapRead, 0, numwords * sizeof(std::uint32_t), (void**)&mask, &e_));
+    Wait();
+
+    // Inactive rays are reported as misses
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        ASSERT_EQ((mask[i / 32] >> (i % 32)) & 1, (i % 3 || i % 5 == 0) ? 0u : 1u);
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(mask_buffer, mask, nullptr));
+
+    // Rays past the number in remote memory are reported as misses as well
+    int numrays = (int)rays.size() / 2;
+    Buffer* numrays_buffer = api_->CreateBuffer(sizeof(int), &numrays);
+
+    ASSERT_NO_THROW(api_->QueryOcclusionMask(ray_buffer, numrays_buffer, (int)rays.size(), mask_buffer, nullptr, &e_));
+    Wait();
+
+    ASSERT_NO_THROW(api_->MapBuffer(mask_buffer, kMapRead, 0, numwords * sizeof(std::uint32_t), (void**)&mask, &e_));
+    Wait();
+
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        ASSERT_EQ((mask[i / 32] >> (i % 32)) & 1, (i >= numrays || i % 3 || i % 5 == 0) ? 0u : 1u);
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(mask_buffer, mask, nullptr));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(numrays_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(mask_buffer));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks compact ray and hit formats with and without ray flags
+TEST_F(Api, Intersection_CompactRays)
+{
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+
+    int indices[] = {0, 1, 2};
+    int numfaceverts[] = { 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(mesh->SetId(5));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Odd rays miss the mesh, every fourth ray is disabled via flags
+    const int numrays = 64;
+    std::vector<compact_ray> rays(numrays);
+    std::vector<int2> flags(numrays);
+    for (int i = 0; i < numrays; ++i)
+    {
+        rays[i] = compact_ray(float3((i % 2) ? 10.f : 0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f);
+        flags[i] = int2(-1, (i % 4) ? 1 : 0);
+    }
+
+    // Sentinel to tell disabled rays from misses
+    std::vector<CompactIntersection> init(numrays);
+    for (auto& hit : init)
+    {
+        hit.shapeid = 42;
+    }
+
+    Buffer* ray_buffer = api_->CreateBuffer(numrays * sizeof(compact_ray), &rays[0]);
+    Buffer* flags_buffer = api_->CreateBuffer(numrays * sizeof(int2), &flags[0]);
+    Buffer* hit_buffer = api_->CreateBuffer(numrays * sizeof(CompactIntersection), &init[0]);
+    Buffer* occl_buffer = api_->CreateBuffer(numrays * sizeof(int), nullptr);
+
+    // All rays are active without flags
+    ASSERT_NO_THROW(api_->QueryIntersectionCompact(ray_buffer, nullptr, numrays, hit_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusionCompact(ray_buffer, nullptr, numrays, occl_buffer, nullptr, &e_));
+    Wait();
+
+    CompactIntersection* hits = nullptr;
+    int* occl = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, numrays * sizeof(CompactIntersection), (void**)&hits, &e_));
+    Wait();
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, numrays * sizeof(int), (void**)&occl, &e_));
+    Wait();
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        if (i % 2)
+        {
+            ASSERT_EQ(hits[i].shapeid, kNullId);
+            ASSERT_EQ(occl[i], -1);
+        }
+        else
+        {
+            ASSERT_EQ(hits[i].shapeid, 5);
+            ASSERT_EQ(hits[i].primid, 0);
+            ASSERT_NEAR(hits[i].t, 10.f, 0.01f);
+            ASSERT_NEAR(hits[i].GetUv().x + hits[i].GetUv().y, 0.75f, 0.01f);
+            ASSERT_EQ(occl[i], 1);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, hits, nullptr));
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, nullptr));
+
+    // Disabled rays keep previous buffer contents
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapWrite, 0, numrays * sizeof(CompactIntersection), (void**)&hits, &e_));
+    Wait();
+    std::copy(init.begin(), init.end(), hits);
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, hits, nullptr));
+
+    ASSERT_NO_THROW(api_->QueryIntersectionCompact(ray_buffer, flags_buffer, numrays, hit_buffer, nullptr, &e_));
+    Wait();
+
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, numrays * sizeof(CompactIntersection), (void**)&hits, &e_));
+    Wait();
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        if (i % 4 == 0)
+        {
+            ASSERT_EQ(hits[i].shapeid, init[i].shapeid);
+        }
+        else
+        {
+            ASSERT_EQ(hits[i].shapeid, (i % 2) ? kNullId : 5);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, hits, nullptr));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(flags_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks hits of sorted rays are written in the original order
+TEST_F(Api, Intersection_SortRays)
+{
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+
+    int indices[] = {0, 1, 2};
+    int numfaceverts[] = { 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("query.sortrays", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("query.sortrays.threshold", 1.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Rays come from both sides at different distances, every third one misses
+    std::vector<ray> rays(1000);
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        float z = (i % 2) ? -1.f - i : 1.f + i;
+        float x = (i % 3) ? 0.f : 10.f;
+        rays[i] = ray(float3(x, 0.f, z), float3(0.f, 0.f, (i % 2) ? 1.f : -1.f), 10000.f);
+    }
+
+    Buffer* ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), &rays[0]);
+    Buffer* hit_buffer = api_->CreateBuffer(rays.size() * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)rays.size(), hit_buffer, nullptr, &e_));
+    Wait();
+
+    Intersection* hits = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, rays.size() * sizeof(Intersection), (void**)&hits, &e_));
+    Wait();
+
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        if (i % 3)
+        {
+            ASSERT_EQ(hits[i].shapeid, mesh->GetId());
+            ASSERT_NEAR(hits[i].uvwt.w, 1.f + i, 0.01f);
+        }
+        else
+        {
+            ASSERT_EQ(hits[i].shapeid, kNullId);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, hits, nullptr));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("query.sortrays", 0.f));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks persistent threads traversal gives the same hits as the regular one
+TEST_F(Api, Intersection_PersistentThreads)
+{
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+
+    int indices[] = {0, 1, 2};
+    int numfaceverts[] = { 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("query.persistent", 1.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // More rays than resident threads, so groups have to fetch several batches, every third one misses
+    std::vector<ray> rays(100000 + 17);
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        float x = (i % 3) ? 0.f : 10.f;
+        rays[i] = ray(float3(x, 0.f, -1.f - (i % 100)), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    Buffer* ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), &rays[0]);
+    Buffer* hit_buffer = api_->CreateBuffer(rays.size() * sizeof(Intersection), nullptr);
+    Buffer* occlusion_buffer = api_->CreateBuffer(rays.size() * sizeof(int), nullptr);
+
+    // Run twice to make sure the ray counter is reset between the launches
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        // Sentinel values, if the counter is not reset no ray is processed and they stay in place
+        Intersection* hits = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapWrite, 0, rays.size() * sizeof(Intersection), (void**)&hits, &e_));
+        Wait();
+
+        int* occluded = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapWrite, 0, rays.size() * sizeof(int), (void**)&occluded, &e_));
+        Wait();
+
+        for (int i = 0; i < (int)rays.size(); ++i)
+        {
+            hits[i].shapeid = -2;
+            occluded[i] = -2;
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, hits, &e_));
+        Wait();
+        ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, occluded, &e_));
+        Wait();
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)rays.size(), hit_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, (int)rays.size(), occlusion_buffer, nullptr, &e_));
+        Wait();
+
+        ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, rays.size() * sizeof(Intersection), (void**)&hits, &e_));
+        Wait();
+
+        ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapRead, 0, rays.size() * sizeof(int), (void**)&occluded, &e_));
+        Wait();
+
+        for (int i = 0; i < (int)rays.size(); ++i)
+        {
+            ASSERT_NE(hits[i].shapeid, -2);
+            ASSERT_NE(occluded[i], -2);
+
+            if (i % 3)
+            {
+                ASSERT_EQ(hits[i].shapeid, mesh->GetId());
+                ASSERT_NEAR(hits[i].uvwt.w, 1.f + (i % 100), 0.01f);
+                ASSERT_EQ(occluded[i], 1);
+            }
+            else
+            {
+                ASSERT_EQ(hits[i].shapeid, kNullId);
+                ASSERT_EQ(occluded[i], -1);
+            }
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, hits, nullptr));
+        ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, occluded, nullptr));
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("query.persistent", 0.f));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks rays hitting the shared edge of precomputed triangles are not lost
+TEST_F(Api, Intersection_PrecomputedTriangles)
+{
+    // Quad made of two triangles sharing the diagonal
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        1.f,1.f,0.f,
+        -1.f,1.f,0.f,
+    };
+
+    int indices[] = {0, 1, 2, 0, 2, 3};
+    int numfaceverts[] = { 3, 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 4, 3*sizeof(float), indices, 0, numfaceverts, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.triangles.precomputed", 1.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Rays go along the diagonal from different directions, every fourth one misses the quad
+    std::vector<ray> rays(1024);
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        float x = -0.99f + 1.98f * i / rays.size();
+        float3 target = (i % 4) ? float3(x, x, 0.f) : float3(2.f + x, x, 0.f);
+        float3 origin = float3(0.3f * (i % 7) - 1.f, 0.2f * (i % 5) - 0.5f, -1.f);
+        rays[i] = ray(origin, normalize(target - origin), 10000.f);
+    }
+
+    Buffer* ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), &rays[0]);
+    Buffer* hit_buffer = api_->CreateBuffer(rays.size() * sizeof(Intersection), nullptr);
+    Buffer* occlusion_buffer = api_->CreateBuffer(rays.size() * sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)rays.size(), hit_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, (int)rays.size(), occlusion_buffer, nullptr, &e_));
+    Wait();
+
+    Intersection* hits = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, rays.size() * sizeof(Intersection), (void**)&hits, &e_));
+    Wait();
+
+    int* occluded = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapRead, 0, rays.size() * sizeof(int), (void**)&occluded, &e_));
+    Wait();
+
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        if (i % 4)
+        {
+            // Hit point has to be on the diagonal
+            float3 p = rays[i].o + rays[i].d * hits[i].uvwt.w;
+            ASSERT_EQ(hits[i].shapeid, mesh->GetId());
+            ASSERT_NEAR(p.x, p.y, 0.001f);
+            ASSERT_NEAR(p.z, 0.f, 0.001f);
+            ASSERT_EQ(occluded[i], 1);
+        }
+        else
+        {
+            ASSERT_EQ(hits[i].shapeid, kNullId);
+            ASSERT_EQ(occluded[i], -1);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, hits, nullptr));
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, occluded, nullptr));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.triangles.precomputed", 0.f));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks quad faces are intersected as two triangles by every acceleration structure
+TEST_F(Api, Intersection_Quads)
+{
+    // Strip of two quads
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        1.f,1.f,0.f,
+        -1.f,1.f,0.f,
+        3.f,-1.f,0.f,
+        3.f,1.f,0.f,
+    };
+
+    int indices[] = {0, 1, 2, 3, 1, 4, 5, 2};
+    int numfaceverts[] = { 4, 4 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 6, 3*sizeof(float), indices, 0, numfaceverts, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays hit triangles (v1, v2, v3) and (v3, v4, v1) of each quad in turn, the last one misses the strip
+    std::vector<ray> rays(5);
+    rays[0] = ray(float3(0.5f, -0.5f, -1.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[1] = ray(float3(-0.5f, 0.5f, -1.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[2] = ray(float3(2.5f, -0.5f, -1.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[3] = ray(float3(1.5f, 0.5f, -1.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[4] = ray(float3(3.5f, 0.5f, -1.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    Buffer* ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), &rays[0]);
+    Buffer* hit_buffer = api_->CreateBuffer(rays.size() * sizeof(Intersection), nullptr);
+    Buffer* occlusion_buffer = api_->CreateBuffer(rays.size() * sizeof(int), nullptr);
+
+    // Same rays in the compact layout
+    std::vector<compact_ray> compact_rays;
+    for (auto const& r : rays)
+    {
+        compact_rays.push_back(compact_ray(float3(r.o.x, r.o.y, r.o.z), float3(r.d.x, r.d.y, r.d.z), 10000.f));
+    }
+
+    Buffer* compact_ray_buffer = api_->CreateBuffer(compact_rays.size() * sizeof(compact_ray), &compact_rays[0]);
+    Buffer* compact_hit_buffer = api_->CreateBuffer(compact_rays.size() * sizeof(CompactIntersection), nullptr);
+
+    char const* acctypes[] = { "bvh", "fatbvh", "qbvh", "grid", "bvh2l" };
+
+    for (auto acctype : acctypes)
+    {
+        bool force2level = std::string(acctype) == "bvh2l";
+        ASSERT_NO_THROW(api_->SetOption("acc.type", force2level ? "bvh" : acctype));
+        ASSERT_NO_THROW(api_->SetOption("bvh.force2level", force2level ? 1.f : 0.f));
+        ASSERT_NO_THROW(api_->Commit());
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)rays.size(), hit_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, (int)rays.size(), occlusion_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* hits = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, rays.size() * sizeof(Intersection), (void**)&hits, &e_));
+        Wait();
+
+        int* occluded = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapRead, 0, rays.size() * sizeof(int), (void**)&occluded, &e_));
+        Wait();
+
+        for (int i = 0; i < 4; ++i)
+        {
+            ASSERT_EQ(hits[i].shapeid, mesh->GetId());
+            ASSERT_EQ(hits[i].primid, i / 2);
+            ASSERT_NEAR(hits[i].uvwt.w, 1.f, 0.001f);
+            ASSERT_EQ(hits[i].uvwt.z, (float)(i % 2));
+            ASSERT_EQ(occluded[i], 1);
+        }
+
+        ASSERT_EQ(hits[4].shapeid, kNullId);
+        ASSERT_EQ(occluded[4], -1);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, hits, nullptr));
+        ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, occluded, nullptr));
+
+        // Compact hits keep the triangle of the quad in the primitive id
+        ASSERT_NO_THROW(api_->QueryIntersectionCompact(compact_ray_buffer, nullptr, (int)compact_rays.size(), compact_hit_buffer, nullptr, &e_));
+        Wait();
+
+        CompactIntersection* compact_hits = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(compact_hit_buffer, kMapRead, 0, compact_rays.size() * sizeof(CompactIntersection), (void**)&compact_hits, &e_));
+        Wait();
+
+        for (int i = 0; i < 4; ++i)
+        {
+            ASSERT_EQ(compact_hits[i].shapeid, mesh->GetId());
+            ASSERT_EQ(compact_hits[i].GetPrimId(), i / 2);
+            ASSERT_EQ(compact_hits[i].GetQuadTriangle(), i % 2);
+        }
+
+        ASSERT_EQ(compact_hits[4].shapeid, kNullId);
+        ASSERT_EQ(compact_hits[4].GetPrimId(), kNullId);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(compact_hit_buffer, compact_hits, nullptr));
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(compact_ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(compact_hit_buffer));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks moving shapes are intersected at the ray time
+TEST_F(Api, Intersection_MotionBlur)
+{
+    // Thin rectangle rotating by 90 degrees around z axis
+    float bar[] = {
+        -2.f,-0.1f,0.f,
+        2.f,-0.1f,0.f,
+        2.f,0.1f,0.f,
+        -2.f,0.1f,0.f,
+    };
+
+    // Square moving along x axis
+    float square[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        1.f,1.f,0.f,
+        -1.f,1.f,0.f,
+    };
+
+    int indices[] = {0, 1, 2, 0, 2, 3};
+    int numfaceverts[] = { 3, 3 };
+
+    Shape* rotating = nullptr;
+    Shape* moving = nullptr;
+    ASSERT_NO_THROW(rotating = api_->CreateMesh(bar, 4, 3*sizeof(float), indices, 0, numfaceverts, 2));
+    ASSERT_NO_THROW(moving = api_->CreateMesh(square, 4, 3*sizeof(float), indices, 0, numfaceverts, 2));
+
+    float const s = std::sqrt(0.5f);
+    ASSERT_NO_THROW(rotating->SetAngularVelocity(quaternion(0.f, 0.f, s, s)));
+
+    matrix m = translation(float3(10.f, 0.f, 0.f));
+    ASSERT_NO_THROW(moving->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(moving->SetLinearVelocity(float3(4.f, 0.f, 0.f)));
+
+    ASSERT_NO_THROW(api_->AttachShape(rotating));
+    ASSERT_NO_THROW(api_->AttachShape(moving));
+
+    // Ray origins and times along with the shapes expected to be hit
+    float3 origins[] = { float3(1.5f, 0.f, -1.f), float3(1.5f, 0.f, -1.f), float3(0.f, 1.5f, -1.f), float3(0.f, 1.5f, -1.f),
+        float3(10.f, 0.f, -1.f), float3(10.f, 0.f, -1.f), float3(14.f, 0.f, -1.f), float3(12.f, 0.f, -1.f) };
+    float times[] = { 0.f, 1.f, 1.f, 0.f, 0.f, 1.f, 1.f, 0.5f };
+    Id expected[] = { rotating->GetId(), kNullId, rotating->GetId(), kNullId, moving->GetId(), kNullId, moving->GetId(), moving->GetId() };
+
+    std::vector<ray> rays(8);
+    for (int i = 0; i < (int)rays.size(); ++i)
+    {
+        rays[i] = ray(origins[i], float3(0.f, 0.f, 1.f), 10000.f, times[i]);
+    }
+
+    Buffer* ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), &rays[0]);
+    Buffer* hit_buffer = api_->CreateBuffer(rays.size() * sizeof(Intersection), nullptr);
+    Buffer* occlusion_buffer = api_->CreateBuffer(rays.size() * sizeof(int), nullptr);
+
+    // Single top level BVH over the shutter interval and one per segment
+    float segments[] = { 1.f, 4.f };
+
+    for (auto numsegments : segments)
+    {
+        ASSERT_NO_THROW(api_->SetOption("bvh.motion.segments", numsegments));
+        ASSERT_NO_THROW(api_->Commit());
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)rays.size(), hit_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, (int)rays.size(), occlusion_buffer, nullptr, &e_));
+        Wait();
+
+        Intersection* hits = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, rays.size() * sizeof(Intersection), (void**)&hits, &e_));
+        Wait();
+
+        int* occluded = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapRead, 0, rays.size() * sizeof(int), (void**)&occluded, &e_));
+        Wait();
+
+        for (int i = 0; i < (int)rays.size(); ++i)
+        {
+            ASSERT_EQ(hits[i].shapeid, expected[i]);
+            ASSERT_EQ(occluded[i], expected[i] == kNullId ? -1 : 1);
+
+            if (expected[i] != kNullId)
+            {
+                ASSERT_NEAR(hits[i].uvwt.w, 1.f, 0.001f);
+            }
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, hits, nullptr));
+        ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, occluded, nullptr));
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.motion.segments", 1.f));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+    ASSERT_NO_THROW(api_->DetachShape(rotating));
+    ASSERT_NO_THROW(api_->DetachShape(moving));
+    ASSERT_NO_THROW(api_->DeleteShape(rotating));
+    ASSERT_NO_THROW(api_->DeleteShape(moving));
+}
+
+// The test checks the acceleration structure picked by the cost model gives correct hits
+TEST_F(Api, Intersection_AutoAccType)
+{
+    // Grid of 64x64 quads split into triangles, large enough for the cost model to kick in
+    int const res = 64;
+    std::vector<float> vertices;
+    std::vector<int> indices;
+
+    for (int y = 0; y <= res; ++y)
+    {
+        for (int x = 0; x <= res; ++x)
+        {
+            vertices.push_back((float)x);
+            vertices.push_back((float)y);
+            vertices.push_back(0.f);
+        }
+    }
+
+    for (int y = 0; y < res; ++y)
+    {
+        for (int x = 0; x < res; ++x)
+        {
+            int v = y * (res + 1) + x;
+            int quad[] = { v, v + 1, v + res + 2, v, v + res + 2, v + res + 1 };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+
+    int numfaces = (int)indices.size() / 3;
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(&vertices[0], (int)vertices.size() / 3, 3*sizeof(float), &indices[0], 0, nullptr, numfaces));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays hit the centers of the lower right triangles, the last one misses the grid
+    std::vector<ray> rays(res + 1);
+    for (int i = 0; i < res; ++i)
+    {
+        rays[i] = ray(float3(i + 0.75f, i + 0.25f, -1.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    rays[res] = ray(float3(-1.f, -1.f, -1.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    Buffer* ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), &rays[0]);
+    Buffer* hit_buffer = api_->CreateBuffer(rays.size() * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "auto"));
+
+    // Model only, then probing the cheapest candidates, second commit reuses the choice
+    float probes[] = { 0.f, 3.f };
+
+    for (auto probe : probes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.auto.probe", probe));
+
+        for (int commit = 0; commit < 2; ++commit)
+        {
+            ASSERT_NO_THROW(api_->Commit());
+
+            ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)rays.size(), hit_buffer, nullptr, &e_));
+            Wait();
+
+            Intersection* hits = nullptr;
+            ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, rays.size() * sizeof(Intersection), (void**)&hits, &e_));
+            Wait();
+
+            for (int i = 0; i < res; ++i)
+            {
+                ASSERT_EQ(hits[i].shapeid, mesh->GetId());
+                ASSERT_EQ(hits[i].primid, 2 * (i * res + i));
+                ASSERT_NEAR(hits[i].uvwt.w, 1.f, 0.001f);
+            }
+
+            ASSERT_EQ(hits[res].shapeid, kNullId);
+
+            ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, hits, nullptr));
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("acc.auto.probe", 0.f));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
 TEST_F(Api, CornellBoxLoad)
 {
     using namespace tinyobj;
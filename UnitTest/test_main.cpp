@@ -25,6 +25,8 @@ THE SOFTWARE.
 #include "firerays_conformance_test.h"
 #include "firerays_cl_test.h"
 #include "calc_test_cl.h"
+#include "calc_test_native.h"
+#include "bvh_test.h"
 
 #include "gtest/gtest.h"
 
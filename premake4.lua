@@ -8,11 +8,6 @@ newoption {
     description = "Embed CL kernels into binary module"
 }
 
-newoption {
-    trigger = "use_tbb",
-    description = "Use Intel(R) TBB library for multithreading"
-}
-
 newoption {
     trigger = "use_embree",
     description = "Use Intel(R) Embree for CPU hit testing"